@@ -0,0 +1,92 @@
+/*
+ * Build-time helper: decode an image (optionally scaling it) and write
+ * it out as raw RGBA with a small header, ready to be linked in with
+ * objcopy and handed to image_rgba_raw at run time. This way the
+ * program itself never has to decode its built-in images.
+ *
+ * usage: asset_compiler input output [width height]
+ *
+ * The header is native endian, so run this on the target (or on
+ * a host of the same byte order).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "image_intf.h"
+
+int main ( int argc, char* argv[] )
+{
+  if ( argc != 3 && argc != 5 ) {
+    fprintf( stderr, "usage: %s input output [width height]\n", argv[0] );
+    return 1;
+  }
+
+  GError* error = NULL;
+  GdkPixbuf* original = gdk_pixbuf_new_from_file( argv[1], &error );
+  if ( original == NULL ) {
+    fprintf( stderr, "%s: %s\n", argv[1], error->message );
+    g_error_free( error );
+    return 1;
+  }
+
+  // Scale here, with a proper filter, rather than leaving it to OpenVG
+  // on every frame.
+  if ( argc == 5 ) {
+    int width  = atoi( argv[3] );
+    int height = atoi( argv[4] );
+    if ( width <= 0 || height <= 0 ) {
+      fprintf( stderr, "bad size: %s x %s\n", argv[3], argv[4] );
+      return 1;
+    }
+    GdkPixbuf* scaled = gdk_pixbuf_scale_simple( original, width, height,
+						 GDK_INTERP_HYPER );
+    g_object_unref( original );
+    original = scaled;
+  }
+
+  // OpenVG insists on an alpha channel.
+  GdkPixbuf* rgba = gdk_pixbuf_add_alpha( original, FALSE, 0, 0, 0 );
+  g_object_unref( original );
+  if ( rgba == NULL || gdk_pixbuf_get_bits_per_sample( rgba ) != 8 ) {
+    fprintf( stderr, "%s: could not convert to RGBA\n", argv[1] );
+    return 1;
+  }
+
+  struct IMAGE_RAW_HEADER header;
+  memcpy( header.magic, IMAGE_RAW_MAGIC, sizeof header.magic );
+  header.width  = gdk_pixbuf_get_width( rgba );
+  header.height = gdk_pixbuf_get_height( rgba );
+
+  FILE* out = fopen( argv[2], "wb" );
+  if ( out == NULL ) {
+    perror( argv[2] );
+    return 1;
+  }
+
+  int ok = fwrite( &header, sizeof header, 1, out ) == 1;
+
+  // Rows may be padded in the pixbuf but not in the output.
+  const guchar* pixels = gdk_pixbuf_get_pixels( rgba );
+  int rowstride = gdk_pixbuf_get_rowstride( rgba );
+  uint32_t row;
+  for ( row = 0; ok && row < header.height; row++ ) {
+    ok = fwrite( pixels + row * rowstride, 4 * header.width, 1, out ) == 1;
+  }
+
+  if ( fclose( out ) != 0 )
+    ok = 0;
+
+  g_object_unref( rgba );
+
+  if ( ! ok ) {
+    perror( argv[2] );
+    remove( argv[2] );
+    return 1;
+  }
+
+  return 0;
+}
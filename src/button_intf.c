@@ -0,0 +1,181 @@
+/*
+ * Push buttons on GPIO lines using libgpiod (v2). Replaces exporting
+ * the lines through sysfs with the "gpio" program and then polling
+ * the value files: the kernel queues every edge (so nothing is lost
+ * while we're busy) and debounces them for us.
+ */
+#include <stdlib.h>
+
+#include <gpiod.h>
+
+#include "glib.h"
+
+#include "log_intf.h"
+#include "button_intf.h"
+
+// Most edge events we take from the kernel per wakeup.
+#define BUTTON_EVENTS_MAX 16
+
+struct BUTTON_PRIVATE {
+  int status;
+  struct LOG_HANDLE logger;
+  struct gpiod_chip* chip;
+  struct gpiod_line_request* request;
+  struct gpiod_edge_event_buffer* events;
+  GIOChannel* channel;
+  guint source;
+  BUTTON_CALLBACK callback;
+  void* data;
+};
+
+static gboolean button_callback ( GIOChannel* gio, GIOCondition condition,
+				  gpointer data )
+{
+  (void)gio;
+  (void)condition;
+
+  struct BUTTON_PRIVATE* d = data;
+
+  // Everything which has piled up, in one read.
+  int count = gpiod_line_request_read_edge_events( d->request, d->events,
+						   BUTTON_EVENTS_MAX );
+  if ( count < 0 ) {
+    log_message_warn( d->logger, "Error reading button events" );
+    return TRUE;
+  }
+
+  int e;
+  for ( e = 0; e < count; e++ ) {
+    struct gpiod_edge_event* event =
+      gpiod_edge_event_buffer_get_event( d->events, e );
+    if ( gpiod_edge_event_get_event_type( event ) !=
+	 GPIOD_EDGE_EVENT_RISING_EDGE )
+      continue;
+    d->callback( gpiod_edge_event_get_line_offset( event ),
+		 gpiod_edge_event_get_timestamp_ns( event ),
+		 d->data );
+  }
+
+  return TRUE;
+}
+
+struct BUTTON_HANDLE button_init ( const char* chip,
+				   const unsigned int* offsets,
+				   int offsets_count,
+				   unsigned long debounce_us,
+				   BUTTON_CALLBACK callback, void* data,
+				   struct LOG_HANDLE logger )
+{
+  struct BUTTON_HANDLE handle;
+  handle.d = malloc( sizeof( struct BUTTON_PRIVATE ) );
+  handle.d->status   = 0;
+  handle.d->logger   = logger;
+  handle.d->chip     = NULL;
+  handle.d->request  = NULL;
+  handle.d->events   = NULL;
+  handle.d->channel  = NULL;
+  handle.d->source   = 0;
+  handle.d->callback = callback;
+  handle.d->data     = data;
+
+  if ( offsets_count <= 0 ) {
+    // Nothing to do is fine.
+    return handle;
+  }
+
+  handle.d->chip = gpiod_chip_open( chip );
+
+  if ( handle.d->chip == NULL ) {
+    log_message_warn( logger, "Could not open GPIO chip \"%s\"", chip );
+    handle.d->status = -1;
+    return handle;
+  }
+
+  struct gpiod_line_settings* settings = gpiod_line_settings_new();
+  struct gpiod_line_config* line_config = gpiod_line_config_new();
+  struct gpiod_request_config* request_config = gpiod_request_config_new();
+
+  if ( settings == NULL || line_config == NULL || request_config == NULL ) {
+    log_message_warn( logger, "Could not allocate GPIO configuration" );
+    handle.d->status = -1;
+  }
+  else {
+    gpiod_line_settings_set_direction( settings, GPIOD_LINE_DIRECTION_INPUT );
+    gpiod_line_settings_set_edge_detection( settings, GPIOD_LINE_EDGE_RISING );
+    // Done in hardware if the chip can, otherwise by the kernel.
+    gpiod_line_settings_set_debounce_period_us( settings, debounce_us );
+    gpiod_line_settings_set_event_clock( settings,
+					 GPIOD_LINE_CLOCK_MONOTONIC );
+
+    gpiod_request_config_set_consumer( request_config, "mpddisplay" );
+    gpiod_request_config_set_event_buffer_size( request_config,
+						BUTTON_EVENTS_MAX );
+
+    if ( gpiod_line_config_add_line_settings( line_config, offsets,
+					      offsets_count, settings ) < 0 ) {
+      log_message_warn( logger, "Could not configure GPIO lines" );
+      handle.d->status = -1;
+    }
+    else {
+      handle.d->request = gpiod_chip_request_lines( handle.d->chip,
+						    request_config,
+						    line_config );
+      if ( handle.d->request == NULL ) {
+	log_message_warn( logger, "Could not request GPIO lines on \"%s\"",
+			  chip );
+	handle.d->status = -1;
+      }
+    }
+  }
+
+  gpiod_request_config_free( request_config );
+  gpiod_line_config_free( line_config );
+  gpiod_line_settings_free( settings );
+
+  if ( handle.d->status < 0 )
+    return handle;
+
+  handle.d->events = gpiod_edge_event_buffer_new( BUTTON_EVENTS_MAX );
+
+  handle.d->channel =
+    g_io_channel_unix_new( gpiod_line_request_get_fd( handle.d->request ) );
+
+  handle.d->source = g_io_add_watch( handle.d->channel, G_IO_IN,
+				     button_callback, handle.d );
+
+  if ( handle.d->events == NULL || handle.d->source == 0 ) {
+    log_message_warn( logger, "Error creating watch on buttons" );
+    handle.d->status = -1;
+    return handle;
+  }
+
+  int o;
+  for ( o = 0; o < offsets_count; o++ ) {
+    log_message_info( logger, "Watching button on %s line %u", chip,
+		      offsets[o] );
+  }
+
+  return handle;
+}
+
+int button_status ( struct BUTTON_HANDLE handle )
+{
+  return handle.d->status;
+}
+
+void button_free ( struct BUTTON_HANDLE handle )
+{
+  if ( handle.d != NULL ) {
+    if ( handle.d->source != 0 )
+      g_source_remove( handle.d->source );
+    if ( handle.d->channel != NULL )
+      g_io_channel_unref( handle.d->channel );
+    if ( handle.d->events != NULL )
+      gpiod_edge_event_buffer_free( handle.d->events );
+    if ( handle.d->request != NULL )
+      gpiod_line_request_release( handle.d->request );
+    if ( handle.d->chip != NULL )
+      gpiod_chip_close( handle.d->chip );
+    free( handle.d );
+  }
+}
@@ -0,0 +1,56 @@
+/*
+ * Push buttons wired to GPIO lines. The lines are requested from the
+ * GPIO character device (through libgpiod), so no privileged setup
+ * is needed, the kernel does the debouncing and every edge arrives
+ * with a timestamp.
+ */
+#ifndef BUTTON_INTF_H
+#define BUTTON_INTF_H
+
+#include <stdint.h>
+
+struct BUTTON_PRIVATE;
+struct LOG_HANDLE;
+
+struct BUTTON_HANDLE {
+  struct BUTTON_PRIVATE* d;
+};
+
+/*!
+ * Called for each press.
+ * \param[in] offset the line (pin) of the button.
+ * \param[in] timestamp_ns when the kernel saw the edge.
+ * \param[in] data the user data given to button_init.
+ */
+typedef void (*BUTTON_CALLBACK)( unsigned int offset, uint64_t timestamp_ns,
+				 void* data );
+
+/*!
+ * Request the lines and add them to the default GLib main context.
+ * Buttons are expected to pull the line high when pressed.
+ * \param[in] chip the GPIO chip device (e.g. "/dev/gpiochip0").
+ * \param[in] offsets the lines (pins) of the buttons.
+ * \param[in] offsets_count number of lines.
+ * \param[in] debounce_us debounce period in microseconds (0 for none).
+ * \param[in] callback called for each press.
+ * \param[in] data passed to the callback.
+ * \param[in] logger our logger.
+ * \return a handle to the buttons. Check it with button_status.
+ */
+struct BUTTON_HANDLE button_init ( const char* chip,
+				   const unsigned int* offsets,
+				   int offsets_count,
+				   unsigned long debounce_us,
+				   BUTTON_CALLBACK callback, void* data,
+				   struct LOG_HANDLE logger );
+/*!
+ * \param[in] handle the buttons.
+ * \return 0 if everything is ok, -1 otherwise.
+ */
+int button_status ( struct BUTTON_HANDLE handle );
+/*!
+ * Release the lines.
+ * \param[in] handle the buttons.
+ */
+void button_free ( struct BUTTON_HANDLE handle );
+#endif
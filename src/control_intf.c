@@ -0,0 +1,322 @@
+/*
+ * The control socket. Everything is non-blocking and driven by the
+ * main loop: a client which sends a lot (or reads slowly) just gets
+ * serviced in pieces between frames.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "glib.h"
+#include "glib-unix.h"
+
+#include "log_intf.h"
+#include "control_intf.h"
+
+// Most clients at once.
+#define CONTROL_CLIENTS_MAX 16
+// Longest request line.
+#define CONTROL_LINE_MAX 1024
+// Stop reading from a client which has this much unsent reply.
+#define CONTROL_OUTPUT_MAX 65536
+
+struct CONTROL_CLIENT {
+  struct CONTROL_PRIVATE* control;
+  int fd;
+  guint source;
+  // Partial request line.
+  GString* input;
+  // Reply not yet written.
+  GString* output;
+  gsize output_sent;
+  // Set when the client has hung up (or misbehaved); we close once
+  // its replies are out.
+  int closing;
+  // What the source is waiting for.
+  GIOCondition watching;
+};
+
+struct CONTROL_PRIVATE {
+  int status;
+  struct LOG_HANDLE logger;
+  GString* path;
+  int fd;
+  guint source;
+  CONTROL_HANDLER handler;
+  void* data;
+  struct CONTROL_CLIENT* clients[CONTROL_CLIENTS_MAX];
+  // Scratch space for each reply.
+  GString* reply;
+};
+
+static void client_free ( struct CONTROL_CLIENT* client )
+{
+  struct CONTROL_PRIVATE* d = client->control;
+  int c;
+  for ( c = 0; c < CONTROL_CLIENTS_MAX; c++ ) {
+    if ( d->clients[c] == client )
+      d->clients[c] = NULL;
+  }
+  if ( client->source != 0 )
+    g_source_remove( client->source );
+  close( client->fd );
+  g_string_free( client->input, TRUE );
+  g_string_free( client->output, TRUE );
+  free( client );
+}
+
+/*!
+ * Run one request line and queue the reply.
+ */
+static void client_line ( struct CONTROL_CLIENT* client, char* line )
+{
+  struct CONTROL_PRIVATE* d = client->control;
+
+  // Words are separated by a single space; tolerate a trailing CR.
+  size_t length = strlen( line );
+  if ( length > 0 && line[length-1] == '\r' )
+    line[--length] = '\0';
+  if ( length == 0 )
+    return;
+
+  char* arguments = strchr( line, ' ' );
+  if ( arguments != NULL )
+    *arguments++ = '\0';
+  else
+    arguments = line + length;
+
+  g_string_truncate( d->reply, 0 );
+  if ( d->handler( line, arguments, d->reply, d->data ) == 0 ) {
+    g_string_append_len( client->output, d->reply->str, d->reply->len );
+    g_string_append( client->output, "OK\n" );
+  }
+  else {
+    g_string_append( client->output, "ERR " );
+    g_string_append_len( client->output, d->reply->str, d->reply->len );
+    g_string_append_c( client->output, '\n' );
+  }
+}
+
+static gboolean client_callback ( gint fd, GIOCondition condition,
+				  gpointer data );
+
+/*!
+ * What should we wait for from this client?
+ */
+static GIOCondition client_wanted ( const struct CONTROL_CLIENT* client )
+{
+  GIOCondition condition = 0;
+  // Stop reading from a client which isn't reading its replies.
+  if ( ! client->closing && client->output->len < CONTROL_OUTPUT_MAX )
+    condition |= G_IO_IN;
+  if ( client->output_sent < client->output->len )
+    condition |= G_IO_OUT;
+  return condition;
+}
+
+/*!
+ * Watch for whatever the client is waiting on next.
+ */
+static void client_watch ( struct CONTROL_CLIENT* client )
+{
+  if ( client->source != 0 )
+    g_source_remove( client->source );
+  client->watching = client_wanted( client );
+  client->source = g_unix_fd_add( client->fd,
+				  client->watching | G_IO_HUP | G_IO_ERR,
+				  client_callback, client );
+}
+
+static gboolean client_callback ( gint fd, GIOCondition condition,
+				  gpointer data )
+{
+  struct CONTROL_CLIENT* client = data;
+
+  if ( condition & G_IO_IN ) {
+    char buffer[4096];
+    ssize_t n_bytes = read( fd, buffer, sizeof buffer );
+    if ( n_bytes > 0 ) {
+      g_string_append_len( client->input, buffer, n_bytes );
+      // Each complete line.
+      char* start = client->input->str;
+      char* newline;
+      while ( ( newline = memchr( start, '\n',
+				  client->input->len -
+				  ( start - client->input->str ) ) ) != NULL ) {
+	*newline = '\0';
+	client_line( client, start );
+	start = newline + 1;
+      }
+      g_string_erase( client->input, 0, start - client->input->str );
+      if ( client->input->len > CONTROL_LINE_MAX ) {
+	g_string_append( client->output, "ERR line too long\n" );
+	client->closing = 1;
+      }
+    }
+    else if ( n_bytes == 0 || ( errno != EAGAIN && errno != EINTR ) ) {
+      client->closing = 1;
+    }
+  }
+  else if ( condition & ( G_IO_HUP | G_IO_ERR ) ) {
+    client->closing = 1;
+    // Nobody to write to either.
+    if ( condition & G_IO_ERR )
+      g_string_truncate( client->output, client->output_sent );
+  }
+
+  if ( client->output_sent < client->output->len ) {
+    ssize_t n_bytes = send( fd, client->output->str + client->output_sent,
+			    client->output->len - client->output_sent,
+			    MSG_NOSIGNAL | MSG_DONTWAIT );
+    if ( n_bytes > 0 ) {
+      client->output_sent += n_bytes;
+    }
+    else if ( n_bytes < 0 && errno != EAGAIN && errno != EINTR ) {
+      g_string_truncate( client->output, client->output_sent );
+      client->closing = 1;
+    }
+  }
+  if ( client->output_sent == client->output->len ) {
+    g_string_truncate( client->output, 0 );
+    client->output_sent = 0;
+  }
+
+  if ( client->closing && client->output->len == 0 ) {
+    // Returning FALSE removes the source.
+    client->source = 0;
+    client_free( client );
+    return FALSE;
+  }
+
+  // The same source will do unless what we're waiting for changed.
+  if ( client_wanted( client ) != client->watching ) {
+    // This one goes away when we return FALSE.
+    client->source = 0;
+    client_watch( client );
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static gboolean accept_callback ( gint fd, GIOCondition condition,
+				  gpointer data )
+{
+  (void)condition;
+
+  struct CONTROL_PRIVATE* d = data;
+
+  int client_fd = accept( fd, NULL, NULL );
+  if ( client_fd < 0 )
+    return TRUE;
+  fcntl( client_fd, F_SETFL, fcntl( client_fd, F_GETFL ) | O_NONBLOCK );
+  fcntl( client_fd, F_SETFD, FD_CLOEXEC );
+
+  int c;
+  for ( c = 0; c < CONTROL_CLIENTS_MAX; c++ ) {
+    if ( d->clients[c] == NULL )
+      break;
+  }
+  if ( c == CONTROL_CLIENTS_MAX ) {
+    static const char busy[] = "ERR too many clients\n";
+    (void)send( client_fd, busy, sizeof busy - 1, MSG_NOSIGNAL | MSG_DONTWAIT );
+    close( client_fd );
+    return TRUE;
+  }
+
+  struct CONTROL_CLIENT* client = malloc( sizeof( struct CONTROL_CLIENT ) );
+  client->control     = d;
+  client->fd          = client_fd;
+  client->source      = 0;
+  client->input       = g_string_sized_new( 256 );
+  client->output      = g_string_sized_new( 1024 );
+  client->output_sent = 0;
+  client->closing     = 0;
+  client->watching    = 0;
+  d->clients[c] = client;
+
+  client_watch( client );
+
+  return TRUE;
+}
+
+struct CONTROL_HANDLE control_init ( const char* path, CONTROL_HANDLER handler,
+				     void* data, struct LOG_HANDLE logger )
+{
+  struct CONTROL_HANDLE handle;
+  handle.d = malloc( sizeof( struct CONTROL_PRIVATE ) );
+  memset( handle.d, 0, sizeof( struct CONTROL_PRIVATE ) );
+  handle.d->logger  = logger;
+  handle.d->path    = g_string_new( path );
+  handle.d->handler = handler;
+  handle.d->data    = data;
+  handle.d->reply   = g_string_sized_new( 1024 );
+
+  struct sockaddr_un address;
+  memset( &address, 0, sizeof address );
+  address.sun_family = AF_UNIX;
+  if ( strlen( path ) >= sizeof address.sun_path ) {
+    log_message_warn( logger, "Control socket path too long: \"%s\"", path );
+    handle.d->fd = -1;
+    handle.d->status = -1;
+    return handle;
+  }
+  strcpy( address.sun_path, path );
+
+  handle.d->fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			 0 );
+  if ( handle.d->fd < 0 ) {
+    log_message_warn( logger, "Could not create control socket: %s",
+		      strerror( errno ) );
+    handle.d->status = -1;
+    return handle;
+  }
+
+  // Left over from last time, presumably.
+  (void)unlink( path );
+
+  if ( bind( handle.d->fd, (struct sockaddr*)&address, sizeof address ) < 0 ||
+       listen( handle.d->fd, 8 ) < 0 ) {
+    log_message_warn( logger, "Could not listen on control socket \"%s\": %s",
+		      path, strerror( errno ) );
+    close( handle.d->fd );
+    handle.d->fd = -1;
+    handle.d->status = -1;
+    return handle;
+  }
+
+  handle.d->source = g_unix_fd_add( handle.d->fd, G_IO_IN, accept_callback,
+				    handle.d );
+
+  log_message_info( logger, "Listening on control socket \"%s\"", path );
+
+  return handle;
+}
+
+int control_status ( struct CONTROL_HANDLE handle )
+{
+  return handle.d->status;
+}
+
+void control_free ( struct CONTROL_HANDLE handle )
+{
+  if ( handle.d != NULL ) {
+    int c;
+    for ( c = 0; c < CONTROL_CLIENTS_MAX; c++ ) {
+      if ( handle.d->clients[c] != NULL )
+	client_free( handle.d->clients[c] );
+    }
+    if ( handle.d->source != 0 )
+      g_source_remove( handle.d->source );
+    if ( handle.d->fd >= 0 ) {
+      close( handle.d->fd );
+      (void)unlink( handle.d->path->str );
+    }
+    g_string_free( handle.d->path, TRUE );
+    g_string_free( handle.d->reply, TRUE );
+    free( handle.d );
+  }
+}
@@ -0,0 +1,52 @@
+/*
+ * A Unix domain socket for poking at a running mpddisplay. The protocol
+ * is a line at a time: a command word, optionally followed by a space
+ * and arguments. Each reply is zero or more "key: value" lines followed
+ * by "OK" or "ERR message" (much like MPD's own protocol).
+ */
+#ifndef CONTROL_INTF_H
+#define CONTROL_INTF_H
+
+#include "glib.h"
+
+struct CONTROL_PRIVATE;
+struct LOG_HANDLE;
+
+struct CONTROL_HANDLE {
+  struct CONTROL_PRIVATE* d;
+};
+
+/*!
+ * Carry out one command.
+ * \param[in] command the command word.
+ * \param[in] arguments the rest of the line (never NULL).
+ * \param[inout] reply append any "key: value" lines here; on error,
+ * put the message here instead.
+ * \param[in] data the user data given to control_init.
+ * \return 0 if everything is ok, -1 for an error.
+ */
+typedef int (*CONTROL_HANDLER)( const char* command, const char* arguments,
+				GString* reply, void* data );
+
+/*!
+ * Create the socket and serve it from the default GLib main context.
+ * A stale socket file left behind by a previous run is replaced.
+ * \param[in] path where to put the socket.
+ * \param[in] handler called for each command.
+ * \param[in] data passed to the handler.
+ * \param[in] logger our logger.
+ * \return a handle to the socket. Check it with control_status.
+ */
+struct CONTROL_HANDLE control_init ( const char* path, CONTROL_HANDLER handler,
+				     void* data, struct LOG_HANDLE logger );
+/*!
+ * \param[in] handle the socket.
+ * \return 0 if everything is ok, -1 otherwise.
+ */
+int control_status ( struct CONTROL_HANDLE handle );
+/*!
+ * Disconnect any clients and remove the socket.
+ * \param[in] handle the socket.
+ */
+void control_free ( struct CONTROL_HANDLE handle );
+#endif
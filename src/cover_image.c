@@ -6,41 +6,69 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 
 #include "sqlite3.h"
+#include "glib.h"
 
 #include "image_intf.h"
 #include "log_intf.h"
+#include "metrics.h"
+#include "trace.h"
+#include "recorder.h"
+#include "spsc_queue.h"
 #include "cover_image.h"
 
-// The unknown cover is compiled into the code.
-extern const unsigned char _binary_no_cover_png_start;
-extern const unsigned char _binary_no_cover_png_end;
+// Finding the cover in the database, and turning it into pixels.
+static struct METRIC cover_metrics[] = {
+  METRIC_LATENCY_INIT( "mpddisplay_cover_seconds",
+		       "Time to look up and decode album covers.",
+		       "step", "lookup" ),
+  METRIC_LATENCY_INIT( "mpddisplay_cover_seconds",
+		       "Time to look up and decode album covers.",
+		       "step", "decode" ),
+};
+static struct METRIC cover_found_metrics[] = {
+  METRIC_COUNTER_INIT( "mpddisplay_cover_lookups_total",
+		       "Album cover lookups.", "result", "found" ),
+  METRIC_COUNTER_INIT( "mpddisplay_cover_lookups_total",
+		       "Album cover lookups.", "result", "missing" ),
+};
+static struct METRIC cover_cache_metrics[] = {
+  METRIC_COUNTER_INIT( "mpddisplay_cover_cache_total",
+		       "Covers asked of the cover thread.", "result", "hit" ),
+  METRIC_COUNTER_INIT( "mpddisplay_cover_cache_total",
+		       "Covers asked of the cover thread.", "result", "miss" ),
+};
 
-// If there is no entry in the database, return this warning image.
+// How many scaled covers the cover thread keeps. Enough for every
+// zone's album and a few it has just moved on from.
+#define COVER_CACHE_SIZE 16
 
-struct IMAGE_HANDLE no_cover ( void )
+// The unknown cover is compiled into the code, already decoded and
+// scaled to fit the cover widget of the usual screen (see
+// asset_compiler and COVER_SIZE in the Makefile).
+extern const unsigned char _binary_no_cover_rgba_start;
+extern const unsigned char _binary_no_cover_rgba_end;
+
+static struct IMAGE_HANDLE raw_no_cover ( void )
 {
-  // If we reach here, we haven't found an image.
   size_t no_cover_size =
-    &_binary_no_cover_png_end - &_binary_no_cover_png_start; 
+    &_binary_no_cover_rgba_end - &_binary_no_cover_rgba_start;
 
-  return image_rgba_create( &_binary_no_cover_png_start, no_cover_size );
+  return image_rgba_raw( &_binary_no_cover_rgba_start, no_cover_size );
 }
 
-// The empty cover is compiled into the code.
-extern const unsigned char _binary_empty_cover_png_start;
-extern const unsigned char _binary_empty_cover_png_end;
-
-// If nothing is being displayed (for instance if playback is stopped
-// at the end of a playlist), return this empty image.
+// The empty cover is compiled into the code, likewise.
+extern const unsigned char _binary_empty_cover_rgba_start;
+extern const unsigned char _binary_empty_cover_rgba_end;
 
-struct IMAGE_HANDLE empty_cover ( void )
+static struct IMAGE_HANDLE raw_empty_cover ( void )
 {
   size_t empty_cover_size =
-    &_binary_empty_cover_png_end - &_binary_empty_cover_png_start;
+    &_binary_empty_cover_rgba_end - &_binary_empty_cover_rgba_start;
 
-  return image_rgba_create( &_binary_empty_cover_png_start, empty_cover_size );
+  return image_rgba_raw( &_binary_empty_cover_rgba_start, empty_cover_size );
 }
 
 /*!
@@ -48,28 +76,145 @@ struct IMAGE_HANDLE empty_cover ( void )
  */
 struct IMAGE_DB_PRIVATE {
   sqlite3* db;
+  // The cover query, prepared once.
+  sqlite3_stmt* lookup;
   struct LOG_HANDLE logger;
+  // The database is opened in the background; this is joined before
+  // the first lookup.
+  GThread* opener;
+  GString* database;
+  // Anything the opener had to complain about (logged when joined).
+  GString* error;
+  // The cover thread (if it's running) and its queues.
+  GThread* worker;
+  struct SPSC_QUEUE_HANDLE requests;
+  struct SPSC_QUEUE_HANDLE results;
+  int width;
+  int height;
+  int stopping;
+  // The built-in covers: as compiled in until the cover thread has
+  // scaled them for a screen of another size.
+  struct IMAGE_HANDLE no_cover;
+  struct IMAGE_HANDLE empty_cover;
+  // Scaled covers, most recently used first. Only the cover thread
+  // touches these.
+  struct COVER_CACHE_ENTRY {
+    char* artist;
+    char* album;
+    struct IMAGE_HANDLE image;
+  } cache[COVER_CACHE_SIZE];
+  int cache_count;
 };
 
-struct IMAGE_DB_HANDLE image_db_create ( const char* database,
-					 struct LOG_HANDLE logger )
+// Pushed to tell the cover thread to finish.
+static struct COVER_RESULT stop_request;
+
+static gpointer db_open ( gpointer data )
 {
-  int rc;
-  struct IMAGE_DB_HANDLE handle;
-  handle.d = malloc( sizeof( struct IMAGE_DB_PRIVATE ) );
-  handle.d->logger = logger;
+  struct IMAGE_DB_PRIVATE* d = data;
+  trace_thread_name( "database" );
+  gint64 span = trace_begin();
 
-  rc = sqlite3_open_v2( database, &handle.d->db, SQLITE_OPEN_READONLY, 0 );
+  int rc = sqlite3_open_v2( d->database->str, &d->db, SQLITE_OPEN_READONLY, 0 );
 
   if ( rc != SQLITE_OK ) {
     // Interesting: You still get a database handle even if the open
     // fails just so you can emit an error message! Though I must
     // say it is not very informative.
-    log_message_error( logger, "Image database '%s': %s: (%d)",
-		       database, sqlite3_errmsg( handle.d->db ), rc );
-    sqlite3_close( handle.d->db );
-    handle.d->db = NULL;
+    g_string_printf( d->error, "Image database '%s': %s: (%d)",
+		     d->database->str, sqlite3_errmsg( d->db ), rc );
+    sqlite3_close( d->db );
+    d->db = NULL;
   }
+  else {
+    // This is also what reads the schema.
+    rc = sqlite3_prepare_v2( d->db, "SELECT albums.cover_format, albums.cover_image FROM contributions JOIN artists ON artists.ROWID = contributions.artist JOIN albums ON albums.ROWID = contributions.album WHERE artists.name = ? AND albums.title = ?", -1, &d->lookup, NULL );
+
+    if ( rc != SQLITE_OK ) {
+      g_string_printf( d->error, "SQLITE3 error on prepare: %s",
+		       sqlite3_errmsg( d->db ) );
+      d->lookup = NULL;
+    }
+  }
+
+  trace_end( "database open", span );
+  return NULL;
+}
+
+// If there is no entry in the database, return this warning image.
+
+static struct IMAGE_HANDLE no_cover ( struct IMAGE_DB_PRIVATE* d )
+{
+  return image_rgba_ref( d->no_cover );
+}
+
+// If nothing is being displayed (for instance if playback is stopped
+// at the end of a playlist), return this empty image.
+
+static struct IMAGE_HANDLE empty_cover ( struct IMAGE_DB_PRIVATE* d )
+{
+  return image_rgba_ref( d->empty_cover );
+}
+
+/*!
+ * The built-in covers were made for the usual screen. On any other,
+ * scale them once here rather than for every album without a cover.
+ */
+static void fit_builtin_cover ( struct IMAGE_DB_PRIVATE* d,
+				struct IMAGE_HANDLE* cover )
+{
+  if ( image_rgba_width( *cover ) == d->width &&
+       image_rgba_height( *cover ) == d->height )
+    return;
+  struct IMAGE_HANDLE scaled = image_rgba_scale( *cover, d->width,
+						 d->height );
+  image_rgba_free( *cover );
+  *cover = scaled;
+}
+
+/*!
+ * Make sure the opener is finished.
+ */
+static void db_wait ( struct IMAGE_DB_PRIVATE* d )
+{
+  if ( d->opener == NULL )
+    return;
+
+  gint64 span = trace_begin();
+  g_thread_join( d->opener );
+  d->opener = NULL;
+  trace_end( "wait for database", span );
+
+  if ( d->error->len > 0 )
+    log_message_error( d->logger, "%s", d->error->str );
+}
+
+struct IMAGE_DB_HANDLE image_db_create ( const char* database,
+					 struct LOG_HANDLE logger )
+{
+  struct IMAGE_DB_HANDLE handle;
+  handle.d = malloc( sizeof( struct IMAGE_DB_PRIVATE ) );
+  handle.d->db = NULL;
+  handle.d->lookup = NULL;
+  handle.d->logger = logger;
+  handle.d->database = g_string_new( database );
+  handle.d->error = g_string_new( "" );
+  handle.d->worker = NULL;
+  handle.d->requests.d = NULL;
+  handle.d->results.d = NULL;
+  handle.d->stopping = 0;
+  handle.d->cache_count = 0;
+  handle.d->no_cover = raw_no_cover();
+  handle.d->empty_cover = raw_empty_cover();
+
+  metrics_register( &cover_metrics[0] );
+  metrics_register( &cover_metrics[1] );
+  metrics_register( &cover_found_metrics[0] );
+  metrics_register( &cover_found_metrics[1] );
+  metrics_register( &cover_cache_metrics[0] );
+  metrics_register( &cover_cache_metrics[1] );
+
+  handle.d->opener = g_thread_new( "database", db_open, handle.d );
 
   return handle;
 }
@@ -77,27 +222,29 @@ struct IMAGE_DB_HANDLE image_db_create ( const char* database,
 struct IMAGE_HANDLE cover_image ( struct IMAGE_DB_HANDLE handle,
 				  const char* artist, const char* album )
 {
-  if ( handle.d == NULL || handle.d->db == NULL ) {
-    return empty_cover();
+  if ( handle.d == NULL ) {
+    return raw_empty_cover();
   }
 
-  if ( strlen( artist ) == 0 && strlen( album ) == 0 ) {
-    return empty_cover();
-  }
+  db_wait( handle.d );
 
-  int rc;
-  sqlite3_stmt* stmt;
-  const char* tail;
+  if ( handle.d->db == NULL ) {
+    return empty_cover( handle.d );
+  }
 
-  rc = sqlite3_prepare_v2( handle.d->db, "SELECT albums.cover_format, albums.cover_image FROM contributions JOIN artists ON artists.ROWID = contributions.artist JOIN albums ON albums.ROWID = contributions.album WHERE artists.name = ? AND albums.title = ?", -1, &stmt, &tail );
+  if ( strlen( artist ) == 0 && strlen( album ) == 0 ) {
+    return empty_cover( handle.d );
+  }
 
-  if ( rc != SQLITE_OK ) {
-    log_message_warn( handle.d->logger,
-		      "SQLITE3 error on prepare: %s\n",
-		      sqlite3_errmsg(handle.d->db) );
-    return no_cover();
+  if ( handle.d->lookup == NULL ) {
+    return no_cover( handle.d );
   }
 
+  int rc;
+  sqlite3_stmt* stmt = handle.d->lookup;
+  gint64 start = g_get_monotonic_time();
+  gint64 span = trace_begin();
+
   rc = sqlite3_bind_text( stmt, 1, artist, -1, SQLITE_STATIC );
   rc = sqlite3_bind_text( stmt, 2, album, -1, SQLITE_STATIC );
 
@@ -109,19 +256,250 @@ struct IMAGE_HANDLE cover_image ( struct IMAGE_DB_HANDLE handle,
       image = sqlite3_column_blob( stmt, 1 );
       if ( n_bytes == 0 )
 	break;
-      return image_rgba_create( image, n_bytes );
+      gint64 found = g_get_monotonic_time();
+      trace_end( "cover lookup", span );
+      metric_observe( &cover_metrics[0], found - start );
+      metric_add( &cover_found_metrics[0], 1 );
+      struct IMAGE_HANDLE cover = image_rgba_create( image, n_bytes );
+      metric_observe( &cover_metrics[1], g_get_monotonic_time() - found );
+      // The blob was only good until now.
+      sqlite3_reset( stmt );
+      return cover;
+    }
+  }
+
+  sqlite3_reset( stmt );
+  metric_observe( &cover_metrics[0], g_get_monotonic_time() - start );
+  metric_add( &cover_found_metrics[1], 1 );
+  trace_end( "cover lookup", span );
+
+  return no_cover( handle.d );
+}
+
+/*!
+ * A scaled cover for the album, from the cache if we've seen it lately.
+ */
+static struct IMAGE_HANDLE cached_cover ( struct IMAGE_DB_PRIVATE* d,
+					  const char* artist,
+					  const char* album )
+{
+  struct IMAGE_DB_HANDLE handle = { d };
+  struct COVER_CACHE_ENTRY entry;
+  int c;
+  for ( c = 0; c < d->cache_count; c++ ) {
+    if ( strcmp( d->cache[c].artist, artist ) == 0 &&
+	 strcmp( d->cache[c].album, album ) == 0 )
+      break;
+  }
+
+  if ( c < d->cache_count ) {
+    metric_add( &cover_cache_metrics[0], 1 );
+    entry = d->cache[c];
+  }
+  else {
+    metric_add( &cover_cache_metrics[1], 1 );
+    gint64 start = g_get_monotonic_time();
+    struct IMAGE_HANDLE cover = cover_image( handle, artist, album );
+
+    // Scale it to fit here rather than on every frame.
+    if ( image_rgba_width( cover ) != d->width ||
+	 image_rgba_height( cover ) != d->height ) {
+      gint64 span = trace_begin();
+      struct IMAGE_HANDLE scaled = image_rgba_scale( cover, d->width,
+						     d->height );
+      image_rgba_free( cover );
+      cover = scaled;
+      trace_end( "cover scale", span );
+    }
+    recorder_event( RECORDER_COVER_MISS, 0, 0,
+		    g_get_monotonic_time() - start );
+
+    // Make room by dropping the least recently used.
+    if ( d->cache_count == COVER_CACHE_SIZE ) {
+      struct COVER_CACHE_ENTRY* last = &d->cache[--d->cache_count];
+      g_free( last->artist );
+      g_free( last->album );
+      image_rgba_free( last->image );
     }
+    c = d->cache_count++;
+    entry.artist = g_strdup( artist );
+    entry.album = g_strdup( album );
+    entry.image = cover;
   }
 
-  return no_cover();
+  // Either way, it goes to the front.
+  memmove( &d->cache[1], &d->cache[0], c * sizeof d->cache[0] );
+  d->cache[0] = entry;
+
+  return image_rgba_ref( entry.image );
+}
+
+static gpointer cover_worker ( gpointer data )
+{
+  struct IMAGE_DB_PRIVATE* d = data;
+
+  trace_thread_name( "covers" );
+
+  fit_builtin_cover( d, &d->no_cover );
+  fit_builtin_cover( d, &d->empty_cover );
+
+  while ( 1 ) {
+    struct pollfd wait = { spsc_queue_fd( d->requests ), POLLIN, 0 };
+    (void)poll( &wait, 1, -1 );
+
+    // Skip straight to each server's latest request; the others are
+    // out of date.
+    GPtrArray* latest = g_ptr_array_new();
+    struct COVER_RESULT* request;
+    int stop = 0;
+    while ( ( request = spsc_queue_pop( d->requests ) ) != NULL ) {
+      if ( request == &stop_request ) {
+	stop = 1;
+	continue;
+      }
+      guint r;
+      for ( r = 0; r < latest->len; r++ ) {
+	struct COVER_RESULT* earlier = g_ptr_array_index( latest, r );
+	if ( earlier->server == request->server ) {
+	  cover_result_free( earlier );
+	  break;
+	}
+      }
+      if ( r < latest->len )
+	g_ptr_array_index( latest, r ) = request;
+      else
+	g_ptr_array_add( latest, request );
+    }
+
+    guint r;
+    for ( r = 0; r < latest->len; r++ ) {
+      request = g_ptr_array_index( latest, r );
+      if ( stop ) {
+	cover_result_free( request );
+	continue;
+      }
+
+      request->image = cached_cover( d, request->artist, request->album );
+
+      // The queue is only full if the main loop is stuck; wait for it.
+      while ( spsc_queue_push( d->results, request ) < 0 ) {
+	if ( __atomic_load_n( &d->stopping, __ATOMIC_RELAXED ) ) {
+	  cover_result_free( request );
+	  break;
+	}
+	g_usleep( 10000 );
+      }
+    }
+    g_ptr_array_free( latest, TRUE );
+
+    if ( stop )
+      break;
+  }
+
+  return NULL;
+}
+
+int image_db_start ( struct IMAGE_DB_HANDLE handle, int width, int height )
+{
+  if ( handle.d == NULL || handle.d->worker != NULL )
+    return -1;
+
+  // Room for a request (and result) from each of several servers.
+  handle.d->requests = spsc_queue_create( 32 );
+  handle.d->results = spsc_queue_create( 32 );
+  if ( spsc_queue_status( handle.d->requests ) < 0 ||
+       spsc_queue_status( handle.d->results ) < 0 ) {
+    spsc_queue_free( handle.d->requests );
+    spsc_queue_free( handle.d->results );
+    handle.d->requests.d = NULL;
+    handle.d->results.d = NULL;
+    return -1;
+  }
+
+  handle.d->width = width;
+  handle.d->height = height;
+  handle.d->worker = g_thread_new( "covers", cover_worker, handle.d );
+
+  return 0;
+}
+
+int image_db_request ( struct IMAGE_DB_HANDLE handle, int server,
+		       const char* artist, const char* album )
+{
+  if ( handle.d == NULL || handle.d->worker == NULL )
+    return -1;
+
+  struct COVER_RESULT* request = g_new( struct COVER_RESULT, 1 );
+  request->artist = g_strdup( artist );
+  request->album = g_strdup( album );
+  request->image.d = NULL;
+  request->requested = g_get_monotonic_time();
+  request->server = server;
+
+  if ( spsc_queue_push( handle.d->requests, request ) < 0 ) {
+    cover_result_free( request );
+    return -1;
+  }
+
+  return 0;
+}
+
+int image_db_results_fd ( struct IMAGE_DB_HANDLE handle )
+{
+  if ( handle.d == NULL || handle.d->worker == NULL )
+    return -1;
+  return spsc_queue_fd( handle.d->results );
+}
+
+struct COVER_RESULT* image_db_result ( struct IMAGE_DB_HANDLE handle )
+{
+  if ( handle.d == NULL || handle.d->worker == NULL )
+    return NULL;
+  return spsc_queue_pop( handle.d->results );
+}
+
+void cover_result_free ( struct COVER_RESULT* result )
+{
+  if ( result != NULL ) {
+    g_free( result->artist );
+    g_free( result->album );
+    image_rgba_free( result->image );
+    g_free( result );
+  }
 }
 
 void image_db_free ( struct IMAGE_DB_HANDLE handle )
 {
   if ( handle.d != NULL ) {
+    if ( handle.d->worker != NULL ) {
+      __atomic_store_n( &handle.d->stopping, 1, __ATOMIC_RELAXED );
+      while ( spsc_queue_push( handle.d->requests, &stop_request ) < 0 )
+	g_usleep( 1000 );
+      g_thread_join( handle.d->worker );
+      struct COVER_RESULT* result;
+      while ( ( result = image_db_result( handle ) ) != NULL )
+	cover_result_free( result );
+      handle.d->worker = NULL;
+      spsc_queue_free( handle.d->requests );
+      spsc_queue_free( handle.d->results );
+    }
+    int c;
+    for ( c = 0; c < handle.d->cache_count; c++ ) {
+      g_free( handle.d->cache[c].artist );
+      g_free( handle.d->cache[c].album );
+      image_rgba_free( handle.d->cache[c].image );
+    }
+    image_rgba_free( handle.d->no_cover );
+    image_rgba_free( handle.d->empty_cover );
+    db_wait( handle.d );
+    if ( handle.d->lookup != NULL ) {
+      sqlite3_finalize( handle.d->lookup );
+    }
     if ( handle.d->db != NULL ) {
       sqlite3_close( handle.d->db );
     }
+    g_string_free( handle.d->database, TRUE );
+    g_string_free( handle.d->error, TRUE );
     free( handle.d );
     handle.d = NULL;
   }
@@ -4,7 +4,10 @@
 #ifndef COVER_IMAGE_H
 #define COVER_IMAGE_H
 
-struct IMAGE_HANDLE;
+#include <stdint.h>
+
+#include "image_intf.h"
+
 struct IMAGE_DB_PRIVATE;
 struct LOG_HANDLE;
 
@@ -19,5 +22,56 @@ struct IMAGE_HANDLE cover_image ( struct IMAGE_DB_HANDLE handle,
 				  const char* artist,
 				  const char* album );
 
+/*!
+ * A cover looked up on the cover thread.
+ */
+struct COVER_RESULT {
+  char* artist;
+  char* album;
+  //! Already scaled to the size given to image_db_start.
+  struct IMAGE_HANDLE image;
+  //! When it was asked for (monotonic, us).
+  int64_t requested;
+  //! Who asked (see image_db_request).
+  int server;
+};
+/*!
+ * Start a thread to look up, decode and scale covers so none of that
+ * holds up drawing. Don't call cover_image once this is running.
+ * \param[in] handle the database.
+ * \param[in] width the width to scale covers to.
+ * \param[in] height the height to scale covers to.
+ * \return 0 if the thread started, -1 otherwise.
+ */
+int image_db_start ( struct IMAGE_DB_HANDLE handle, int width, int height );
+/*!
+ * Ask for a cover. If several requests from the same server are
+ * waiting, only the latest is looked up. Recent covers are kept (for
+ * every server), so an album showing in two zones, or coming round
+ * again, is only decoded once. Call this from one thread only.
+ * \param[in] handle the database.
+ * \param[in] server which MPD server it's for (0 if there's only one).
+ * \param[in] artist the artist.
+ * \param[in] album the album.
+ * \return 0 if the request was queued, -1 otherwise.
+ */
+int image_db_request ( struct IMAGE_DB_HANDLE handle, int server,
+		       const char* artist, const char* album );
+/*!
+ * \param[in] handle the database.
+ * \return a descriptor which is readable when results may be waiting.
+ */
+int image_db_results_fd ( struct IMAGE_DB_HANDLE handle );
+/*!
+ * \param[in] handle the database.
+ * \return the next finished cover (free it with cover_result_free), or
+ * NULL if there isn't one.
+ */
+struct COVER_RESULT* image_db_result ( struct IMAGE_DB_HANDLE handle );
+/*!
+ * \param[in] result a result (may be NULL).
+ */
+void cover_result_free ( struct COVER_RESULT* result );
+
 void image_db_free ( struct IMAGE_DB_HANDLE handle );
 #endif
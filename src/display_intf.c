@@ -3,7 +3,9 @@
  * with the tiny TV monitor. We're primarily working with OpenVG here,
  * but we may need to throw in some VideoCore Dispmanx stuff as well.
  */
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include "bcm_host.h"
 #include "EGL/egl.h"
@@ -11,16 +13,63 @@
 #include "VG/vgu.h"
 
 #include "glib.h"
+#include "glib-unix.h"
 
+#include "log_intf.h"
 #include "mpd_intf.h"
+#include "glyph_cache.h"
 #include "text_widget.h"
 #include "image_widget.h"
 #include "cover_image.h"
 #include "display_intf.h"
 #include "image_intf.h"
+#include "metrics.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "recorder.h"
 
 static const char* egl_carp ( void );
 
+// Where the time goes in display_update (drawing includes redraws
+// for animation).
+enum UPDATE_STAGE {
+  UPDATE_STAGE_METADATA,
+  UPDATE_STAGE_TIME,
+  UPDATE_STAGE_COVER,
+  UPDATE_STAGE_DRAW,
+  UPDATE_STAGES
+};
+
+#define UPDATE_METRIC( stage )						\
+  METRIC_LATENCY_INIT( "mpddisplay_display_update_seconds",		\
+		       "Time spent updating the display, by stage.",	\
+		       "stage", stage )
+
+static struct METRIC update_metrics[UPDATE_STAGES] = {
+  UPDATE_METRIC( "metadata" ),
+  UPDATE_METRIC( "time" ),
+  UPDATE_METRIC( "cover" ),
+  UPDATE_METRIC( "draw" ),
+};
+static struct METRIC swap_metric =
+  METRIC_LATENCY_INIT( "mpddisplay_egl_swap_seconds",
+		       "Time spent in eglSwapBuffers.", NULL, NULL );
+// How long things wait between the other threads and us.
+static struct METRIC handoff_metrics[] = {
+  METRIC_LATENCY_INIT( "mpddisplay_handoff_seconds",
+		       "Time from another thread producing something to "
+		       "the display taking it.", "queue", "state" ),
+  METRIC_LATENCY_INIT( "mpddisplay_handoff_seconds",
+		       "Time from another thread producing something to "
+		       "the display taking it.", "queue", "cover" ),
+};
+static struct METRIC frame_metrics[] = {
+  METRIC_COUNTER_INIT( "mpddisplay_frames_total", "Frames drawn.",
+		       "kind", "full" ),
+  METRIC_COUNTER_INIT( "mpddisplay_frames_total", "Frames drawn.",
+		       "kind", "partial" ),
+};
+
 static int window_width = 0;
 static int window_height = 0;
 // The basic decoration.
@@ -39,9 +88,10 @@ static VGPaint thermometer_paint;
 // Background color and alpha
 static const VGfloat thermometer_color[] = { 0.f, 0.75f, 1.f, 0.3f };
 
-// The frame texture is compiled into the code.
-extern const unsigned char _binary_pattern_png_start;
-extern const unsigned char _binary_pattern_png_end;
+// The frame texture is compiled into the code (already decoded, see
+// asset_compiler).
+extern const unsigned char _binary_pattern_rgba_start;
+extern const unsigned char _binary_pattern_rgba_end;
 
 // Rather than burying these in the code, here are some constants
 // which we can play with to make the screen look better.
@@ -79,33 +129,290 @@ static const VGfloat thermometer_gap = 0.5f;
 // The basic height of the font in mm.
 static const VGfloat font_size_mm = 3.f;
 
+// The metadata box is split into a line for each of these, top to
+// bottom. Each has its own widget so that a new title doesn't disturb
+// the artist or album.
+enum METADATA_FIELD {
+  METADATA_ARTIST,
+  METADATA_ALBUM,
+  METADATA_TITLE,
+  METADATA_FIELDS
+};
+
+// With several servers, each gets a panel like this: the cover on
+// the left and these lines on the right.
+enum PANEL_PART {
+  PANEL_TITLE,
+  PANEL_DETAIL,
+  PANEL_TIME,
+  PANEL_COVER,
+  PANEL_PARTS
+};
+
+// More than this many servers go in two columns.
+#define PANEL_ROWS_MAX 4
+
+struct DISPLAY_PANEL {
+  // What the server is called on the screen.
+  gchar* name;
+  struct TEXT_WIDGET_HANDLE title_widget;
+  // The server's name, artist and album.
+  struct TEXT_WIDGET_HANDLE detail_widget;
+  struct TEXT_WIDGET_HANDLE time_widget;
+  struct IMAGE_WIDGET_HANDLE cover_widget;
+  int time_sprites;
+  char time_markup[96];
+  // Where the whole panel and its parts are (pixels).
+  VGint box[4];
+  VGint boxes[PANEL_PARTS][4];
+  // Nothing from the server yet, so the first update replaces
+  // everything.
+  int fresh;
+};
+
+// If more than this many regions change at once, just redraw it all.
+#define DAMAGE_RECTS_MAX 8
+
+// Seconds to wait after new glyphs turn up before saving them.
+#define GLYPH_SAVE_DELAY 10
+
 struct DISPLAY_PRIVATE {
   int status;
+  struct LOG_HANDLE logger;
   struct IMAGE_DB_HANDLE image_db;
-  struct MPD_HANDLE mpd;
+  // Covers come from the cover thread; this watches for them (0 if
+  // the thread isn't running and we look covers up ourselves).
+  guint covers_source;
+  // The album the last cover was asked for, for each server. Anything
+  // else which turns up is out of date.
+  gchar* cover_artist[MPD_SERVERS_MAX];
+  gchar* cover_album[MPD_SERVERS_MAX];
+  // How many servers are shown. With more than one, each has a panel
+  // instead of the widgets below.
+  int servers;
+  struct DISPLAY_PANEL panels[MPD_SERVERS_MAX];
   EGLDisplay egl_display;
   EGLSurface egl_surface;
   // This must persist or the process segfaults and/or the system hangs!
   EGL_DISPMANX_WINDOW_T native_window;
-  // Our metadata widget.
-  struct TEXT_WIDGET_HANDLE metadata_widget;
+  // Glyph outlines kept between runs.
+  struct GLYPH_CACHE_HANDLE glyph_cache;
+  // Writes out new glyphs a little after they turn up (0 if nothing
+  // is waiting).
+  guint glyph_save_source;
+  // Our metadata widgets.
+  struct TEXT_WIDGET_HANDLE metadata_widgets[METADATA_FIELDS];
   // Our time widget.
   struct TEXT_WIDGET_HANDLE time_widget;
   // The album cover widget.
   struct IMAGE_WIDGET_HANDLE cover_widget;
-
+  // Markup for the metadata widget. Reused so that building it doesn't
+  // allocate once it has grown to fit.
+  GString* metadata_markup;
+  // Is the time widget in sprite mode?
+  int time_sprites;
+  // Text (or markup if not in sprite mode) for the time widget. It is
+  // (nearly) always the same length.
+  char time_markup[96];
+  // Where things are on the screen (pixels: x, y, width, height).
+  VGint metadata_boxes[METADATA_FIELDS][4];
+  VGint thermometer_box[4];
+  VGint cover_box[4];
+  // Does the surface keep its contents after a swap? If so, we only
+  // need to redraw what has changed.
+  int preserved;
+  // What has changed since the last redraw.
+  VGint damage[DAMAGE_RECTS_MAX][4];
+  int damage_count;
+  int damage_all;
+  // What was on the screen, for next time.
+  struct SNAPSHOT_HANDLE snapshot;
+  // Is the screen showing the snapshot rather than MPD?
+  int restored;
+  // Frame timing.
+  struct DISPLAY_STATS stats;
+  long long frame_total;
 };
 
+static void restore_snapshot ( struct DISPLAY_PRIVATE* d );
+static void panels_init ( struct DISPLAY_PRIVATE* d,
+			  const char* const* servers );
+static gboolean covers_ready ( gint fd, GIOCondition condition,
+			       gpointer data );
+
+/*!
+ * Convert a box in mm to a pixel rectangle which covers it.
+ */
+static void box_from_mm ( VGint box[4], float x_mm, float y_mm,
+			  float width_mm, float height_mm )
+{
+  box[0] = floorf( vc_frame_x + x_mm * dpmm_x );
+  box[1] = floorf( vc_frame_y + y_mm * dpmm_y );
+  box[2] = ceilf( vc_frame_x + ( x_mm + width_mm ) * dpmm_x ) - box[0];
+  box[3] = ceilf( vc_frame_y + ( y_mm + height_mm ) * dpmm_y ) - box[1];
+}
+
+/*!
+ * Where the cover goes (mm).
+ */
+static void cover_box_mm ( float* x_mm, float* y_mm, float* width_mm,
+			   float* height_mm )
+{
+  float image_edge_length = tv_width / 2.f - 1.5 * border_thickness;
+  *x_mm = tv_width / 2.f + border_thickness / 2.f;
+  *y_mm = tv_height - border_thickness - image_edge_length;
+  *width_mm = image_edge_length;
+  *height_mm = image_edge_length;
+}
+
+void display_cover_size ( int* width, int* height )
+{
+  float x_mm, y_mm, width_mm, height_mm;
+  VGint box[4];
+  cover_box_mm( &x_mm, &y_mm, &width_mm, &height_mm );
+  box_from_mm( box, x_mm, y_mm, width_mm, height_mm );
+  *width = box[2];
+  *height = box[3];
+}
+
+/*!
+ * Where covers go (pixels); they are all the same size.
+ */
+static const VGint* cover_size ( const struct DISPLAY_PRIVATE* d )
+{
+  if ( d->servers > 1 )
+    return d->panels[0].boxes[PANEL_COVER];
+  return d->cover_box;
+}
+
+/*!
+ * Where a server's panel goes (mm) when there are several.
+ */
+static void panel_box_mm ( int servers, int panel, float* x_mm, float* y_mm,
+			   float* width_mm, float* height_mm )
+{
+  int columns = servers > PANEL_ROWS_MAX ? 2 : 1;
+  int rows = ( servers + columns - 1 ) / columns;
+  *width_mm = ( tv_width - ( columns + 1 ) * border_thickness ) / columns;
+  *height_mm = ( tv_height - ( rows + 1 ) * border_thickness ) / rows;
+  // Top to bottom, then left to right.
+  *x_mm = border_thickness +
+    ( panel / rows ) * ( *width_mm + border_thickness );
+  *y_mm = tv_height - ( panel % rows + 1 ) * ( *height_mm + border_thickness );
+}
+
+/*!
+ * Note that a part of the screen needs redrawing.
+ */
+static void damage ( struct DISPLAY_PRIVATE* d, const VGint box[4] )
+{
+  if ( d->damage_all )
+    return;
+  if ( d->damage_count == DAMAGE_RECTS_MAX ) {
+    d->damage_all = 1;
+    return;
+  }
+  memcpy( d->damage[d->damage_count++], box, 4 * sizeof( VGint ) );
+}
+
+/*!
+ * Does this box need redrawing?
+ */
+static int damaged ( const struct DISPLAY_PRIVATE* d, const VGint box[4] )
+{
+  if ( d->damage_all )
+    return 1;
+  int r;
+  for ( r = 0; r < d->damage_count; r++ ) {
+    const VGint* rect = d->damage[r];
+    if ( rect[0] < box[0] + box[2] && box[0] < rect[0] + rect[2] &&
+	 rect[1] < box[1] + box[3] && box[1] < rect[1] + rect[3] )
+      return 1;
+  }
+  return 0;
+}
+
+/*!
+ * Append text to the buffer with the markup characters escaped. This
+ * is g_markup_escape_text without the intermediate allocation.
+ * \param[inout] buffer the markup being built.
+ * \param[in] text the (UTF-8) text to append.
+ */
+static void append_escaped ( GString* buffer, const char* text )
+{
+  const char* start = text;
+  const char* p;
+  for ( p = text; *p != '\0'; p++ ) {
+    const char* entity = NULL;
+    switch ( *p ) {
+    case '&':  entity = "&amp;"; break;
+    case '<':  entity = "&lt;"; break;
+    case '>':  entity = "&gt;"; break;
+    case '\'': entity = "&apos;"; break;
+    case '"':  entity = "&quot;"; break;
+    default:
+      continue;
+    }
+    g_string_append_len( buffer, start, p - start );
+    g_string_append( buffer, entity );
+    start = p + 1;
+  }
+  g_string_append_len( buffer, start, p - start );
+}
+
 struct DISPLAY_HANDLE display_init ( struct IMAGE_DB_HANDLE image_db,
-				     struct MPD_HANDLE mpd )
+				     const char* const* servers,
+				     int server_count,
+				     struct LOG_HANDLE logger )
 {
   struct DISPLAY_HANDLE handle;
   handle.d = malloc( sizeof( struct DISPLAY_PRIVATE ) );
   handle.d->status      = 0;
+  handle.d->logger      = logger;
   handle.d->image_db    = image_db;
-  handle.d->mpd         = mpd;
+  handle.d->covers_source = 0;
+  handle.d->glyph_save_source = 0;
+  int s;
+  for ( s = 0; s < MPD_SERVERS_MAX; s++ ) {
+    handle.d->cover_artist[s] = NULL;
+    handle.d->cover_album[s] = NULL;
+  }
+  handle.d->servers = MAX( 1, MIN( server_count, MPD_SERVERS_MAX ) );
+  memset( handle.d->panels, 0, sizeof handle.d->panels );
+  memset( handle.d->metadata_widgets, 0, sizeof handle.d->metadata_widgets );
+  handle.d->time_widget.d = NULL;
+  handle.d->cover_widget.d = NULL;
+  handle.d->snapshot.d  = NULL;
+  handle.d->restored    = 0;
   handle.d->egl_display = EGL_NO_DISPLAY;
   handle.d->egl_surface = EGL_NO_SURFACE;
+  handle.d->metadata_markup = g_string_sized_new( 1024 );
+  handle.d->time_sprites = 0;
+  handle.d->time_markup[0] = '\0';
+  handle.d->preserved = 0;
+  handle.d->damage_count = 0;
+  handle.d->damage_all = 1;
+  memset( &handle.d->stats, 0, sizeof handle.d->stats );
+  handle.d->frame_total = 0;
+
+  int m;
+  for ( m = 0; m < UPDATE_STAGES; m++ )
+    metrics_register( &update_metrics[m] );
+  metrics_register( &swap_metric );
+  metrics_register( &frame_metrics[0] );
+  metrics_register( &frame_metrics[1] );
+  metrics_register( &handoff_metrics[0] );
+  metrics_register( &handoff_metrics[1] );
+
+  // Finding and opening the fonts takes a while; do it while we bring
+  // up EGL. The first text widget waits for it.
+  static const char* const fonts[] = {
+    "Droid Sans 32px", "Droid Sans Italic 32px", "Droid Sans Bold 32px",
+    "Droid Sans 24px", NULL
+  };
+  text_widget_warm_up( fonts, dpmm_x, dpmm_y );
+
+  gint64 span = trace_begin();
 
   // There is a lot which can go wrong here. But evidently this can't
   // fail!
@@ -224,7 +531,9 @@ struct DISPLAY_HANDLE display_init ( struct IMAGE_DB_HANDLE image_db,
     EGL_RED_SIZE, 8,
     EGL_GREEN_SIZE, 8,
     EGL_BLUE_SIZE, 8,
-    EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+    // Preferably one which can keep the buffer between swaps, so
+    // we can get away with partial redraws.
+    EGL_SURFACE_TYPE, EGL_WINDOW_BIT | EGL_SWAP_BEHAVIOR_PRESERVED_BIT,
     // If this is not set to something, then the DISPMANX window
     // is opaque. (So, there's not much reason for it here.)
     EGL_ALPHA_SIZE, 8,
@@ -237,6 +546,16 @@ struct DISPLAY_HANDLE display_init ( struct IMAGE_DB_HANDLE image_db,
 					    egl_attrs, &egl_config, 1,
 					    &egl_n_configs );
 
+  if ( got_config == EGL_TRUE && egl_n_configs > 0 ) {
+    handle.d->preserved = 1;
+  }
+  else {
+    egl_attrs[7] = EGL_WINDOW_BIT;
+    got_config = eglChooseConfig( handle.d->egl_display,
+				  egl_attrs, &egl_config, 1,
+				  &egl_n_configs );
+  }
+
   if ( got_config == EGL_FALSE ) {
     printf( "Error: Could not find a usable config: %s\n", egl_carp() );
     handle.d->status = -1;
@@ -267,6 +586,14 @@ struct DISPLAY_HANDLE display_init ( struct IMAGE_DB_HANDLE image_db,
     return handle;
   }
 
+  if ( handle.d->preserved &&
+       eglSurfaceAttrib( handle.d->egl_display, handle.d->egl_surface,
+			 EGL_SWAP_BEHAVIOR, EGL_BUFFER_PRESERVED ) == EGL_FALSE ) {
+    printf( "Warning: Could not preserve the EGL buffer; redrawing everything: %s\n",
+	    egl_carp() );
+    handle.d->preserved = 0;
+  }
+
   EGLContext egl_context = eglCreateContext( handle.d->egl_display, egl_config,
 					     EGL_NO_CONTEXT, // no sharing
 					     NULL );
@@ -317,11 +644,14 @@ struct DISPLAY_HANDLE display_init ( struct IMAGE_DB_HANDLE image_db,
     return handle;
   }
 
+  trace_end( "egl", span );
+  span = trace_begin();
+
   size_t pattern_size =
-    &_binary_pattern_png_end - &_binary_pattern_png_start;
+    &_binary_pattern_rgba_end - &_binary_pattern_rgba_start;
 
-  struct IMAGE_HANDLE pattern = image_rgba_create( &_binary_pattern_png_start,
-						   pattern_size );
+  struct IMAGE_HANDLE pattern = image_rgba_raw( &_binary_pattern_rgba_start,
+						pattern_size );
   int pattern_width = image_rgba_width( pattern );
   int pattern_height = image_rgba_height( pattern );
   unsigned char* image = image_rgba_image( pattern );
@@ -384,38 +714,50 @@ struct DISPLAY_HANDLE display_init ( struct IMAGE_DB_HANDLE image_db,
 
   vguRect( frame_path, 0.f, 0.f, tv_width, tv_height );
 
-  // Metadata box.
-  vguRoundRect( frame_path,
-	   border_thickness,
-	   border_thickness,
-	   tv_width / 2.f - 1.5f * border_thickness,
-	   tv_height - 2.f * border_thickness,
-	   round_radius, round_radius );
-
-  // Image box.
   float image_edge_length = tv_width / 2.f - 1.5 * border_thickness;
-  vguRoundRect( frame_path,
-	   tv_width / 2.f + border_thickness / 2.f,
-	   tv_height - border_thickness - image_edge_length,
-	   image_edge_length,
-	   image_edge_length,
-	   round_radius, round_radius
-	   );
-
-  // Thermometer box.
-
   // This should really be a function of the font height.
   float therm_height = 2.f * font_size_mm;
   float therm_width  = image_edge_length;
   float therm_x      = tv_width / 2.f + border_thickness / 2.f;
   float therm_y      = border_thickness;
 
-  vguRoundRect( frame_path,
-		therm_x,
-		therm_y,
-		therm_width,
-		therm_height,
-		round_radius, round_radius );
+  if ( handle.d->servers > 1 ) {
+    // A box for each server instead.
+    for ( s = 0; s < handle.d->servers; s++ ) {
+      float x_mm, y_mm, width_mm, height_mm;
+      panel_box_mm( handle.d->servers, s, &x_mm, &y_mm, &width_mm,
+		    &height_mm );
+      float radius = MIN( round_radius, height_mm / 4.f );
+      vguRoundRect( frame_path, x_mm, y_mm, width_mm, height_mm,
+		    radius, radius );
+    }
+  }
+  else {
+    // Metadata box.
+    vguRoundRect( frame_path,
+		  border_thickness,
+		  border_thickness,
+		  tv_width / 2.f - 1.5f * border_thickness,
+		  tv_height - 2.f * border_thickness,
+		  round_radius, round_radius );
+
+    // Image box.
+    vguRoundRect( frame_path,
+		  tv_width / 2.f + border_thickness / 2.f,
+		  tv_height - border_thickness - image_edge_length,
+		  image_edge_length,
+		  image_edge_length,
+		  round_radius, round_radius
+		  );
+
+    // Thermometer box.
+    vguRoundRect( frame_path,
+		  therm_x,
+		  therm_y,
+		  therm_width,
+		  therm_height,
+		  round_radius, round_radius );
+  }
 
   vgSetPaint( frame_paint, VG_FILL_PATH );
 
@@ -448,33 +790,122 @@ struct DISPLAY_HANDLE display_init ( struct IMAGE_DB_HANDLE image_db,
   vgSetParameterfv( thermometer_paint, VG_PAINT_COLOR_RAMP_STOPS,
 		    4 * 5, fill_stops );
 
-  handle.d->metadata_widget =
-    text_widget_init( border_thickness, border_thickness,
-		      tv_width / 2.f - 1.5f * border_thickness,
-		      tv_height - 2.f * border_thickness,
-		      dpmm_x, dpmm_y );
-
-  // \bug widget height is a judgement text_widget should really
-  // have a vertical centering option.
-  handle.d->time_widget =
-    text_widget_init( tv_width / 2.f + border_thickness / 2.f,
-		      border_thickness,
-		      image_edge_length, therm_height - border_thickness,
-		      dpmm_x, dpmm_y );
-
-  text_widget_set_alignment( handle.d->time_widget, TEXT_WIDGET_ALIGN_CENTER );
-
-  // The cover widget. Where is it going to go? Need to specify
-  // the width and height carefully so that the aspect ratio is
-  // correct.
-  float iw_x_mm = tv_width / 2.f + border_thickness / 2.f;
-  float iw_y_mm = tv_height - border_thickness - image_edge_length;
-  float iw_width_mm = image_edge_length;
-  float iw_height_mm = iw_width_mm;
-
-  handle.d->cover_widget = image_widget_init( iw_x_mm, iw_y_mm,
-					      iw_width_mm, iw_height_mm,
-					      dpmm_x, dpmm_y );
+  trace_end( "vg setup", span );
+  span = trace_begin();
+
+  // Reuse the glyph outlines from last time (if any).
+  gchar* cache_dir = g_build_filename( g_get_user_cache_dir(), "mpddisplay",
+				       NULL );
+  gchar* cache_file = g_build_filename( cache_dir, "glyphs.cache", NULL );
+  if ( g_mkdir_with_parents( cache_dir, 0755 ) < 0 ) {
+    printf( "Warning: Could not create cache directory %s\n", cache_dir );
+  }
+  handle.d->glyph_cache = glyph_cache_open( cache_file );
+  text_widget_set_glyph_cache( handle.d->glyph_cache );
+  g_free( cache_file );
+
+  if ( handle.d->servers > 1 ) {
+    panels_init( handle.d, servers );
+  }
+  else {
+    // Long titles shrink, and if that's not enough, scroll rather
+    // than wrap.
+    static const float metadata_sizes[] = {
+      32.f, 28.f, 24.f, 20.f, 18.f, 16.f
+    };
+    float field_height =
+      ( tv_height - 2.f * border_thickness ) / METADATA_FIELDS;
+    int f;
+    for ( f = 0; f < METADATA_FIELDS; f++ ) {
+      float field_y = border_thickness +
+	( METADATA_FIELDS - 1 - f ) * field_height;
+      handle.d->metadata_widgets[f] =
+	text_widget_init( border_thickness, field_y,
+			  tv_width / 2.f - 1.5f * border_thickness,
+			  field_height,
+			  dpmm_x, dpmm_y );
+      box_from_mm( handle.d->metadata_boxes[f], border_thickness, field_y,
+		   tv_width / 2.f - 1.5f * border_thickness, field_height );
+
+      text_widget_set_auto_fit( handle.d->metadata_widgets[f], "Droid Sans",
+				metadata_sizes,
+				sizeof metadata_sizes / sizeof metadata_sizes[0] );
+      text_widget_set_marquee( handle.d->metadata_widgets[f], 1 );
+      // At these sizes, blitting bitmaps beats filling paths.
+      text_widget_set_render_mode( handle.d->metadata_widgets[f],
+				   TEXT_WIDGET_RENDER_ATLAS );
+    }
+
+    // \bug widget height is a judgement text_widget should really
+    // have a vertical centering option.
+    handle.d->time_widget =
+      text_widget_init( tv_width / 2.f + border_thickness / 2.f,
+			border_thickness,
+			image_edge_length, therm_height - border_thickness,
+			dpmm_x, dpmm_y );
+
+    text_widget_set_alignment( handle.d->time_widget,
+			       TEXT_WIDGET_ALIGN_CENTER );
+
+    box_from_mm( handle.d->thermometer_box, therm_x, therm_y,
+		 therm_width, therm_height );
+
+    // The time is only ever these characters, so it can skip Pango.
+    handle.d->time_sprites =
+      text_widget_set_sprites( handle.d->time_widget, "Droid Sans 24px",
+			       "0123456789:/ " ) == 0;
+    if ( ! handle.d->time_sprites )
+      log_message_warn( handle.d->logger,
+			"Could not load the time digits; using Pango" );
+
+    // The cover widget. Where is it going to go? Need to specify
+    // the width and height carefully so that the aspect ratio is
+    // correct.
+    float iw_x_mm, iw_y_mm, iw_width_mm, iw_height_mm;
+    cover_box_mm( &iw_x_mm, &iw_y_mm, &iw_width_mm, &iw_height_mm );
+
+    handle.d->cover_widget = image_widget_init( iw_x_mm, iw_y_mm,
+						iw_width_mm, iw_height_mm,
+						dpmm_x, dpmm_y );
+    box_from_mm( handle.d->cover_box, iw_x_mm, iw_y_mm,
+		 iw_width_mm, iw_height_mm );
+  }
+
+  trace_end( "widgets", span );
+
+  // Covers are looked up, decoded and scaled on a thread of their own
+  // (unless they come from a daemon).
+  const VGint* cover = cover_size( handle.d );
+  if ( handle.d->image_db.d != NULL ) {
+    if ( image_db_start( handle.d->image_db, cover[2], cover[3] ) == 0 )
+      handle.d->covers_source =
+	g_unix_fd_add( image_db_results_fd( handle.d->image_db ), G_IO_IN,
+		       covers_ready, handle.d );
+    else
+      printf( "Warning: Could not start the cover thread\n" );
+  }
+
+  if ( handle.d->servers > 1 ) {
+    // The snapshot only knows the one server. Put up the empty panels.
+    g_free( cache_dir );
+    display_redraw( handle );
+    return handle;
+  }
+
+  // Show what we had last time straight away; MPD can take a while.
+  gchar* snapshot_file = g_build_filename( cache_dir, "snapshot", NULL );
+  handle.d->snapshot = snapshot_open( snapshot_file, handle.d->cover_box[2],
+				      handle.d->cover_box[3] );
+  g_free( snapshot_file );
+  g_free( cache_dir );
+
+  if ( snapshot_valid( handle.d->snapshot ) ) {
+    span = trace_begin();
+    restore_snapshot( handle.d );
+    display_redraw( handle );
+    trace_end( "snapshot", span );
+    return handle;
+  }
 
   EGLBoolean swapped = eglSwapBuffers( handle.d->egl_display,
 				       handle.d->egl_surface );
@@ -488,124 +919,587 @@ struct DISPLAY_HANDLE display_init ( struct IMAGE_DB_HANDLE image_db,
   return handle;
 }
 
-void display_update ( struct DISPLAY_HANDLE handle )
+/*!
+ * Put new text in one of the metadata lines.
+ */
+static void show_metadata ( struct DISPLAY_PRIVATE* d, int field,
+			    const char* text )
 {
-  // For now, this is very simple. Redraw the whole screen.
+  static const struct {
+    const char* open;
+    const char* close;
+  } styles[METADATA_FIELDS] = {
+    { "", "" },
+    { "<i>", "</i>" },
+    { "<b>", "</b>" },
+  };
 
-  vgClear( 0, 0, window_width, window_height );
+  // The widget picks the size.
+  GString* buffer = d->metadata_markup;
+  g_string_truncate( buffer, 0 );
+  g_string_append( buffer, styles[field].open );
+  append_escaped( buffer, text );
+  g_string_append( buffer, styles[field].close );
 
-  vgSeti( VG_MATRIX_MODE, VG_MATRIX_FILL_PAINT_TO_USER );
-  vgLoadIdentity();
-  vgScale( 0.1, 0.1 );
+  text_widget_set_text( d->metadata_widgets[field], buffer->str, buffer->len );
+  damage( d, d->metadata_boxes[field] );
+}
 
-  vgSetPaint( frame_paint, VG_FILL_PATH );
+/*!
+ * Update the time and the thermometer.
+ */
+static void show_times ( struct DISPLAY_PRIVATE* d, long elapsed, long total )
+{
+  // Only digits here, so no escaping is required.
+  const char* format = d->time_sprites ?
+    "%02ld:%02ld / %02ld:%02ld" :
+    "<span font=\"Droid Sans 24px\">%02ld:%02ld / %02ld:%02ld</span>";
+  int len = snprintf( d->time_markup, sizeof d->time_markup,
+		      format,
+		      elapsed / 60,
+		      elapsed % 60,
+		      total / 60,
+		      total % 60 );
+
+  if ( len >= (int)sizeof d->time_markup )
+    len = sizeof d->time_markup - 1;
+
+  if ( d->time_sprites )
+    text_widget_set_sprite_text( d->time_widget, d->time_markup, len );
+  else
+    text_widget_set_text( d->time_widget, d->time_markup, len );
+
+  damage( d, d->thermometer_box );
+
+  vgClearPath( thermometer_path, VG_PATH_CAPABILITY_ALL );
+
+  if ( total > 0 ) {
+    float image_edge = tv_width / 2.f - 1.5 * border_thickness;
+    float time_height = tv_height - border_thickness - image_edge - border_thickness - border_thickness - 2.f * thermometer_gap;
+
+    VGfloat thermometer_width =
+      (float)elapsed / (float)total *
+      ( tv_width / 2.f - 1.5f * border_thickness - 2.f * thermometer_gap );
+
+
+    vguRoundRect( thermometer_path, 
+		  tv_width / 2.f + border_thickness / 2.f + thermometer_gap,
+		  border_thickness + thermometer_gap,
+		  thermometer_width,
+		  time_height,
+		  round_radius, round_radius );
+  }
+}
 
-  vgPaintPattern( frame_paint, bg_brush );
+/*!
+ * Change the cover image. The widget copies it, so the caller still
+ * owns it.
+ */
+static void show_cover ( struct DISPLAY_PRIVATE* d, struct IMAGE_HANDLE cover )
+{
+  image_widget_set_image( d->cover_widget, cover );
+  damage( d, d->cover_box );
+}
 
-  vgDrawPath( background_path, VG_FILL_PATH );
+/*!
+ * The emblem for the cover.
+ */
+static enum IMAGE_WIDGET_EMBLEM status_emblem ( enum MPD_PLAY_STATUS status,
+						const char* artist,
+						const char* album )
+{
+  switch ( status ) {
+  case MPD_PLAY_STATUS_STOPPED:
+    if ( strlen( artist ) == 0 || strlen( album ) == 0 )
+      return IMAGE_WIDGET_EMBLEM_NOEMBLEM;
+    return IMAGE_WIDGET_EMBLEM_STOPPED;
+  case MPD_PLAY_STATUS_PLAYING:
+    return IMAGE_WIDGET_EMBLEM_PLAYING;
+  case MPD_PLAY_STATUS_PAUSED:
+    return IMAGE_WIDGET_EMBLEM_PAUSED;
+  default:
+    return IMAGE_WIDGET_EMBLEM_NOEMBLEM;
+  }
+}
 
-  vgPaintPattern( frame_paint, fg_brush );
+/*!
+ * Put the right emblem on the cover.
+ */
+static void show_status ( struct DISPLAY_PRIVATE* d,
+			  enum MPD_PLAY_STATUS status,
+			  const char* artist, const char* album )
+{
+  image_widget_set_emblem( d->cover_widget,
+			   status_emblem( status, artist, album ) );
+
+  damage( d, d->cover_box );
+}
+
+/*!
+ * Lay out a panel for each server: the cover on the left, and the
+ * title, the server's name with the artist and album, and the time on
+ * the right.
+ */
+void panels_init ( struct DISPLAY_PRIVATE* d, const char* const* servers )
+{
+  static const float title_sizes[] = {
+    32.f, 28.f, 24.f, 20.f, 18.f, 16.f, 14.f
+  };
+  static const float detail_sizes[] = { 24.f, 20.f, 18.f, 16.f, 14.f, 12.f };
+  int p;
+  for ( p = 0; p < d->servers; p++ ) {
+    struct DISPLAY_PANEL* panel = &d->panels[p];
+    float x_mm, y_mm, width_mm, height_mm;
+    panel_box_mm( d->servers, p, &x_mm, &y_mm, &width_mm, &height_mm );
+    box_from_mm( panel->box, x_mm, y_mm, width_mm, height_mm );
+
+    float gap = thermometer_gap;
+    float cover_edge = MIN( height_mm - 2.f * gap, width_mm / 2.f );
+    float cover_x = x_mm + gap;
+    float cover_y = y_mm + ( height_mm - cover_edge ) / 2.f;
+    panel->cover_widget = image_widget_init( cover_x, cover_y,
+					     cover_edge, cover_edge,
+					     dpmm_x, dpmm_y );
+    box_from_mm( panel->boxes[PANEL_COVER], cover_x, cover_y,
+		 cover_edge, cover_edge );
+
+    // Three lines beside it, top to bottom.
+    float text_x = cover_x + cover_edge + gap;
+    float text_width = x_mm + width_mm - gap - text_x;
+    float line_height = ( height_mm - 2.f * gap ) / 3.f;
+    struct TEXT_WIDGET_HANDLE* lines[3] = {
+      &panel->title_widget, &panel->detail_widget, &panel->time_widget
+    };
+    static const int parts[3] = { PANEL_TITLE, PANEL_DETAIL, PANEL_TIME };
+    int l;
+    for ( l = 0; l < 3; l++ ) {
+      float line_y = y_mm + gap + ( 2 - l ) * line_height;
+      *lines[l] = text_widget_init( text_x, line_y, text_width, line_height,
+				    dpmm_x, dpmm_y );
+      box_from_mm( panel->boxes[parts[l]], text_x, line_y,
+		   text_width, line_height );
+    }
+
+    text_widget_set_auto_fit( panel->title_widget, "Droid Sans", title_sizes,
+			      sizeof title_sizes / sizeof title_sizes[0] );
+    text_widget_set_auto_fit( panel->detail_widget, "Droid Sans",
+			      detail_sizes,
+			      sizeof detail_sizes / sizeof detail_sizes[0] );
+    for ( l = 0; l < 2; l++ ) {
+      text_widget_set_marquee( *lines[l], 1 );
+      text_widget_set_render_mode( *lines[l], TEXT_WIDGET_RENDER_ATLAS );
+    }
+    panel->time_sprites =
+      text_widget_set_sprites( panel->time_widget, "Droid Sans 24px",
+			       "0123456789:/ " ) == 0;
+    if ( ! panel->time_sprites )
+      log_message_warn( d->logger, "Could not load the time digits for "
+			"panel %d; using Pango", p );
+
+    panel->name = g_strdup( servers != NULL && servers[p] != NULL ?
+			    servers[p] : "" );
+    panel->fresh = 1;
+  }
+}
+
+/*!
+ * Bring a server's panel up to date.
+ */
+static void panel_update ( struct DISPLAY_PRIVATE* d,
+			   struct DISPLAY_PANEL* panel,
+			   const struct MPD_STATE* state )
+{
+  // At first, everything.
+  int changed = panel->fresh ? MPD_CHANGED_ANY : state->changed;
+  GString* buffer = d->metadata_markup;
+
+  if ( changed & MPD_CHANGED_TITLE ) {
+    g_string_truncate( buffer, 0 );
+    g_string_append( buffer, "<b>" );
+    append_escaped( buffer, state->title );
+    g_string_append( buffer, "</b>" );
+    text_widget_set_text( panel->title_widget, buffer->str, buffer->len );
+    damage( d, panel->boxes[PANEL_TITLE] );
+  }
+
+  if ( changed & ( MPD_CHANGED_ARTIST | MPD_CHANGED_ALBUM ) ) {
+    g_string_truncate( buffer, 0 );
+    g_string_append( buffer, "<b>" );
+    append_escaped( buffer, panel->name );
+    g_string_append( buffer, "</b>  " );
+    append_escaped( buffer, state->artist );
+    if ( *state->artist != '\0' && *state->album != '\0' )
+      g_string_append( buffer, " \xe2\x80\x94 " ); // An em dash.
+    g_string_append( buffer, "<i>" );
+    append_escaped( buffer, state->album );
+    g_string_append( buffer, "</i>" );
+    text_widget_set_text( panel->detail_widget, buffer->str, buffer->len );
+    damage( d, panel->boxes[PANEL_DETAIL] );
+  }
+
+  if ( changed & ( MPD_CHANGED_ELAPSED | MPD_CHANGED_TOTAL ) ) {
+    long elapsed = state->times.elapsed;
+    long total = state->times.total;
+    const char* format = panel->time_sprites ?
+      "%02ld:%02ld / %02ld:%02ld" :
+      "<span font=\"Droid Sans 24px\">%02ld:%02ld / %02ld:%02ld</span>";
+    int len = snprintf( panel->time_markup, sizeof panel->time_markup, format,
+			elapsed / 60, elapsed % 60, total / 60, total % 60 );
+    if ( len >= (int)sizeof panel->time_markup )
+      len = sizeof panel->time_markup - 1;
+    if ( panel->time_sprites )
+      text_widget_set_sprite_text( panel->time_widget, panel->time_markup,
+				   len );
+    else
+      text_widget_set_text( panel->time_widget, panel->time_markup, len );
+    damage( d, panel->boxes[PANEL_TIME] );
+  }
 
-  if ( mpd_changed( handle.d->mpd,
-		    MPD_CHANGED_ARTIST | MPD_CHANGED_ALBUM | MPD_CHANGED_TITLE ) ) {
-    char* buffer =
-      g_markup_printf_escaped( "<span font=\"Droid Sans 24px\">%s\n<i>%s</i>\n<b>%s</b></span>",
-			       mpd_artist( handle.d->mpd ),
-			       mpd_album( handle.d->mpd ),
-			       mpd_title( handle.d->mpd ) );
+  if ( changed & MPD_CHANGED_STATUS ) {
+    image_widget_set_emblem( panel->cover_widget,
+			     status_emblem( state->play_status,
+					    state->artist, state->album ) );
+    damage( d, panel->boxes[PANEL_COVER] );
+  }
+}
 
-    size_t len = strlen( buffer );
+/*!
+ * Put up whatever was on the screen when we last ran.
+ */
+static void restore_snapshot ( struct DISPLAY_PRIVATE* d )
+{
+  int f;
+  for ( f = 0; f < METADATA_FIELDS; f++ )
+    show_metadata( d, f, snapshot_text( d->snapshot, f ) );
+
+  long elapsed, total;
+  snapshot_times( d->snapshot, &elapsed, &total );
+  show_times( d, elapsed, total );
+
+  struct IMAGE_HANDLE cover = snapshot_cover( d->snapshot );
+  if ( image_rgba_width( cover ) > 0 )
+    show_cover( d, cover );
+  image_rgba_free( cover );
+
+  show_status( d, snapshot_play_status( d->snapshot ),
+	       snapshot_text( d->snapshot, METADATA_ARTIST ),
+	       snapshot_text( d->snapshot, METADATA_ALBUM ) );
+
+  // MPD only reports differences from its own idea of the previous
+  // state, so the first update has to replace everything.
+  d->restored = 1;
+}
 
-    text_widget_set_text( handle.d->metadata_widget, buffer, len );
+/*!
+ * Does this need updating? After a restore, everything on the screen
+ * is suspect.
+ */
+static int changed ( const struct DISPLAY_PRIVATE* d,
+		     const struct MPD_STATE* state, int flags )
+{
+  return d->restored || ( state->changed & flags );
+}
 
-    g_free( buffer );
+/*!
+ * Put up a cover from the cover thread wherever it's still the right
+ * one (several servers may be playing the same album).
+ */
+static void take_cover ( struct DISPLAY_PRIVATE* d,
+			 struct COVER_RESULT* result )
+{
+  metric_observe( &handoff_metrics[1],
+		  g_get_monotonic_time() - result->requested );
+
+  int s;
+  for ( s = 0; s < d->servers; s++ ) {
+    if ( g_strcmp0( result->artist, d->cover_artist[s] ) != 0 ||
+	 g_strcmp0( result->album, d->cover_album[s] ) != 0 )
+      continue;
+    if ( d->servers > 1 ) {
+      image_widget_set_image( d->panels[s].cover_widget, result->image );
+      damage( d, d->panels[s].boxes[PANEL_COVER] );
+    }
+    else {
+      show_cover( d, result->image );
+      snapshot_set_cover( d->snapshot, result->image );
+    }
   }
 
-  struct MPD_TIMES times = mpd_times( handle.d->mpd );
+  // I guess we're responsible for this and can assume that the
+  // widget doesn't need it anymore.
+  cover_result_free( result );
+}
 
-  if ( mpd_changed( handle.d->mpd,
-		    MPD_CHANGED_ELAPSED | MPD_CHANGED_TOTAL ) ) {
-    char* buffer =
-      g_markup_printf_escaped( "<span font=\"Droid Sans 24px\">%02ld:%02ld / %02ld:%02ld</span>",
-			       times.elapsed / 60,
-			       times.elapsed % 60,
-			       times.total / 60,
-			       times.total % 60 );
+static gboolean covers_ready ( gint fd, GIOCondition condition,
+			       gpointer data )
+{
+  (void)fd;
+  (void)condition;
+
+  struct DISPLAY_PRIVATE* d = data;
+  struct DISPLAY_HANDLE handle = { d };
+  struct COVER_RESULT* result;
+  int covers = 0;
+  while ( ( result = image_db_result( d->image_db ) ) != NULL ) {
+    take_cover( d, result );
+    covers++;
+  }
 
-    size_t len = strlen( buffer );
+  if ( covers > 0 )
+    display_redraw( handle );
 
-    text_widget_set_text( handle.d->time_widget, buffer, len );
+  return TRUE;
+}
 
-    g_free( buffer );
+/*!
+ * Ask for the cover of an album. It's put up when it arrives.
+ */
+static void request_cover ( struct DISPLAY_PRIVATE* d, int server,
+			    const char* artist, const char* album )
+{
+  g_free( d->cover_artist[server] );
+  g_free( d->cover_album[server] );
+  d->cover_artist[server] = g_strdup( artist );
+  d->cover_album[server] = g_strdup( album );
+
+  if ( d->covers_source != 0 ) {
+    if ( image_db_request( d->image_db, server, artist, album ) < 0 )
+      printf( "Warning: Cover request for '%s' dropped\n", album );
+    return;
+  }
+
+  // The daemon sends it (display_cover).
+  if ( d->image_db.d == NULL )
+    return;
+
+  // No cover thread, so do it all here.
+  struct COVER_RESULT* result = g_new( struct COVER_RESULT, 1 );
+  result->artist = g_strdup( artist );
+  result->album = g_strdup( album );
+  result->requested = g_get_monotonic_time();
+  result->server = server;
+  result->image = cover_image( d->image_db, artist, album );
+  const VGint* size = cover_size( d );
+  if ( image_rgba_width( result->image ) != size[2] ||
+       image_rgba_height( result->image ) != size[3] ) {
+    struct IMAGE_HANDLE scaled =
+      image_rgba_scale( result->image, size[2], size[3] );
+    image_rgba_free( result->image );
+    result->image = scaled;
+  }
+  take_cover( d, result );
+}
+
+void display_cover ( struct DISPLAY_HANDLE handle,
+		     struct COVER_RESULT* cover )
+{
+  struct DISPLAY_PRIVATE* d = handle.d;
+
+  // It may not have been made for our screen.
+  const VGint* size = cover_size( d );
+  if ( image_rgba_width( cover->image ) != size[2] ||
+       image_rgba_height( cover->image ) != size[3] ) {
+    struct IMAGE_HANDLE scaled =
+      image_rgba_scale( cover->image, size[2], size[3] );
+    image_rgba_free( cover->image );
+    cover->image = scaled;
+  }
 
-    vgClearPath( thermometer_path, VG_PATH_CAPABILITY_ALL );
+  take_cover( d, cover );
+  display_redraw( handle );
+}
 
-    if ( times.total > 0 ) {
-      float image_edge = tv_width / 2.f - 1.5 * border_thickness;
-      float time_height = tv_height - border_thickness - image_edge - border_thickness - border_thickness - 2.f * thermometer_gap;
+static gboolean save_glyphs ( gpointer data )
+{
+  struct DISPLAY_PRIVATE* d = data;
+  d->glyph_save_source = 0;
+  (void)glyph_cache_save( d->glyph_cache );
+  return G_SOURCE_REMOVE;
+}
 
-      VGfloat thermometer_width =
-	(float)times.elapsed / (float)times.total *
-	( tv_width / 2.f - 1.5f * border_thickness - 2.f * thermometer_gap );
+/*!
+ * A new song may have brought new glyphs. We don't get a chance to
+ * save them if we're killed, but rewriting the whole file is too slow
+ * to do between frames. So, wait until things settle down, and then
+ * only if the cache has grown.
+ */
+static void save_glyphs_later ( struct DISPLAY_PRIVATE* d )
+{
+  if ( d->glyph_save_source == 0 && glyph_cache_unsaved( d->glyph_cache ) )
+    d->glyph_save_source =
+      g_timeout_add_seconds( GLYPH_SAVE_DELAY, save_glyphs, d );
+}
 
+void display_update ( struct DISPLAY_HANDLE handle,
+		      const struct MPD_STATE* state )
+{
+  // Bring the widgets up to date with MPD and then draw them.
+  struct DISPLAY_PRIVATE* d = handle.d;
+
+  metric_observe( &handoff_metrics[0], g_get_monotonic_time() - state->polled );
+
+  if ( d->servers > 1 ) {
+    if ( state->server < 0 || state->server >= d->servers )
+      return;
+    struct DISPLAY_PANEL* panel = &d->panels[state->server];
+    if ( panel->fresh || ( state->changed & MPD_CHANGED_ALBUM ) )
+      request_cover( d, state->server, state->artist, state->album );
+    panel_update( d, panel, state );
+    panel->fresh = 0;
+    display_redraw( handle );
+    save_glyphs_later( d );
+    return;
+  }
 
-      vguRoundRect( thermometer_path, 
-		    tv_width / 2.f + border_thickness / 2.f + thermometer_gap,
-		    border_thickness + thermometer_gap,
-		    thermometer_width,
-		    time_height,
-		    round_radius, round_radius );
+  // Each line only if it has changed.
+  static const int fields[METADATA_FIELDS] = {
+    MPD_CHANGED_ARTIST,
+    MPD_CHANGED_ALBUM,
+    MPD_CHANGED_TITLE,
+  };
+  int f;
+  gint64 span = trace_begin();
+  gint64 start = g_get_monotonic_time();
+  for ( f = 0; f < METADATA_FIELDS; f++ ) {
+    if ( ! changed( d, state, fields[f] ) )
+      continue;
+
+    const char* text = "";
+    switch ( f ) {
+    case METADATA_ARTIST: text = state->artist; break;
+    case METADATA_ALBUM:  text = state->album; break;
+    case METADATA_TITLE:  text = state->title; break;
     }
+
+    show_metadata( d, f, text );
+    snapshot_set_text( d->snapshot, f, text );
+  }
+  save_glyphs_later( d );
+
+  gint64 now = g_get_monotonic_time();
+  metric_observe( &update_metrics[UPDATE_STAGE_METADATA], now - start );
+  start = now;
+
+  struct MPD_TIMES times = state->times;
+
+  if ( changed( d, state, MPD_CHANGED_ELAPSED | MPD_CHANGED_TOTAL ) ) {
+    show_times( d, times.elapsed, times.total );
+    snapshot_set_times( d->snapshot, times.elapsed, times.total );
+  }
+
+  now = g_get_monotonic_time();
+  metric_observe( &update_metrics[UPDATE_STAGE_TIME], now - start );
+  start = now;
+
+  if ( changed( d, state, MPD_CHANGED_ALBUM ) )
+    request_cover( d, 0, state->artist, state->album );
+
+  if ( changed( d, state, MPD_CHANGED_STATUS ) ) {
+    enum MPD_PLAY_STATUS status = state->play_status;
+    show_status( d, status, state->artist, state->album );
+    snapshot_set_play_status( d->snapshot, status );
+  }
+  d->restored = 0;
+
+  metric_observe( &update_metrics[UPDATE_STAGE_COVER],
+		  g_get_monotonic_time() - start );
+  trace_end( "display update", span );
+
+  display_redraw( handle );
+}
+
+/*!
+ * Scrolling text needs redrawing whether MPD said anything or not, but
+ * only the lines which are actually scrolling.
+ */
+static void damage_marquees ( struct DISPLAY_PRIVATE* d,
+			      struct TEXT_WIDGET_HANDLE widget )
+{
+  int rects[4][4];
+  int count = text_widget_marquee_rects( widget, rects, 4 );
+  int r;
+  for ( r = 0; r < count; r++ ) {
+    VGint box[4] = { rects[r][0], rects[r][1], rects[r][2], rects[r][3] };
+    damage( d, box );
+  }
+}
+
+void display_redraw ( struct DISPLAY_HANDLE handle )
+{
+  struct DISPLAY_PRIVATE* d = handle.d;
+  int f;
+
+  for ( f = 0; f < METADATA_FIELDS; f++ )
+    damage_marquees( d, d->metadata_widgets[f] );
+  int p;
+  for ( p = 0; p < d->servers; p++ ) {
+    damage_marquees( d, d->panels[p].title_widget );
+    damage_marquees( d, d->panels[p].detail_widget );
+  }
+
+  if ( ! d->preserved )
+    d->damage_all = 1;
+
+  if ( ! d->damage_all && d->damage_count == 0 )
+    return;
+
+  gint64 frame_start = g_get_monotonic_time();
+  int partial = ! d->damage_all;
+  if ( partial )
+    d->stats.partial_frames++;
+  metric_add( &frame_metrics[d->damage_all ? 0 : 1], 1 );
+
+  // Everything is drawn clipped to the damage, but we skip whatever
+  // doesn't overlap it entirely.
+  if ( ! d->damage_all ) {
+    vgSetiv( VG_SCISSOR_RECTS, 4 * d->damage_count, &d->damage[0][0] );
+    vgSeti( VG_SCISSORING, VG_TRUE );
+  }
+  else {
+    vgClear( 0, 0, window_width, window_height );
   }
 
   vgSeti( VG_MATRIX_MODE, VG_MATRIX_FILL_PAINT_TO_USER );
   vgLoadIdentity();
+  vgScale( 0.1, 0.1 );
+
+  vgSetPaint( frame_paint, VG_FILL_PATH );
 
-  vgSetPaint( thermometer_paint, VG_FILL_PATH );
-  vgDrawPath( thermometer_path, VG_FILL_PATH );
+  vgPaintPattern( frame_paint, bg_brush );
 
-  text_widget_draw_text( handle.d->metadata_widget );
+  vgDrawPath( background_path, VG_FILL_PATH );
 
-  text_widget_draw_text( handle.d->time_widget );
+  vgPaintPattern( frame_paint, fg_brush );
 
-  if ( mpd_changed( handle.d->mpd, MPD_CHANGED_ALBUM ) ) {
+  for ( p = 0; d->servers > 1 && p < d->servers; p++ ) {
+    struct DISPLAY_PANEL* panel = &d->panels[p];
+    if ( damaged( d, panel->boxes[PANEL_TITLE] ) )
+      text_widget_draw_text( panel->title_widget );
+    if ( damaged( d, panel->boxes[PANEL_DETAIL] ) )
+      text_widget_draw_text( panel->detail_widget );
+    if ( damaged( d, panel->boxes[PANEL_TIME] ) )
+      text_widget_draw_text( panel->time_widget );
+    if ( damaged( d, panel->boxes[PANEL_COVER] ) )
+      image_widget_draw_image( panel->cover_widget );
+  }
 
-    struct IMAGE_HANDLE cover_image_handle =
-      cover_image( handle.d->image_db,
-		   mpd_artist( handle.d->mpd ),
-		   mpd_album( handle.d->mpd ) );
+  if ( d->servers == 1 && damaged( d, d->thermometer_box ) ) {
+    vgSeti( VG_MATRIX_MODE, VG_MATRIX_FILL_PAINT_TO_USER );
+    vgLoadIdentity();
 
-    image_widget_set_image( handle.d->cover_widget, cover_image_handle );
+    vgSetPaint( thermometer_paint, VG_FILL_PATH );
+    vgDrawPath( thermometer_path, VG_FILL_PATH );
 
-    // I guess we're responsible for this and can assume that the
-    // widget doesn't need it anymore.
-    image_rgba_free( cover_image_handle );
+    text_widget_draw_text( d->time_widget );
   }
 
-  if ( mpd_changed( handle.d->mpd, MPD_CHANGED_STATUS ) ) {
-    enum MPD_PLAY_STATUS status = mpd_play_status( handle.d->mpd );
-    enum IMAGE_WIDGET_EMBLEM emblem = IMAGE_WIDGET_EMBLEM_NOEMBLEM;
-    switch ( status ) {
-    case MPD_PLAY_STATUS_STOPPED:
-      if ( strlen( mpd_artist( handle.d->mpd ) ) == 0 ||
-	   strlen( mpd_album( handle.d->mpd ) ) == 0 ) {
-	emblem = IMAGE_WIDGET_EMBLEM_NOEMBLEM;
-      }
-      else {
-	emblem = IMAGE_WIDGET_EMBLEM_STOPPED;
-      }
-      break;
-    case MPD_PLAY_STATUS_PLAYING:
-      emblem = IMAGE_WIDGET_EMBLEM_PLAYING; break;
-    case MPD_PLAY_STATUS_PAUSED:
-      emblem = IMAGE_WIDGET_EMBLEM_PAUSED; break;
-    default:
-      break;
-    }
-    image_widget_set_emblem( handle.d->cover_widget, emblem );
+  for ( f = 0; d->servers == 1 && f < METADATA_FIELDS; f++ ) {
+    if ( damaged( d, d->metadata_boxes[f] ) )
+      text_widget_draw_text( d->metadata_widgets[f] );
   }
 
-  image_widget_draw_image( handle.d->cover_widget );
+  if ( d->servers == 1 && damaged( d, d->cover_box ) )
+    image_widget_draw_image( d->cover_widget );
 
   vgSeti( VG_MATRIX_MODE, VG_MATRIX_PATH_USER_TO_SURFACE );
   vgLoadIdentity();
@@ -619,13 +1513,160 @@ void display_update ( struct DISPLAY_HANDLE handle )
 
   vgDrawPath( frame_path, VG_FILL_PATH );
 
-  EGLBoolean swapped = eglSwapBuffers( handle.d->egl_display,
-				       handle.d->egl_surface );
+  vgSeti( VG_SCISSORING, VG_FALSE );
+  d->damage_count = 0;
+  d->damage_all = 0;
+
+  gint64 swap_start = g_get_monotonic_time();
+  metric_observe( &update_metrics[UPDATE_STAGE_DRAW],
+		  swap_start - frame_start );
+  if ( trace_enabled )
+    trace_record( "draw", frame_start, swap_start );
+
+  EGLBoolean swapped = eglSwapBuffers( d->egl_display, d->egl_surface );
 
   if ( swapped == EGL_FALSE ) {
     printf( "Error: Could not swap EGL buffers: %s\n", egl_carp() );
-    handle.d->status = -1;
+    d->status = -1;
+  }
+
+  gint64 frame_end = g_get_monotonic_time();
+  metric_observe( &swap_metric, frame_end - swap_start );
+  if ( trace_enabled )
+    trace_record( "swap", swap_start, frame_end );
+
+  long long frame_time = frame_end - frame_start;
+  recorder_event( RECORDER_FRAME, 0, partial, frame_time );
+  d->stats.frames++;
+  d->stats.last_frame = frame_time;
+  if ( frame_time > d->stats.max_frame )
+    d->stats.max_frame = frame_time;
+  d->frame_total += frame_time;
+  d->stats.mean_frame = d->frame_total / d->stats.frames;
+}
+
+void display_force_redraw ( struct DISPLAY_HANDLE handle )
+{
+  handle.d->damage_all = 1;
+  display_redraw( handle );
+}
+
+void display_set_layout ( struct DISPLAY_HANDLE handle,
+			  enum DISPLAY_LAYOUT layout )
+{
+  int f;
+  for ( f = 0; handle.d->servers == 1 && f < METADATA_FIELDS; f++ ) {
+    text_widget_set_marquee( handle.d->metadata_widgets[f],
+			     layout == DISPLAY_LAYOUT_SCROLL );
+    damage( handle.d, handle.d->metadata_boxes[f] );
+  }
+  int p;
+  for ( p = 0; handle.d->servers > 1 && p < handle.d->servers; p++ ) {
+    struct DISPLAY_PANEL* panel = &handle.d->panels[p];
+    text_widget_set_marquee( panel->title_widget,
+			     layout == DISPLAY_LAYOUT_SCROLL );
+    text_widget_set_marquee( panel->detail_widget,
+			     layout == DISPLAY_LAYOUT_SCROLL );
+    damage( handle.d, panel->box );
+  }
+}
+
+int display_flush_caches ( struct DISPLAY_HANDLE handle )
+{
+  int status = glyph_cache_save( handle.d->glyph_cache );
+  // Not there if the cache directory couldn't be made; nothing to do.
+  if ( snapshot_status( handle.d->snapshot ) == 0 &&
+       snapshot_sync( handle.d->snapshot ) < 0 )
+    status = -1;
+  return status;
+}
+
+struct DISPLAY_STATS display_stats ( struct DISPLAY_HANDLE handle )
+{
+  struct DISPLAY_STATS stats = handle.d->stats;
+  stats.glyph_cache = glyph_cache_stats( handle.d->glyph_cache );
+  stats.atlas_usage = text_widget_atlas_usage();
+  return stats;
+}
+
+int display_animating ( struct DISPLAY_HANDLE handle )
+{
+  int f;
+  for ( f = 0; f < METADATA_FIELDS; f++ ) {
+    if ( text_widget_animating( handle.d->metadata_widgets[f] ) )
+      return 1;
+  }
+  int p;
+  for ( p = 0; p < handle.d->servers; p++ ) {
+    if ( text_widget_animating( handle.d->panels[p].title_widget ) ||
+	 text_widget_animating( handle.d->panels[p].detail_widget ) )
+      return 1;
   }
+  return text_widget_animating( handle.d->time_widget );
+}
+
+/*!
+ * Is the point (pixels) in the box?
+ */
+static int inside ( const VGint box[4], float x, float y )
+{
+  return x >= box[0] && x < box[0] + box[2] &&
+    y >= box[1] && y < box[1] + box[3];
+}
+
+enum DISPLAY_REGION display_hit ( struct DISPLAY_HANDLE handle, float x, float y,
+				  float* fraction )
+{
+  // Note: inverted Y coordinate
+  float px = x * window_width;
+  float py = ( 1.f - y ) * window_height;
+
+  if ( handle.d->servers > 1 ) {
+    int p;
+    for ( p = 0; p < handle.d->servers; p++ ) {
+      const struct DISPLAY_PANEL* panel = &handle.d->panels[p];
+      if ( inside( panel->boxes[PANEL_COVER], px, py ) )
+	return DISPLAY_REGION_COVER;
+      if ( inside( panel->box, px, py ) )
+	return DISPLAY_REGION_METADATA;
+    }
+    return DISPLAY_REGION_NONE;
+  }
+
+  // Wherever the point is, so a drag can overshoot either end.
+  if ( fraction != NULL ) {
+    *fraction = CLAMP( ( px - handle.d->thermometer_box[0] ) /
+		       handle.d->thermometer_box[2], 0.f, 1.f );
+  }
+
+  if ( inside( handle.d->thermometer_box, px, py ) )
+    return DISPLAY_REGION_THERMOMETER;
+
+  if ( inside( handle.d->cover_box, px, py ) )
+    return DISPLAY_REGION_COVER;
+
+  int f;
+  for ( f = 0; f < METADATA_FIELDS; f++ ) {
+    if ( inside( handle.d->metadata_boxes[f], px, py ) )
+      return DISPLAY_REGION_METADATA;
+  }
+
+  return DISPLAY_REGION_NONE;
+}
+
+int display_server_at ( struct DISPLAY_HANDLE handle, float x, float y )
+{
+  if ( handle.d->servers == 1 )
+    return 0;
+
+  float px = x * window_width;
+  float py = ( 1.f - y ) * window_height;
+  int p;
+  for ( p = 0; p < handle.d->servers; p++ ) {
+    if ( inside( handle.d->panels[p].box, px, py ) )
+      return p;
+  }
+  return -1;
 }
 
 int display_status ( struct DISPLAY_HANDLE handle )
@@ -639,13 +1680,36 @@ int display_status ( struct DISPLAY_HANDLE handle )
 void display_close ( struct DISPLAY_HANDLE handle )
 {
   if ( handle.d != NULL ) {
-    text_widget_free_handle( handle.d->metadata_widget );
+    int f;
+    for ( f = 0; f < METADATA_FIELDS; f++ )
+      text_widget_free_handle( handle.d->metadata_widgets[f] );
     text_widget_free_handle( handle.d->time_widget );
     image_widget_free_handle( handle.d->cover_widget );
+    int p;
+    for ( p = 0; handle.d->servers > 1 && p < handle.d->servers; p++ ) {
+      struct DISPLAY_PANEL* panel = &handle.d->panels[p];
+      text_widget_free_handle( panel->title_widget );
+      text_widget_free_handle( panel->detail_widget );
+      text_widget_free_handle( panel->time_widget );
+      image_widget_free_handle( panel->cover_widget );
+      g_free( panel->name );
+    }
+    glyph_cache_close( handle.d->glyph_cache );
+    snapshot_close( handle.d->snapshot );
+    g_string_free( handle.d->metadata_markup, TRUE );
 
     eglTerminate( handle.d->egl_display );
     // \bug what about the native window?
+    if ( handle.d->glyph_save_source != 0 )
+      g_source_remove( handle.d->glyph_save_source );
+    if ( handle.d->covers_source != 0 )
+      g_source_remove( handle.d->covers_source );
     image_db_free( handle.d->image_db );
+    int s;
+    for ( s = 0; s < MPD_SERVERS_MAX; s++ ) {
+      g_free( handle.d->cover_artist[s] );
+      g_free( handle.d->cover_album[s] );
+    }
 
     free( handle.d );
     handle.d = NULL;
@@ -4,8 +4,12 @@
 #ifndef DISPLAY_INTF_H
 #define DISPLAY_INTF_H
 
-struct MPD_HANDLE;
+#include "glyph_cache.h"
+
+struct MPD_STATE;
+struct COVER_RESULT;
 struct IMAGE_DB_HANDLE;
+struct LOG_HANDLE;
 
 struct DISLPAY_PRIVATE;
 
@@ -14,13 +18,57 @@ struct DISPLAY_HANDLE {
 };
 
 /*!
- * Initialize the display.
- * \param[in] image_db image database connector.
- * \param[in] mpd connection to MPD.
+ * The parts of the screen which respond to touch.
+ */
+enum DISPLAY_REGION {
+  DISPLAY_REGION_NONE,
+  DISPLAY_REGION_METADATA,
+  DISPLAY_REGION_COVER,
+  DISPLAY_REGION_THERMOMETER
+};
+
+/*!
+ * How the metadata lines deal with text which is too long.
+ */
+enum DISPLAY_LAYOUT {
+  //! Shrink and then scroll.
+  DISPLAY_LAYOUT_SCROLL,
+  //! Shrink and then wrap.
+  DISPLAY_LAYOUT_WRAP
+};
+
+/*!
+ * Drawing statistics. Times are in microseconds.
+ */
+struct DISPLAY_STATS {
+  unsigned long frames;
+  //! Frames which only redrew part of the screen.
+  unsigned long partial_frames;
+  long long last_frame;
+  long long mean_frame;
+  long long max_frame;
+  //! Glyph outline cache.
+  struct GLYPH_CACHE_STATS glyph_cache;
+  //! Glyph atlas use (percent, -1 if there isn't one).
+  int atlas_usage;
+};
+
+/*!
+ * Initialize the display. If there is a snapshot of what was showing
+ * last time, it goes up straight away.
+ * \param[in] image_db image database connector. If its handle is
+ * NULL, covers only come through display_cover.
+ * \param[in] servers what to call each MPD server (may be NULL).
+ * \param[in] server_count how many servers there are. With more than
+ * one (up to MPD_SERVERS_MAX), each gets a compact panel of its own
+ * and there's no snapshot.
+ * \param[in] logger where to complain.
  * \return a handle to the display.
  */
 struct DISPLAY_HANDLE display_init ( struct IMAGE_DB_HANDLE image_db,
-				     struct MPD_HANDLE mpd );
+				     const char* const* servers,
+				     int server_count,
+				     struct LOG_HANDLE logger );
 /*!
  * The structure is opaque so every access has to be through
  * a function call.
@@ -28,10 +76,85 @@ struct DISPLAY_HANDLE display_init ( struct IMAGE_DB_HANDLE image_db,
  */
 int display_status ( struct DISPLAY_HANDLE handle );
 /*!
- * Update the display.
+ * Update the display. A new cover is asked for from the cover thread
+ * and goes up when it's ready (from the main loop).
+ * \param[in] handle our display.
+ * \param[in] state what one of the MPD servers is doing (from the
+ * polling thread).
+ */
+void display_update ( struct DISPLAY_HANDLE handle,
+		      const struct MPD_STATE* state );
+/*!
+ * Put up a cover which came from elsewhere (a daemon). It only goes
+ * up if it's for the album of the last update.
+ * \param[in] handle our display.
+ * \param[in] cover the cover. The display takes care of freeing it.
+ */
+void display_cover ( struct DISPLAY_HANDLE handle,
+		     struct COVER_RESULT* cover );
+/*!
+ * The size covers are shown at, for scaling them ahead of time. This
+ * doesn't need an initialized display.
+ * \param[out] width the width in pixels.
+ * \param[out] height the height in pixels.
+ */
+void display_cover_size ( int* width, int* height );
+/*!
+ * Draw the display again without looking at MPD. For animation.
+ * \param[in] handle our display.
+ */
+void display_redraw ( struct DISPLAY_HANDLE handle );
+/*!
+ * \param[in] handle our display.
+ * \return non-zero if something is moving and display_redraw should be
+ * called at the frame rate.
+ */
+int display_animating ( struct DISPLAY_HANDLE handle );
+/*!
+ * What is at this point on the screen?
+ * \param[in] handle our display.
+ * \param[in] x fraction of the screen width from the left.
+ * \param[in] y fraction of the screen height from the top.
+ * \param[out] fraction how far along the thermometer the point is
+ * horizontally, clamped to 0 to 1 (set even if the point is somewhere
+ * else; left alone if there are several servers). May be NULL.
+ * \return the region.
+ */
+enum DISPLAY_REGION display_hit ( struct DISPLAY_HANDLE handle, float x, float y,
+				  float* fraction );
+/*!
+ * Which server's panel is at this point on the screen?
+ * \param[in] handle our display.
+ * \param[in] x fraction of the screen width from the left.
+ * \param[in] y fraction of the screen height from the top.
+ * \return the server, or -1 if the point isn't in a panel. Always 0
+ * with just the one server.
+ */
+int display_server_at ( struct DISPLAY_HANDLE handle, float x, float y );
+/*!
+ * Redraw the whole screen, changed or not.
+ * \param[in] handle our display.
+ */
+void display_force_redraw ( struct DISPLAY_HANDLE handle );
+/*!
+ * Choose what happens to long metadata.
+ * \param[in] handle our display.
+ * \param[in] layout the layout.
+ */
+void display_set_layout ( struct DISPLAY_HANDLE handle,
+			  enum DISPLAY_LAYOUT layout );
+/*!
+ * Write any cached data which is kept between runs (the glyph cache
+ * and the snapshot of the screen) to the disk.
+ * \param[in] handle our display.
+ * \return 0 if everything is ok, -1 otherwise.
+ */
+int display_flush_caches ( struct DISPLAY_HANDLE handle );
+/*!
  * \param[in] handle our display.
+ * \return the drawing statistics.
  */
-void display_update ( struct DISPLAY_HANDLE handle );
+struct DISPLAY_STATS display_stats ( struct DISPLAY_HANDLE handle );
 /*!
  * Restore the display to whatever it showed before.
  * \param[in] handle the display handle to close.
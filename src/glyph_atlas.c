@@ -0,0 +1,142 @@
+/*
+ * Glyph bitmaps packed into one VG_A_8 image. Packing is by shelves:
+ * glyphs are placed left to right in a row as tall as the tallest
+ * glyph so far; when a row is full, a new one is started above it.
+ * Text in a widget tends to be a single size, so not much is wasted.
+ * Nothing is removed on its own; when the atlas is full, the user
+ * empties it (glyph_atlas_reset) and starts again.
+ */
+#include <stdlib.h>
+
+#include "glib.h"
+
+#include "glyph_atlas.h"
+
+// Blank pixels around each glyph so filtering never picks up a
+// neighbor.
+#define ATLAS_PADDING 1
+
+struct GLYPH_ATLAS_PRIVATE {
+  VGImage image;
+  int width;
+  int height;
+  // The shelf being filled.
+  int shelf_x;
+  int shelf_y;
+  int shelf_height;
+  // Resets so far.
+  unsigned int generation;
+};
+
+struct GLYPH_ATLAS_HANDLE glyph_atlas_init ( int width, int height )
+{
+  struct GLYPH_ATLAS_HANDLE handle = { NULL };
+
+  VGImage image = vgCreateImage( VG_A_8, width, height,
+				 VG_IMAGE_QUALITY_NONANTIALIASED );
+  if ( image == VG_INVALID_HANDLE )
+    return handle;
+
+  // New images start out zeroed, which is exactly no coverage. (Not
+  // vgClearImage: that would use the display's clear color.)
+
+  handle.d = malloc( sizeof( struct GLYPH_ATLAS_PRIVATE ) );
+  handle.d->image = image;
+  handle.d->width = width;
+  handle.d->height = height;
+  handle.d->shelf_x = 0;
+  handle.d->shelf_y = 0;
+  handle.d->shelf_height = 0;
+  handle.d->generation = 0;
+
+  return handle;
+}
+
+int glyph_atlas_add ( struct GLYPH_ATLAS_HANDLE handle,
+		      int width, int rows, int pitch,
+		      const unsigned char* buffer, VGImage* image )
+{
+  *image = VG_INVALID_HANDLE;
+
+  if ( handle.d == NULL || width <= 0 || rows <= 0 )
+    return -1;
+
+  struct GLYPH_ATLAS_PRIVATE* d = handle.d;
+  int cell_width = width + ATLAS_PADDING;
+  int cell_height = rows + ATLAS_PADDING;
+
+  // Where it goes: on this shelf or, if it's full, a new one. Nothing
+  // changes until the glyph is in.
+  int x = d->shelf_x;
+  int y = d->shelf_y;
+  int shelf_height = d->shelf_height;
+  if ( x + cell_width > d->width ) {
+    y += shelf_height;
+    x = 0;
+    shelf_height = 0;
+  }
+  if ( cell_width > d->width || y + cell_height > d->height )
+    return -1;
+
+  // OpenVG images have their first row at the bottom, so walk the
+  // bitmap backwards.
+  vgImageSubData( d->image, buffer + ( rows - 1 ) * pitch, -pitch, VG_A_8,
+		  x, y, width, rows );
+
+  VGImage child = vgChildImage( d->image, x, y, width, rows );
+  if ( child == VG_INVALID_HANDLE )
+    return -1;
+
+  d->shelf_x = x + cell_width;
+  d->shelf_y = y;
+  d->shelf_height = MAX( shelf_height, cell_height );
+
+  *image = child;
+
+  return 0;
+}
+
+void glyph_atlas_reset ( struct GLYPH_ATLAS_HANDLE handle )
+{
+  if ( handle.d == NULL )
+    return;
+
+  struct GLYPH_ATLAS_PRIVATE* d = handle.d;
+
+  // No coverage anywhere, padding included.
+  VGfloat saved_clear[4];
+  static const VGfloat transparent[] = { 0.f, 0.f, 0.f, 0.f };
+  vgGetfv( VG_CLEAR_COLOR, 4, saved_clear );
+  vgSetfv( VG_CLEAR_COLOR, 4, transparent );
+  vgClearImage( d->image, 0, 0, d->width, d->height );
+  vgSetfv( VG_CLEAR_COLOR, 4, saved_clear );
+
+  d->shelf_x = 0;
+  d->shelf_y = 0;
+  d->shelf_height = 0;
+  d->generation++;
+}
+
+unsigned int glyph_atlas_generation ( struct GLYPH_ATLAS_HANDLE handle )
+{
+  if ( handle.d == NULL )
+    return 0;
+  return handle.d->generation;
+}
+
+int glyph_atlas_usage ( struct GLYPH_ATLAS_HANDLE handle )
+{
+  if ( handle.d == NULL )
+    return -1;
+  // Whole shelves, since that's what's left for new ones.
+  return 100 * ( handle.d->shelf_y + handle.d->shelf_height ) /
+    handle.d->height;
+}
+
+void glyph_atlas_free ( struct GLYPH_ATLAS_HANDLE handle )
+{
+  if ( handle.d != NULL ) {
+    vgDestroyImage( handle.d->image );
+    free( handle.d );
+  }
+}
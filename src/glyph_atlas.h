@@ -0,0 +1,68 @@
+/*
+ * One big alpha-only image which holds pre-rendered glyph bitmaps.
+ * Each glyph is handed back as a child image of the atlas, which can be
+ * drawn in stencil mode with whatever paint the text needs.
+ */
+#ifndef GLYPH_ATLAS_H
+#define GLYPH_ATLAS_H
+
+#include "VG/openvg.h"
+
+struct GLYPH_ATLAS_PRIVATE;
+
+struct GLYPH_ATLAS_HANDLE {
+  struct GLYPH_ATLAS_PRIVATE* d;
+};
+
+/*!
+ * Create an empty atlas. Requires a current OpenVG context.
+ * \param[in] width width of the atlas image in pixels.
+ * \param[in] height height of the atlas image in pixels.
+ * \return a handle to the atlas. If the image could not be created,
+ * the handle's d is NULL.
+ */
+struct GLYPH_ATLAS_HANDLE glyph_atlas_init ( int width, int height );
+
+/*!
+ * Copy a coverage bitmap into the atlas.
+ * \param[inout] handle the atlas.
+ * \param[in] width width of the bitmap in pixels.
+ * \param[in] rows height of the bitmap in pixels.
+ * \param[in] pitch bytes from one row to the next (rows run top to
+ * bottom, as FreeType has them).
+ * \param[in] buffer the 8 bit coverage values.
+ * \param[out] image the child image holding the bitmap.
+ * \return 0 if everything is ok, -1 if the atlas is full.
+ */
+int glyph_atlas_add ( struct GLYPH_ATLAS_HANDLE handle,
+		      int width, int rows, int pitch,
+		      const unsigned char* buffer, VGImage* image );
+
+/*!
+ * Empty the atlas. The child images handed out so far are still valid
+ * handles, but their pixels will be overwritten by new glyphs: destroy
+ * them and don't draw them again.
+ * \param[inout] handle the atlas.
+ */
+void glyph_atlas_reset ( struct GLYPH_ATLAS_HANDLE handle );
+
+/*!
+ * \param[in] handle the atlas.
+ * \return how many times the atlas has been reset. A child image made
+ * in an earlier generation is stale.
+ */
+unsigned int glyph_atlas_generation ( struct GLYPH_ATLAS_HANDLE handle );
+
+/*!
+ * \param[in] handle the atlas.
+ * \return how much of the atlas is in use (percent), or -1 if there
+ * is no atlas.
+ */
+int glyph_atlas_usage ( struct GLYPH_ATLAS_HANDLE handle );
+
+/*!
+ * Release the atlas. Any child images must already be destroyed.
+ * \param[in] handle the atlas.
+ */
+void glyph_atlas_free ( struct GLYPH_ATLAS_HANDLE handle );
+#endif
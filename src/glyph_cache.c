@@ -0,0 +1,506 @@
+/*
+ * A file backed cache of glyph outlines. Converting a FreeType outline
+ * into an OpenVG path isn't hard, but on a Pi Zero doing it for every
+ * glyph of every new song right after boot is noticeable. So, we save
+ * the converted path data and map it back in the next time.
+ *
+ * The file is just the native layout of a few structures (it never
+ * leaves the machine which wrote it):
+ *
+ *   FILE_HEADER
+ *   FILE_FONT[fonts_count]
+ *   FILE_GLYPH[glyphs_count]
+ *   data: for each glyph, its segments (padded to 4 bytes) then its
+ *         coordinates.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include "glib.h"
+
+#include "glyph_cache.h"
+#include "metrics.h"
+
+#define GLYPH_CACHE_MAGIC "MPDGLYPH"
+#define GLYPH_CACHE_VERSION 1
+#define FONT_PATH_MAX 256
+
+struct FILE_HEADER {
+  char magic[8];
+  uint32_t version;
+  //! Different FreeType, different hinting. Throw everything away.
+  uint32_t freetype_version;
+  uint32_t fonts_count;
+  uint32_t glyphs_count;
+  uint32_t data_bytes;
+  uint32_t reserved;
+};
+
+struct FILE_FONT {
+  uint64_t file_key;
+  int64_t size;
+  int64_t mtime;
+  char path[FONT_PATH_MAX];
+};
+
+struct FILE_GLYPH {
+  uint64_t face_key;
+  uint64_t file_key;
+  uint32_t glyph;
+  uint32_t segments_count;
+  uint32_t coords_count;
+  //! Offset of the segments from the start of the data.
+  uint32_t offset;
+  float escapement[2];
+};
+
+/*!
+ * A font file we've looked at (either in the cache file or this
+ * session).
+ */
+struct FONT_FILE {
+  uint64_t key;
+  char path[FONT_PATH_MAX];
+  int64_t size;
+  int64_t mtime;
+};
+
+/*!
+ * All the glyphs of one face at one size.
+ */
+struct FACE {
+  uint64_t key;
+  uint64_t file_key;
+  //! Glyph index -> struct GLYPH_OUTLINE. The outline data points
+  //! either into the mapped file or just past the structure.
+  GHashTable* glyphs;
+};
+
+struct GLYPH_CACHE_PRIVATE {
+  GString* path;
+  //! The mapped file (if any).
+  void* map;
+  size_t map_size;
+  //! File key (uint64_t*) -> struct FONT_FILE.
+  GHashTable* fonts;
+  //! Face key (uint64_t*) -> struct FACE.
+  GHashTable* faces;
+  //! Has anything been added since we read the file?
+  int dirty;
+  unsigned long lookups;
+  unsigned long hits;
+};
+
+// Hits and misses, for working out the hit rate.
+static struct METRIC lookup_metrics[] = {
+  METRIC_COUNTER_INIT( "mpddisplay_glyph_cache_lookups_total",
+		       "Glyph outline cache lookups.", "result", "hit" ),
+  METRIC_COUNTER_INIT( "mpddisplay_glyph_cache_lookups_total",
+		       "Glyph outline cache lookups.", "result", "miss" ),
+};
+
+static uint64_t fnv1a_64 ( uint64_t hash, const void* data, size_t n_bytes )
+{
+  const unsigned char* p = data;
+  size_t i;
+  for ( i = 0; i < n_bytes; i++ ) {
+    hash ^= p[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static const uint64_t FNV_OFFSET = 14695981039346656037ull;
+
+static uint32_t freetype_version ( void )
+{
+  return FREETYPE_MAJOR * 10000 + FREETYPE_MINOR * 100 + FREETYPE_PATCH;
+}
+
+static uint64_t file_key ( const char* path, int64_t size, int64_t mtime )
+{
+  uint64_t key = fnv1a_64( FNV_OFFSET, path, strlen( path ) );
+  key = fnv1a_64( key, &size, sizeof size );
+  key = fnv1a_64( key, &mtime, sizeof mtime );
+  return key;
+}
+
+static void face_free ( gpointer data )
+{
+  struct FACE* face = data;
+  g_hash_table_destroy( face->glyphs );
+  free( face );
+}
+
+static struct FACE* face_get ( struct GLYPH_CACHE_PRIVATE* d,
+			       uint64_t key, uint64_t file_key )
+{
+  struct FACE* face = g_hash_table_lookup( d->faces, &key );
+  if ( face == NULL ) {
+    face = malloc( sizeof( struct FACE ) );
+    face->key = key;
+    face->file_key = file_key;
+    face->glyphs = g_hash_table_new_full( g_direct_hash, g_direct_equal,
+					  NULL, free );
+    g_hash_table_insert( d->faces, &face->key, face );
+  }
+  return face;
+}
+
+static void font_file_add ( struct GLYPH_CACHE_PRIVATE* d,
+			    uint64_t key, const char* path,
+			    int64_t size, int64_t mtime )
+{
+  struct FONT_FILE* font = malloc( sizeof( struct FONT_FILE ) );
+  font->key = key;
+  g_strlcpy( font->path, path, sizeof font->path );
+  font->size  = size;
+  font->mtime = mtime;
+  g_hash_table_insert( d->fonts, &font->key, font );
+}
+
+static void glyph_cache_load ( struct GLYPH_CACHE_PRIVATE* d )
+{
+  int fd = open( d->path->str, O_RDONLY );
+  if ( fd < 0 )
+    return;
+
+  struct stat st;
+  if ( fstat( fd, &st ) < 0 || (size_t)st.st_size < sizeof( struct FILE_HEADER ) ) {
+    close( fd );
+    return;
+  }
+
+  void* map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if ( map == MAP_FAILED )
+    return;
+
+  d->map = map;
+  d->map_size = st.st_size;
+
+  const struct FILE_HEADER* header = map;
+  if ( memcmp( header->magic, GLYPH_CACHE_MAGIC, sizeof header->magic ) != 0 ||
+       header->version != GLYPH_CACHE_VERSION ||
+       header->freetype_version != freetype_version() )
+    return;
+
+  // The counts are only as good as the file, and size_t is 32 bits on
+  // the Pi, so add them up where they can't wrap.
+  uint64_t fonts_bytes  =
+    (uint64_t)header->fonts_count * sizeof( struct FILE_FONT );
+  uint64_t glyphs_bytes =
+    (uint64_t)header->glyphs_count * sizeof( struct FILE_GLYPH );
+  if ( sizeof *header + fonts_bytes + glyphs_bytes + header->data_bytes >
+       (uint64_t)d->map_size )
+    return;
+
+  const struct FILE_FONT* fonts = (const struct FILE_FONT*)( header + 1 );
+  const struct FILE_GLYPH* glyphs =
+    (const struct FILE_GLYPH*)( fonts + header->fonts_count );
+  const unsigned char* data = (const unsigned char*)( glyphs + header->glyphs_count );
+
+  // Only fonts which haven't changed on disk are any use.
+  uint32_t i;
+  for ( i = 0; i < header->fonts_count; i++ ) {
+    char path[FONT_PATH_MAX];
+    g_strlcpy( path, fonts[i].path, sizeof path );
+    struct stat font_st;
+    if ( stat( path, &font_st ) < 0 ||
+	 font_st.st_size != fonts[i].size ||
+	 font_st.st_mtime != fonts[i].mtime ||
+	 file_key( path, font_st.st_size, font_st.st_mtime ) != fonts[i].file_key )
+      continue;
+    font_file_add( d, fonts[i].file_key, path, fonts[i].size, fonts[i].mtime );
+  }
+
+  for ( i = 0; i < header->glyphs_count; i++ ) {
+    const struct FILE_GLYPH* g = &glyphs[i];
+    if ( g_hash_table_lookup( d->fonts, &g->file_key ) == NULL )
+      continue;
+    uint64_t segments_bytes = ( (uint64_t)g->segments_count + 3 ) & ~3ull;
+    // The coordinates are read in place, so they had better be aligned.
+    if ( ( g->offset & 3 ) != 0 ||
+	 g->offset + segments_bytes +
+	 (uint64_t)g->coords_count * sizeof( VGfloat ) > header->data_bytes )
+      continue;
+
+    struct GLYPH_OUTLINE* outline = malloc( sizeof( struct GLYPH_OUTLINE ) );
+    outline->glyph          = g->glyph;
+    outline->segments_count = g->segments_count;
+    outline->segments       = data + g->offset;
+    outline->coords_count   = g->coords_count;
+    outline->coords         = (const VGfloat*)( data + g->offset + segments_bytes );
+    outline->escapement[0]  = g->escapement[0];
+    outline->escapement[1]  = g->escapement[1];
+
+    struct FACE* face = face_get( d, g->face_key, g->file_key );
+    g_hash_table_replace( face->glyphs, GUINT_TO_POINTER( g->glyph ), outline );
+  }
+}
+
+struct GLYPH_CACHE_HANDLE glyph_cache_open ( const char* path )
+{
+  struct GLYPH_CACHE_HANDLE handle;
+  handle.d = malloc( sizeof( struct GLYPH_CACHE_PRIVATE ) );
+  handle.d->path     = g_string_new( path );
+  handle.d->map      = NULL;
+  handle.d->map_size = 0;
+  handle.d->fonts    = g_hash_table_new_full( g_int64_hash, g_int64_equal,
+					      NULL, free );
+  handle.d->faces    = g_hash_table_new_full( g_int64_hash, g_int64_equal,
+					      NULL, face_free );
+  handle.d->dirty    = 0;
+  handle.d->lookups  = 0;
+  handle.d->hits     = 0;
+
+  metrics_register( &lookup_metrics[0] );
+  metrics_register( &lookup_metrics[1] );
+
+  glyph_cache_load( handle.d );
+
+  return handle;
+}
+
+uint64_t glyph_cache_face_key ( struct GLYPH_CACHE_HANDLE handle,
+				const char* font_file, int face_index,
+				long x_scale, long y_scale )
+{
+  if ( handle.d == NULL || font_file == NULL ||
+       strlen( font_file ) >= FONT_PATH_MAX )
+    return 0;
+
+  struct stat st;
+  if ( stat( font_file, &st ) < 0 )
+    return 0;
+
+  int64_t size  = st.st_size;
+  int64_t mtime = st.st_mtime;
+  uint64_t key = file_key( font_file, size, mtime );
+
+  if ( g_hash_table_lookup( handle.d->fonts, &key ) == NULL ) {
+    font_file_add( handle.d, key, font_file, size, mtime );
+  }
+
+  int64_t scales[3] = { face_index, x_scale, y_scale };
+  uint64_t face_key = fnv1a_64( key, scales, sizeof scales );
+  // Remember which file this face came from.
+  (void)face_get( handle.d, face_key, key );
+
+  return face_key;
+}
+
+const struct GLYPH_OUTLINE* glyph_cache_lookup ( struct GLYPH_CACHE_HANDLE handle,
+						 uint64_t key, VGuint glyph )
+{
+  if ( handle.d == NULL || key == 0 )
+    return NULL;
+
+  handle.d->lookups++;
+
+  struct FACE* face = g_hash_table_lookup( handle.d->faces, &key );
+  if ( face == NULL ) {
+    metric_add( &lookup_metrics[1], 1 );
+    return NULL;
+  }
+
+  const struct GLYPH_OUTLINE* outline =
+    g_hash_table_lookup( face->glyphs, GUINT_TO_POINTER( glyph ) );
+  if ( outline != NULL )
+    handle.d->hits++;
+  metric_add( &lookup_metrics[outline != NULL ? 0 : 1], 1 );
+
+  return outline;
+}
+
+void glyph_cache_foreach ( struct GLYPH_CACHE_HANDLE handle, uint64_t key,
+			   void (*function)( const struct GLYPH_OUTLINE*, void* ),
+			   void* user_data )
+{
+  if ( handle.d == NULL || key == 0 )
+    return;
+
+  struct FACE* face = g_hash_table_lookup( handle.d->faces, &key );
+  if ( face == NULL )
+    return;
+
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init( &iter, face->glyphs );
+  while ( g_hash_table_iter_next( &iter, NULL, &value ) ) {
+    function( value, user_data );
+  }
+}
+
+void glyph_cache_store ( struct GLYPH_CACHE_HANDLE handle, uint64_t key,
+			 const struct GLYPH_OUTLINE* outline )
+{
+  if ( handle.d == NULL || key == 0 )
+    return;
+
+  struct FACE* face = g_hash_table_lookup( handle.d->faces, &key );
+  if ( face == NULL ) // Key didn't come from glyph_cache_face_key.
+    return;
+
+  // One allocation for the lot.
+  size_t segments_bytes = ( outline->segments_count + 3 ) & ~3u;
+  size_t coords_bytes   = outline->coords_count * sizeof( VGfloat );
+  struct GLYPH_OUTLINE* copy = malloc( sizeof( struct GLYPH_OUTLINE ) +
+				       segments_bytes + coords_bytes );
+  unsigned char* data = (unsigned char*)( copy + 1 );
+  memcpy( data, outline->segments, outline->segments_count );
+  memcpy( data + segments_bytes, outline->coords, coords_bytes );
+
+  *copy = *outline;
+  copy->segments = data;
+  copy->coords   = (const VGfloat*)( data + segments_bytes );
+
+  g_hash_table_replace( face->glyphs, GUINT_TO_POINTER( outline->glyph ), copy );
+
+  handle.d->dirty = 1;
+}
+
+int glyph_cache_save ( struct GLYPH_CACHE_HANDLE handle )
+{
+  if ( handle.d == NULL )
+    return -1;
+  if ( ! handle.d->dirty )
+    return 0;
+
+  struct FILE_HEADER header;
+  memset( &header, 0, sizeof header );
+  memcpy( header.magic, GLYPH_CACHE_MAGIC, sizeof header.magic );
+  header.version          = GLYPH_CACHE_VERSION;
+  header.freetype_version = freetype_version();
+
+  GArray* fonts  = g_array_new( FALSE, TRUE, sizeof( struct FILE_FONT ) );
+  GArray* glyphs = g_array_new( FALSE, TRUE, sizeof( struct FILE_GLYPH ) );
+  GByteArray* data = g_byte_array_new();
+
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init( &iter, handle.d->fonts );
+  while ( g_hash_table_iter_next( &iter, NULL, &value ) ) {
+    struct FONT_FILE* font = value;
+    struct FILE_FONT record;
+    memset( &record, 0, sizeof record );
+    record.file_key = font->key;
+    record.size     = font->size;
+    record.mtime    = font->mtime;
+    g_strlcpy( record.path, font->path, sizeof record.path );
+    g_array_append_val( fonts, record );
+  }
+
+  static const unsigned char padding[4] = { 0, 0, 0, 0 };
+
+  g_hash_table_iter_init( &iter, handle.d->faces );
+  while ( g_hash_table_iter_next( &iter, NULL, &value ) ) {
+    struct FACE* face = value;
+    GHashTableIter glyph_iter;
+    gpointer glyph_value;
+    g_hash_table_iter_init( &glyph_iter, face->glyphs );
+    while ( g_hash_table_iter_next( &glyph_iter, NULL, &glyph_value ) ) {
+      const struct GLYPH_OUTLINE* outline = glyph_value;
+      struct FILE_GLYPH record;
+      record.face_key       = face->key;
+      record.file_key       = face->file_key;
+      record.glyph          = outline->glyph;
+      record.segments_count = outline->segments_count;
+      record.coords_count   = outline->coords_count;
+      record.offset         = data->len;
+      record.escapement[0]  = outline->escapement[0];
+      record.escapement[1]  = outline->escapement[1];
+      g_array_append_val( glyphs, record );
+
+      g_byte_array_append( data, outline->segments, outline->segments_count );
+      g_byte_array_append( data, padding,
+			   ( 4 - ( outline->segments_count & 3 ) ) & 3 );
+      g_byte_array_append( data, (const guint8*)outline->coords,
+			   outline->coords_count * sizeof( VGfloat ) );
+    }
+  }
+
+  header.fonts_count  = fonts->len;
+  header.glyphs_count = glyphs->len;
+  header.data_bytes   = data->len;
+
+  // Write beside the old file and rename over it; the old file may
+  // still be mapped.
+  int status = -1;
+  GString* temporary = g_string_new( handle.d->path->str );
+  g_string_append( temporary, ".tmp" );
+  FILE* file = fopen( temporary->str, "wb" );
+  if ( file != NULL ) {
+    size_t written = 0;
+    written += fwrite( &header, sizeof header, 1, file );
+    written += fwrite( fonts->data, sizeof( struct FILE_FONT ), fonts->len, file );
+    written += fwrite( glyphs->data, sizeof( struct FILE_GLYPH ), glyphs->len, file );
+    written += fwrite( data->data, 1, data->len, file );
+    if ( fclose( file ) == 0 &&
+	 written == 1 + fonts->len + glyphs->len + data->len &&
+	 rename( temporary->str, handle.d->path->str ) == 0 ) {
+      status = 0;
+      handle.d->dirty = 0;
+    }
+    else {
+      unlink( temporary->str );
+    }
+  }
+
+  g_string_free( temporary, TRUE );
+  g_array_free( fonts, TRUE );
+  g_array_free( glyphs, TRUE );
+  g_byte_array_free( data, TRUE );
+
+  return status;
+}
+
+int glyph_cache_unsaved ( struct GLYPH_CACHE_HANDLE handle )
+{
+  return handle.d != NULL && handle.d->dirty;
+}
+
+struct GLYPH_CACHE_STATS glyph_cache_stats ( struct GLYPH_CACHE_HANDLE handle )
+{
+  struct GLYPH_CACHE_STATS stats;
+  memset( &stats, 0, sizeof stats );
+  if ( handle.d == NULL )
+    return stats;
+
+  stats.faces   = g_hash_table_size( handle.d->faces );
+  stats.lookups = handle.d->lookups;
+  stats.hits    = handle.d->hits;
+  stats.dirty   = handle.d->dirty;
+
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init( &iter, handle.d->faces );
+  while ( g_hash_table_iter_next( &iter, NULL, &value ) ) {
+    stats.glyphs += g_hash_table_size( ((struct FACE*)value)->glyphs );
+  }
+
+  return stats;
+}
+
+void glyph_cache_close ( struct GLYPH_CACHE_HANDLE handle )
+{
+  if ( handle.d != NULL ) {
+    (void)glyph_cache_save( handle );
+    g_hash_table_destroy( handle.d->faces );
+    g_hash_table_destroy( handle.d->fonts );
+    if ( handle.d->map != NULL ) {
+      munmap( handle.d->map, handle.d->map_size );
+    }
+    g_string_free( handle.d->path, TRUE );
+    free( handle.d );
+    handle.d = NULL;
+  }
+}
@@ -0,0 +1,121 @@
+/*
+ * Keep the OpenVG path data for glyphs in a file so that we don't have
+ * to ask FreeType for the outlines again every time we start.
+ */
+#ifndef GLYPH_CACHE_H
+#define GLYPH_CACHE_H
+
+#include <stdint.h>
+
+#include "VG/openvg.h"
+
+struct GLYPH_CACHE_PRIVATE;
+
+struct GLYPH_CACHE_HANDLE {
+  struct GLYPH_CACHE_PRIVATE* d;
+};
+
+/*!
+ * The converted outline of one glyph, ready for vgAppendPathData.
+ */
+struct GLYPH_OUTLINE {
+  VGuint glyph;
+  VGint segments_count;
+  const VGubyte* segments;
+  VGint coords_count;
+  const VGfloat* coords;
+  VGfloat escapement[2];
+};
+
+/*!
+ * How the cache has been doing.
+ */
+struct GLYPH_CACHE_STATS {
+  unsigned int faces;
+  unsigned int glyphs;
+  unsigned long lookups;
+  unsigned long hits;
+  //! Are there glyphs not yet saved?
+  int dirty;
+};
+
+/*!
+ * Open (well, map) the cache file. Entries for font files which have
+ * changed or disappeared since they were cached are ignored. A missing
+ * or damaged file just gives an empty cache.
+ * \param[in] path the cache file.
+ * \return a handle to the cache.
+ */
+struct GLYPH_CACHE_HANDLE glyph_cache_open ( const char* path );
+
+/*!
+ * Compute the key for a face of a font file at a particular scale.
+ * The file's size and modification time are folded into the key, so
+ * replacing a font invalidates its entries.
+ * \param[inout] handle the cache (remembers the font file for saving).
+ * \param[in] font_file the font file name (from fontconfig).
+ * \param[in] face_index which face in the file.
+ * \param[in] x_scale the FreeType x scale (16.16) of the size.
+ * \param[in] y_scale the FreeType y scale (16.16) of the size.
+ * \return the key, or 0 if the font file can't be examined.
+ */
+uint64_t glyph_cache_face_key ( struct GLYPH_CACHE_HANDLE handle,
+				const char* font_file, int face_index,
+				long x_scale, long y_scale );
+
+/*!
+ * Find a glyph in the cache.
+ * \param[in] handle the cache.
+ * \param[in] key the face key.
+ * \param[in] glyph the glyph index.
+ * \return the outline or NULL if it isn't in the cache.
+ */
+const struct GLYPH_OUTLINE* glyph_cache_lookup ( struct GLYPH_CACHE_HANDLE handle,
+						 uint64_t key, VGuint glyph );
+
+/*!
+ * Call the function for every glyph cached for this face.
+ * \param[in] handle the cache.
+ * \param[in] key the face key.
+ * \param[in] function called with each outline and user_data.
+ * \param[in] user_data passed along.
+ */
+void glyph_cache_foreach ( struct GLYPH_CACHE_HANDLE handle, uint64_t key,
+			   void (*function)( const struct GLYPH_OUTLINE*, void* ),
+			   void* user_data );
+
+/*!
+ * Add a newly converted glyph to the cache. The data is copied.
+ * \param[inout] handle the cache.
+ * \param[in] key the face key.
+ * \param[in] outline the glyph.
+ */
+void glyph_cache_store ( struct GLYPH_CACHE_HANDLE handle, uint64_t key,
+			 const struct GLYPH_OUTLINE* outline );
+
+/*!
+ * Write the cache back to its file if anything has been added.
+ * \param[in] handle the cache.
+ * \return 0 if everything is ok, -1 otherwise.
+ */
+int glyph_cache_save ( struct GLYPH_CACHE_HANDLE handle );
+
+/*!
+ * \param[in] handle the cache.
+ * \return 1 if glyphs have been added since the file was last written,
+ * 0 otherwise.
+ */
+int glyph_cache_unsaved ( struct GLYPH_CACHE_HANDLE handle );
+
+/*!
+ * \param[in] handle the cache.
+ * \return the cache's statistics.
+ */
+struct GLYPH_CACHE_STATS glyph_cache_stats ( struct GLYPH_CACHE_HANDLE handle );
+
+/*!
+ * Save the cache and release everything.
+ * \param[in] handle the cache.
+ */
+void glyph_cache_close ( struct GLYPH_CACHE_HANDLE handle );
+#endif
@@ -3,16 +3,22 @@
  * OpenVG.
  */
 #include <stdlib.h>
+#include <string.h>
 
 #include <gio/gio.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
 #include "image_intf.h"
+#include "trace.h"
 
 struct IMAGE_HANDLE_PRIVATE {
   // The GdkPixbuf handles practically all the loading and conversion
   // duties.
   GdkPixbuf* pb;
+  // Or a pre-decoded image which we don't own.
+  const unsigned char* raw;
+  int raw_width;
+  int raw_height;
 };
 
 struct IMAGE_HANDLE image_rgba_create ( const unsigned char* data,
@@ -20,6 +26,8 @@ struct IMAGE_HANDLE image_rgba_create ( const unsigned char* data,
 {
   struct IMAGE_HANDLE handle;
   handle.d = malloc( sizeof( struct IMAGE_HANDLE_PRIVATE ) );
+  handle.d->raw = NULL;
+  gint64 span = trace_begin();
 
   // Convert the blob we loaded from the database into a GInputStream.
   // The last argument is a destructor callback which we don't
@@ -44,14 +52,95 @@ struct IMAGE_HANDLE image_rgba_create ( const unsigned char* data,
   g_clear_object( &original );
   g_clear_object( &stream );
 
+  trace_end( "image decode", span );
+
   return handle;
 }
 
+struct IMAGE_HANDLE image_rgba_raw ( const unsigned char* data,
+				     size_t n_bytes )
+{
+  struct IMAGE_HANDLE handle;
+  handle.d = malloc( sizeof( struct IMAGE_HANDLE_PRIVATE ) );
+  handle.d->pb = NULL;
+  handle.d->raw = NULL;
+  handle.d->raw_width = 0;
+  handle.d->raw_height = 0;
+
+  // objcopy doesn't promise any alignment, so copy the header out.
+  struct IMAGE_RAW_HEADER header;
+  if ( n_bytes < sizeof header )
+    return handle;
+  memcpy( &header, data, sizeof header );
+
+  if ( memcmp( header.magic, IMAGE_RAW_MAGIC, sizeof header.magic ) != 0 ||
+       header.width == 0 || header.height == 0 ||
+       ( n_bytes - sizeof header ) / 4 / header.width < header.height )
+    return handle;
+
+  const unsigned char* pixels = data + sizeof header;
+
+  // Nor, then, are the pixels aligned, and vgImageSubData wants them
+  // aligned to a pixel. When they aren't, they have to be copied.
+  if ( (uintptr_t)pixels % 4 != 0 ) {
+    handle.d->pb = gdk_pixbuf_new( GDK_COLORSPACE_RGB, TRUE, 8,
+				   header.width, header.height );
+    if ( handle.d->pb == NULL )
+      return handle;
+    unsigned char* copy = gdk_pixbuf_get_pixels( handle.d->pb );
+    int stride = gdk_pixbuf_get_rowstride( handle.d->pb );
+    uint32_t row;
+    for ( row = 0; row < header.height; row++ )
+      memcpy( copy + (size_t)row * stride,
+	      pixels + (size_t)row * header.width * 4, header.width * 4 );
+    return handle;
+  }
+
+  handle.d->raw = pixels;
+  handle.d->raw_width = header.width;
+  handle.d->raw_height = header.height;
+
+  return handle;
+}
+
+struct IMAGE_HANDLE image_rgba_scale ( struct IMAGE_HANDLE handle,
+				       int width, int height )
+{
+  struct IMAGE_HANDLE scaled;
+  scaled.d = malloc( sizeof( struct IMAGE_HANDLE_PRIVATE ) );
+  scaled.d->pb = NULL;
+  scaled.d->raw = NULL;
+
+  GdkPixbuf* source = NULL;
+  if ( handle.d && handle.d->pb ) {
+    source = g_object_ref( handle.d->pb );
+  }
+  else if ( handle.d && handle.d->raw ) {
+    source = gdk_pixbuf_new_from_data( handle.d->raw, GDK_COLORSPACE_RGB,
+				       TRUE, 8, handle.d->raw_width,
+				       handle.d->raw_height,
+				       4 * handle.d->raw_width, NULL, NULL );
+  }
+
+  if ( source != NULL ) {
+    gint64 span = trace_begin();
+    scaled.d->pb = gdk_pixbuf_scale_simple( source, width, height,
+					    GDK_INTERP_BILINEAR );
+    trace_end( "image scale", span );
+    g_object_unref( source );
+  }
+
+  return scaled;
+}
+
 int image_rgba_width ( struct IMAGE_HANDLE handle )
 {
   if ( handle.d && handle.d->pb ) {
     return gdk_pixbuf_get_width( handle.d->pb );
   }
+  if ( handle.d && handle.d->raw ) {
+    return handle.d->raw_width;
+  }
   return 0;
 }
 
@@ -60,6 +149,9 @@ int image_rgba_height ( struct IMAGE_HANDLE handle )
   if ( handle.d && handle.d->pb ) {
     return gdk_pixbuf_get_height( handle.d->pb );
   }
+  if ( handle.d && handle.d->raw ) {
+    return handle.d->raw_height;
+  }
   return 0;
 }
 
@@ -68,9 +160,33 @@ unsigned char* image_rgba_image ( struct IMAGE_HANDLE handle )
   if ( handle.d && handle.d->pb ) {
     return gdk_pixbuf_get_pixels( handle.d->pb );
   }
+  if ( handle.d && handle.d->raw ) {
+    // Only ever read (by vgImageSubData).
+    return (unsigned char*)handle.d->raw;
+  }
   return NULL;
 }
 
+struct IMAGE_HANDLE image_rgba_ref ( struct IMAGE_HANDLE handle )
+{
+  struct IMAGE_HANDLE ref;
+  ref.d = malloc( sizeof( struct IMAGE_HANDLE_PRIVATE ) );
+  ref.d->pb = NULL;
+  ref.d->raw = NULL;
+  ref.d->raw_width = 0;
+  ref.d->raw_height = 0;
+
+  if ( handle.d != NULL ) {
+    if ( handle.d->pb != NULL )
+      ref.d->pb = g_object_ref( handle.d->pb );
+    ref.d->raw = handle.d->raw;
+    ref.d->raw_width = handle.d->raw_width;
+    ref.d->raw_height = handle.d->raw_height;
+  }
+
+  return ref;
+}
+
 void image_rgba_free ( struct IMAGE_HANDLE handle )
 {
   if ( handle.d ) {
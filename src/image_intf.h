@@ -4,6 +4,9 @@
 #ifndef IMAGE_INTF_H
 #define IMAGE_INTF_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 struct IMAGE_HANDLE {
   struct IMAGE_HANDLE_PRIVATE* d;
 };
@@ -18,6 +21,49 @@ struct IMAGE_HANDLE {
 struct IMAGE_HANDLE image_rgba_create ( const unsigned char* data,
 					size_t n_bytes );
 
+/*!
+ * Pre-decoded images (see asset_compiler) start with this header,
+ * followed immediately by width x height RGBA pixels with no padding.
+ */
+#define IMAGE_RAW_MAGIC "RGBA"
+struct IMAGE_RAW_HEADER {
+  char magic[4];
+  uint32_t width;
+  uint32_t height;
+};
+
+/*!
+ * Wrap a pre-decoded image. Nothing is decoded or copied (unless the
+ * pixels aren't 4 byte aligned, as OpenVG needs them to be), so the
+ * data must stay put for as long as the handle is in use.
+ * \param data pointer to the header and pixels.
+ * \param n_bytes number of bytes in the data.
+ * \return the image handle. If the data isn't a valid raw image, its
+ * width and height are 0.
+ */
+struct IMAGE_HANDLE image_rgba_raw ( const unsigned char* data,
+				     size_t n_bytes );
+
+/*!
+ * Make a resized copy of an image.
+ * \param handle the image.
+ * \param width the new width in pixels.
+ * \param height the new height in pixels.
+ * \return the new image (free it as usual). If the image is empty, so
+ * is the copy.
+ */
+struct IMAGE_HANDLE image_rgba_scale ( struct IMAGE_HANDLE handle,
+				       int width, int height );
+
+/*!
+ * Another handle on the same pixels, which nobody changes once the
+ * image is made. Cheap: nothing is copied. A wrapped raw image still
+ * depends on its data staying put.
+ * \param handle the image.
+ * \return the new handle (free it as usual).
+ */
+struct IMAGE_HANDLE image_rgba_ref ( struct IMAGE_HANDLE handle );
+
 /*!
  * Release any resources associated with the image.
  * \param handle the image to free.
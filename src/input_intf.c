@@ -0,0 +1,276 @@
+/*
+ * Touch input. All the events available are read at each wakeup; the
+ * ones between SYN_REPORTs are collected into a single touch state,
+ * and the recognizer only looks at those states.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <linux/input.h>
+
+#include "glib.h"
+
+#include "log_intf.h"
+#include "input_intf.h"
+
+// Events read per read(2).
+#define INPUT_EVENTS_MAX 64
+// A tap is shorter than this (us) ...
+static const gint64 TAP_TIME_MAX = 400000;
+// ... and moves less than this (fraction of the screen).
+static const float TAP_SLOP = 0.03f;
+// A swipe is at least this far horizontally ...
+static const float SWIPE_DISTANCE_MIN = 0.2f;
+// ... and quicker than this (us).
+static const gint64 SWIPE_TIME_MAX = 600000;
+
+/*!
+ * The state of the touch as of the last SYN_REPORT.
+ */
+struct TOUCH {
+  int x;
+  int y;
+  int touching;
+  gint64 time;
+};
+
+struct INPUT_PRIVATE {
+  int status;
+  struct LOG_HANDLE logger;
+  int fd;
+  GIOChannel* channel;
+  guint source;
+  INPUT_CALLBACK callback;
+  void* data;
+  // Ranges of the axes.
+  struct input_absinfo abs_x;
+  struct input_absinfo abs_y;
+  // Being accumulated until the next SYN_REPORT.
+  struct TOUCH pending;
+  // The kernel's buffer overflowed; ignore events until the next
+  // SYN_REPORT and then ask for the state directly.
+  int dropped;
+  // The last complete state.
+  struct TOUCH current;
+  // Where and when the touch went down.
+  struct TOUCH start;
+  // Has it moved far enough to be a drag?
+  int dragging;
+  // Has it moved since we last said so?
+  int drag_moved;
+};
+
+static float scale_axis ( const struct input_absinfo* info, int value )
+{
+  if ( info->maximum <= info->minimum )
+    return 0.f;
+  return (float)( value - info->minimum ) /
+    (float)( info->maximum - info->minimum );
+}
+
+static void emit ( struct INPUT_PRIVATE* d, enum INPUT_GESTURE_TYPE type )
+{
+  struct INPUT_GESTURE gesture;
+  gesture.type    = type;
+  gesture.start_x = scale_axis( &d->abs_x, d->start.x );
+  gesture.start_y = scale_axis( &d->abs_y, d->start.y );
+  gesture.x       = scale_axis( &d->abs_x, d->current.x );
+  gesture.y       = scale_axis( &d->abs_y, d->current.y );
+  d->callback( &gesture, d->data );
+}
+
+/*!
+ * A complete touch state has arrived. This is the recognizer.
+ */
+static void touch_frame ( struct INPUT_PRIVATE* d, const struct TOUCH* touch )
+{
+  int was_touching = d->current.touching;
+  d->current = *touch;
+
+  float dx = scale_axis( &d->abs_x, touch->x ) -
+    scale_axis( &d->abs_x, d->start.x );
+  float dy = scale_axis( &d->abs_y, touch->y ) -
+    scale_axis( &d->abs_y, d->start.y );
+
+  if ( touch->touching && ! was_touching ) {
+    d->start = *touch;
+    d->dragging = 0;
+    d->drag_moved = 0;
+  }
+  else if ( touch->touching ) {
+    if ( ! d->dragging && ( fabsf( dx ) > TAP_SLOP || fabsf( dy ) > TAP_SLOP ) )
+      d->dragging = 1;
+    if ( d->dragging )
+      d->drag_moved = 1;
+  }
+  else if ( was_touching ) {
+    gint64 duration = touch->time - d->start.time;
+    d->drag_moved = 0;
+    if ( ! d->dragging && duration < TAP_TIME_MAX )
+      emit( d, INPUT_GESTURE_TAP );
+    else if ( fabsf( dx ) > SWIPE_DISTANCE_MIN &&
+	      fabsf( dx ) > 2.f * fabsf( dy ) && duration < SWIPE_TIME_MAX )
+      emit( d, dx < 0 ? INPUT_GESTURE_SWIPE_LEFT : INPUT_GESTURE_SWIPE_RIGHT );
+    else if ( d->dragging )
+      emit( d, INPUT_GESTURE_DRAG_END );
+  }
+}
+
+/*!
+ * After SYN_DROPPED, the events we have are incomplete, so get the
+ * state straight from the device.
+ */
+static void resync ( struct INPUT_PRIVATE* d, struct TOUCH* touch )
+{
+  struct input_absinfo info;
+  if ( ioctl( d->fd, EVIOCGABS( ABS_X ), &info ) == 0 )
+    touch->x = info.value;
+  if ( ioctl( d->fd, EVIOCGABS( ABS_Y ), &info ) == 0 )
+    touch->y = info.value;
+  unsigned char keys[KEY_MAX / 8 + 1];
+  memset( keys, 0, sizeof keys );
+  if ( ioctl( d->fd, EVIOCGKEY( sizeof keys ), keys ) >= 0 )
+    touch->touching = ( keys[BTN_TOUCH / 8] >> ( BTN_TOUCH % 8 ) ) & 1;
+}
+
+static gboolean input_callback ( GIOChannel* gio, GIOCondition condition,
+				 gpointer data )
+{
+  (void)gio;
+  (void)condition;
+
+  struct INPUT_PRIVATE* d = data;
+  struct input_event events[INPUT_EVENTS_MAX];
+
+  for ( ;; ) {
+    ssize_t n_bytes = read( d->fd, events, sizeof events );
+    if ( n_bytes < 0 ) {
+      if ( errno == EINTR )
+	continue;
+      if ( errno != EAGAIN ) {
+	log_message_warn( d->logger, "Error reading input: %s",
+			  strerror( errno ) );
+	d->status = -1;
+	d->source = 0;
+	return FALSE;
+      }
+      break;
+    }
+    if ( n_bytes == 0 )
+      break;
+
+    int count = n_bytes / sizeof( struct input_event );
+    int e;
+    for ( e = 0; e < count; e++ ) {
+      const struct input_event* event = &events[e];
+      switch ( event->type ) {
+      case EV_ABS:
+	if ( event->code == ABS_X )
+	  d->pending.x = event->value;
+	else if ( event->code == ABS_Y )
+	  d->pending.y = event->value;
+	break;
+      case EV_KEY:
+	if ( event->code == BTN_TOUCH || event->code == BTN_LEFT )
+	  d->pending.touching = event->value != 0;
+	break;
+      case EV_SYN:
+	if ( event->code == SYN_DROPPED ) {
+	  d->dropped = 1;
+	}
+	else if ( event->code == SYN_REPORT ) {
+	  if ( d->dropped ) {
+	    resync( d, &d->pending );
+	    d->dropped = 0;
+	  }
+	  d->pending.time = (gint64)event->input_event_sec * G_USEC_PER_SEC +
+	    event->input_event_usec;
+	  touch_frame( d, &d->pending );
+	}
+	break;
+      default:
+	break;
+      }
+    }
+
+    if ( count < INPUT_EVENTS_MAX )
+      break;
+  }
+
+  // However much the finger moved in this batch, that's one drag.
+  if ( d->drag_moved ) {
+    d->drag_moved = 0;
+    emit( d, INPUT_GESTURE_DRAG );
+  }
+
+  return TRUE;
+}
+
+struct INPUT_HANDLE input_init ( const char* device, INPUT_CALLBACK callback,
+				 void* data, struct LOG_HANDLE logger )
+{
+  struct INPUT_HANDLE handle;
+  handle.d = malloc( sizeof( struct INPUT_PRIVATE ) );
+  memset( handle.d, 0, sizeof( struct INPUT_PRIVATE ) );
+  handle.d->logger   = logger;
+  handle.d->callback = callback;
+  handle.d->data     = data;
+
+  handle.d->fd = open( device, O_RDONLY | O_NONBLOCK | O_CLOEXEC );
+
+  if ( handle.d->fd < 0 ) {
+    log_message_warn( logger, "Could not open event file \"%s\": %s",
+		      device, strerror( errno ) );
+    handle.d->status = -1;
+    return handle;
+  }
+
+  if ( ioctl( handle.d->fd, EVIOCGABS( ABS_X ), &handle.d->abs_x ) < 0 ||
+       ioctl( handle.d->fd, EVIOCGABS( ABS_Y ), &handle.d->abs_y ) < 0 ) {
+    log_message_warn( logger, "\"%s\" doesn't look like a touch screen",
+		      device );
+    handle.d->status = -1;
+    return handle;
+  }
+
+  // Start from wherever the device is now.
+  resync( handle.d, &handle.d->pending );
+  handle.d->current = handle.d->pending;
+
+  handle.d->channel = g_io_channel_unix_new( handle.d->fd );
+  handle.d->source = g_io_add_watch( handle.d->channel, G_IO_IN,
+				     input_callback, handle.d );
+
+  if ( handle.d->source == 0 ) {
+    log_message_warn( logger, "Error creating watch on event" );
+    handle.d->status = -1;
+    return handle;
+  }
+
+  log_message_info( logger, "Opened event \"%s\"", device );
+
+  return handle;
+}
+
+int input_status ( struct INPUT_HANDLE handle )
+{
+  return handle.d->status;
+}
+
+void input_free ( struct INPUT_HANDLE handle )
+{
+  if ( handle.d != NULL ) {
+    if ( handle.d->source != 0 )
+      g_source_remove( handle.d->source );
+    if ( handle.d->channel != NULL )
+      g_io_channel_unref( handle.d->channel );
+    if ( handle.d->fd >= 0 )
+      close( handle.d->fd );
+    free( handle.d );
+  }
+}
@@ -0,0 +1,69 @@
+/*
+ * Touch screen (or mouse) input from an evdev device, boiled down to a
+ * few gestures.
+ */
+#ifndef INPUT_INTF_H
+#define INPUT_INTF_H
+
+struct INPUT_PRIVATE;
+struct LOG_HANDLE;
+
+struct INPUT_HANDLE {
+  struct INPUT_PRIVATE* d;
+};
+
+enum INPUT_GESTURE_TYPE {
+  //! A short touch which didn't move.
+  INPUT_GESTURE_TAP,
+  //! A quick horizontal flick.
+  INPUT_GESTURE_SWIPE_LEFT,
+  INPUT_GESTURE_SWIPE_RIGHT,
+  //! The finger is moving (at most one per batch of events).
+  INPUT_GESTURE_DRAG,
+  //! The finger was lifted after a drag.
+  INPUT_GESTURE_DRAG_END
+};
+
+/*!
+ * Positions are fractions of the screen: x from the left, y from the
+ * top.
+ */
+struct INPUT_GESTURE {
+  enum INPUT_GESTURE_TYPE type;
+  //! Where the touch started.
+  float start_x;
+  float start_y;
+  //! Where it is now (or ended).
+  float x;
+  float y;
+};
+
+/*!
+ * Called for each gesture.
+ * \param[in] gesture what happened.
+ * \param[in] data the user data given to input_init.
+ */
+typedef void (*INPUT_CALLBACK)( const struct INPUT_GESTURE* gesture,
+				void* data );
+
+/*!
+ * Open the device and add it to the default GLib main context.
+ * \param[in] device the evdev device (e.g. "/dev/input/event0").
+ * \param[in] callback called for each gesture.
+ * \param[in] data passed to the callback.
+ * \param[in] logger our logger.
+ * \return a handle to the input. Check it with input_status.
+ */
+struct INPUT_HANDLE input_init ( const char* device, INPUT_CALLBACK callback,
+				 void* data, struct LOG_HANDLE logger );
+/*!
+ * \param[in] handle the input.
+ * \return 0 if everything is ok, -1 otherwise.
+ */
+int input_status ( struct INPUT_HANDLE handle );
+/*!
+ * Close the device.
+ * \param[in] handle the input.
+ */
+void input_free ( struct INPUT_HANDLE handle );
+#endif
@@ -1,22 +1,206 @@
 /*
  * Do some more generalized logging than printf. This implementation
  * is based on log4c (at least for now).
+ *
+ * Writing a message can block (a slow serial console, a busy
+ * journal), so the threads which log only format the message into a
+ * ring; a thread of our own hands them to log4c. Messages below the
+ * category's priority aren't even formatted.
  */
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
+#include "glib.h"
 #include "log4c.h"
 
+#include "metrics.h"
+#include "trace.h"
 #include "log_intf.h"
 
+// Messages waiting to be written (a power of two). If the writer falls
+// this far behind, new messages are dropped rather than wait.
+#define LOG_RING_SIZE 256
+// Longest message (bytes, including the NUL); longer ones are cut.
+#define LOG_TEXT_MAX 256
+// The writer passes at most this many messages a second (after a
+// burst of LOG_BURST). Errors always get through.
+#define LOG_RATE 20
+#define LOG_BURST 50
+// The same message again within this long (us) is only counted.
+#define LOG_REPEAT_WINDOW ( 10 * G_USEC_PER_SEC )
+// log_flush gives the writer this long (us) to catch up.
+#define LOG_FLUSH_TIMEOUT ( G_USEC_PER_SEC / 10 )
+
+static struct METRIC dropped_metrics[] = {
+  METRIC_COUNTER_INIT( "mpddisplay_log_dropped_total",
+		       "Log messages not written.", "reason", "full" ),
+  METRIC_COUNTER_INIT( "mpddisplay_log_dropped_total",
+		       "Log messages not written.", "reason", "rate" ),
+  METRIC_COUNTER_INIT( "mpddisplay_log_dropped_total",
+		       "Log messages not written.", "reason", "repeated" ),
+};
+
+struct LOG_RECORD {
+  // The ring position this slot is ready for: equal to it when free
+  // for a logger, one more when the message is ready for the writer.
+  unsigned int sequence;
+  int priority;
+  char text[LOG_TEXT_MAX];
+};
+
 struct LOG_PRIVATE {
   log4c_category_t* category;
+  struct LOG_RECORD ring[LOG_RING_SIZE];
+  // Next position for a logger (any thread) to take...
+  unsigned int head __attribute__(( aligned( 64 ) ));
+  // ...and for the writer to write.
+  unsigned int tail __attribute__(( aligned( 64 ) ));
+  // Readable when there's something in the ring.
+  int wakeup;
+  // The writer (NULL if it couldn't start; then we write directly).
+  GThread* writer;
+  int stopping;
 };
 
+/*!
+ * Put a message in the ring. Any thread may call this.
+ */
+static void log_push ( struct LOG_PRIVATE* d, int priority,
+		       const char* format, va_list argp )
+{
+  unsigned int position = __atomic_load_n( &d->head, __ATOMIC_RELAXED );
+  struct LOG_RECORD* record;
+
+  for ( ;; ) {
+    record = &d->ring[position & ( LOG_RING_SIZE - 1 )];
+    unsigned int sequence = __atomic_load_n( &record->sequence,
+					     __ATOMIC_ACQUIRE );
+    int lag = (int)( sequence - position );
+    if ( lag == 0 ) {
+      // Free: try to take it (position is updated if someone beat us).
+      if ( __atomic_compare_exchange_n( &d->head, &position, position + 1,
+					1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED ) )
+	break;
+    }
+    else if ( lag < 0 ) {
+      // Still waiting to be written: the ring is full.
+      metric_add( &dropped_metrics[0], 1 );
+      return;
+    }
+    else {
+      position = __atomic_load_n( &d->head, __ATOMIC_RELAXED );
+    }
+  }
+
+  record->priority = priority;
+  vsnprintf( record->text, sizeof record->text, format, argp );
+  __atomic_store_n( &record->sequence, position + 1, __ATOMIC_RELEASE );
+
+  uint64_t one = 1;
+  (void)write( d->wakeup, &one, sizeof one );
+}
+
+static gpointer log_writer ( gpointer data )
+{
+  struct LOG_PRIVATE* d = data;
+  // Rate limit: tokens, and when they were last topped up.
+  double tokens = LOG_BURST;
+  gint64 filled = g_get_monotonic_time();
+  unsigned int rate_dropped = 0;
+  // The last message written, and how often it has come round since.
+  // The text, not the format: the same format about another server
+  // (say) is another message.
+  char last_text[LOG_TEXT_MAX] = "";
+  int last_priority = 0;
+  gint64 last_written = 0;
+  unsigned int repeats = 0;
+
+  trace_thread_name( "log" );
+
+  while ( 1 ) {
+    struct LOG_RECORD* record = &d->ring[d->tail & ( LOG_RING_SIZE - 1 )];
+    unsigned int sequence = __atomic_load_n( &record->sequence,
+					     __ATOMIC_ACQUIRE );
+    if ( sequence != d->tail + 1 ) {
+      // Nothing ready. Loggers finish what they start, so stopping
+      // only once the ring is empty loses nothing already logged.
+      if ( __atomic_load_n( &d->stopping, __ATOMIC_ACQUIRE ) )
+	break;
+      struct pollfd wait = { d->wakeup, POLLIN, 0 };
+      (void)poll( &wait, 1, -1 );
+      uint64_t count;
+      (void)read( d->wakeup, &count, sizeof count );
+      continue;
+    }
+
+    gint64 now = g_get_monotonic_time();
+    tokens += ( now - filled ) * (double)LOG_RATE / G_USEC_PER_SEC;
+    if ( tokens > LOG_BURST )
+      tokens = LOG_BURST;
+    filled = now;
+
+    if ( strcmp( record->text, last_text ) == 0 &&
+	 record->priority == last_priority &&
+	 now - last_written < LOG_REPEAT_WINDOW ) {
+      repeats++;
+      metric_add( &dropped_metrics[2], 1 );
+    }
+    else if ( tokens < 1. && record->priority > LOG4C_PRIORITY_ERROR ) {
+      rate_dropped++;
+      metric_add( &dropped_metrics[1], 1 );
+    }
+    else {
+      if ( repeats > 0 )
+	log4c_category_log( d->category, last_priority,
+			    "(last message repeated %u more times)", repeats );
+      if ( rate_dropped > 0 )
+	log4c_category_log( d->category, LOG4C_PRIORITY_WARN,
+			    "(%u messages dropped: too many)", rate_dropped );
+      log4c_category_log( d->category, record->priority, "%s",
+			  record->text );
+      tokens -= 1.;
+      memcpy( last_text, record->text, sizeof last_text );
+      last_priority = record->priority;
+      last_written = now;
+      repeats = 0;
+      rate_dropped = 0;
+    }
+
+    // Free the slot for the lap after this one.
+    __atomic_store_n( &record->sequence, d->tail + LOG_RING_SIZE,
+		      __ATOMIC_RELEASE );
+    __atomic_store_n( &d->tail, d->tail + 1, __ATOMIC_RELEASE );
+  }
+
+  if ( repeats > 0 )
+    log4c_category_log( d->category, last_priority,
+			"(last message repeated %u more times)", repeats );
+  if ( rate_dropped > 0 )
+    log4c_category_log( d->category, LOG4C_PRIORITY_WARN,
+			"(%u messages dropped: too many)", rate_dropped );
+
+  return NULL;
+}
+
 struct LOG_HANDLE log_init ( void )
 {
   struct LOG_HANDLE handle;
 
   handle.d = malloc( sizeof( struct LOG_PRIVATE ) );
+  handle.d->category = NULL;
+  handle.d->head = 0;
+  handle.d->tail = 0;
+  handle.d->writer = NULL;
+  handle.d->stopping = 0;
+  unsigned int r;
+  for ( r = 0; r < LOG_RING_SIZE; r++ )
+    handle.d->ring[r].sequence = r;
 
   if ( log4c_init() ) {
   }
@@ -24,41 +208,77 @@ struct LOG_HANDLE log_init ( void )
     handle.d->category = log4c_category_get( "mpddisplay" );
   }
 
+  int m;
+  for ( m = 0; m < 3; m++ )
+    metrics_register( &dropped_metrics[m] );
+
+  handle.d->wakeup = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  if ( handle.d->wakeup >= 0 )
+    handle.d->writer = g_thread_new( "log", log_writer, handle.d );
+
   return handle;
 }
 
-int log_message_info ( struct LOG_HANDLE handle, const char* message, ... )
+/*!
+ * The common part of the log_message_* functions.
+ */
+static int log_message ( struct LOG_HANDLE handle, int priority,
+			 const char* message, va_list argp )
 {
-  if ( handle.d != NULL ) {
-    va_list argp;
-    va_start( argp, message );
-    log4c_category_vlog( handle.d->category, LOG4C_PRIORITY_INFO, message,
-			 argp );
-    va_end( argp );
-  }
+  if ( handle.d == NULL || handle.d->category == NULL )
+    return 0;
+
+  // Don't even format what nobody will see.
+  if ( ! log4c_category_is_priority_enabled( handle.d->category, priority ) )
+    return 0;
+
+  if ( handle.d->writer != NULL )
+    log_push( handle.d, priority, message, argp );
+  else
+    log4c_category_vlog( handle.d->category, priority, message, argp );
+
   return 0;
 }
 
+int log_message_info ( struct LOG_HANDLE handle, const char* message, ... )
+{
+  va_list argp;
+  va_start( argp, message );
+  int status = log_message( handle, LOG4C_PRIORITY_INFO, message, argp );
+  va_end( argp );
+  return status;
+}
+
 int log_message_warn ( struct LOG_HANDLE handle, const char* message, ... )
 {
-  if ( handle.d != NULL ) {
-    va_list argp;
-    va_start( argp, message );
-    log4c_category_vlog( handle.d->category, LOG4C_PRIORITY_WARN, message,
-			 argp );
-    va_end( argp );
-  }
-  return 0;
+  va_list argp;
+  va_start( argp, message );
+  int status = log_message( handle, LOG4C_PRIORITY_WARN, message, argp );
+  va_end( argp );
+  return status;
 }
 
 int log_message_error ( struct LOG_HANDLE handle, const char* message, ... )
 {
-  if ( handle.d != NULL ) {
-    va_list argp;
-    va_start( argp, message );
-    log4c_category_vlog( handle.d->category, LOG4C_PRIORITY_ERROR, message,
-			 argp );
-    va_end( argp );
+  va_list argp;
+  va_start( argp, message );
+  int status = log_message( handle, LOG4C_PRIORITY_ERROR, message, argp );
+  va_end( argp );
+  return status;
+}
+
+int log_flush ( struct LOG_HANDLE handle )
+{
+  if ( handle.d == NULL || handle.d->writer == NULL )
+    return 0;
+  // Only what is already in the ring; new messages could keep us here.
+  unsigned int target = __atomic_load_n( &handle.d->head, __ATOMIC_ACQUIRE );
+  gint64 deadline = g_get_monotonic_time() + LOG_FLUSH_TIMEOUT;
+  while ( (int)( target - __atomic_load_n( &handle.d->tail,
+					     __ATOMIC_ACQUIRE ) ) > 0 ) {
+    if ( g_get_monotonic_time() > deadline )
+      return -1;
+    g_usleep( 1000 );
   }
   return 0;
 }
@@ -66,6 +286,15 @@ int log_message_error ( struct LOG_HANDLE handle, const char* message, ... )
 int log_close ( struct LOG_HANDLE handle )
 {
   if ( handle.d != NULL ) {
+    // Write out whatever is left first.
+    if ( handle.d->writer != NULL ) {
+      __atomic_store_n( &handle.d->stopping, 1, __ATOMIC_RELEASE );
+      uint64_t one = 1;
+      (void)write( handle.d->wakeup, &one, sizeof one );
+      g_thread_join( handle.d->writer );
+    }
+    if ( handle.d->wakeup >= 0 )
+      close( handle.d->wakeup );
     if ( log4c_fini() ) {
     }
     free( handle.d );
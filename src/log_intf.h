@@ -1,6 +1,11 @@
 /*
  * Try to wrap a logging library. The presence of convenient stdarg
  * functions makes this a little tricky.
+ *
+ * Any thread may log. The log_message_* functions don't wait for the
+ * message to be written: a thread started by log_init does that. If
+ * it falls behind, messages are dropped rather than stall the caller,
+ * and the same message over and over is written once with a count.
  */
 #ifndef LOG_INTF_H
 #define LOG_INTF_H
@@ -38,7 +43,13 @@ int log_message_warn ( struct LOG_HANDLE handle, const char* message, ... );
  */
 int log_message_error ( struct LOG_HANDLE handle, const char* message, ... );
 /*!
- * Close the logs.
+ * Wait (a little) for the messages logged so far to be written.
+ * \param[in] handle the log object.
+ * \return 0 if they were, -1 if the writer didn't catch up in time.
+ */
+int log_flush ( struct LOG_HANDLE handle );
+/*!
+ * Write out any waiting messages and close the logs.
  * \param[in] handle the log object.
  * \return 0 if everything went ok, -1 otherwise.
  */
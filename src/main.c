@@ -7,67 +7,193 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <getopt.h>
+#include <signal.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
-#include <linux/input.h>
-
 #include "glib.h"
+#include "glib-unix.h"
 
 #include "mpd_intf.h"
 #include "display_intf.h"
 #include "log_intf.h"
 #include "cover_image.h"
+#include "button_intf.h"
+#include "input_intf.h"
+#include "control_intf.h"
+#include "metrics.h"
+#include "trace.h"
+#include "recorder.h"
+#include "spsc_queue.h"
+#include "now_playing.h"
+#include "relay.h"
+
+// States on their way from the poller. The display takes at most this
+// many at a time, and only draws the newest for each server, so a
+// poller with lots to say can't keep the touch screen (or anything
+// else in the main loop) waiting.
+#define STATES_CAPACITY 16
 
 static int convert_int ( const char* string );
 
-static gboolean poll_mpd ( gpointer data );
-static gboolean reconnect_mpd ( gpointer data );
-
-static void add_pibrella_button10 ( gpointer data );
-static void add_pibrella_button11 ( gpointer data );
-static void add_event ( gpointer data );
-static gboolean play_pause_button_callback ( GIOChannel* gio,
-					     GIOCondition condition,
-					     gpointer data );
-
-const char* USAGE = "usage: %s [--host hostname] [--port port#] [--database databse]\n";
+static gboolean states_ready ( gint fd, GIOCondition condition,
+			       gpointer data );
+static gboolean covers_ready ( gint fd, GIOCondition condition,
+			       gpointer data );
+static gboolean relay_ready ( gint fd, GIOCondition condition,
+			      gpointer data );
+static gboolean attach_relay ( gpointer data );
+static gboolean quit ( gpointer data );
+static gboolean animate ( gpointer data );
+struct MAIN_DATA;
+static void control_mpd ( struct MAIN_DATA* main_data,
+			  enum RELAY_COMMAND command, int value );
+static int serve ( const char* path, const char* host, int port,
+		   const char* database );
+static void check_animation ( struct MAIN_DATA* main_data );
+
+static void button_pressed ( unsigned int offset, uint64_t timestamp_ns,
+			     void* data );
+static void gesture ( const struct INPUT_GESTURE* gesture, void* data );
+static int control_command ( const char* command, const char* arguments,
+			     GString* reply, void* data );
+static gboolean dump_trace ( gpointer data );
+
+const char* USAGE = "usage: %s [--host hostname[:port#] ...] [--port port#]\n"
+  "  [--database databse]\n"
+  "  [--gpio-chip device] [--play-pin line] [--exit-pin line] [--debounce ms]\n"
+  "  [--control-socket path] [--trace] [--startup-profile]\n"
+  "  [--record path]\n"
+  "  [--serve path | --attach path]\n";
 
 struct MAIN_DATA {
   struct DISPLAY_HANDLE display;
-  struct MPD_HANDLE mpd;
+  // One for each --host, all polled by the one poller thread.
+  struct MPD_HANDLE mpds[MPD_SERVERS_MAX];
+  int servers;
+  // Where buttons and commands go: the server last touched on the
+  // screen (or picked with the "server" command).
+  int selected;
   struct LOG_HANDLE logger;
   struct IMAGE_DB_HANDLE image_db;
-  GIOChannel* play_button;
-  uint play_source;
+  struct BUTTON_HANDLE buttons;
+  struct INPUT_HANDLE input;
+  struct CONTROL_HANDLE control;
+  // New states from the MPD polling thread, and the latest one from
+  // each server (NULL until the first arrives).
+  struct SPSC_QUEUE_HANDLE states;
+  struct MPD_STATE* state[MPD_SERVERS_MAX];
+  // The state again, for other programs.
+  struct NOW_PLAYING_HANDLE now_playing;
+  // With --serve, the renderers; with --attach, the daemon.
+  struct RELAY_HANDLE relay;
+  bool serving;
+  bool attached;
+  const char* relay_path;
+  // GPIO lines of the buttons (-1 if not connected).
+  int play_pin;
+  int exit_pin;
+  uint animation_source;
+  // Where SIGUSR1 writes the trace.
+  gchar* trace_path;
+  // How long it took from exec to the first frame (us).
+  gint64 first_frame;
   GMainLoop* loop;
 } main_data;
 
+/*!
+ * When the kernel started us, on the monotonic clock, so that the time
+ * to the first frame includes loading the libraries. Now, if that
+ * can't be found out.
+ */
+static gint64 process_start_time ( void )
+{
+  gint64 now = g_get_monotonic_time();
+  gchar* stat = NULL;
+  if ( ! g_file_get_contents( "/proc/self/stat", &stat, NULL, NULL ) )
+    return now;
+
+  // The start time (clock ticks since boot) is the 22nd field. The
+  // command in the 2nd may have spaces in it, so count from its end.
+  const char* field = strrchr( stat, ')' );
+  int f;
+  for ( f = 2; field != NULL && f < 22; f++ )
+    field = strchr( field + 1, ' ' );
+  unsigned long long ticks;
+  int found = field != NULL && sscanf( field, " %llu", &ticks ) == 1;
+  g_free( stat );
+
+  struct timespec boot;
+  if ( ! found || clock_gettime( CLOCK_BOOTTIME, &boot ) < 0 )
+    return now;
+  gint64 age = (gint64)boot.tv_sec * G_USEC_PER_SEC + boot.tv_nsec / 1000 -
+    (gint64)( ticks * G_USEC_PER_SEC / sysconf( _SC_CLK_TCK ) );
+  // It's rounded down to a tick (10 ms), so this errs on the long side.
+  // Anything much longer and something is odd about the clocks.
+  if ( age < 0 || age > 10 * G_USEC_PER_SEC )
+    return now;
+  return now - age;
+}
+
 int main ( int argc, char* argv[] )
 {
   // We have to be told where MPD is running.
   char* host = "guanaco"; // Well, that's mine. Maybe this should be localhost.
   int   port = 6600;      // The standard MPD port.
+  // Or several of them (one per zone), each with its own port if
+  // given as host:port.
+  char* hosts[MPD_SERVERS_MAX];
+  int ports[MPD_SERVERS_MAX];
+  int host_count = 0;
   // Default database.
   char* database = "album_art.sqlite3";
+  // The buttons on the Pibrella.
+  char* gpio_chip = "/dev/gpiochip0";
+  int play_pin = 11;
+  int exit_pin = 10;
+  int debounce_ms = 20;
+  // Default is in the runtime directory (see below).
+  char* control_socket = NULL;
+  // Be a daemon for other screens, or one of those screens.
+  char* serve_path = NULL;
+  char* attach_path = NULL;
+  // Print how long each part of starting up took?
+  bool startup_profile = false;
+  bool trace = false;
+  // Keep a flight recording here.
+  char* record_path = NULL;
 
   bool bad_argument = false;
   int c;
+  gint64 start_time = process_start_time();
 
   // Start the logger.
   main_data.logger = log_init();
 
+  trace_thread_name( "main" );
+
   while ( 1 ) {
     int option_index = 0;
     static struct option long_options[] = {
       { "host", required_argument, 0, 'h' },
       { "port", required_argument, 0, 'p' },
       { "database", required_argument, 0, 'd' },
+      { "gpio-chip", required_argument, 0, 'g' },
+      { "play-pin", required_argument, 0, 'P' },
+      { "exit-pin", required_argument, 0, 'X' },
+      { "debounce", required_argument, 0, 'b' },
+      { "control-socket", required_argument, 0, 's' },
+      { "trace", no_argument, 0, 't' },
+      { "startup-profile", no_argument, 0, 'S' },
+      { "serve", required_argument, 0, 'D' },
+      { "attach", required_argument, 0, 'A' },
+      { "record", required_argument, 0, 'R' },
       { 0,      0,                 0, 0 }
     };
 
-    c = getopt_long( argc, argv, "h:p:d:", long_options, &option_index );
+    c = getopt_long( argc, argv, "h:p:d:g:P:X:b:s:tSD:A:R:", long_options,
+		     &option_index );
 
     if ( c == -1 ) {
       break;
@@ -79,7 +205,12 @@ int main ( int argc, char* argv[] )
 	bad_argument = true;
 	printf( "--host argument must be non-empty\n" );
       }
-      host = optarg;
+      if ( host_count == MPD_SERVERS_MAX ) {
+	bad_argument = true;
+	printf( "at most %d --host arguments\n", MPD_SERVERS_MAX );
+	break;
+      }
+      hosts[host_count++] = optarg;
       break;
     case 'p':
 #if 0
@@ -118,53 +249,222 @@ int main ( int argc, char* argv[] )
       }
       database = optarg;
       break;
+    case 'g':
+      if ( *optarg == '\0' ) {
+	bad_argument = true;
+	printf( "--gpio-chip argument must be non-empty\n" );
+      }
+      gpio_chip = optarg;
+      break;
+    case 'P':
+    case 'X':
+      {
+	// -1 means there is no such button.
+	int pin = convert_int( optarg );
+	if ( errno != 0 || pin < -1 ) {
+	  bad_argument = true;
+	  printf( "--%s argument was not a valid line: '%s'\n",
+		  c == 'P' ? "play-pin" : "exit-pin", optarg );
+	}
+	if ( c == 'P' )
+	  play_pin = pin;
+	else
+	  exit_pin = pin;
+      }
+      break;
+    case 'b':
+      debounce_ms = convert_int( optarg );
+      if ( errno != 0 || debounce_ms < 0 ) {
+	bad_argument = true;
+	printf( "--debounce argument was not a valid time: '%s'\n", optarg );
+      }
+      break;
+    case 's':
+      control_socket = optarg;
+      break;
+    case 't':
+      trace = true;
+      trace_enable( 1 );
+      break;
+    case 'S':
+      startup_profile = true;
+      trace_enable( 1 );
+      break;
+    case 'D':
+      serve_path = optarg;
+      break;
+    case 'A':
+      attach_path = optarg;
+      break;
+    case 'R':
+      record_path = optarg;
+      break;
     default:
       bad_argument = true;
       printf( "?? getopt returned character code 0%o ??\n", c );
     }
   }
+  if ( serve_path != NULL && attach_path != NULL ) {
+    bad_argument = true;
+    printf( "--serve and --attach don't go together\n" );
+  }
+  if ( host_count == 0 )
+    hosts[host_count++] = host;
+  if ( host_count > 1 && ( serve_path != NULL || attach_path != NULL ) ) {
+    bad_argument = true;
+    printf( "--serve and --attach only work with one --host\n" );
+  }
+  int h;
+  for ( h = 0; h < host_count; h++ ) {
+    // Only one colon, so not an IPv6 address.
+    char* colon = strchr( hosts[h], ':' );
+    ports[h] = port;
+    if ( colon != NULL && strrchr( hosts[h], ':' ) == colon ) {
+      ports[h] = convert_int( colon + 1 );
+      if ( errno != 0 || ports[h] <= 0 ) {
+	bad_argument = true;
+	printf( "--host port was not a valid port: '%s'\n", colon + 1 );
+      }
+      *colon = '\0';
+    }
+  }
   if ( bad_argument ) {
     printf( USAGE, argv[0] );
     return 1;
   }
 
-  log_message_info( main_data.logger, "MPD host: '%s'", host );
-  log_message_info( main_data.logger, "MPD port: '%d'", port );
-  log_message_info( main_data.logger, "Database: '%s'", database );
+  // Before any threads are started which might record.
+  if ( record_path != NULL && recorder_open( record_path ) < 0 ) {
+    if ( errno == EWOULDBLOCK )
+      log_message_warn( main_data.logger, "Not recording: another "
+			"mpddisplay is already recording to '%s'",
+			record_path );
+    else
+      log_message_warn( main_data.logger, "Could not record to '%s': %s",
+			record_path, strerror( errno ) );
+  }
 
-  main_data.mpd = mpd_create( host, port, main_data.logger );
+  if ( serve_path != NULL )
+    return serve( serve_path, hosts[0], ports[0], database );
 
-  if ( mpd_status( main_data.mpd ) < 0 ) {
-    printf( USAGE, argv[0] );
-    return 1;
+  for ( h = 0; h < host_count; h++ ) {
+    log_message_info( main_data.logger, "MPD host: '%s'", hosts[h] );
+    log_message_info( main_data.logger, "MPD port: '%d'", ports[h] );
   }
+  log_message_info( main_data.logger, "Database: '%s'", database );
 
-  // Try to open the image database connection.
-
-  main_data.image_db = image_db_create( database, main_data.logger );
+  // A renderer gets everything from the daemon. Otherwise, try to open
+  // the image database connection.
+
+  main_data.attached = attach_path != NULL;
+  if ( ! main_data.attached )
+    main_data.image_db = image_db_create( database, main_data.logger );
+
+  // Connecting to MPD can take a while (more so if the name has to be
+  // looked up, or a server is down), so the poller does it, while the
+  // display comes up and then while the main loop runs. Each server's
+  // state turns up when it answers.
+
+  main_data.servers = host_count;
+  if ( ! main_data.attached ) {
+    for ( h = 0; h < host_count; h++ )
+      main_data.mpds[h] = mpd_new( hosts[h], ports[h], main_data.logger );
+    main_data.states = spsc_queue_create( STATES_CAPACITY );
+    if ( spsc_queue_status( main_data.states ) < 0 ||
+	 mpd_poller_start( main_data.mpds, main_data.servers,
+			   main_data.states ) < 0 ) {
+      log_message_error( main_data.logger, "Could not start polling MPD" );
+      return 1;
+    }
+  }
 
-  // If we get this far, we can try to initialize the graphics.
+  // The display comes first: it can put up what we showed last time
+  // while we wait for MPD.
 
-  main_data.display = display_init( main_data.image_db, main_data.mpd );
+  gint64 span = trace_begin();
+  main_data.display = display_init( main_data.image_db,
+				    (const char* const*)hosts,
+				    main_data.servers, main_data.logger );
+  trace_end( "display init", span );
 
   if ( display_status( main_data.display ) < 0 ) {
     return 1;
   }
 
-  // Well, after all that, we can now start polling MPD to see what's up.
+  main_data.first_frame = g_get_monotonic_time() - start_time;
+  log_message_info( main_data.logger, "First frame %lld ms after exec",
+		    (long long)main_data.first_frame / 1000 );
+
+  if ( startup_profile ) {
+    GString* profile = g_string_new( NULL );
+    trace_report( profile, start_time );
+    printf( "Startup (ready after %.1f ms):\n%s",
+	    ( g_get_monotonic_time() - start_time ) / 1000., profile->str );
+    g_string_free( profile, TRUE );
+    if ( ! trace )
+      trace_enable( 0 );
+  }
 
   main_data.loop = g_main_loop_new( NULL, FALSE );
 
-  // Poll MPD periodically.
-  (void)g_timeout_add_seconds( 1, poll_mpd, &main_data );
+  if ( main_data.attached ) {
+    // The daemon may not be up yet; keep showing the snapshot and try
+    // again.
+    main_data.relay_path = attach_path;
+    if ( attach_relay( &main_data ) )
+      (void)g_timeout_add_seconds( 3, attach_relay, &main_data );
+  }
+  else {
+    main_data.now_playing = now_playing_create();
+    if ( now_playing_status( main_data.now_playing ) < 0 ) {
+      log_message_warn( main_data.logger,
+			"Not publishing the MPD state in shared memory" );
+    }
+
+    // The poller has been at it since before the display came up; we
+    // just take the results.
+    (void)g_unix_fd_add( spsc_queue_fd( main_data.states ), G_IO_IN,
+			 states_ready, &main_data );
+  }
 
-  // Also try to poll the buttons on the Pibrella (if it is configured
-  // properly).
-  add_pibrella_button10( &main_data );
-  add_pibrella_button11( &main_data );
+  // Also watch the buttons on the Pibrella (if there is one).
+  main_data.play_pin = play_pin;
+  main_data.exit_pin = exit_pin;
+  unsigned int pins[2];
+  int pins_count = 0;
+  if ( play_pin >= 0 )
+    pins[pins_count++] = play_pin;
+  if ( exit_pin >= 0 )
+    pins[pins_count++] = exit_pin;
+
+  main_data.buttons = button_init( gpio_chip, pins, pins_count,
+				   debounce_ms * 1000UL,
+				   button_pressed, &main_data,
+				   main_data.logger );
+  if ( button_status( main_data.buttons ) < 0 ) {
+    log_message_warn( main_data.logger,
+		      "Continuing without buttons" );
+  }
+
+  // Local control (an empty path turns it off).
+  gchar* default_socket = g_build_filename( g_get_user_runtime_dir(),
+					    "mpddisplay.sock", NULL );
+  if ( control_socket == NULL )
+    control_socket = default_socket;
+  if ( *control_socket != '\0' )
+    main_data.control = control_init( control_socket, control_command,
+				      &main_data, main_data.logger );
+  else
+    main_data.control.d = NULL;
+
+  // Dump the trace spans on demand (see also the "trace" command).
+  main_data.trace_path = g_build_filename( g_get_user_runtime_dir(),
+					   "mpddisplay-trace.json", NULL );
+  (void)g_unix_signal_add( SIGUSR1, dump_trace, &main_data );
 
   // Mouse or touch screen events.
-  add_event( &main_data );
+  main_data.input = input_init( "/dev/input/event0", gesture, &main_data,
+				main_data.logger );
 
   g_main_loop_run( main_data.loop );
 
@@ -172,10 +472,40 @@ int main ( int argc, char* argv[] )
 
   g_main_loop_unref( main_data.loop );
 
+  button_free( main_data.buttons );
+  input_free( main_data.input );
+  control_free( main_data.control );
+  g_free( default_socket );
+  g_free( main_data.trace_path );
+
+  // Nothing more from the poller (or the daemon) once the display has
+  // gone.
+  mpd_poller_stop( main_data.mpds[0] );
+  if ( main_data.states.d != NULL ) {
+    struct MPD_STATE* state;
+    while ( ( state = spsc_queue_pop( main_data.states ) ) != NULL )
+      mpd_state_free( state );
+    spsc_queue_free( main_data.states );
+  }
+  relay_free( main_data.relay );
+  for ( h = 0; h < main_data.servers; h++ )
+    mpd_state_free( main_data.state[h] );
+  now_playing_free( main_data.now_playing );
+
   display_close( main_data.display );
 
-  mpd_free( main_data.mpd );
+  for ( h = 0; h < main_data.servers; h++ ) {
+    struct MPD_CONTROL_STATS control = mpd_control_stats( main_data.mpds[h] );
+    log_message_info( main_data.logger,
+		      "MPD control (%s): %u batches, %u failures, %u dropped; "
+		      "latency mean %lld us, max %lld us", hosts[h],
+		      control.batches, control.failures, control.dropped,
+		      control.mean_latency, control.max_latency );
 
+    mpd_free( main_data.mpds[h] );
+  }
+
+  recorder_close();
   log_close( main_data.logger );
 
   return 0;
@@ -201,374 +531,615 @@ static int convert_int ( const char* string )
   return value;
 }
 
-gboolean reconnect_mpd ( gpointer data )
+/*!
+ * A new state, from the poller or the daemon. Show it (or, as the
+ * daemon, pass it on) and keep it.
+ */
+static void take_state ( struct MAIN_DATA* main_data, struct MPD_STATE* state )
 {
-  struct MAIN_DATA* main_data = data;
-  int status;
-  log_message_warn( main_data->logger, "Reconnecting to MPD again!" );
+  if ( state->server < 0 || state->server >= MAX( main_data->servers, 1 ) ) {
+    mpd_state_free( state );
+    return;
+  }
+  struct MPD_STATE** latest = &main_data->state[state->server];
 
-  status = mpd_reconnect( main_data->mpd );
+  recorder_event( RECORDER_STATE, state->server,
+		  state->play_status | ( state->changed & 0xff ) << 8,
+		  state->times.elapsed );
 
-  if ( status < 0 ) {
-    log_message_error( main_data->logger, "Reconnection failed" );
-    return TRUE;
+  if ( main_data->serving ) {
+    relay_send_state( main_data->relay, state );
+    if ( *latest == NULL || ( state->changed & MPD_CHANGED_ALBUM ) )
+      (void)image_db_request( main_data->image_db, 0, state->artist,
+			      state->album );
   }
-  (void)g_timeout_add_seconds( 1, poll_mpd, data );
-  return FALSE;
+  else {
+    gint64 span = trace_begin();
+    display_update( main_data->display, state );
+    // \bug maybe check for error...
+    check_animation( main_data );
+    trace_end( "update", span );
+  }
+
+  // The shared memory only has room for the first server.
+  if ( state->server == 0 )
+    now_playing_publish( main_data->now_playing, state );
+
+  mpd_state_free( *latest );
+  *latest = state;
 }
 
-gboolean poll_mpd ( gpointer data )
+gboolean states_ready ( gint fd, GIOCondition condition, gpointer data )
 {
-  struct MAIN_DATA* main_data = data;
-
-  int status = mpd_poll( main_data->mpd );
+  (void)fd;
+  (void)condition;
 
-  if ( status != 0 ) {
-    log_message_warn( main_data->logger,
-		      "We lost our connection to MPD. Trying again shortly." );
-    (void)g_timeout_add_seconds( 3, reconnect_mpd, data );
-    return FALSE;
+  struct MAIN_DATA* main_data = data;
+  struct MPD_STATE* newest[MPD_SERVERS_MAX] = { NULL };
+  struct MPD_STATE* state;
+  int n;
+
+  // Anything left over keeps the descriptor readable.
+  for ( n = 0; n < STATES_CAPACITY &&
+	  ( state = spsc_queue_pop( main_data->states ) ) != NULL; n++ ) {
+    if ( state->server < 0 || state->server >= MPD_SERVERS_MAX ) {
+      mpd_state_free( state );
+      continue;
+    }
+    // Only the newest is drawn, but it has to own up to what changed
+    // in the ones before it.
+    struct MPD_STATE** older = &newest[state->server];
+    if ( *older != NULL ) {
+      state->changed |= (*older)->changed;
+      mpd_state_free( *older );
+    }
+    *older = state;
   }
 
-  if ( mpd_changed( main_data->mpd, MPD_CHANGED_ANY ) ) {
-    display_update( main_data->display );
-    // \bug maybe check for error...
+  int s;
+  for ( s = 0; s < MPD_SERVERS_MAX; s++ ) {
+    if ( newest[s] != NULL )
+      take_state( main_data, newest[s] );
   }
 
   return TRUE;
 }
 
-gboolean debounce ( gpointer data )
+/*!
+ * The daemon's covers are passed straight on to the renderers.
+ */
+gboolean covers_ready ( gint fd, GIOCondition condition, gpointer data )
 {
-  // Toggle the play back. Note: This is a bit sloppy; we should
-  // probably test that the button is still down.
-  struct MPD_HANDLE mpd = ((struct MAIN_DATA*)data)->mpd;
-  mpd_play_pause( mpd );
+  (void)fd;
+  (void)condition;
 
-  // Re-add button to the main loop.
-  GIOChannel* button = ((struct MAIN_DATA*)data)->play_button;
-  uint source = g_io_add_watch( button, G_IO_PRI, play_pause_button_callback, data );
-  ((struct MAIN_DATA*)data)->play_source = source;
+  struct MAIN_DATA* main_data = data;
+  struct COVER_RESULT* cover;
 
-  // Don't call this again.
-  return FALSE;
+  while ( ( cover = image_db_result( main_data->image_db ) ) != NULL ) {
+    relay_send_cover( main_data->relay, cover );
+    cover_result_free( cover );
+  }
+
+  return TRUE;
 }
 
-gboolean play_pause_button_callback ( GIOChannel* gio,
-				      GIOCondition condition,
-				      gpointer data )
+/*!
+ * Try to attach to the daemon.
+ * \return TRUE to try again later.
+ */
+gboolean attach_relay ( gpointer data )
 {
-  // Don't bother with anything if it's not the interrupt.
-  if ( condition != G_IO_PRI ) {
+  struct MAIN_DATA* main_data = data;
+
+  main_data->relay = relay_attach( main_data->relay_path, main_data->logger );
+  if ( relay_status( main_data->relay ) < 0 ) {
+    relay_free( main_data->relay );
+    main_data->relay.d = NULL;
     return TRUE;
   }
 
-  struct LOG_HANDLE logger = ((struct MAIN_DATA*)data)->logger;
-  GIOStatus status;
-  gchar byte;
-  gsize bytes_read;
-  GError* error = NULL;
+  log_message_info( main_data->logger, "Attached to %s",
+		    main_data->relay_path );
+  (void)g_unix_fd_add( relay_fd( main_data->relay ),
+		       G_IO_IN | G_IO_HUP | G_IO_ERR, relay_ready, main_data );
+  return FALSE;
+}
 
-  status = g_io_channel_seek_position( gio, 0, G_SEEK_SET, &error );
+/*!
+ * Something from the daemon.
+ */
+gboolean relay_ready ( gint fd, GIOCondition condition, gpointer data )
+{
+  (void)fd;
+  (void)condition;
 
-  if ( status == G_IO_STATUS_ERROR ) {
-    log_message_warn( logger, "Error seeking button: %s", error->message );
+  struct MAIN_DATA* main_data = data;
 
-    g_error_free( error );
-    return TRUE;
+  for ( ;; ) {
+    struct MPD_STATE* state;
+    struct COVER_RESULT* cover;
+    int received = relay_receive( main_data->relay, &state, &cover );
+    if ( received == 0 )
+      return TRUE;
+    if ( received < 0 ) {
+      // Keep showing what we have until the daemon comes back.
+      log_message_warn( main_data->logger, "Lost the daemon. Reattaching." );
+      relay_free( main_data->relay );
+      main_data->relay.d = NULL;
+      (void)g_timeout_add_seconds( 3, attach_relay, main_data );
+      return FALSE;
+    }
+    if ( state != NULL )
+      take_state( main_data, state );
+    if ( cover != NULL ) {
+      display_cover( main_data->display, cover );
+      cover_result_free( cover );
+    }
   }
+}
 
-  error = NULL;
-  // OK. But the button really needs to be debounced...
-  status = g_io_channel_read_chars( gio, &byte, 1, &bytes_read, &error );
-
-  if ( status == G_IO_STATUS_ERROR ) {
-    log_message_warn( logger, "Error reading button: %s", error->message );
-
-    g_error_free( error );
-  }
-  else if ( bytes_read == 0 ) {
-    log_message_warn( logger, "Read button OK but no data" );
+/*!
+ * Do something to MPD: directly, or through the daemon if we're one of
+ * its renderers.
+ */
+void control_mpd ( struct MAIN_DATA* main_data, enum RELAY_COMMAND command,
+		   int value )
+{
+  if ( main_data->attached ) {
+    relay_command( main_data->relay, command, value );
+    return;
   }
-  else {
-    if ( byte == '1' ) {
-      // Don't respond to interrupts for a while.
-      uint source = ((struct MAIN_DATA*)data)->play_source;
-      g_source_remove( source );
-      g_timeout_add( 250 /*ms*/, debounce, data );
-    }
+
+  struct MPD_HANDLE mpd = main_data->mpds[main_data->selected];
+  switch ( command ) {
+  case RELAY_COMMAND_PLAY_PAUSE:
+    mpd_play_pause( mpd );
+    break;
+  case RELAY_COMMAND_NEXT:
+    mpd_next( mpd );
+    break;
+  case RELAY_COMMAND_PREVIOUS:
+    mpd_previous( mpd );
+    break;
+  case RELAY_COMMAND_SEEK:
+    mpd_seek( mpd, value );
+    break;
+  case RELAY_COMMAND_SET_VOLUME:
+    mpd_set_volume( mpd, value );
+    break;
+  case RELAY_COMMAND_CHANGE_VOLUME:
+    mpd_change_volume( mpd, value );
+    break;
   }
+}
 
+gboolean quit ( gpointer data )
+{
+  struct MAIN_DATA* main_data = data;
+  g_main_loop_quit( main_data->loop );
   return TRUE;
 }
 
-gboolean exit_button_callback ( GIOChannel* gio,
-				GIOCondition condition,
-				gpointer data )
+/*!
+ * Run as the daemon for other screens: poll MPD and look up the covers
+ * for them, but show nothing ourselves.
+ * \return the exit status.
+ */
+int serve ( const char* path, const char* host, int port,
+	    const char* database )
 {
-  // Don't bother with anything if it's not the interrupt.
-  if ( condition != G_IO_PRI ) {
-    return TRUE;
-  }
+  log_message_info( main_data.logger, "MPD host: '%s'", host );
+  log_message_info( main_data.logger, "MPD port: '%d'", port );
+  log_message_info( main_data.logger, "Database: '%s'", database );
+  log_message_info( main_data.logger, "Serving on %s", path );
 
-  struct LOG_HANDLE logger = ((struct MAIN_DATA*)data)->logger;
-  GIOStatus status;
-  gchar byte;
-  gsize bytes_read;
-  GError* error = NULL;
+  main_data.serving = true;
 
-  status = g_io_channel_seek_position( gio, 0, G_SEEK_SET, &error );
+  // Covers are scaled once, here, to the size the renderers show them.
+  main_data.image_db = image_db_create( database, main_data.logger );
+  int cover_width, cover_height;
+  display_cover_size( &cover_width, &cover_height );
+  if ( image_db_start( main_data.image_db, cover_width, cover_height ) < 0 ) {
+    log_message_error( main_data.logger, "Could not start the cover lookup" );
+    return 1;
+  }
 
-  if ( status == G_IO_STATUS_ERROR ) {
-    log_message_warn( logger, "Error seeking button: %s", error->message );
+  main_data.servers = 1;
+  main_data.mpds[0] = mpd_create( host, port, main_data.logger );
+  if ( mpd_status( main_data.mpds[0] ) < 0 ) {
+    log_message_warn( main_data.logger,
+		      "Could not connect to MPD. Trying again shortly." );
+  }
 
-    g_error_free( error );
-    return TRUE;
+  main_data.relay = relay_serve( path, main_data.mpds[0], main_data.logger );
+  if ( relay_status( main_data.relay ) < 0 ) {
+    log_message_error( main_data.logger, "Could not serve on %s", path );
+    return 1;
   }
 
-  error = NULL;
-  // OK. But the button really needs to be debounced...
-  status = g_io_channel_read_chars( gio, &byte, 1, &bytes_read, &error );
+  main_data.now_playing = now_playing_create();
+  if ( now_playing_status( main_data.now_playing ) < 0 ) {
+    log_message_warn( main_data.logger,
+		      "Not publishing the MPD state in shared memory" );
+  }
 
-  if ( status == G_IO_STATUS_ERROR ) {
-    log_message_warn( logger, "Error reading button: %s", error->message );
+  main_data.loop = g_main_loop_new( NULL, FALSE );
 
-    g_error_free( error );
-  }
-  else if ( bytes_read == 0 ) {
-    log_message_warn( logger, "Read button OK but no data" );
-  }
-  else {
-    if ( byte == '1' ) {
-      // Use the button to exit!
-      log_message_warn( logger, "Button: Exiting main loop" );
-      g_main_loop_quit( ((struct MAIN_DATA*)data)->loop );
-    }
+  main_data.states = spsc_queue_create( STATES_CAPACITY );
+  if ( spsc_queue_status( main_data.states ) < 0 ||
+       mpd_poller_start( main_data.mpds, 1, main_data.states ) < 0 ) {
+    log_message_error( main_data.logger, "Could not start polling MPD" );
+    return 1;
   }
+  (void)g_unix_fd_add( spsc_queue_fd( main_data.states ), G_IO_IN,
+		       states_ready, &main_data );
+  (void)g_unix_fd_add( image_db_results_fd( main_data.image_db ), G_IO_IN,
+		       covers_ready, &main_data );
+  (void)g_unix_signal_add( SIGTERM, quit, &main_data );
+  (void)g_unix_signal_add( SIGINT, quit, &main_data );
 
-  return TRUE;
-}
+  g_main_loop_run( main_data.loop );
 
-void add_pibrella_button11 ( gpointer data )
-{
-  struct MAIN_DATA* main_data = data;
-  struct LOG_HANDLE logger = main_data->logger;
-
-  // We want the interrupt mode. But /sys/class/gpio operations
-  // are usually privileged. So, we call out to the "gpio" program.
-  gchar*  stdout_buffer = NULL;
-  gchar*  stderr_buffer = NULL;
-  gint    exit_status   = 0;
-  GError* error         = NULL;
-  gboolean result =
-    g_spawn_command_line_sync( "gpio edge 11 rising",
-			       &stdout_buffer, &stderr_buffer, &exit_status,
-			       &error );
-
-  if ( ! result ) {
-    log_message_warn( logger, "Could not set gpio 11 button to rising interrupt: %s",
-		      error->message );
-    g_error_free( error );
-    return;
-  }
-  else {
-    g_free( stdout_buffer );
-    g_free( stderr_buffer );
-  }
+  log_message_info( main_data.logger, "Done serving. Cleaning up." );
 
-  GIOChannel* button;
+  g_main_loop_unref( main_data.loop );
 
-  guint source;
-  char* gpio_file = "/sys/class/gpio/gpio11/value";
-  error = NULL;
+  mpd_poller_stop( main_data.mpds[0] );
+  struct MPD_STATE* state;
+  while ( ( state = spsc_queue_pop( main_data.states ) ) != NULL )
+    mpd_state_free( state );
+  spsc_queue_free( main_data.states );
+  mpd_state_free( main_data.state[0] );
+  relay_free( main_data.relay );
+  now_playing_free( main_data.now_playing );
+  image_db_free( main_data.image_db );
+  mpd_free( main_data.mpds[0] );
+
+  recorder_close();
+  log_close( main_data.logger );
 
-  // Well, it goes without saying that the GPIO pin should be an
-  // argument to the program.
-  button = g_io_channel_new_file( gpio_file, "r", &error );
+  return 0;
+}
 
-  if ( ! button ) {
-    log_message_warn( logger, "Could not open GPIO file \"%s\": %s",
-		      gpio_file, error->message );
-    g_error_free( error );
-    return;
+// About 30 frames per second.
+#define ANIMATION_INTERVAL 33
+
+/*!
+ * Start or stop the frame timer depending on whether anything on the
+ * display is moving.
+ */
+void check_animation ( struct MAIN_DATA* main_data )
+{
+  if ( display_animating( main_data->display ) ) {
+    if ( main_data->animation_source == 0 )
+      main_data->animation_source =
+	g_timeout_add( ANIMATION_INTERVAL, animate, main_data );
   }
-  else {
-    log_message_info( logger, "Opened GPIO \"%s\"", gpio_file );
+  else if ( main_data->animation_source != 0 ) {
+    g_source_remove( main_data->animation_source );
+    main_data->animation_source = 0;
   }
+}
 
-  source = g_io_add_watch( button, G_IO_PRI, play_pause_button_callback, data );
+gboolean animate ( gpointer data )
+{
+  struct MAIN_DATA* main_data = data;
 
-  if ( ! source ) {
-    log_message_warn( logger, "Error creating watch on button" );
-    return;
-  }
+  // Just a redraw: the MPD changes have already been taken care of.
+  display_redraw( main_data->display );
 
-  main_data->play_button = button;
-  main_data->play_source = source;
+  return TRUE;
 }
 
-void add_pibrella_button10 ( gpointer data )
+void button_pressed ( unsigned int offset, uint64_t timestamp_ns,
+		      void* data )
 {
-  struct MAIN_DATA* main_data = data;
-  struct LOG_HANDLE logger = main_data->logger;
-
-  // We want the interrupt mode. But /sys/class/gpio operations
-  // are usually privileged. So, we call out to the "gpio" program.
-  gchar*  stdout_buffer = NULL;
-  gchar*  stderr_buffer = NULL;
-  gint    exit_status   = 0;
-  GError* error         = NULL;
-  gboolean result =
-    g_spawn_command_line_sync( "gpio edge 10 rising",
-			       &stdout_buffer, &stderr_buffer, &exit_status,
-			       &error );
-
-  if ( ! result ) {
-    log_message_warn( logger, "Could not set gpio 10 button to rising interrupt: %s",
-		      error->message );
-    g_error_free( error );
-    return;
-  }
-  else {
-    g_free( stdout_buffer );
-    g_free( stderr_buffer );
-  }
-
-  GIOChannel* button;
+  (void)timestamp_ns;
 
-  guint ret;
-  char* gpio_file = "/sys/class/gpio/gpio10/value";
-  error = NULL;
+  struct MAIN_DATA* main_data = data;
 
-  // Well, it goes without saying that the GPIO pin should be an
-  // argument to the program.
-  button = g_io_channel_new_file( gpio_file, "r", &error );
+  recorder_event( RECORDER_BUTTON, main_data->selected, offset, 0 );
 
-  if ( ! button ) {
-    log_message_warn( logger, "Could not open GPIO file \"%s\": %s",
-		      gpio_file, error->message );
-    g_error_free( error );
-    return;
+  if ( (int)offset == main_data->play_pin ) {
+    // Toggle the play back.
+    control_mpd( main_data, RELAY_COMMAND_PLAY_PAUSE, 0 );
   }
-  else {
-    log_message_info( logger, "Opened GPIO \"%s\"", gpio_file );
+  else if ( (int)offset == main_data->exit_pin ) {
+    // Use the button to exit!
+    log_message_warn( main_data->logger, "Button: Exiting main loop" );
+    g_main_loop_quit( main_data->loop );
   }
+}
 
-  ret = g_io_add_watch( button, G_IO_PRI, exit_button_callback, data );
-
-  if ( ! ret ) {
-    log_message_warn( logger, "Error creating watch on button" );
+/*!
+ * Seek to a point along the thermometer.
+ */
+static void seek_to ( struct MAIN_DATA* main_data, float fraction )
+{
+  const struct MPD_STATE* state = main_data->state[main_data->selected];
+  if ( state == NULL || state->times.total <= 0 )
     return;
-  }
+  struct MPD_TIMES times = state->times;
+  if ( fraction < 0.f )
+    fraction = 0.f;
+  else if ( fraction > 1.f )
+    fraction = 1.f;
+  control_mpd( main_data, RELAY_COMMAND_SEEK, fraction * times.total );
 }
 
-gboolean event_button_callback ( GIOChannel* gio,
-				 GIOCondition condition,
-				 gpointer data )
+void gesture ( const struct INPUT_GESTURE* gesture, void* data )
 {
-  (void)condition;
-
   struct MAIN_DATA* main_data = data;
-  struct LOG_HANDLE logger = main_data->logger;
-#if 0
-  gchar bytes[3];
-#else
-  struct input_event event;
-#endif
-  gsize bytes_read;
-  GError* error = NULL;
-  GIOStatus status;
-
-  error = NULL;
 
-  status = g_io_channel_read_chars( gio, (gchar*)&event, sizeof event,
-				    &bytes_read, &error );
-
-  if ( status == G_IO_STATUS_ERROR ) {
-    log_message_warn( logger, "Error reading event: %s", error->message );
-
-    g_error_free( error );
-  }
-  else if ( bytes_read == 0 ) {
-    log_message_warn( logger, "Read event OK but no data" );
-  }
-  else {
-    switch ( event.type ) {
-    case EV_SYN:
-      log_message_warn( logger, "SYN %d [%d] event", event.code, event.value );
-      break;
-    case EV_KEY:
-      log_message_warn( logger, "KEY %d [%d] event", event.code, event.value );
-      break;
-    case EV_REL:
-      log_message_warn( logger, "REL event" );
-      break;
-    case EV_ABS:
-      switch ( event.code ) {
-      case ABS_X:
-	log_message_warn( logger, "ABS X [%d] event", event.value ); break;
-      case ABS_Y:
-	log_message_warn( logger, "ABS Y [%d] event", event.value ); break;
-      case ABS_Z:
-	log_message_warn( logger, "ABS Z [%d] event", event.value ); break;
-      default:
-	log_message_warn( logger, "ABS %d [%d] event", event.code, event.value );
-	break;
-      }
-      break;
-    case EV_MSC:
-      log_message_warn( logger, "MSC %d [%d] event", event.code, event.value );
+  // What happens depends mostly on where the finger went down, which
+  // also picks the server (if there are several).
+  int server = display_server_at( main_data->display, gesture->start_x,
+				  gesture->start_y );
+  if ( server >= 0 )
+    main_data->selected = server;
+
+  // Where, in steps of 1/10000 of the screen (see recorder_file.h).
+  float corners[4] = { gesture->start_x, gesture->start_y,
+		       gesture->x, gesture->y };
+  uint64_t where = 0;
+  int i;
+  for ( i = 0; i < 4; i++ )
+    where = where << 16 | (uint16_t)( CLAMP( corners[i], 0.f, 1.f ) * 10000 );
+  recorder_event( RECORDER_GESTURE, main_data->selected, gesture->type,
+		  where );
+
+  float fraction = 0.f;
+  enum DISPLAY_REGION start =
+    display_hit( main_data->display, gesture->start_x, gesture->start_y,
+		 &fraction );
+
+  if ( start == DISPLAY_REGION_THERMOMETER ) {
+    switch ( gesture->type ) {
+    case INPUT_GESTURE_TAP:
       break;
+    case INPUT_GESTURE_DRAG:
+      // Not until the finger comes up; MPD doesn't need every step.
+      return;
     default:
-      log_message_warn( logger, "%d [%d [%d]] event", event.type, event.code,
-			event.value ); 
+      // Wherever it ended up along the thermometer, even past either
+      // end of it (display_hit clamps the fraction for us).
+      (void)display_hit( main_data->display, gesture->x, gesture->y,
+			 &fraction );
       break;
     }
+    log_message_info( main_data->logger, "Touch: seek to %.0f%%",
+		      100.f * fraction );
+    seek_to( main_data, fraction );
+    return;
   }
 
-  return TRUE;
+  switch ( gesture->type ) {
+  case INPUT_GESTURE_TAP:
+    if ( start != DISPLAY_REGION_NONE ) {
+      log_message_info( main_data->logger, "Touch: play/pause" );
+      control_mpd( main_data, RELAY_COMMAND_PLAY_PAUSE, 0 );
+    }
+    break;
+  case INPUT_GESTURE_SWIPE_LEFT:
+    log_message_info( main_data->logger, "Touch: next" );
+    control_mpd( main_data, RELAY_COMMAND_NEXT, 0 );
+    break;
+  case INPUT_GESTURE_SWIPE_RIGHT:
+    log_message_info( main_data->logger, "Touch: previous" );
+    control_mpd( main_data, RELAY_COMMAND_PREVIOUS, 0 );
+    break;
+  default:
+    break;
+  }
 }
 
-void add_event ( gpointer data )
+/*!
+ * Add a "key: value" line, with any backslashes and line breaks in
+ * the value escaped (as \\, \n and \r) so it stays on one line.
+ */
+static void append_field ( GString* reply, const char* key,
+			   const char* value )
 {
-  struct MAIN_DATA* main_data = data;
-  struct LOG_HANDLE logger = main_data->logger;
-
-  GIOChannel* event;
-  GIOStatus status;
+  g_string_append_printf( reply, "%s: ", key );
+  for ( ; *value != '\0'; value++ ) {
+    switch ( *value ) {
+    case '\\': g_string_append( reply, "\\\\" ); break;
+    case '\n': g_string_append( reply, "\\n" ); break;
+    case '\r': g_string_append( reply, "\\r" ); break;
+    default:   g_string_append_c( reply, *value ); break;
+    }
+  }
+  g_string_append_c( reply, '\n' );
+}
 
-  guint ret;
-  char* event_file = "/dev/input/event0";
-  GError* error    = NULL;
+static const char* play_status_name ( enum MPD_PLAY_STATUS status )
+{
+  switch ( status ) {
+  case MPD_PLAY_STATUS_STOPPED: return "stopped";
+  case MPD_PLAY_STATUS_PLAYING: return "playing";
+  case MPD_PLAY_STATUS_PAUSED:  return "paused";
+  default:                      return "nosong";
+  }
+}
 
-  event = g_io_channel_new_file( event_file, "r", &error );
+/*!
+ * Handle a request from the control socket. The replies are meant to
+ * be easy to pick apart in a shell script.
+ */
+int control_command ( const char* command, const char* arguments,
+		      GString* reply, void* data )
+{
+  struct MAIN_DATA* main_data = data;
 
-  if ( ! event ) {
-    log_message_warn( logger, "Could not open event file \"%s\": %s",
-		      event_file, error->message );
-    g_error_free( error );
-    return;
+  if ( strcmp( command, "current" ) == 0 ) {
+    const struct MPD_STATE* state = main_data->state[main_data->selected];
+    if ( state == NULL ) {
+      g_string_append( reply, "MPD hasn't said anything yet" );
+      return -1;
+    }
+    g_string_append_printf( reply, "state: %s\n",
+			    play_status_name( state->play_status ) );
+    append_field( reply, "artist", state->artist );
+    append_field( reply, "album", state->album );
+    append_field( reply, "title", state->title );
+    g_string_append_printf( reply, "elapsed: %ld\ntotal: %ld\n",
+			    (long)state->times.elapsed,
+			    (long)state->times.total );
+  }
+  else if ( strcmp( command, "stats" ) == 0 ) {
+    struct DISPLAY_STATS display = display_stats( main_data->display );
+    struct MPD_CONTROL_STATS control =
+      mpd_control_stats( main_data->mpds[main_data->selected] );
+    g_string_append_printf( reply,
+			    "frames: %lu\npartial_frames: %lu\n"
+			    "frame_last_us: %lld\nframe_mean_us: %lld\n"
+			    "frame_max_us: %lld\n"
+			    "glyph_faces: %u\nglyph_glyphs: %u\n"
+			    "glyph_lookups: %lu\nglyph_hits: %lu\n"
+			    "glyph_unsaved: %d\natlas_usage: %d\n"
+			    "control_connected: %d\ncontrol_batches: %u\n"
+			    "control_failures: %u\ncontrol_dropped: %u\n"
+			    "control_latency_last_us: %lld\n"
+			    "control_latency_mean_us: %lld\n"
+			    "control_latency_max_us: %lld\n"
+			    "first_frame_us: %lld\n",
+			    display.frames, display.partial_frames,
+			    display.last_frame, display.mean_frame,
+			    display.max_frame,
+			    display.glyph_cache.faces, display.glyph_cache.glyphs,
+			    display.glyph_cache.lookups, display.glyph_cache.hits,
+			    display.glyph_cache.dirty, display.atlas_usage,
+			    control.connected, control.batches,
+			    control.failures, control.dropped,
+			    control.last_latency, control.mean_latency,
+			    control.max_latency,
+			    (long long)main_data->first_frame );
+  }
+  else if ( strcmp( command, "metrics" ) == 0 ) {
+    // Prometheus text format, so not "key: value".
+    metrics_expose( reply );
+  }
+  else if ( strcmp( command, "trace" ) == 0 ) {
+    if ( strcmp( arguments, "on" ) == 0 )
+      trace_enable( 1 );
+    else if ( strcmp( arguments, "off" ) == 0 )
+      trace_enable( 0 );
+    else if ( strncmp( arguments, "dump", 4 ) == 0 &&
+	      ( arguments[4] == '\0' || arguments[4] == ' ' ) ) {
+      const char* path = arguments[4] == ' ' ?
+	arguments + 5 : main_data->trace_path;
+      if ( trace_dump( path ) < 0 ) {
+	g_string_append_printf( reply, "could not write \"%s\"", path );
+	return -1;
+      }
+      g_string_append_printf( reply, "file: %s\n", path );
+    }
+    else {
+      g_string_append( reply, "trace is on, off or dump [path]" );
+      return -1;
+    }
+  }
+  else if ( strcmp( command, "redraw" ) == 0 ) {
+    display_force_redraw( main_data->display );
+  }
+  else if ( strcmp( command, "flush" ) == 0 ) {
+    // Everything that outlives us. The metrics and the trace are only
+    // ever in memory, so there's nothing of theirs to write.
+    int caches = display_flush_caches( main_data->display );
+    int log = log_flush( main_data->logger );
+    int recording = recorder_flush();
+    g_string_append_printf( reply, "caches: %s\nlog: %s\nrecording: %s\n",
+			    caches < 0 ? "failed" : "ok",
+			    log < 0 ? "behind" : "ok",
+			    recording < 0 ? "failed" : "ok" );
+    if ( caches < 0 || log < 0 || recording < 0 ) {
+      g_string_append( reply, "could not flush everything" );
+      return -1;
+    }
+  }
+  else if ( strcmp( command, "layout" ) == 0 ) {
+    if ( strcmp( arguments, "scroll" ) == 0 )
+      display_set_layout( main_data->display, DISPLAY_LAYOUT_SCROLL );
+    else if ( strcmp( arguments, "wrap" ) == 0 )
+      display_set_layout( main_data->display, DISPLAY_LAYOUT_WRAP );
+    else {
+      g_string_append( reply, "layout is scroll or wrap" );
+      return -1;
+    }
+    display_redraw( main_data->display );
+    check_animation( main_data );
+  }
+  else if ( strcmp( command, "server" ) == 0 ) {
+    // Which server the other commands are about.
+    if ( *arguments != '\0' ) {
+      int server = convert_int( arguments );
+      if ( errno != 0 || server < 0 || server >= main_data->servers ) {
+	g_string_append_printf( reply, "server is 0 to %d",
+				main_data->servers - 1 );
+	return -1;
+      }
+      main_data->selected = server;
+    }
+    g_string_append_printf( reply, "server: %d\nservers: %d\n",
+			    main_data->selected, main_data->servers );
+  }
+  else if ( strcmp( command, "toggle" ) == 0 ) {
+    control_mpd( main_data, RELAY_COMMAND_PLAY_PAUSE, 0 );
+  }
+  else if ( strcmp( command, "next" ) == 0 ) {
+    control_mpd( main_data, RELAY_COMMAND_NEXT, 0 );
+  }
+  else if ( strcmp( command, "previous" ) == 0 ) {
+    control_mpd( main_data, RELAY_COMMAND_PREVIOUS, 0 );
+  }
+  else if ( strcmp( command, "seek" ) == 0 ) {
+    int seconds = convert_int( arguments );
+    if ( *arguments == '\0' || errno != 0 || seconds < 0 ) {
+      g_string_append( reply, "seek needs a time in seconds" );
+      return -1;
+    }
+    control_mpd( main_data, RELAY_COMMAND_SEEK, seconds );
+  }
+  else if ( strcmp( command, "volume" ) == 0 ) {
+    // +N and -N are relative.
+    int volume = convert_int( arguments );
+    if ( *arguments == '\0' || errno != 0 ) {
+      g_string_append( reply, "volume needs a number (+N or -N to change it)" );
+      return -1;
+    }
+    if ( arguments[0] == '+' || arguments[0] == '-' )
+      control_mpd( main_data, RELAY_COMMAND_CHANGE_VOLUME, volume );
+    else
+      control_mpd( main_data, RELAY_COMMAND_SET_VOLUME, volume );
+  }
+  else if ( strcmp( command, "help" ) == 0 ) {
+    g_string_append( reply,
+		     "command: current\ncommand: stats\ncommand: metrics\n"
+		     "command: redraw\ncommand: trace on|off|dump [PATH]\n"
+		     "command: flush\ncommand: layout scroll|wrap\n"
+		     "command: toggle\ncommand: next\ncommand: previous\n"
+		     "command: seek SECONDS\ncommand: volume [+-]PERCENT\n"
+		     "command: server [N]\n" );
   }
   else {
-    log_message_info( logger, "Opened event \"%s\"", event_file );
+    g_string_append_printf( reply, "unknown command \"%s\"", command );
+    return -1;
   }
 
-  // The default encoding is UTF-8 and we're just reading binary
-  // data.
-  status = g_io_channel_set_encoding( event, NULL, &error );
-
-  if ( status == G_IO_STATUS_ERROR ) {
-    log_message_warn( logger, "Error setting event encoding: %s",
-		      error->message );
-    g_error_free( error );
+  return 0;
+}
 
-    return;
-  }
+gboolean dump_trace ( gpointer data )
+{
+  struct MAIN_DATA* main_data = data;
 
-  ret = g_io_add_watch( event, G_IO_IN, event_button_callback, data );
+  if ( trace_dump( main_data->trace_path ) < 0 )
+    log_message_warn( main_data->logger, "Could not write trace to '%s'",
+		      main_data->trace_path );
+  else
+    log_message_info( main_data->logger, "Wrote trace to '%s'",
+		      main_data->trace_path );
 
-  if ( ! ret ) {
-    log_message_warn( logger, "Error creating watch on event" );
-    return;
-  }
+  return TRUE;
 }
@@ -0,0 +1,169 @@
+/*
+ * The metrics registry and its text exposition.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "metrics.h"
+
+const int64_t metrics_latency_bounds[METRICS_LATENCY_BOUNDS] = {
+  50, 100, 250, 500,
+  1000, 2500, 5000, 10000, 25000, 50000,
+  100000, 250000, 500000, 1000000
+};
+
+// In registration order. Modules may register from startup threads.
+static GMutex metrics_lock;
+static struct METRIC* metrics_head = NULL;
+static struct METRIC* metrics_tail = NULL;
+
+void metrics_register ( struct METRIC* metric )
+{
+  g_mutex_lock( &metrics_lock );
+  if ( metric->registered ) {
+    g_mutex_unlock( &metrics_lock );
+    return;
+  }
+  if ( metric->bounds_count > METRIC_BUCKETS_MAX )
+    metric->bounds_count = METRIC_BUCKETS_MAX;
+  metric->registered = 1;
+  metric->next = NULL;
+  if ( metrics_tail != NULL )
+    metrics_tail->next = metric;
+  else
+    metrics_head = metric;
+  metrics_tail = metric;
+  g_mutex_unlock( &metrics_lock );
+}
+
+/*!
+ * Put a counter's (or a histogram sum's) two words back together.
+ * Only called with the registry locked.
+ */
+static uint64_t accumulated ( struct METRIC* metric )
+{
+  uint32_t high, low;
+  do {
+    high = __atomic_load_n( &metric->value_high, __ATOMIC_ACQUIRE );
+    low = __atomic_load_n( &metric->value, __ATOMIC_ACQUIRE );
+  } while ( high != __atomic_load_n( &metric->value_high,
+				     __ATOMIC_ACQUIRE ) );
+  uint64_t value = (uint64_t)high << 32 | low;
+  // The low word has wrapped but the carry isn't in yet. A counter
+  // never goes down, so it must be that.
+  if ( value < metric->exposed )
+    value += (uint64_t)1 << 32;
+  metric->exposed = value;
+  return value;
+}
+
+static void append_value ( GString* out, int64_t value, double scale )
+{
+  if ( scale == 1. )
+    g_string_append_printf( out, "%lld\n", (long long)value );
+  else
+    g_string_append_printf( out, "%.9g\n", value / scale );
+}
+
+/*!
+ * The format wants backslashes and line breaks escaped in help text,
+ * and double quotes as well in label values.
+ */
+static void append_escaped ( GString* out, const char* text, int quotes )
+{
+  for ( ; *text != '\0'; text++ ) {
+    switch ( *text ) {
+    case '\\': g_string_append( out, "\\\\" ); break;
+    case '\n': g_string_append( out, "\\n" ); break;
+    case '"':
+      if ( quotes ) {
+	g_string_append( out, "\\\"" );
+	break;
+      }
+      // Fall through.
+    default:   g_string_append_c( out, *text ); break;
+    }
+  }
+}
+
+static void append_label ( GString* out, const char* label,
+			   const char* value )
+{
+  g_string_append_printf( out, "%s=\"", label );
+  append_escaped( out, value, 1 );
+  g_string_append_c( out, '"' );
+}
+
+/*!
+ * The name and labels of one sample. le is the histogram bucket's
+ * bound or NULL.
+ */
+static void append_series ( GString* out, const struct METRIC* metric,
+			    const char* suffix, const char* le )
+{
+  g_string_append( out, metric->name );
+  g_string_append( out, suffix );
+  if ( metric->label != NULL || le != NULL ) {
+    g_string_append_c( out, '{' );
+    if ( metric->label != NULL )
+      append_label( out, metric->label,
+		    metric->label_value != NULL ? metric->label_value : "" );
+    if ( metric->label != NULL && le != NULL )
+      g_string_append_c( out, ',' );
+    if ( le != NULL )
+      append_label( out, "le", le );
+    g_string_append_c( out, '}' );
+  }
+  g_string_append_c( out, ' ' );
+}
+
+void metrics_expose ( GString* out )
+{
+  static const char* types[] = { "counter", "gauge", "histogram" };
+  const char* family = NULL;
+  struct METRIC* metric;
+  g_mutex_lock( &metrics_lock );
+  for ( metric = metrics_head; metric != NULL; metric = metric->next ) {
+    if ( family == NULL || strcmp( family, metric->name ) != 0 ) {
+      family = metric->name;
+      g_string_append_printf( out, "# HELP %s ", metric->name );
+      append_escaped( out, metric->help, 0 );
+      g_string_append_printf( out, "\n# TYPE %s %s\n",
+			      metric->name, types[metric->type] );
+    }
+
+    int64_t value;
+    if ( metric->type == METRIC_TYPE_GAUGE )
+      value = (int32_t)__atomic_load_n( &metric->value, __ATOMIC_RELAXED );
+    else
+      value = accumulated( metric );
+
+    if ( metric->type != METRIC_TYPE_HISTOGRAM ) {
+      append_series( out, metric, "", NULL );
+      append_value( out, value, metric->scale );
+      continue;
+    }
+
+    // The buckets are kept separately and made cumulative here. Since
+    // nothing stops the world, the sum may be a hair out of step with
+    // the counts. (A bucket wraps after 2^32 observations: years, at
+    // a frame every 33 ms.)
+    uint64_t cumulative = 0;
+    char le[32];
+    int b;
+    for ( b = 0; b <= metric->bounds_count; b++ ) {
+      cumulative += __atomic_load_n( &metric->counts[b], __ATOMIC_RELAXED );
+      if ( b < metric->bounds_count )
+	snprintf( le, sizeof le, "%.9g", metric->bounds[b] / metric->scale );
+      else
+	strcpy( le, "+Inf" );
+      append_series( out, metric, "_bucket", le );
+      g_string_append_printf( out, "%llu\n", (unsigned long long)cumulative );
+    }
+    append_series( out, metric, "_sum", NULL );
+    append_value( out, value, metric->scale );
+    append_series( out, metric, "_count", NULL );
+    g_string_append_printf( out, "%llu\n", (unsigned long long)cumulative );
+  }
+  g_mutex_unlock( &metrics_lock );
+}
@@ -0,0 +1,136 @@
+/*
+ * A little registry of counters, gauges and histograms which can be
+ * written out in the Prometheus text exposition format. The metrics
+ * themselves are static structures owned by whichever module updates
+ * them; updating one is a relaxed atomic add (or two), so it is cheap
+ * enough for the drawing and polling paths.
+ *
+ * The atomics are all 32 bits wide: ARMv6 has no 64 bit atomic add,
+ * and GCC would call libatomic, which takes a lock. Counters and
+ * histogram sums carry into a second word when they wrap, and the
+ * exposition puts the two back together.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include "glib.h"
+
+//! Most buckets in a histogram (not counting +Inf).
+#define METRIC_BUCKETS_MAX 16
+
+enum METRIC_TYPE {
+  METRIC_TYPE_COUNTER,
+  METRIC_TYPE_GAUGE,
+  METRIC_TYPE_HISTOGRAM
+};
+
+/*!
+ * One time series. Metrics with the same name but different labels
+ * form a family and should be registered one after another.
+ */
+struct METRIC {
+  const char* name;
+  const char* help;
+  enum METRIC_TYPE type;
+  //! A label name, e.g. stage, or NULL for none...
+  const char* label;
+  //! ...and its value, e.g. draw. It is escaped when exposed, so it
+  //! may be anything (say, a host name from the command line).
+  const char* label_value;
+  //! Recorded values are divided by this when exposed (e.g. 1e6 to
+  //! show microseconds as seconds).
+  double scale;
+  //! Histogram upper bounds in ascending order, in recorded units.
+  const int64_t* bounds;
+  int bounds_count;
+  //! The counter or gauge value, or the histogram's sum: the low 32
+  //! bits (all of a gauge, which is signed)...
+  uint32_t value;
+  //! ...and, for the others, how many times they have wrapped.
+  uint32_t value_high;
+  //! Histogram bucket counts (not cumulative); the last is +Inf.
+  uint32_t counts[METRIC_BUCKETS_MAX+1];
+  //! The value last exposed (see metrics_expose).
+  uint64_t exposed;
+  int registered;
+  struct METRIC* next;
+};
+
+//! Initializers for the static metric structures.
+#define METRIC_COUNTER_INIT( name, help, label, value )			\
+  { name, help, METRIC_TYPE_COUNTER, label, value, 1., NULL, 0, 0, 0,	\
+      { 0 }, 0, 0, NULL }
+#define METRIC_GAUGE_INIT( name, help, label, value )			\
+  { name, help, METRIC_TYPE_GAUGE, label, value, 1., NULL, 0, 0, 0,	\
+      { 0 }, 0, 0, NULL }
+//! Times are recorded in microseconds and shown in seconds.
+#define METRIC_LATENCY_INIT( name, help, label, value )			\
+  { name, help, METRIC_TYPE_HISTOGRAM, label, value, 1e6,		\
+      metrics_latency_bounds, METRICS_LATENCY_BOUNDS, 0, 0, { 0 }, 0, 0, \
+      NULL }
+
+//! Default histogram buckets for latencies, 50 us to 1 s.
+#define METRICS_LATENCY_BOUNDS 14
+extern const int64_t metrics_latency_bounds[METRICS_LATENCY_BOUNDS];
+
+/*!
+ * Add the metric to the registry. Registering twice is harmless.
+ * \param[inout] metric the metric (must outlive the registry).
+ */
+void metrics_register ( struct METRIC* metric );
+
+/*!
+ * Write every registered metric in the text exposition format.
+ * \param[inout] out the text is appended here.
+ */
+void metrics_expose ( GString* out );
+
+/*!
+ * Add to a counter or a histogram's sum, carrying into the high word.
+ */
+static inline void metric_accumulate ( struct METRIC* metric, uint32_t n )
+{
+  uint32_t old = __atomic_fetch_add( &metric->value, n, __ATOMIC_RELAXED );
+  if ( (uint32_t)( old + n ) < old )
+    __atomic_fetch_add( &metric->value_high, 1, __ATOMIC_RELAXED );
+}
+
+/*!
+ * Count something.
+ * \param[inout] metric a counter (or gauge).
+ * \param[in] n how much to add (at most 2^32 - 1, or for a gauge,
+ * between -2^31 and 2^31 - 1).
+ */
+static inline void metric_add ( struct METRIC* metric, int64_t n )
+{
+  if ( metric->type == METRIC_TYPE_GAUGE )
+    __atomic_fetch_add( &metric->value, (uint32_t)n, __ATOMIC_RELAXED );
+  else
+    metric_accumulate( metric, (uint32_t)n );
+}
+
+/*!
+ * \param[inout] metric a gauge.
+ * \param[in] value its new value (between -2^31 and 2^31 - 1).
+ */
+static inline void metric_set ( struct METRIC* metric, int64_t value )
+{
+  __atomic_store_n( &metric->value, (uint32_t)value, __ATOMIC_RELAXED );
+}
+
+/*!
+ * Record an observation in a histogram.
+ * \param[inout] metric a histogram.
+ * \param[in] value the observation, in recorded units.
+ */
+static inline void metric_observe ( struct METRIC* metric, int64_t value )
+{
+  int b = 0;
+  while ( b < metric->bounds_count && value > metric->bounds[b] )
+    b++;
+  __atomic_fetch_add( &metric->counts[b], 1, __ATOMIC_RELAXED );
+  metric_accumulate( metric, (uint32_t)value );
+}
+#endif
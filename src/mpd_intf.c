@@ -5,12 +5,22 @@
  * In this version, we try to use libmpdclient since it provides more
  * functionality (namely writing to the server) than I want to code by
  * hand.
+ *
+ * The poller looks after every server from one thread. None of its
+ * connections ever block: they are non-blocking sockets, read and
+ * written with libmpdclient's mpd_async and mpd_parser, all waited on
+ * together with one poll().
  */
+#define _GNU_SOURCE // getaddrinfo_a
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <stdio.h>
 #include <errno.h>
 #include <netdb.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -20,8 +30,31 @@
 #include "mpd/client.h"
 
 #include "log_intf.h"
+#include "metrics.h"
+#include "trace.h"
+#include "recorder.h"
 #include "mpd_intf.h"
 
+static struct METRIC poll_metric =
+  METRIC_LATENCY_INIT( "mpddisplay_mpd_poll_seconds",
+		       "Time to fetch the status and current song from MPD.",
+		       NULL, NULL );
+static struct METRIC command_metric =
+  METRIC_LATENCY_INIT( "mpddisplay_mpd_command_seconds",
+		       "Time from queueing a control command to MPD's reply.",
+		       NULL, NULL );
+static struct METRIC reconnect_metrics[] = {
+  METRIC_COUNTER_INIT( "mpddisplay_mpd_connects_total",
+		       "Connections made to MPD.",
+		       "connection", "status" ),
+  METRIC_COUNTER_INIT( "mpddisplay_mpd_connects_total",
+		       "Connections made to MPD.",
+		       "connection", "control" ),
+};
+static struct METRIC control_failure_metric =
+  METRIC_COUNTER_INIT( "mpddisplay_mpd_control_failures_total",
+		       "Errors on the MPD control connection.", NULL, NULL );
+
 /*!
  * This is the data extracted from the MPD command. changed is updated
  * with MPD_CHANGED flags to note differences from the current values.
@@ -42,11 +75,68 @@ struct MPD_CURRENT {
   //! Total track time in seconds.
   unsigned int total_time;
 };
+/*!
+ * Control commands waiting to be sent. Requests are folded together as
+ * they arrive: pause toggles cancel in pairs, skips are netted out, and
+ * the last seek or volume setting wins.
+ */
+struct MPD_COMMANDS {
+  //! Number of play/pause toggles requested.
+  int toggles;
+  //! Net skips: > 0 is next, < 0 is previous.
+  int skip;
+  //! Seek in the current song (in seconds).
+  bool seek;
+  unsigned int seek_seconds;
+  //! Set the volume (percent).
+  bool volume;
+  int volume_percent;
+  //! Relative volume change (only if there's no absolute setting).
+  int volume_delta;
+  //! How many requests went into this batch.
+  int requests;
+  //! When the first of them was made (monotonic, us).
+  gint64 first_request;
+};
+/*!
+ * Where one of the poller's connections has got to.
+ */
+enum MPD_LINK_STATE {
+  //! Not connected.
+  MPD_LINK_CLOSED,
+  //! Waiting for the host to be looked up.
+  MPD_LINK_LOOKUP,
+  //! connect() is under way.
+  MPD_LINK_CONNECTING,
+  //! Waiting for MPD's greeting.
+  MPD_LINK_GREETING,
+  //! Connected, with nothing asked.
+  MPD_LINK_IDLE,
+  //! Waiting for the reply to a command list.
+  MPD_LINK_BUSY,
+};
+/*!
+ * A non-blocking connection to MPD. Only the poller thread touches it.
+ */
+struct MPD_LINK {
+  enum MPD_LINK_STATE state;
+  //! The socket (mpd_async owns it once we're connected).
+  int fd;
+  struct mpd_async* async;
+  struct mpd_parser* parser;
+  //! Which of the host's addresses is being tried.
+  int address;
+  //! How long each step (connecting, or a reply) may take (ms), and
+  //! when this one gives up (monotonic, us).
+  int timeout;
+  gint64 deadline;
+};
 /*!
  * The details of the MPD connection.
  */
 struct MPD_PRIVATE {
-  //! Our connection to MPD.
+  //! Our connection to MPD (from mpd_create or mpd_reconnect; the
+  //! poller makes its own).
   struct mpd_connection* connection;
   //! The socket file descriptor.
   int fd;
@@ -58,7 +148,84 @@ struct MPD_PRIVATE {
   struct LOG_HANDLE logger;
   //! The results of the last poll of the server.
   struct MPD_CURRENT current;
+  //! Commands not yet sent.
+  struct MPD_COMMANDS queue;
+  //! Guards the queue and the stats: requests are made from the main
+  //! loop, and the poller sends them.
+  GMutex control_lock;
+  //! How the control connection has been doing.
+  struct MPD_CONTROL_STATS stats;
+  gint64 latency_total;
+  //! The poller looking after us (if it's running), and our index in
+  //! its list.
+  struct MPD_POLLER* poller;
+  int server;
+  //! Anyone may set this (and wake the poller) to have us polled now.
+  int poll_now;
+
+  // Only the poller thread touches the rest.
+
+  //! Looking up the host (with getaddrinfo_a, so the poller never
+  //! waits for it). The addresses are kept until none of them work.
+  struct gaicb lookup;
+  struct addrinfo hints;
+  char service[8];
+  bool looking_up;
+  struct addrinfo* addresses;
+  //! The status connection, and when we're next due a poll (or a
+  //! retry) (monotonic, us).
+  struct MPD_LINK link;
+  gint64 poll_due;
+  //! When this poll (or attempt to connect) started.
+  gint64 poll_started;
+  bool connected_before;
+  //! The reply to the poll so far: the status, then the current song.
+  struct mpd_status* reply_status;
+  struct mpd_song* reply_song;
+  bool reply_song_part;
+  //! Changes not handed over yet (because the queue was full).
+  int pending;
+  //! Commands go on their own connection so they never wait behind a
+  //! poll. It is opened when first needed (and again after a failure).
+  struct MPD_LINK control;
+  //! Don't try to reopen it before this (monotonic, us).
+  gint64 control_retry;
+  //! The batch on its way to MPD (no requests if there isn't one).
+  struct MPD_COMMANDS sending;
 };
+/*!
+ * The poller's thread, and the servers it looks after.
+ */
+struct MPD_POLLER {
+  //! Only the poller thread pushes on to this.
+  struct SPSC_QUEUE_HANDLE states;
+  //! An eventfd, written to wake the poller when a poll is wanted, a
+  //! command has been queued, or it's time to stop.
+  int wake;
+  int stop;
+  GThread* thread;
+  int count;
+  struct MPD_PRIVATE* servers[MPD_SERVERS_MAX];
+};
+
+// How often the poller looks at MPD, and how long it waits before
+// trying again when MPD has gone away (ms).
+#define POLL_INTERVAL 1000
+#define RECONNECT_INTERVAL 3000
+// Connecting (and reconnecting), and every poll on the connection,
+// give up after this long (ms) rather than libmpdclient's default
+// (30 s).
+#define RECONNECT_TIMEOUT 3000
+
+// The control connection gives up on MPD after this long (ms). Much
+// less than the default: a button press which takes longer than this
+// isn't worth waiting for.
+#define CONTROL_TIMEOUT 2000
+// After a failure, wait this long before reconnecting (us).
+#define CONTROL_RETRY ( 5 * G_USEC_PER_SEC )
+// While a host is being looked up, the poller checks on it this often
+// (ms).
+#define LOOKUP_CHECK 20
 
 static void mpd_current_init ( struct MPD_CURRENT* current )
 {
@@ -78,7 +245,7 @@ static void mpd_current_free ( struct MPD_CURRENT* current )
   g_string_free( current->title, TRUE );
 }
 
-static void get_song_string ( struct mpd_song* song,
+static void get_song_string ( const struct mpd_song* song,
 			      enum mpd_tag_type type,
 			      GString* result )
 {
@@ -95,6 +262,75 @@ static void get_song_string ( struct mpd_song* song,
   }
 }
 
+static void current_from_status ( struct MPD_CURRENT* current,
+				  const struct mpd_status* status )
+{
+  enum mpd_state state = mpd_status_get_state( status );
+
+  switch ( state ) {
+  case MPD_STATE_PLAY:
+    current->play_status = MPD_PLAY_STATUS_PLAYING;
+    break;
+  case MPD_STATE_PAUSE:
+    current->play_status = MPD_PLAY_STATUS_PAUSED;
+    break;
+  case MPD_STATE_STOP:
+    current->play_status = MPD_PLAY_STATUS_STOPPED;
+    break;
+  case MPD_STATE_UNKNOWN:
+    current->play_status = MPD_PLAY_STATUS_NOSONG;
+    break;
+  default:
+    break;
+  }
+
+  current->elapsed_time = mpd_status_get_elapsed_time( status );
+  current->total_time = mpd_status_get_total_time( status );
+}
+
+static void current_from_song ( struct MPD_CURRENT* current,
+				const struct mpd_song* song )
+{
+  get_song_string( song, MPD_TAG_ARTIST, current->artist );
+  get_song_string( song, MPD_TAG_ALBUM, current->album );
+  get_song_string( song, MPD_TAG_TITLE, current->title );
+}
+
+/*!
+ * Keep what we've just heard from MPD, and note in previous->changed
+ * what's different.
+ */
+static void current_take ( struct MPD_CURRENT* previous,
+			   const struct MPD_CURRENT* current )
+{
+  // I can already tell this needs some rearrangment.
+  previous->changed = 0;
+  if ( previous->play_status != current->play_status ) {
+    previous->play_status = current->play_status;
+    previous->changed |= MPD_CHANGED_STATUS;
+  }
+  if ( previous->elapsed_time != current->elapsed_time ) {
+    previous->elapsed_time = current->elapsed_time;
+    previous->changed |= MPD_CHANGED_ELAPSED;
+  }
+  if ( previous->total_time != current->total_time ) {
+    previous->total_time = current->total_time;
+    previous->changed |= MPD_CHANGED_TOTAL;
+  }
+  if ( ! g_string_equal( previous->artist, current->artist ) ) {
+    g_string_assign( previous->artist, current->artist->str );
+    previous->changed |= MPD_CHANGED_ARTIST;
+  }
+  if ( ! g_string_equal( previous->album, current->album ) ) {
+    g_string_assign( previous->album, current->album->str );
+    previous->changed |= MPD_CHANGED_ALBUM;
+  }
+  if ( ! g_string_equal( previous->title, current->title ) ) {
+    g_string_assign( previous->title, current->title->str );
+    previous->changed |= MPD_CHANGED_TITLE;
+  }
+}
+
 static int mpd_get_current ( struct mpd_connection* connection,
 			     struct LOG_HANDLE logger,
 			     struct MPD_CURRENT* previous )
@@ -120,6 +356,7 @@ static int mpd_get_current ( struct mpd_connection* connection,
 
   if ( status == NULL ) {
     log_message_error( logger, "error retrieving status" );
+    mpd_current_free( &current );
     return -1;
   }
 
@@ -127,42 +364,11 @@ static int mpd_get_current ( struct mpd_connection* connection,
     log_message_error( logger, "error in status: %s",
 		       mpd_status_get_error( status ) );
     mpd_status_free( status );
+    mpd_current_free( &current );
     return -1;
   }
 
-  enum mpd_state state = mpd_status_get_state( status );
-
-  switch ( state ) {
-  case MPD_STATE_PLAY:
-    current.play_status = MPD_PLAY_STATUS_PLAYING;
-    break;
-  case MPD_STATE_PAUSE:
-    current.play_status = MPD_PLAY_STATUS_PAUSED;
-    break;
-  case MPD_STATE_STOP:
-    current.play_status = MPD_PLAY_STATUS_STOPPED;
-    break;
-  case MPD_STATE_UNKNOWN:
-    current.play_status = MPD_PLAY_STATUS_NOSONG;
-    break;
-  default:
-    break;
-  }
-
-  // I can already tell this needs some rearrangment.
-  previous->changed = 0;
-  if ( previous->play_status != current.play_status ) {
-    previous->play_status = current.play_status;
-    previous->changed |= MPD_CHANGED_STATUS;
-  }
-  if ( previous->elapsed_time != mpd_status_get_elapsed_time( status ) ) {
-    previous->elapsed_time = mpd_status_get_elapsed_time( status );
-    previous->changed |= MPD_CHANGED_ELAPSED;
-  }
-  if ( previous->total_time != mpd_status_get_total_time( status ) ) {
-    previous->total_time = mpd_status_get_total_time( status );
-    previous->changed |= MPD_CHANGED_TOTAL;
-  }
+  current_from_status( &current, status );
 
   mpd_status_free( status );
 
@@ -174,24 +380,11 @@ static int mpd_get_current ( struct mpd_connection* connection,
   // The command was "send_current_song" which seems to imply
   // only one.
   while ( ( song = mpd_recv_song( connection ) ) != NULL ) {
-    get_song_string( song, MPD_TAG_ARTIST, current.artist );
-    get_song_string( song, MPD_TAG_ALBUM, current.album );
-    get_song_string( song, MPD_TAG_TITLE, current.title );
+    current_from_song( &current, song );
     mpd_song_free( song );
   }
 
-  if ( ! g_string_equal( previous->artist, current.artist ) ) {
-    g_string_assign( previous->artist, current.artist->str );
-    previous->changed |= MPD_CHANGED_ARTIST;
-  }
-  if ( ! g_string_equal( previous->album, current.album ) ) {
-    g_string_assign( previous->album, current.album->str );
-    previous->changed |= MPD_CHANGED_ALBUM;
-  }
-  if ( ! g_string_equal( previous->title, current.title ) ) {
-    g_string_assign( previous->title, current.title->str );
-    previous->changed |= MPD_CHANGED_TITLE;
-  }
+  current_take( previous, &current );
 
   if ( ( mpd_connection_get_error( connection ) != MPD_ERROR_SUCCESS ) ||
        ! mpd_response_finish( connection ) ) {
@@ -207,8 +400,476 @@ static int mpd_get_current ( struct mpd_connection* connection,
   return 0;
 }
 
-struct MPD_HANDLE mpd_create ( const char* host, int port,
-			       struct LOG_HANDLE logger )
+static void link_init ( struct MPD_LINK* link, int timeout )
+{
+  link->state = MPD_LINK_CLOSED;
+  link->fd = -1;
+  link->async = NULL;
+  link->parser = NULL;
+  link->address = 0;
+  link->timeout = timeout;
+  link->deadline = 0;
+}
+
+/*!
+ * Close the connection, whatever it's doing.
+ */
+static void link_close ( struct MPD_LINK* link )
+{
+  if ( link->async != NULL ) {
+    mpd_async_free( link->async ); // This closes the socket.
+    link->async = NULL;
+  }
+  else if ( link->fd > -1 ) {
+    close( link->fd );
+  }
+  link->fd = -1;
+  if ( link->parser != NULL ) {
+    mpd_parser_free( link->parser );
+    link->parser = NULL;
+  }
+  link->state = MPD_LINK_CLOSED;
+}
+
+/*!
+ * Start looking up the host, unless that's under way already. An
+ * address needs no looking up (and getaddrinfo_a would start a thread
+ * just to find that out).
+ * \return 1 if we have the addresses already, 0 if the lookup is under
+ * way, -1 if it couldn't be started.
+ */
+static int lookup_start ( struct MPD_PRIVATE* d )
+{
+  if ( d->looking_up )
+    return 0;
+
+  memset( &d->hints, 0, sizeof d->hints );
+  d->hints.ai_family = AF_UNSPEC;
+  d->hints.ai_socktype = SOCK_STREAM;
+  d->hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+  g_snprintf( d->service, sizeof d->service, "%d", d->port );
+  if ( getaddrinfo( d->host->str, d->service, &d->hints,
+		    &d->addresses ) == 0 )
+    return 1;
+  d->addresses = NULL;
+  d->hints.ai_flags = AI_NUMERICSERV;
+  memset( &d->lookup, 0, sizeof d->lookup );
+  d->lookup.ar_name = d->host->str;
+  d->lookup.ar_service = d->service;
+  d->lookup.ar_request = &d->hints;
+
+  struct gaicb* list[] = { &d->lookup };
+  int error = getaddrinfo_a( GAI_NOWAIT, list, 1, NULL );
+  if ( error != 0 ) {
+    log_message_error( d->logger, "Could not look up %s: %s",
+		       d->host->str, gai_strerror( error ) );
+    return -1;
+  }
+  d->looking_up = true;
+  return 0;
+}
+
+/*!
+ * \return 1 if we have the host's addresses, 0 if the lookup is still
+ * going, -1 if it failed.
+ */
+static int lookup_check ( struct MPD_PRIVATE* d )
+{
+  if ( d->addresses != NULL )
+    return 1;
+  if ( ! d->looking_up )
+    return -1;
+  int error = gai_error( &d->lookup );
+  if ( error == EAI_INPROGRESS )
+    return 0;
+  d->looking_up = false;
+  if ( error != 0 ) {
+    log_message_error( d->logger, "Could not look up %s: %s",
+		       d->host->str, gai_strerror( error ) );
+    return -1;
+  }
+  d->addresses = d->lookup.ar_result;
+  return 1;
+}
+
+/*!
+ * Wait for a lookup in progress (it uses our memory) and let go of
+ * the addresses.
+ */
+static void lookup_free ( struct MPD_PRIVATE* d )
+{
+  if ( d->looking_up ) {
+    if ( gai_cancel( &d->lookup ) != EAI_CANCELED ) {
+      const struct gaicb* list[] = { &d->lookup };
+      while ( gai_error( &d->lookup ) == EAI_INPROGRESS )
+	(void)gai_suspend( list, 1, NULL );
+    }
+    if ( gai_error( &d->lookup ) == 0 && d->lookup.ar_result != NULL )
+      freeaddrinfo( d->lookup.ar_result );
+    d->looking_up = false;
+  }
+  if ( d->addresses != NULL ) {
+    freeaddrinfo( d->addresses );
+    d->addresses = NULL;
+  }
+}
+
+/*!
+ * Start connecting a non-blocking socket.
+ * \return 0 if it's under way, -1 if not.
+ */
+static int link_connect_to ( struct MPD_LINK* link, int family,
+			     const struct sockaddr* address,
+			     socklen_t length )
+{
+  link->fd = socket( family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+  if ( link->fd < 0 )
+    return -1;
+  if ( connect( link->fd, address, length ) < 0 && errno != EINPROGRESS ) {
+    close( link->fd );
+    link->fd = -1;
+    return -1;
+  }
+  // Writable once it's connected (or has failed).
+  link->state = MPD_LINK_CONNECTING;
+  return 0;
+}
+
+/*!
+ * Try the host's addresses, starting with link->address, until
+ * connecting to one gets under way. If none of them do, they're
+ * looked up again next time.
+ * \return 0 if it's under way, -1 if there's nothing left to try.
+ */
+static int link_try ( struct MPD_PRIVATE* d, struct MPD_LINK* link )
+{
+  // A path is a local socket (as with libmpdclient).
+  if ( d->host->str[0] == '/' ) {
+    struct sockaddr_un local;
+    memset( &local, 0, sizeof local );
+    local.sun_family = AF_UNIX;
+    if ( link->address > 0 ||
+	 g_strlcpy( local.sun_path, d->host->str,
+		    sizeof local.sun_path ) >= sizeof local.sun_path )
+      return -1;
+    return link_connect_to( link, AF_UNIX, (struct sockaddr*)&local,
+			    sizeof local );
+  }
+
+  struct addrinfo* address = d->addresses;
+  int a;
+  for ( a = 0; address != NULL && a < link->address; a++ )
+    address = address->ai_next;
+  for ( ; address != NULL; address = address->ai_next, link->address++ ) {
+    if ( link_connect_to( link, address->ai_family, address->ai_addr,
+			  address->ai_addrlen ) == 0 )
+      return 0;
+  }
+
+  if ( d->addresses != NULL ) {
+    freeaddrinfo( d->addresses );
+    d->addresses = NULL;
+  }
+  return -1;
+}
+
+/*!
+ * Start connecting (once the host has been looked up, if need be).
+ * \return 0 if it's under way, -1 if not.
+ */
+static int link_open ( struct MPD_PRIVATE* d, struct MPD_LINK* link,
+		       gint64 now )
+{
+  link->address = 0;
+  link->deadline = now + link->timeout * 1000LL;
+  if ( d->host->str[0] == '/' || d->addresses != NULL )
+    return link_try( d, link );
+  int found = lookup_start( d );
+  if ( found < 0 )
+    return -1;
+  if ( found > 0 )
+    return link_try( d, link );
+  link->state = MPD_LINK_LOOKUP;
+  return 0;
+}
+
+/*!
+ * A connect() has finished, one way or the other. Wait for MPD's
+ * greeting, or try the next address.
+ * \return NULL if all is well, otherwise what went wrong.
+ */
+static const char* link_connected ( struct MPD_PRIVATE* d,
+				    struct MPD_LINK* link, gint64 now )
+{
+  int error = 0;
+  socklen_t length = sizeof error;
+  if ( getsockopt( link->fd, SOL_SOCKET, SO_ERROR, &error, &length ) < 0 )
+    error = errno;
+  if ( error != 0 ) {
+    close( link->fd );
+    link->fd = -1;
+    link->address++;
+    if ( link_try( d, link ) == 0 )
+      return NULL;
+    return strerror( error );
+  }
+
+  link->async = mpd_async_new( link->fd );
+  link->parser = mpd_parser_new();
+  if ( link->async == NULL || link->parser == NULL )
+    return "out of memory";
+  link->state = MPD_LINK_GREETING;
+  link->deadline = now + link->timeout * 1000LL;
+  return NULL;
+}
+
+/*!
+ * \return what poll() should wait for on the link's socket.
+ */
+static short link_events ( const struct MPD_LINK* link )
+{
+  if ( link->state == MPD_LINK_CONNECTING )
+    return POLLOUT;
+  enum mpd_async_event events = mpd_async_events( link->async );
+  short wanted = 0;
+  if ( events & MPD_ASYNC_EVENT_READ )
+    wanted |= POLLIN;
+  if ( events & MPD_ASYNC_EVENT_WRITE )
+    wanted |= POLLOUT;
+  return wanted;
+}
+
+/*!
+ * Send and receive what the socket is ready for.
+ * \return false if the connection has failed.
+ */
+static bool link_io ( struct MPD_LINK* link, short revents )
+{
+  int events = 0;
+  if ( revents & POLLIN )
+    events |= MPD_ASYNC_EVENT_READ;
+  if ( revents & POLLOUT )
+    events |= MPD_ASYNC_EVENT_WRITE;
+  if ( revents & POLLHUP )
+    events |= MPD_ASYNC_EVENT_HUP;
+  if ( revents & POLLERR )
+    events |= MPD_ASYNC_EVENT_ERROR;
+  return mpd_async_io( link->async, (enum mpd_async_event)events );
+}
+
+/*!
+ * Close the control connection (if it's open).
+ */
+static void control_close ( struct MPD_PRIVATE* d )
+{
+  link_close( &d->control );
+  g_mutex_lock( &d->control_lock );
+  d->stats.connected = false;
+  g_mutex_unlock( &d->control_lock );
+}
+
+/*!
+ * Throw away the batch which was to be sent.
+ */
+static void control_drop ( struct MPD_PRIVATE* d )
+{
+  log_message_warn( d->logger, "Dropped %d MPD request(s)",
+		    d->sending.requests );
+  g_mutex_lock( &d->control_lock );
+  d->stats.dropped += d->sending.requests;
+  g_mutex_unlock( &d->control_lock );
+  memset( &d->sending, 0, sizeof d->sending );
+}
+
+/*!
+ * Something went wrong on the control connection. Drop it; it'll be
+ * reopened for the next command (but not straight away). So is the
+ * batch, unless it had already been sent.
+ */
+static void control_failed ( struct MPD_PRIVATE* d, const char* what,
+			     gint64 now )
+{
+  log_message_error( d->logger, "MPD control connection: %s", what );
+  g_mutex_lock( &d->control_lock );
+  d->stats.failures++;
+  d->stats.consecutive_failures++;
+  g_mutex_unlock( &d->control_lock );
+  metric_add( &control_failure_metric, 1 );
+  bool sent = d->control.state == MPD_LINK_BUSY;
+  control_close( d );
+  d->control_retry = now + CONTROL_RETRY;
+  if ( sent )
+    memset( &d->sending, 0, sizeof d->sending );
+  else if ( d->sending.requests > 0 )
+    control_drop( d );
+}
+
+static void control_connected ( struct MPD_PRIVATE* d )
+{
+  log_message_info( d->logger, "Opened MPD control connection" );
+  g_mutex_lock( &d->control_lock );
+  d->stats.connected = true;
+  g_mutex_unlock( &d->control_lock );
+  metric_add( &reconnect_metrics[1], 1 );
+}
+
+/*!
+ * Take what's in the queue as the next batch.
+ * \return true if there's anything to send.
+ */
+static bool control_take ( struct MPD_PRIVATE* d )
+{
+  g_mutex_lock( &d->control_lock );
+  d->sending = d->queue;
+  memset( &d->queue, 0, sizeof d->queue );
+  g_mutex_unlock( &d->control_lock );
+
+  const struct MPD_COMMANDS* commands = &d->sending;
+  if ( commands->requests == 0 )
+    return false;
+
+  // Everything may have cancelled out.
+  if ( commands->skip == 0 && ! commands->seek &&
+       commands->toggles % 2 == 0 && ! commands->volume &&
+       commands->volume_delta == 0 ) {
+    log_message_info( d->logger, "%d MPD request(s) cancelled out",
+		      commands->requests );
+    memset( &d->sending, 0, sizeof d->sending );
+    return false;
+  }
+
+  return true;
+}
+
+/*!
+ * Send the batch as a single command list. The reply comes back
+ * through the poller (see control_line).
+ */
+static void send_commands ( struct MPD_PRIVATE* d, gint64 now )
+{
+  const struct MPD_COMMANDS* commands = &d->sending;
+  struct mpd_async* async = d->control.async;
+  char argument[16];
+  int sent = 0;
+
+  bool ok = mpd_async_send_command( async, "command_list_begin", NULL );
+  int i;
+  for ( i = 0; i < commands->skip; i++, sent++ )
+    ok = ok && mpd_async_send_command( async, "next", NULL );
+  for ( i = 0; i > commands->skip; i--, sent++ )
+    ok = ok && mpd_async_send_command( async, "previous", NULL );
+  if ( commands->seek ) {
+    g_snprintf( argument, sizeof argument, "%u", commands->seek_seconds );
+    ok = ok && mpd_async_send_command( async, "seekcur", argument, NULL );
+    sent++;
+  }
+  if ( commands->toggles % 2 ) {
+    ok = ok && mpd_async_send_command( async, "pause", NULL );
+    sent++;
+  }
+  if ( commands->volume ) {
+    g_snprintf( argument, sizeof argument, "%d", commands->volume_percent );
+    ok = ok && mpd_async_send_command( async, "setvol", argument, NULL );
+    sent++;
+  }
+  else if ( commands->volume_delta != 0 ) {
+    g_snprintf( argument, sizeof argument, "%d", commands->volume_delta );
+    ok = ok && mpd_async_send_command( async, "volume", argument, NULL );
+    sent++;
+  }
+  ok = ok && mpd_async_send_command( async, "command_list_end", NULL );
+
+  if ( ! ok ) {
+    control_failed( d, "could not send commands", now );
+    return;
+  }
+
+  log_message_info( d->logger, "Sent %d MPD command(s) for %d request(s)",
+		    sent, commands->requests );
+
+  d->control.state = MPD_LINK_BUSY;
+  d->control.deadline = now + d->control.timeout * 1000LL;
+}
+
+/*!
+ * MPD has acknowledged the batch.
+ */
+static void control_done ( struct MPD_PRIVATE* d, gint64 now )
+{
+  gint64 latency = now - d->sending.first_request;
+  if ( trace_enabled )
+    trace_record( "mpd commands", d->sending.first_request, now );
+  g_mutex_lock( &d->control_lock );
+  d->stats.consecutive_failures = 0;
+  d->stats.batches++;
+  d->stats.last_latency = latency;
+  if ( latency > d->stats.max_latency )
+    d->stats.max_latency = latency;
+  d->latency_total += latency;
+  d->stats.mean_latency = d->latency_total / d->stats.batches;
+  g_mutex_unlock( &d->control_lock );
+  metric_observe( &command_metric, latency );
+
+  log_message_info( d->logger, "MPD commands done in %lld us",
+		    (long long)latency );
+
+  memset( &d->sending, 0, sizeof d->sending );
+  d->control.state = MPD_LINK_IDLE;
+
+  // Show what the commands did without waiting for the next tick.
+  __atomic_store_n( &d->poll_now, 1, __ATOMIC_RELAXED );
+}
+
+/*!
+ * A line of MPD's reply to the commands.
+ * \return NULL if all is well, otherwise what went wrong.
+ */
+static const char* control_line ( struct MPD_PRIVATE* d, char* line,
+				  gint64 now )
+{
+  switch ( mpd_parser_feed( d->control.parser, line ) ) {
+  case MPD_PARSER_SUCCESS:
+    control_done( d, now );
+    return NULL;
+  case MPD_PARSER_ERROR:
+    return mpd_parser_get_message( d->control.parser );
+  case MPD_PARSER_PAIR:
+    return NULL;
+  default:
+    return "malformed reply";
+  }
+}
+
+/*!
+ * Take the lock on the queue before folding a request into it.
+ */
+static void queue_lock ( struct MPD_PRIVATE* d )
+{
+  g_mutex_lock( &d->control_lock );
+}
+
+static void poller_wake ( struct MPD_POLLER* poller )
+{
+  uint64_t one = 1;
+  (void)write( poller->wake, &one, sizeof one );
+}
+
+/*!
+ * Count a request which has just been folded into the queue and wake
+ * the poller, which sends it. The queue must be locked (queue_lock);
+ * this unlocks it.
+ */
+static void queue_request ( struct MPD_PRIVATE* d )
+{
+  if ( d->queue.requests++ == 0 )
+    d->queue.first_request = g_get_monotonic_time();
+  g_mutex_unlock( &d->control_lock );
+  if ( d->poller != NULL )
+    poller_wake( d->poller );
+}
+
+struct MPD_HANDLE mpd_new ( const char* host, int port,
+			    struct LOG_HANDLE logger )
 {
   struct MPD_HANDLE handle;
   handle.d = malloc( sizeof( struct MPD_PRIVATE ) );
@@ -218,10 +879,46 @@ struct MPD_HANDLE mpd_create ( const char* host, int port,
   handle.d->logger = logger;
 
   mpd_current_init( &handle.d->current );
+  memset( &handle.d->queue, 0, sizeof handle.d->queue );
+  g_mutex_init( &handle.d->control_lock );
+  memset( &handle.d->stats, 0, sizeof handle.d->stats );
+  handle.d->latency_total = 0;
+  handle.d->poller = NULL;
+  handle.d->server = 0;
+  handle.d->poll_now = 0;
+  handle.d->looking_up = false;
+  handle.d->addresses = NULL;
+  link_init( &handle.d->link, RECONNECT_TIMEOUT );
+  handle.d->poll_due = 0;
+  handle.d->poll_started = 0;
+  handle.d->connected_before = false;
+  handle.d->reply_status = NULL;
+  handle.d->reply_song = NULL;
+  handle.d->reply_song_part = false;
+  handle.d->pending = 0;
+  link_init( &handle.d->control, CONTROL_TIMEOUT );
+  handle.d->control_retry = 0;
+  memset( &handle.d->sending, 0, sizeof handle.d->sending );
+
+  metrics_register( &poll_metric );
+  metrics_register( &command_metric );
+  metrics_register( &reconnect_metrics[0] );
+  metrics_register( &reconnect_metrics[1] );
+  metrics_register( &control_failure_metric );
+
+  handle.d->connection = NULL;
+
+  return handle;
+}
+
+struct MPD_HANDLE mpd_create ( const char* host, int port,
+			       struct LOG_HANDLE logger )
+{
+  struct MPD_HANDLE handle = mpd_new( host, port, logger );
 
   handle.d->connection = mpd_connection_new( handle.d->host->str,
 					     handle.d->port,
-					     0 ); // <- timeout: 0->default
+					     RECONNECT_TIMEOUT );
 
   if ( mpd_connection_get_error( handle.d->connection ) != MPD_ERROR_SUCCESS ) {
     log_message_error( handle.d->logger, "",
@@ -229,6 +926,7 @@ struct MPD_HANDLE mpd_create ( const char* host, int port,
   }
   else {
     handle.d->fd = mpd_connection_get_fd( handle.d->connection );
+    metric_add( &reconnect_metrics[0], 1 );
   }
 
   return handle;
@@ -245,15 +943,20 @@ int mpd_reconnect ( struct MPD_HANDLE handle )
   }
 
   log_message_info( handle.d->logger, "starting new connection." );
+  if ( handle.d->connection != NULL )
+    mpd_connection_free( handle.d->connection );
+  handle.d->fd = -1;
   handle.d->connection = mpd_connection_new( handle.d->host->str,
 					     handle.d->port,
-					     0 ); // <- timeout: 0->default
+					     RECONNECT_TIMEOUT );
   log_message_info( handle.d->logger, "new connection returned %x.", 
 		    handle.d->connection );
 
   enum mpd_error well = mpd_connection_get_error( handle.d->connection );
   if ( well == MPD_ERROR_SUCCESS ) {
     log_message_info( handle.d->logger, "appears to have worked" );
+    handle.d->fd = mpd_connection_get_fd( handle.d->connection );
+    metric_add( &reconnect_metrics[0], 1 );
   }
   else {
     log_message_info( handle.d->logger, "meh: %s", mpd_connection_get_error_message( handle.d->connection ) );
@@ -279,6 +982,9 @@ int mpd_status ( const struct MPD_HANDLE handle )
 void mpd_free ( struct MPD_HANDLE handle )
 {
   if ( handle.d != NULL ) {
+    mpd_poller_stop( handle );
+    g_mutex_clear( &handle.d->control_lock );
+
     mpd_current_free( &handle.d->current );
 
     g_string_free( handle.d->host, TRUE );
@@ -294,12 +1000,478 @@ int mpd_poll ( struct MPD_HANDLE handle )
 {
   int status = -1;
   if ( handle.d != 0 ) {
+    gint64 span = trace_begin();
+    gint64 start = g_get_monotonic_time();
     status = mpd_get_current( handle.d->connection,
 			      handle.d->logger, &handle.d->current );
+    metric_observe( &poll_metric, g_get_monotonic_time() - start );
+    trace_end( "mpd status", span );
   }
   return status;
 }
 
+static void reply_free ( struct MPD_PRIVATE* d )
+{
+  if ( d->reply_status != NULL ) {
+    mpd_status_free( d->reply_status );
+    d->reply_status = NULL;
+  }
+  if ( d->reply_song != NULL ) {
+    mpd_song_free( d->reply_song );
+    d->reply_song = NULL;
+  }
+  d->reply_song_part = false;
+}
+
+/*!
+ * The status connection has failed (or never got going). Try again
+ * in a while.
+ */
+static void status_failed ( struct MPD_PRIVATE* d, const char* what,
+			    gint64 now )
+{
+  if ( d->link.state == MPD_LINK_IDLE || d->link.state == MPD_LINK_BUSY ) {
+    log_message_warn( d->logger, "We lost our connection to MPD (%s): %s. "
+		      "Trying again shortly.", d->host->str, what );
+    recorder_event( RECORDER_DISCONNECTED, d->server, 0, 0 );
+  }
+  else {
+    log_message_error( d->logger, "Connecting to MPD (%s) failed: %s",
+		       d->host->str, what );
+    recorder_event( RECORDER_RECONNECT, d->server, 0,
+		    now - d->poll_started );
+  }
+  link_close( &d->link );
+  reply_free( d );
+  d->poll_due = now + RECONNECT_INTERVAL * 1000LL;
+}
+
+static void status_open ( struct MPD_PRIVATE* d, gint64 now )
+{
+  if ( ! d->connected_before )
+    log_message_info( d->logger, "Connecting to MPD (%s)", d->host->str );
+  else
+    log_message_warn( d->logger, "Reconnecting to MPD (%s) again!",
+		      d->host->str );
+  d->poll_started = now;
+  if ( link_open( d, &d->link, now ) < 0 )
+    status_failed( d, "could not connect", now );
+}
+
+static void status_connected ( struct MPD_PRIVATE* d, gint64 now )
+{
+  log_message_info( d->logger, "Connected to MPD (%s)", d->host->str );
+  recorder_event( RECORDER_RECONNECT, d->server, 1, now - d->poll_started );
+  metric_add( &reconnect_metrics[0], 1 );
+  d->connected_before = true;
+  // The first look is straight away.
+  d->poll_due = now;
+}
+
+/*!
+ * Ask for the status and the current song, as one command list.
+ */
+static void status_send ( struct MPD_PRIVATE* d, gint64 now )
+{
+  struct mpd_async* async = d->link.async;
+  d->reply_status = mpd_status_begin();
+  if ( d->reply_status == NULL ||
+       ! mpd_async_send_command( async, "command_list_ok_begin", NULL ) ||
+       ! mpd_async_send_command( async, "status", NULL ) ||
+       ! mpd_async_send_command( async, "currentsong", NULL ) ||
+       ! mpd_async_send_command( async, "command_list_end", NULL ) ) {
+    status_failed( d, "could not send \"status\"", now );
+    return;
+  }
+  d->link.state = MPD_LINK_BUSY;
+  d->link.deadline = now + d->link.timeout * 1000LL;
+  d->poll_started = now;
+}
+
+static struct MPD_STATE* state_new ( const struct MPD_CURRENT* current,
+				     int changed, int server )
+{
+  struct MPD_STATE* state = g_new( struct MPD_STATE, 1 );
+  state->changed = changed;
+  state->play_status = current->play_status;
+  state->artist = g_strdup( current->artist->str );
+  state->album = g_strdup( current->album->str );
+  state->title = g_strdup( current->title->str );
+  state->times.elapsed = current->elapsed_time;
+  state->times.total = current->total_time;
+  state->polled = g_get_monotonic_time();
+  state->server = server;
+  return state;
+}
+
+/*!
+ * The whole reply is in. Keep it, and hand it over if anything has
+ * changed.
+ * \return NULL if all is well, otherwise what went wrong.
+ */
+static const char* status_done ( struct MPD_PRIVATE* d, gint64 now )
+{
+  if ( mpd_status_get_error( d->reply_status ) != NULL ) {
+    log_message_error( d->logger, "error in status: %s",
+		       mpd_status_get_error( d->reply_status ) );
+    return "error in status";
+  }
+
+  struct MPD_CURRENT current;
+  mpd_current_init( &current );
+  current_from_status( &current, d->reply_status );
+  if ( d->reply_song != NULL )
+    current_from_song( &current, d->reply_song );
+  current_take( &d->current, &current );
+  mpd_current_free( &current );
+  reply_free( d );
+  d->link.state = MPD_LINK_IDLE;
+
+  metric_observe( &poll_metric, now - d->poll_started );
+  if ( trace_enabled )
+    trace_record( "mpd status", d->poll_started, now );
+
+  d->pending |= d->current.changed;
+  if ( d->pending ) {
+    struct MPD_STATE* state = state_new( &d->current, d->pending,
+					 d->server );
+    if ( spsc_queue_push( d->poller->states, state ) == 0 )
+      d->pending = 0;
+    else
+      mpd_state_free( state );
+  }
+
+  d->poll_due = now + POLL_INTERVAL * 1000LL;
+  return NULL;
+}
+
+/*!
+ * A line of MPD's reply to the poll: the status, "list_OK", the
+ * current song (if there is one), "list_OK", then "OK".
+ * \return NULL if all is well, otherwise what went wrong.
+ */
+static const char* status_line ( struct MPD_PRIVATE* d, char* line,
+				 gint64 now )
+{
+  struct mpd_parser* parser = d->link.parser;
+  switch ( mpd_parser_feed( parser, line ) ) {
+  case MPD_PARSER_PAIR: {
+    struct mpd_pair pair = { mpd_parser_get_name( parser ),
+			     mpd_parser_get_value( parser ) };
+    if ( ! d->reply_song_part )
+      mpd_status_feed( d->reply_status, &pair );
+    else if ( d->reply_song == NULL )
+      d->reply_song = mpd_song_begin( &pair );
+    else
+      (void)mpd_song_feed( d->reply_song, &pair );
+    return NULL;
+  }
+  case MPD_PARSER_SUCCESS:
+    if ( mpd_parser_is_discrete( parser ) ) {
+      d->reply_song_part = true;
+      return NULL;
+    }
+    return status_done( d, now );
+  case MPD_PARSER_ERROR:
+    return mpd_parser_get_message( parser );
+  default:
+    return "malformed reply";
+  }
+}
+
+/*!
+ * One of the server's sockets is ready (or has failed): carry on with
+ * whatever that connection is doing.
+ * \return NULL if all is well, otherwise what went wrong.
+ */
+static const char* link_ready ( struct MPD_PRIVATE* d, struct MPD_LINK* link,
+				short revents, gint64 now )
+{
+  if ( link->state == MPD_LINK_CONNECTING )
+    return link_connected( d, link, now );
+
+  bool ok = link_io( link, revents );
+  char* line;
+  while ( ( line = mpd_async_recv_line( link->async ) ) != NULL ) {
+    const char* failed = NULL;
+    switch ( link->state ) {
+    case MPD_LINK_GREETING:
+      if ( strncmp( line, "OK MPD ", 7 ) != 0 )
+	return "that's not MPD";
+      link->state = MPD_LINK_IDLE;
+      if ( link == &d->link )
+	status_connected( d, now );
+      else
+	control_connected( d );
+      break;
+    case MPD_LINK_BUSY:
+      failed = link == &d->link ? status_line( d, line, now ) :
+	control_line( d, line, now );
+      break;
+    default:
+      failed = "unexpected reply";
+      break;
+    }
+    if ( failed != NULL )
+      return failed;
+  }
+  if ( ! ok || mpd_async_get_error( link->async ) != MPD_ERROR_SUCCESS ) {
+    const char* message = mpd_async_get_error_message( link->async );
+    return message != NULL ? message : "connection closed";
+  }
+  return NULL;
+}
+
+/*!
+ * Get a link going again once its host has been looked up, and give
+ * up on anything which has taken too long.
+ * \return NULL if all is well, otherwise what went wrong.
+ */
+static const char* link_check ( struct MPD_PRIVATE* d, struct MPD_LINK* link,
+				gint64 now )
+{
+  if ( link->state == MPD_LINK_LOOKUP ) {
+    int found = lookup_check( d );
+    if ( found < 0 || ( found > 0 && link_try( d, link ) < 0 ) )
+      return "could not connect";
+  }
+  if ( link->state != MPD_LINK_CLOSED && link->state != MPD_LINK_IDLE &&
+       now >= link->deadline )
+    return "timed out";
+  return NULL;
+}
+
+static void link_failed ( struct MPD_PRIVATE* d, struct MPD_LINK* link,
+			  const char* what, gint64 now )
+{
+  if ( link == &d->link ) {
+    status_failed( d, what, now );
+  }
+  else if ( link->state == MPD_LINK_IDLE ) {
+    // MPD closes connections which have been idle for a while. That's
+    // no failure: it's reopened for the next command.
+    log_message_info( d->logger, "MPD control connection closed: %s", what );
+    control_close( d );
+  }
+  else {
+    control_failed( d, what, now );
+  }
+}
+
+/*!
+ * Start whatever the server is due: connecting, a poll, or sending
+ * commands.
+ */
+static void server_start ( struct MPD_PRIVATE* d, gint64 now )
+{
+  // A poll asked for during a poll is done after it.
+  if ( d->link.state == MPD_LINK_IDLE &&
+       __atomic_exchange_n( &d->poll_now, 0, __ATOMIC_RELAXED ) )
+    d->poll_due = now;
+  if ( d->link.state == MPD_LINK_CLOSED && now >= d->poll_due )
+    status_open( d, now );
+  else if ( d->link.state == MPD_LINK_IDLE && now >= d->poll_due )
+    status_send( d, now );
+
+  // More requests pile up in the queue while a batch is on its way.
+  if ( d->sending.requests == 0 &&
+       ( d->control.state == MPD_LINK_CLOSED ||
+	 d->control.state == MPD_LINK_IDLE ) )
+    (void)control_take( d );
+  if ( d->sending.requests > 0 ) {
+    if ( d->control.state == MPD_LINK_CLOSED ) {
+      if ( now < d->control_retry )
+	control_drop( d );
+      else if ( link_open( d, &d->control, now ) < 0 )
+	control_failed( d, "could not connect", now );
+    }
+    else if ( d->control.state == MPD_LINK_IDLE ) {
+      send_commands( d, now );
+    }
+  }
+}
+
+/*!
+ * \return when the link next needs looking at, if that's before next.
+ */
+static gint64 link_next ( const struct MPD_LINK* link, gint64 now,
+			  gint64 next )
+{
+  gint64 due = next;
+  if ( link->state == MPD_LINK_LOOKUP )
+    due = now + LOOKUP_CHECK * 1000LL;
+  else if ( link->state != MPD_LINK_CLOSED && link->state != MPD_LINK_IDLE )
+    due = link->deadline;
+  return due < next ? due : next;
+}
+
+static void server_close ( struct MPD_PRIVATE* d )
+{
+  link_close( &d->link );
+  reply_free( d );
+  control_close( d );
+  memset( &d->sending, 0, sizeof d->sending );
+  lookup_free( d );
+}
+
+/*!
+ * The poller: one thread, and one poll() for every server's sockets.
+ */
+static gpointer poller_thread ( gpointer data )
+{
+  struct MPD_POLLER* poller = data;
+  struct pollfd fds[1 + 2 * MPD_SERVERS_MAX];
+  struct MPD_PRIVATE* servers[1 + 2 * MPD_SERVERS_MAX];
+  struct MPD_LINK* links[1 + 2 * MPD_SERVERS_MAX];
+
+  trace_thread_name( "mpd" );
+
+  while ( ! __atomic_load_n( &poller->stop, __ATOMIC_ACQUIRE ) ) {
+    gint64 now = g_get_monotonic_time();
+    gint64 next = now + POLL_INTERVAL * 1000LL;
+    int n = 0;
+    fds[n].fd = poller->wake;
+    fds[n].events = POLLIN;
+    n++;
+    int s;
+    for ( s = 0; s < poller->count; s++ ) {
+      struct MPD_PRIVATE* d = poller->servers[s];
+      server_start( d, now );
+      if ( d->link.state == MPD_LINK_CLOSED ||
+	   d->link.state == MPD_LINK_IDLE )
+	next = d->poll_due < next ? d->poll_due : next;
+      struct MPD_LINK* link[] = { &d->link, &d->control };
+      int l;
+      for ( l = 0; l < 2; l++ ) {
+	next = link_next( link[l], now, next );
+	if ( link[l]->fd < 0 )
+	  continue;
+	fds[n].fd = link[l]->fd;
+	fds[n].events = link_events( link[l] );
+	servers[n] = d;
+	links[n] = link[l];
+	n++;
+      }
+    }
+
+    int timeout = next > now ? ( next - now + 999 ) / 1000 : 0;
+    if ( poll( fds, n, timeout ) < 0 ) {
+      int i;
+      for ( i = 0; i < n; i++ )
+	fds[i].revents = 0;
+    }
+    if ( fds[0].revents & POLLIN ) {
+      uint64_t count;
+      (void)read( poller->wake, &count, sizeof count );
+    }
+
+    now = g_get_monotonic_time();
+    int i;
+    for ( i = 1; i < n; i++ ) {
+      if ( fds[i].revents == 0 )
+	continue;
+      const char* failed = link_ready( servers[i], links[i], fds[i].revents,
+				       now );
+      if ( failed != NULL )
+	link_failed( servers[i], links[i], failed, now );
+    }
+    for ( s = 0; s < poller->count; s++ ) {
+      struct MPD_PRIVATE* d = poller->servers[s];
+      struct MPD_LINK* link[] = { &d->link, &d->control };
+      int l;
+      for ( l = 0; l < 2; l++ ) {
+	const char* failed = link_check( d, link[l], now );
+	if ( failed != NULL )
+	  link_failed( d, link[l], failed, now );
+      }
+    }
+  }
+
+  int s;
+  for ( s = 0; s < poller->count; s++ )
+    server_close( poller->servers[s] );
+
+  return NULL;
+}
+
+int mpd_poller_start ( struct MPD_HANDLE* handles, int count,
+		       struct SPSC_QUEUE_HANDLE states )
+{
+  if ( count < 1 || count > MPD_SERVERS_MAX )
+    return -1;
+  int s;
+  for ( s = 0; s < count; s++ ) {
+    if ( handles[s].d == NULL || handles[s].d->poller != NULL )
+      return -1;
+  }
+
+  struct MPD_POLLER* poller = g_new0( struct MPD_POLLER, 1 );
+  poller->wake = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  if ( poller->wake < 0 ) {
+    g_free( poller );
+    return -1;
+  }
+  poller->states = states;
+  poller->stop = 0;
+  poller->count = count;
+  for ( s = 0; s < count; s++ ) {
+    struct MPD_PRIVATE* d = handles[s].d;
+    poller->servers[s] = d;
+    d->server = s;
+    d->poller = poller;
+    // The poller makes its own connections.
+    if ( d->connection != NULL ) {
+      mpd_connection_free( d->connection );
+      d->connection = NULL;
+      d->fd = -1;
+    }
+    // The first look is straight away.
+    d->poll_due = 0;
+    d->pending = 0;
+    d->poll_now = 0;
+  }
+  poller->thread = g_thread_new( "mpd", poller_thread, poller );
+
+  return 0;
+}
+
+void mpd_poll_soon ( struct MPD_HANDLE handle )
+{
+  if ( handle.d != NULL ) {
+    __atomic_store_n( &handle.d->poll_now, 1, __ATOMIC_RELAXED );
+    if ( handle.d->poller != NULL )
+      poller_wake( handle.d->poller );
+  }
+}
+
+void mpd_poller_stop ( struct MPD_HANDLE handle )
+{
+  if ( handle.d == NULL || handle.d->poller == NULL )
+    return;
+
+  struct MPD_POLLER* poller = handle.d->poller;
+
+  __atomic_store_n( &poller->stop, 1, __ATOMIC_RELEASE );
+  poller_wake( poller );
+  g_thread_join( poller->thread );
+
+  int s;
+  for ( s = 0; s < poller->count; s++ )
+    poller->servers[s]->poller = NULL;
+  close( poller->wake );
+  g_free( poller );
+}
+
+void mpd_state_free ( struct MPD_STATE* state )
+{
+  if ( state != NULL ) {
+    g_free( state->artist );
+    g_free( state->album );
+    g_free( state->title );
+    g_free( state );
+  }
+}
+
 bool mpd_changed ( const struct MPD_HANDLE handle, int flags )
 {
   bool changed = false;
@@ -358,15 +1530,82 @@ struct MPD_TIMES mpd_times ( const struct MPD_HANDLE handle )
 void mpd_play_pause ( struct MPD_HANDLE handle )
 {
   if ( handle.d != 0 ) {
-    struct mpd_connection* connection = handle.d->connection;
+    queue_lock( handle.d );
+    handle.d->queue.toggles++;
+    queue_request( handle.d );
+  }
+}
 
-    mpd_send_toggle_pause( connection );
+void mpd_next ( struct MPD_HANDLE handle )
+{
+  if ( handle.d != 0 ) {
+    queue_lock( handle.d );
+    handle.d->queue.skip++;
+    // A seek was for the song we're leaving.
+    handle.d->queue.seek = false;
+    queue_request( handle.d );
+  }
+}
+
+void mpd_previous ( struct MPD_HANDLE handle )
+{
+  if ( handle.d != 0 ) {
+    queue_lock( handle.d );
+    handle.d->queue.skip--;
+    handle.d->queue.seek = false;
+    queue_request( handle.d );
+  }
+}
 
-    if ( ( mpd_connection_get_error( connection ) != MPD_ERROR_SUCCESS ) ||
-	 ! mpd_response_finish( connection ) ) {
-      
-      log_message_error( handle.d->logger, 
-			 "Well, something went wrong with the MPD play/pause toggle." );
+void mpd_seek ( struct MPD_HANDLE handle, unsigned int seconds )
+{
+  if ( handle.d != 0 ) {
+    queue_lock( handle.d );
+    handle.d->queue.seek = true;
+    handle.d->queue.seek_seconds = seconds;
+    queue_request( handle.d );
+  }
+}
+
+void mpd_set_volume ( struct MPD_HANDLE handle, int percent )
+{
+  if ( handle.d != 0 ) {
+    if ( percent < 0 )
+      percent = 0;
+    else if ( percent > 100 )
+      percent = 100;
+    queue_lock( handle.d );
+    handle.d->queue.volume = true;
+    handle.d->queue.volume_percent = percent;
+    handle.d->queue.volume_delta = 0;
+    queue_request( handle.d );
+  }
+}
+
+void mpd_change_volume ( struct MPD_HANDLE handle, int delta )
+{
+  if ( handle.d != 0 ) {
+    queue_lock( handle.d );
+    if ( handle.d->queue.volume ) {
+      int percent = handle.d->queue.volume_percent + delta;
+      handle.d->queue.volume_percent = percent < 0 ? 0 :
+	percent > 100 ? 100 : percent;
     }
+    else {
+      handle.d->queue.volume_delta += delta;
+    }
+    queue_request( handle.d );
+  }
+}
+
+struct MPD_CONTROL_STATS mpd_control_stats ( const struct MPD_HANDLE handle )
+{
+  struct MPD_CONTROL_STATS stats;
+  memset( &stats, 0, sizeof stats );
+  if ( handle.d != 0 ) {
+    g_mutex_lock( &handle.d->control_lock );
+    stats = handle.d->stats;
+    g_mutex_unlock( &handle.d->control_lock );
   }
+  return stats;
 }
@@ -6,8 +6,11 @@
 #define MPD_INTF_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
+#include "spsc_queue.h"
+
 struct MPD_PRIVATE;
 struct LOG_HANDLE;
 
@@ -15,6 +18,9 @@ struct MPD_HANDLE {
   struct MPD_PRIVATE* d;
 };
 
+//! The most servers one poller looks after.
+#define MPD_SERVERS_MAX 8
+
 /*!
  * Simple status of MPD.
  */
@@ -43,6 +49,24 @@ struct MPD_TIMES {
   time_t elapsed;
   time_t total;
 };
+/*!
+ * Everything learned from one poll, as passed from the poller thread
+ * to the display. Never changed once made, except that whoever pops
+ * it may fold in the changed bits of older states it skips.
+ */
+struct MPD_STATE {
+  //! MPD_CHANGED bits since the previous state handed over.
+  int changed;
+  enum MPD_PLAY_STATUS play_status;
+  char* artist;
+  char* album;
+  char* title;
+  struct MPD_TIMES times;
+  //! When the poll finished (monotonic, us).
+  int64_t polled;
+  //! Which of the poller's servers this came from (0 for the first).
+  int server;
+};
 /*!
  * Connect to the music player daemon on the given host at the
  * given port.
@@ -55,6 +79,16 @@ struct MPD_TIMES {
  */
 struct MPD_HANDLE mpd_create ( const char* host, int port,
 			       struct LOG_HANDLE logger );
+/*!
+ * Like mpd_create, but don't connect yet: the poller does that (see
+ * mpd_poller_start), so this never waits on the network.
+ * \param[in] host the host name.
+ * \param[in] port the port.
+ * \param[in,out] logger the handle to the logger service.
+ * \return a handle to the (not yet connected) MPD server.
+ */
+struct MPD_HANDLE mpd_new ( const char* host, int port,
+			    struct LOG_HANDLE logger );
 /*!
  * Somehow we lost our connection, so we try to connect again.
  * \param[in,out] handle MPD connection.
@@ -73,6 +107,25 @@ int mpd_status ( const struct MPD_HANDLE handle );
  * \param[in,out] handle MPD connection.
  */
 void mpd_free ( struct MPD_HANDLE handle );
+/*!
+ * How control commands have been faring. Latency is from the first
+ * request of a batch until MPD acknowledged it (microseconds).
+ */
+struct MPD_CONTROL_STATS {
+  //! Is the control connection open?
+  bool connected;
+  //! Command lists acknowledged.
+  unsigned int batches;
+  //! Command lists (or connection attempts) which failed.
+  unsigned int failures;
+  //! Failures since the last success.
+  unsigned int consecutive_failures;
+  //! Requests thrown away because there was no connection.
+  unsigned int dropped;
+  long long last_latency;
+  long long max_latency;
+  long long mean_latency;
+};
 /*!
  * Poll the MPD daemon.
  * \parma[in,out] handle MPD connection.
@@ -80,6 +133,40 @@ void mpd_free ( struct MPD_HANDLE handle );
  * the connection to the server.
  */
 int mpd_poll( struct MPD_HANDLE handle );
+/*!
+ * Poll one or more MPD servers (connecting and reconnecting as
+ * necessary) from one thread. Its connections never block: a server
+ * which is slow, dead or still being looked up times out on its own
+ * and holds up neither the main loop nor the others. Control commands
+ * are sent from the same thread. Whenever something has changed, a
+ * struct MPD_STATE is pushed on to states; pop them from the main loop
+ * and free them with mpd_state_free. Don't call mpd_poll or the
+ * accessors below while this is running. A connection made by
+ * mpd_create is closed: the poller makes its own.
+ * \param[in,out] handles MPD connections. A state's server is its
+ * index here.
+ * \param[in] count how many (at most MPD_SERVERS_MAX).
+ * \param[in] states where the states go. The handles don't own it.
+ * \return 0 if the thread started, -1 otherwise.
+ */
+int mpd_poller_start ( struct MPD_HANDLE* handles, int count,
+		       struct SPSC_QUEUE_HANDLE states );
+/*!
+ * Poll again now rather than at the next tick (say, just after a
+ * command). Any thread may call it.
+ * \param[in] handle MPD connection.
+ */
+void mpd_poll_soon ( struct MPD_HANDLE handle );
+/*!
+ * Stop the poller thread and wait for it. This stops polling every
+ * server started with this one. mpd_free does this too.
+ * \param[in,out] handle MPD connection.
+ */
+void mpd_poller_stop ( struct MPD_HANDLE handle );
+/*!
+ * \param[in] state a state popped from the queue (may be NULL).
+ */
+void mpd_state_free ( struct MPD_STATE* state );
 /*!
  * \param[in] handle MPD connection.
  * \param[in] flags or'd list of fields to query (or MPD_CHANGED_ANY).
@@ -107,8 +194,44 @@ char* mpd_title ( const struct MPD_HANDLE handle );
  * \return the time attributes of the current song.
  */
 struct MPD_TIMES mpd_times ( const struct MPD_HANDLE handle );
+/*
+ * The control functions below don't talk to MPD directly. They queue
+ * the request and return straight away; the poller (mpd_poller_start)
+ * sends the queue as one command list on a separate control
+ * connection (connecting first if need be) and waits for the reply.
+ * Requests which arrive while a list is in flight are folded together
+ * (toggles cancel in pairs, skips net out, the last seek or volume
+ * wins).
+ */
 /*!
  * Toggle the playing / paused state.
  */
 void mpd_play_pause ( struct MPD_HANDLE handle );
+/*!
+ * Skip to the next song.
+ */
+void mpd_next ( struct MPD_HANDLE handle );
+/*!
+ * Go back to the previous song.
+ */
+void mpd_previous ( struct MPD_HANDLE handle );
+/*!
+ * Seek within the current song.
+ * \param[in] seconds the new position from the start of the song.
+ */
+void mpd_seek ( struct MPD_HANDLE handle, unsigned int seconds );
+/*!
+ * Set the volume.
+ * \param[in] percent the volume (0 to 100).
+ */
+void mpd_set_volume ( struct MPD_HANDLE handle, int percent );
+/*!
+ * Change the volume (e.g. one step of a rotary encoder).
+ * \param[in] delta percent to add (or subtract).
+ */
+void mpd_change_volume ( struct MPD_HANDLE handle, int delta );
+/*!
+ * \return statistics about the control connection.
+ */
+struct MPD_CONTROL_STATS mpd_control_stats ( const struct MPD_HANDLE handle );
 #endif
@@ -0,0 +1,169 @@
+/*
+ * The writing side of the sequence lock. There is only ever one
+ * writer (the main loop), so the sequence needs no read-modify-write.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+
+#include "glib.h"
+
+#include "mpd_intf.h"
+#include "now_playing_shm.h"
+#include "now_playing.h"
+
+struct NOW_PLAYING_PRIVATE {
+  int status;
+  struct NOW_PLAYING* shared;
+  // Kept open for the lock that says the segment is ours.
+  int fd;
+};
+
+/*!
+ * FNV-1a over the artist and album: a cover ID readers can compare.
+ */
+static uint64_t cover_id ( const char* artist, const char* album )
+{
+  if ( *artist == '\0' && *album == '\0' )
+    return 0;
+
+  uint64_t hash = 14695981039346656037ULL;
+  const char* strings[2] = { artist, album };
+  int s;
+  for ( s = 0; s < 2; s++ ) {
+    const unsigned char* p = (const unsigned char*)strings[s];
+    // Include the NUL so "ab" + "c" differs from "a" + "bc".
+    do {
+      hash ^= *p;
+      hash *= 1099511628211ULL;
+    } while ( *p++ != '\0' );
+  }
+  return hash != 0 ? hash : 1;
+}
+
+// Bracket each change: readers retry if the sequence is odd or moved.
+static void write_begin ( struct NOW_PLAYING* shared )
+{
+  __atomic_store_n( &shared->sequence, shared->sequence + 1,
+		    __ATOMIC_RELAXED );
+  __atomic_thread_fence( __ATOMIC_RELEASE );
+}
+
+static void write_end ( struct NOW_PLAYING* shared )
+{
+  __atomic_store_n( &shared->sequence, shared->sequence + 1,
+		    __ATOMIC_RELEASE );
+}
+
+struct NOW_PLAYING_HANDLE now_playing_create ( void )
+{
+  struct NOW_PLAYING_HANDLE handle;
+  handle.d = malloc( sizeof( struct NOW_PLAYING_PRIVATE ) );
+  handle.d->status = -1;
+  handle.d->shared = NULL;
+  handle.d->fd = -1;
+
+  int fd = shm_open( NOW_PLAYING_SHM_NAME, O_RDWR | O_CREAT | O_CLOEXEC,
+		     0644 );
+  if ( fd < 0 ) {
+    printf( "Warning: Could not open shared memory %s\n",
+	    NOW_PLAYING_SHM_NAME );
+    return handle;
+  }
+
+  // Readers only know the one name, so there can only be one writer:
+  // two would garble each other's updates. The lock goes when we do,
+  // however we go, so the next run can have it.
+  if ( flock( fd, LOCK_EX | LOCK_NB ) < 0 ) {
+    printf( "Warning: Shared memory %s is already in use by another "
+	    "mpddisplay\n", NOW_PLAYING_SHM_NAME );
+    close( fd );
+    return handle;
+  }
+
+  if ( ftruncate( fd, sizeof( struct NOW_PLAYING ) ) < 0 ) {
+    printf( "Warning: Could not size shared memory %s\n",
+	    NOW_PLAYING_SHM_NAME );
+    close( fd );
+    return handle;
+  }
+
+  void* map = mmap( NULL, sizeof( struct NOW_PLAYING ),
+		    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if ( map == MAP_FAILED ) {
+    close( fd );
+    printf( "Warning: Could not map shared memory %s\n",
+	    NOW_PLAYING_SHM_NAME );
+    return handle;
+  }
+
+  // A segment left by an earlier run may still be mapped by readers;
+  // carry on with its sequence rather than pull it out from under them.
+  // Otherwise readers check the magic number, so it goes in last.
+  struct NOW_PLAYING* shared = map;
+  if ( shared->magic != NOW_PLAYING_MAGIC ||
+       shared->version != NOW_PLAYING_VERSION ) {
+    memset( shared, 0, sizeof *shared );
+    shared->version = NOW_PLAYING_VERSION;
+    __atomic_store_n( &shared->magic, NOW_PLAYING_MAGIC, __ATOMIC_RELEASE );
+  }
+  else if ( shared->sequence & 1 ) {
+    // We died half way through an update.
+    write_end( shared );
+  }
+
+  handle.d->shared = shared;
+  handle.d->fd = fd;
+  handle.d->status = 0;
+
+  return handle;
+}
+
+int now_playing_status ( struct NOW_PLAYING_HANDLE handle )
+{
+  if ( handle.d == NULL )
+    return -1;
+  return handle.d->status;
+}
+
+void now_playing_publish ( struct NOW_PLAYING_HANDLE handle,
+			   const struct MPD_STATE* state )
+{
+  if ( handle.d == NULL || handle.d->shared == NULL )
+    return;
+
+  struct NOW_PLAYING* shared = handle.d->shared;
+
+  write_begin( shared );
+  shared->play_status = state->play_status;
+  shared->elapsed = state->times.elapsed;
+  shared->polled = state->polled;
+  shared->total = state->times.total;
+  shared->cover_id = cover_id( state->artist, state->album );
+  shared->updates++;
+  g_strlcpy( shared->artist, state->artist, NOW_PLAYING_TEXT_MAX );
+  g_strlcpy( shared->album, state->album, NOW_PLAYING_TEXT_MAX );
+  g_strlcpy( shared->title, state->title, NOW_PLAYING_TEXT_MAX );
+  write_end( shared );
+}
+
+void now_playing_free ( struct NOW_PLAYING_HANDLE handle )
+{
+  if ( handle.d != NULL ) {
+    if ( handle.d->shared != NULL ) {
+      // Nobody is watching MPD now.
+      struct NOW_PLAYING* shared = handle.d->shared;
+      write_begin( shared );
+      shared->play_status = NOW_PLAYING_NOSONG;
+      shared->updates++;
+      write_end( shared );
+
+      munmap( handle.d->shared, sizeof( struct NOW_PLAYING ) );
+    }
+    if ( handle.d->fd >= 0 )
+      close( handle.d->fd );
+    free( handle.d );
+    handle.d = NULL;
+  }
+}
@@ -0,0 +1,39 @@
+/*
+ * Publish the MPD state in shared memory for other programs (see
+ * now_playing_shm.h for the reading side).
+ */
+#ifndef NOW_PLAYING_H
+#define NOW_PLAYING_H
+
+struct MPD_STATE;
+struct NOW_PLAYING_PRIVATE;
+
+struct NOW_PLAYING_HANDLE {
+  struct NOW_PLAYING_PRIVATE* d;
+};
+
+/*!
+ * Create (or take over) the shared memory segment. Only one process
+ * may publish at a time; while another has it, this fails.
+ * \return a handle to the publisher. Check it with now_playing_status.
+ */
+struct NOW_PLAYING_HANDLE now_playing_create ( void );
+/*!
+ * \param[in] handle the publisher.
+ * \return 0 if everything is ok, -1 otherwise.
+ */
+int now_playing_status ( struct NOW_PLAYING_HANDLE handle );
+/*!
+ * Publish a new state. Only one thread may do this.
+ * \param[in] handle the publisher.
+ * \param[in] state what MPD is doing.
+ */
+void now_playing_publish ( struct NOW_PLAYING_HANDLE handle,
+			   const struct MPD_STATE* state );
+/*!
+ * Mark the state as unknown and let go of the segment. It is left in
+ * place so readers carry on when we start again.
+ * \param[in] handle the publisher.
+ */
+void now_playing_free ( struct NOW_PLAYING_HANDLE handle );
+#endif
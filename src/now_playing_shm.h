@@ -0,0 +1,148 @@
+/*
+ * What mpddisplay is showing, published in POSIX shared memory so
+ * other programs on the Pi (an LED strip, a status bar) don't need
+ * their own MPD connections. This header is all a reader needs: it
+ * only depends on libc (link with -lrt on older systems).
+ *
+ *   const struct NOW_PLAYING* shared = now_playing_map();
+ *   struct NOW_PLAYING now;
+ *   if ( shared != NULL && now_playing_read( shared, &now ) == 0 )
+ *     printf( "%s (%lld s)\n", now.title,
+ *             (long long)now_playing_elapsed( &now ) );
+ *
+ * The segment is written under a sequence lock: the writer makes the
+ * sequence odd, changes the data and makes it even again. Readers
+ * copy the data and check that the sequence didn't move, so they never
+ * wait on the writer (or it on them).
+ */
+#ifndef NOW_PLAYING_SHM_H
+#define NOW_PLAYING_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define NOW_PLAYING_SHM_NAME "/mpddisplay-now-playing"
+#define NOW_PLAYING_MAGIC 0x4d504450 // "MPDP"
+#define NOW_PLAYING_VERSION 1
+//! Longest string (in bytes, including the NUL).
+#define NOW_PLAYING_TEXT_MAX 256
+//! How often now_playing_read tries before giving up.
+#define NOW_PLAYING_READ_TRIES 16
+
+/*!
+ * Same values as enum MPD_PLAY_STATUS.
+ */
+enum NOW_PLAYING_STATUS {
+  NOW_PLAYING_NOSONG,
+  NOW_PLAYING_STOPPED,
+  NOW_PLAYING_PLAYING,
+  NOW_PLAYING_PAUSED
+};
+
+struct NOW_PLAYING {
+  uint32_t magic;
+  uint32_t version;
+  //! Odd while an update is under way.
+  uint32_t sequence;
+  //! A NOW_PLAYING_STATUS.
+  int32_t play_status;
+  //! Seconds into the song when it was last polled...
+  int64_t elapsed;
+  //! ...which was at this CLOCK_MONOTONIC time (microseconds).
+  int64_t polled;
+  //! Length of the song in seconds.
+  int64_t total;
+  //! Changes whenever the album (and so the cover) does. 0 if there
+  //! isn't one.
+  uint64_t cover_id;
+  //! Updates published since mpddisplay started.
+  uint64_t updates;
+  char artist[NOW_PLAYING_TEXT_MAX];
+  char album[NOW_PLAYING_TEXT_MAX];
+  char title[NOW_PLAYING_TEXT_MAX];
+};
+
+/*!
+ * Map the segment read only. It stays mapped for good.
+ * \return the segment, or NULL if mpddisplay isn't publishing one (or
+ * is still setting it up: try again later).
+ */
+static inline const struct NOW_PLAYING* now_playing_map ( void )
+{
+  int fd = shm_open( NOW_PLAYING_SHM_NAME, O_RDONLY, 0 );
+  if ( fd < 0 )
+    return NULL;
+  // Until mpddisplay has sized it, reading the mapping would get us a
+  // SIGBUS.
+  struct stat st;
+  if ( fstat( fd, &st ) < 0 ||
+       st.st_size < (off_t)sizeof( struct NOW_PLAYING ) ) {
+    close( fd );
+    return NULL;
+  }
+  void* map = mmap( NULL, sizeof( struct NOW_PLAYING ), PROT_READ,
+		    MAP_SHARED, fd, 0 );
+  close( fd );
+  if ( map == MAP_FAILED )
+    return NULL;
+  const struct NOW_PLAYING* shared = map;
+  if ( __atomic_load_n( &shared->magic, __ATOMIC_ACQUIRE ) !=
+       NOW_PLAYING_MAGIC ||
+       shared->version != NOW_PLAYING_VERSION ) {
+    munmap( map, sizeof( struct NOW_PLAYING ) );
+    return NULL;
+  }
+  return shared;
+}
+
+/*!
+ * Take a consistent copy. Never blocks.
+ * \param[in] shared the segment.
+ * \param[out] now the copy.
+ * \return 0 if the copy is good, -1 if the writer kept getting in the
+ * way (just try again later).
+ */
+static inline int now_playing_read ( const struct NOW_PLAYING* shared,
+				     struct NOW_PLAYING* now )
+{
+  int tries;
+  for ( tries = 0; tries < NOW_PLAYING_READ_TRIES; tries++ ) {
+    uint32_t before = __atomic_load_n( &shared->sequence, __ATOMIC_ACQUIRE );
+    if ( before & 1 )
+      continue;
+    memcpy( now, shared, sizeof *now );
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    uint32_t after = __atomic_load_n( &shared->sequence, __ATOMIC_RELAXED );
+    if ( before == after ) {
+      now->artist[NOW_PLAYING_TEXT_MAX-1] = '\0';
+      now->album[NOW_PLAYING_TEXT_MAX-1] = '\0';
+      now->title[NOW_PLAYING_TEXT_MAX-1] = '\0';
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*!
+ * \param[in] now a copy from now_playing_read.
+ * \return the elapsed time (seconds) as of now, counting on from the
+ * last poll if the song is playing.
+ */
+static inline int64_t now_playing_elapsed ( const struct NOW_PLAYING* now )
+{
+  if ( now->play_status != NOW_PLAYING_PLAYING )
+    return now->elapsed;
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  int64_t us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  int64_t elapsed = now->elapsed + ( us - now->polled ) / 1000000;
+  if ( now->total > 0 && elapsed > now->total )
+    elapsed = now->total;
+  return elapsed;
+}
+#endif
@@ -0,0 +1,341 @@
+/*
+ * Does the main loop keep up while the other threads are flat out?
+ * This stands in for mpddisplay's pipeline, built from the same
+ * pieces: a poller thread pushing states into a queue as fast as it
+ * will take them, a cover thread decoding and scaling a cover over and
+ * over and handing each one back, and touches arriving on a pipe at
+ * random, all dispatched from a GLib main loop. There is no screen, so
+ * each state is "drawn" by burning draw_us of CPU time.
+ *
+ * It reports how long each touch waited for the main loop to get to
+ * it, how long each frame took (longer than draw_us when the other
+ * threads get the CPU instead) and how long states sat in the queue.
+ *
+ * usage: pipeline_stress [seconds [draw_us [bound_ms]]]
+ *
+ * Run it from the source directory (it decodes no_cover.png). Exits
+ * non-zero if the 99th percentile of the touch latency or the frame
+ * time goes past bound_ms.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "glib.h"
+#include "glib-unix.h"
+
+#include "image_intf.h"
+#include "spsc_queue.h"
+
+// The same sizes as mpddisplay's queues (main.c and cover_image.c).
+#define STATES_CAPACITY 16
+#define COVERS_CAPACITY 32
+// The cover widget's box on the 7" screen.
+#define COVER_WIDTH 390
+#define COVER_HEIGHT 386
+// Touches come this far apart, give or take (us).
+#define TOUCH_INTERVAL_MIN 1000
+#define TOUCH_INTERVAL_MAX 10000
+// Most samples kept of each kind.
+#define SAMPLES_MAX 1000000
+
+struct SAMPLES {
+  const char* name;
+  gint64* values;
+  int count;
+};
+
+struct STATE {
+  gint64 pushed;
+  gchar* title;
+};
+
+struct STRESS {
+  struct SPSC_QUEUE_HANDLE states;
+  struct SPSC_QUEUE_HANDLE covers;
+  int touches[2];
+  int stop;
+  gint64 draw_us;
+  gchar* cover_data;
+  gsize cover_bytes;
+  //! Written by the threads, read once they've been joined.
+  unsigned long states_pushed;
+  unsigned long states_dropped;
+  unsigned long covers_made;
+  struct SAMPLES touch_latency;
+  struct SAMPLES frame_time;
+  struct SAMPLES handoff;
+  GMainLoop* loop;
+};
+
+static void samples_init ( struct SAMPLES* samples, const char* name )
+{
+  samples->name = name;
+  samples->values = g_new( gint64, SAMPLES_MAX );
+  samples->count = 0;
+}
+
+static void sample_add ( struct SAMPLES* samples, gint64 value )
+{
+  if ( samples->count < SAMPLES_MAX )
+    samples->values[samples->count++] = value;
+}
+
+static int compare_gint64 ( const void* a, const void* b )
+{
+  gint64 x = *(const gint64*)a;
+  gint64 y = *(const gint64*)b;
+  return x < y ? -1 : x > y;
+}
+
+/*!
+ * Print the median, 99th percentile and worst of the samples.
+ * \return the 99th percentile (us).
+ */
+static gint64 report ( struct SAMPLES* samples )
+{
+  if ( samples->count == 0 ) {
+    printf( "%-14s none\n", samples->name );
+    return 0;
+  }
+  qsort( samples->values, samples->count, sizeof( gint64 ), compare_gint64 );
+  gint64 p50 = samples->values[( samples->count - 1 ) * 50 / 100];
+  gint64 p99 = samples->values[( samples->count - 1 ) * 99 / 100];
+  gint64 max = samples->values[samples->count - 1];
+  printf( "%-14s %8d  p50 %8.2f ms  p99 %8.2f ms  max %8.2f ms\n",
+	  samples->name, samples->count, p50 / 1000., p99 / 1000.,
+	  max / 1000. );
+  return p99;
+}
+
+static gint64 thread_cpu_time ( void )
+{
+  struct timespec now;
+  clock_gettime( CLOCK_THREAD_CPUTIME_ID, &now );
+  return (gint64)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int stopping ( struct STRESS* stress )
+{
+  return __atomic_load_n( &stress->stop, __ATOMIC_RELAXED );
+}
+
+static void state_free ( struct STATE* state )
+{
+  g_free( state->title );
+  g_free( state );
+}
+
+/*!
+ * Like the MPD poller, except that MPD always has news.
+ */
+static gpointer poller ( gpointer data )
+{
+  struct STRESS* stress = data;
+  unsigned long n = 0;
+  while ( ! stopping( stress ) ) {
+    struct STATE* state = g_new( struct STATE, 1 );
+    state->title = g_strdup_printf( "Track %lu", n++ );
+    state->pushed = g_get_monotonic_time();
+    if ( spsc_queue_push( stress->states, state ) == 0 )
+      stress->states_pushed++;
+    else {
+      // The real poller keeps the changes for next time.
+      state_free( state );
+      stress->states_dropped++;
+    }
+  }
+  return NULL;
+}
+
+/*!
+ * Like the cover thread, except that every request misses the cache.
+ */
+static gpointer covers ( gpointer data )
+{
+  struct STRESS* stress = data;
+  while ( ! stopping( stress ) ) {
+    struct IMAGE_HANDLE image =
+      image_rgba_create( (const unsigned char*)stress->cover_data,
+			 stress->cover_bytes );
+    struct IMAGE_HANDLE* cover = g_new( struct IMAGE_HANDLE, 1 );
+    *cover = image_rgba_scale( image, COVER_WIDTH, COVER_HEIGHT );
+    image_rgba_free( image );
+    stress->covers_made++;
+
+    // As in cover_image.c: wait for the main loop to make room.
+    while ( spsc_queue_push( stress->covers, cover ) < 0 ) {
+      if ( stopping( stress ) ) {
+	image_rgba_free( *cover );
+	g_free( cover );
+	break;
+      }
+      g_usleep( 10000 );
+    }
+  }
+  return NULL;
+}
+
+/*!
+ * Someone prodding the screen. Each touch carries the time it
+ * happened.
+ */
+static gpointer toucher ( gpointer data )
+{
+  struct STRESS* stress = data;
+  while ( ! stopping( stress ) ) {
+    g_usleep( g_random_int_range( TOUCH_INTERVAL_MIN, TOUCH_INTERVAL_MAX ) );
+    gint64 now = g_get_monotonic_time();
+    if ( write( stress->touches[1], &now, sizeof now ) != sizeof now )
+      break;
+  }
+  return NULL;
+}
+
+static gboolean states_ready ( gint fd, GIOCondition condition,
+			       gpointer data )
+{
+  (void)fd;
+  (void)condition;
+  struct STRESS* stress = data;
+  struct STATE* newest = NULL;
+  struct STATE* state;
+  int n;
+  // As in main.c: a queue's worth at a time, then let the others in,
+  // and only the newest is drawn.
+  for ( n = 0; n < STATES_CAPACITY &&
+	  ( state = spsc_queue_pop( stress->states ) ) != NULL; n++ ) {
+    sample_add( &stress->handoff, g_get_monotonic_time() - state->pushed );
+    if ( newest != NULL )
+      state_free( newest );
+    newest = state;
+  }
+  if ( newest == NULL )
+    return TRUE;
+
+  // Draw it.
+  gint64 start = g_get_monotonic_time();
+  gint64 done = thread_cpu_time() + stress->draw_us;
+  while ( thread_cpu_time() < done )
+    ;
+  sample_add( &stress->frame_time, g_get_monotonic_time() - start );
+  state_free( newest );
+  return TRUE;
+}
+
+static gboolean covers_ready ( gint fd, GIOCondition condition,
+			       gpointer data )
+{
+  (void)fd;
+  (void)condition;
+  struct STRESS* stress = data;
+  struct IMAGE_HANDLE* cover;
+  while ( ( cover = spsc_queue_pop( stress->covers ) ) != NULL ) {
+    image_rgba_free( *cover );
+    g_free( cover );
+  }
+  return TRUE;
+}
+
+static gboolean touched ( gint fd, GIOCondition condition, gpointer data )
+{
+  (void)condition;
+  struct STRESS* stress = data;
+  gint64 when;
+  while ( read( fd, &when, sizeof when ) == sizeof when )
+    sample_add( &stress->touch_latency, g_get_monotonic_time() - when );
+  return TRUE;
+}
+
+static gboolean time_up ( gpointer data )
+{
+  struct STRESS* stress = data;
+  g_main_loop_quit( stress->loop );
+  return G_SOURCE_REMOVE;
+}
+
+int main ( int argc, char* argv[] )
+{
+  unsigned int seconds = argc > 1 ? strtoul( argv[1], NULL, 0 ) : 10;
+  struct STRESS stress;
+  stress.draw_us = argc > 2 ? strtol( argv[2], NULL, 0 ) : 5000;
+  gint64 bound = ( argc > 3 ? strtol( argv[3], NULL, 0 ) : 50 ) * 1000;
+  if ( argc > 4 || seconds == 0 || stress.draw_us < 0 || bound <= 0 ) {
+    fprintf( stderr, "usage: %s [seconds [draw_us [bound_ms]]]\n", argv[0] );
+    return 1;
+  }
+
+  if ( ! g_file_get_contents( "no_cover.png", &stress.cover_data,
+			      &stress.cover_bytes, NULL ) ) {
+    fprintf( stderr, "Could not read no_cover.png\n" );
+    return 1;
+  }
+
+  stress.states = spsc_queue_create( STATES_CAPACITY );
+  stress.covers = spsc_queue_create( COVERS_CAPACITY );
+  if ( spsc_queue_status( stress.states ) < 0 ||
+       spsc_queue_status( stress.covers ) < 0 ||
+       ! g_unix_open_pipe( stress.touches, FD_CLOEXEC, NULL ) ||
+       ! g_unix_set_fd_nonblocking( stress.touches[0], TRUE, NULL ) ) {
+    fprintf( stderr, "Could not make the queues\n" );
+    return 1;
+  }
+  stress.stop = 0;
+  stress.states_pushed = 0;
+  stress.states_dropped = 0;
+  stress.covers_made = 0;
+  samples_init( &stress.touch_latency, "touch latency" );
+  samples_init( &stress.frame_time, "frame time" );
+  samples_init( &stress.handoff, "state handoff" );
+
+  stress.loop = g_main_loop_new( NULL, FALSE );
+  (void)g_unix_fd_add( spsc_queue_fd( stress.states ), G_IO_IN,
+		       states_ready, &stress );
+  (void)g_unix_fd_add( spsc_queue_fd( stress.covers ), G_IO_IN,
+		       covers_ready, &stress );
+  (void)g_unix_fd_add( stress.touches[0], G_IO_IN, touched, &stress );
+  (void)g_timeout_add_seconds( seconds, time_up, &stress );
+
+  GThread* threads[3];
+  threads[0] = g_thread_new( "mpd", poller, &stress );
+  threads[1] = g_thread_new( "covers", covers, &stress );
+  threads[2] = g_thread_new( "touch", toucher, &stress );
+
+  g_main_loop_run( stress.loop );
+
+  __atomic_store_n( &stress.stop, 1, __ATOMIC_RELAXED );
+  int t;
+  for ( t = 0; t < 3; t++ )
+    g_thread_join( threads[t] );
+  struct STATE* state;
+  while ( ( state = spsc_queue_pop( stress.states ) ) != NULL )
+    state_free( state );
+  (void)covers_ready( 0, G_IO_IN, &stress );
+
+  printf( "%u s, %lld us a frame: %lu states (%lu dropped), %lu covers\n",
+	  seconds, (long long)stress.draw_us, stress.states_pushed,
+	  stress.states_dropped, stress.covers_made );
+  gint64 touch_p99 = report( &stress.touch_latency );
+  gint64 frame_p99 = report( &stress.frame_time );
+  (void)report( &stress.handoff );
+
+  int status = 0;
+  if ( touch_p99 > bound || frame_p99 > bound ) {
+    printf( "Over the bound of %lld ms\n", (long long)bound / 1000 );
+    status = 1;
+  }
+
+  spsc_queue_free( stress.states );
+  spsc_queue_free( stress.covers );
+  close( stress.touches[0] );
+  close( stress.touches[1] );
+  g_main_loop_unref( stress.loop );
+  g_free( stress.cover_data );
+  g_free( stress.touch_latency.values );
+  g_free( stress.frame_time.values );
+  g_free( stress.handoff.values );
+
+  return status;
+}
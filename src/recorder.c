@@ -0,0 +1,135 @@
+/*
+ * The writing side of the flight recorder. Any number of threads write
+ * at once: each takes the next record number with one atomic add and
+ * then has the slot to itself (until the ring comes round again).
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "recorder.h"
+
+int recorder_enabled = 0;
+
+static struct RECORDER_FILE* recording = NULL;
+// Kept open for its lock.
+static int recording_fd = -1;
+
+int recorder_open ( const char* path )
+{
+  if ( recording != NULL )
+    return 0;
+
+  int fd = open( path, O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+  if ( fd < 0 )
+    return -1;
+
+  // The ring has only the one head, so two of us writing to it would
+  // garble each other's records. The lock goes when we do, however we
+  // go, so the next run can have it.
+  if ( flock( fd, LOCK_EX | LOCK_NB ) < 0 ) {
+    int error = errno;
+    close( fd );
+    errno = error;
+    return -1;
+  }
+
+  struct stat file_stat;
+  if ( fstat( fd, &file_stat ) < 0 ) {
+    close( fd );
+    return -1;
+  }
+  int fresh = file_stat.st_size != (off_t)RECORDER_FILE_SIZE;
+
+  // Take the disk space now: running out of it later, under the
+  // mapping, would be a SIGBUS.
+  if ( fresh ) {
+    int error = ftruncate( fd, 0 ) < 0 ?
+      errno : posix_fallocate( fd, 0, RECORDER_FILE_SIZE );
+    if ( error != 0 ) {
+      close( fd );
+      errno = error;
+      return -1;
+    }
+  }
+
+  // Fault the pages in up front so a record never waits for one.
+  void* map = mmap( NULL, RECORDER_FILE_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, 0 );
+  if ( map == MAP_FAILED ) {
+    close( fd );
+    return -1;
+  }
+  recording_fd = fd;
+
+  struct RECORDER_FILE* file = map;
+  if ( fresh || file->magic != RECORDER_MAGIC ||
+       file->version != RECORDER_VERSION ||
+       file->records != RECORDER_RECORDS ||
+       file->record_size != sizeof( struct RECORDER_RECORD ) ) {
+    memset( file, 0, RECORDER_FILE_SIZE );
+    file->version = RECORDER_VERSION;
+    file->records = RECORDER_RECORDS;
+    file->record_size = sizeof( struct RECORDER_RECORD );
+    file->magic = RECORDER_MAGIC;
+  }
+
+  recording = file;
+  __atomic_store_n( &recorder_enabled, 1, __ATOMIC_RELEASE );
+
+  recorder_write( RECORDER_STARTED, 0, 0, getpid() );
+
+  return 0;
+}
+
+void recorder_write ( enum RECORDER_EVENT event, int server,
+		      uint32_t detail, int64_t value )
+{
+  struct RECORDER_FILE* file = recording;
+  uint32_t number = __atomic_fetch_add( &file->head, 1, __ATOMIC_RELAXED );
+  struct RECORDER_RECORD* record =
+    &file->record[number & ( RECORDER_RECORDS - 1 )];
+  if ( number == RECORDER_RECORDS - 1 )
+    __atomic_store_n( &file->full, 1, __ATOMIC_RELAXED );
+
+  // Empty while we fill it in (see recorder_file.h).
+  __atomic_store_n( &record->sequence, 0, __ATOMIC_RELAXED );
+  __atomic_thread_fence( __ATOMIC_RELEASE );
+
+  struct timespec now;
+  clock_gettime( CLOCK_REALTIME, &now );
+  record->time = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  record->event = event;
+  record->server = server;
+  record->detail = detail;
+  record->reserved = 0;
+  record->value = value;
+
+  __atomic_store_n( &record->sequence, number + 1, __ATOMIC_RELEASE );
+}
+
+int recorder_flush ( void )
+{
+  if ( recording == NULL )
+    return 0;
+  return msync( recording, RECORDER_FILE_SIZE, MS_SYNC ) < 0 ? -1 : 0;
+}
+
+void recorder_close ( void )
+{
+  if ( recording == NULL )
+    return;
+
+  recorder_write( RECORDER_STOPPED, 0, 0, 0 );
+  __atomic_store_n( &recorder_enabled, 0, __ATOMIC_RELEASE );
+
+  // Left mapped: a thread which saw recording on may not be done yet.
+  if ( msync( recording, RECORDER_FILE_SIZE, MS_SYNC ) < 0 )
+    printf( "Warning: Could not flush the flight recording\n" );
+}
@@ -0,0 +1,65 @@
+/*
+ * A flight recorder: a short binary record of each interesting event
+ * (state changes, reconnects, input, cover cache misses, frames) in a
+ * ring in a memory-mapped file. Nothing is formatted and no system
+ * call is made per record (save clock_gettime, on a board whose clock
+ * the vDSO can't read), so it can stay on all the time; the kernel
+ * writes the pages back, and since they belong to the file rather
+ * than to us, the recording is still there after a crash or a hang.
+ * recorder_dump turns it into text.
+ *
+ * While recording is off, an event costs a load and a branch.
+ */
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdint.h>
+
+#include "recorder_file.h"
+
+//! Don't touch; use recorder_open.
+extern int recorder_enabled;
+
+/*!
+ * Start recording. An existing recording of the same layout is carried
+ * on with (so the run before a crash is kept until it is overwritten);
+ * anything else at the path is replaced. Call this before starting
+ * any other threads. Only one process may record to a file at once.
+ * \param[in] path the file.
+ * \return 0 if everything is ok, -1 otherwise (with errno set; it is
+ * EWOULDBLOCK if another process is recording there).
+ */
+int recorder_open ( const char* path );
+
+/*!
+ * Store a record. Use recorder_event instead.
+ */
+void recorder_write ( enum RECORDER_EVENT event, int server,
+		      uint32_t detail, int64_t value );
+
+/*!
+ * Note that something happened. Any thread may call this.
+ * \param[in] event what happened.
+ * \param[in] server which MPD server it was about (or 0).
+ * \param[in] detail, value see enum RECORDER_EVENT.
+ */
+static inline void recorder_event ( enum RECORDER_EVENT event, int server,
+				    uint32_t detail, int64_t value )
+{
+  if ( __atomic_load_n( &recorder_enabled, __ATOMIC_RELAXED ) )
+    recorder_write( event, server, detail, value );
+}
+
+/*!
+ * Write the recording back to the disk now, waiting for it. Recording
+ * carries on.
+ * \return 0 if everything is ok (or we aren't recording), -1 otherwise.
+ */
+int recorder_flush ( void );
+
+/*!
+ * Record that we're stopping, and flush the recording to the disk.
+ * Events after this aren't recorded.
+ */
+void recorder_close ( void );
+#endif
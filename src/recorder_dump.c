@@ -0,0 +1,172 @@
+/*
+ * Turn a flight recording (see recorder_file.h) into text, oldest
+ * record first, one per line:
+ *
+ *   2026-10-18 03:12:45.123456 #1234 server 0 state playing [title] 12 s
+ *
+ * usage: recorder_dump recording
+ *
+ * It can be run on a recording mpddisplay is still writing (say, while
+ * it is hung); a record written while we look at it shows up as torn.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "recorder_file.h"
+
+// Same order as enum MPD_PLAY_STATUS.
+static const char* play_statuses[] = {
+  "no song", "stopped", "playing", "paused"
+};
+
+// Same order as enum INPUT_GESTURE_TYPE.
+static const char* gestures[] = {
+  "tap", "swipe left", "swipe right", "drag", "drag end"
+};
+
+// The MPD_CHANGED bits.
+static const char* changes[] = {
+  "artist", "album", "title", "elapsed", "total", "status"
+};
+
+static void print_record ( const struct RECORDER_RECORD* record )
+{
+  time_t seconds = record->time / 1000000;
+  struct tm local;
+  char when[32];
+  localtime_r( &seconds, &local );
+  strftime( when, sizeof when, "%Y-%m-%d %H:%M:%S", &local );
+  printf( "%s.%06d #%" PRIu32 " server %u ", when,
+	  (int)( record->time % 1000000 ), record->sequence - 1,
+	  record->server );
+
+  switch ( record->event ) {
+  case RECORDER_STARTED:
+    printf( "started (pid %" PRId64 ")\n", record->value );
+    break;
+  case RECORDER_STOPPED:
+    printf( "stopped\n" );
+    break;
+  case RECORDER_STATE: {
+    unsigned int status = record->detail & 0xff;
+    unsigned int changed = record->detail >> 8;
+    unsigned int c;
+    printf( "state %s [", status < 4 ? play_statuses[status] : "?" );
+    for ( c = 0; c < 6; c++ ) {
+      if ( changed & ( 1u << c ) )
+	printf( "%s%s", changed & ( ( 1u << c ) - 1 ) ? " " : "", changes[c] );
+    }
+    printf( "] %" PRId64 " s\n", record->value );
+    break;
+  }
+  case RECORDER_DISCONNECTED:
+    printf( "disconnected\n" );
+    break;
+  case RECORDER_RECONNECT:
+    printf( "reconnect %s after %" PRId64 " us\n",
+	    record->detail ? "worked" : "failed", record->value );
+    break;
+  case RECORDER_GESTURE: {
+    uint64_t where = record->value;
+    printf( "gesture %s from %.4f,%.4f to %.4f,%.4f\n",
+	    record->detail < 5 ? gestures[record->detail] : "?",
+	    ( ( where >> 48 ) & 0xffff ) / 10000.,
+	    ( ( where >> 32 ) & 0xffff ) / 10000.,
+	    ( ( where >> 16 ) & 0xffff ) / 10000.,
+	    ( where & 0xffff ) / 10000. );
+    break;
+  }
+  case RECORDER_BUTTON:
+    printf( "button on line %u\n", record->detail );
+    break;
+  case RECORDER_COVER_MISS:
+    printf( "cover cache miss, %" PRId64 " us to load\n", record->value );
+    break;
+  case RECORDER_FRAME:
+    printf( "%s frame %" PRId64 " us\n", record->detail ? "partial" : "full",
+	    record->value );
+    break;
+  default:
+    printf( "event %u detail %u value %" PRId64 "\n", record->event,
+	    record->detail, record->value );
+    break;
+  }
+}
+
+int main ( int argc, char* argv[] )
+{
+  if ( argc != 2 ) {
+    fprintf( stderr, "usage: %s recording\n", argv[0] );
+    return 1;
+  }
+
+  int fd = open( argv[1], O_RDONLY );
+  if ( fd < 0 ) {
+    perror( argv[1] );
+    return 1;
+  }
+  struct stat file_stat;
+  if ( fstat( fd, &file_stat ) < 0 ||
+       file_stat.st_size < (off_t)sizeof( struct RECORDER_FILE ) ) {
+    fprintf( stderr, "%s: not a flight recording\n", argv[1] );
+    return 1;
+  }
+  void* map = mmap( NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+  if ( map == MAP_FAILED ) {
+    perror( argv[1] );
+    return 1;
+  }
+
+  const struct RECORDER_FILE* file = map;
+  if ( file->magic != RECORDER_MAGIC || file->version != RECORDER_VERSION ||
+       file->record_size != sizeof( struct RECORDER_RECORD ) ||
+       file->records == 0 ||
+       file_stat.st_size < (off_t)( sizeof( struct RECORDER_FILE ) +
+				    (uint64_t)file->records *
+				    sizeof( struct RECORDER_RECORD ) ) ) {
+    fprintf( stderr, "%s: not a flight recording (or the wrong version)\n",
+	     argv[1] );
+    return 1;
+  }
+
+  // The numbers wrap, so it's only by full that we know whether the
+  // ring has come round.
+  uint32_t head = __atomic_load_n( &file->head, __ATOMIC_ACQUIRE );
+  int full = __atomic_load_n( &file->full, __ATOMIC_RELAXED );
+  uint32_t count = full || head > file->records ? file->records : head;
+  uint32_t first = head - count;
+  uint32_t r;
+  unsigned int torn = 0;
+
+  for ( r = 0; r < count; r++ ) {
+    uint32_t number = first + r;
+    const struct RECORDER_RECORD* slot = &file->record[number % file->records];
+    // Copy it and check it didn't change under us.
+    struct RECORDER_RECORD record;
+    uint32_t before = __atomic_load_n( &slot->sequence, __ATOMIC_ACQUIRE );
+    memcpy( &record, slot, sizeof record );
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    uint32_t after = __atomic_load_n( &slot->sequence, __ATOMIC_RELAXED );
+    if ( before != (uint32_t)( number + 1 ) || after != before ) {
+      torn++;
+      printf( "#%" PRIu32 " torn\n", number );
+      continue;
+    }
+    record.sequence = before;
+    print_record( &record );
+  }
+
+  fprintf( stderr, "%" PRIu32 " records%s, %u torn\n", count,
+	   full ? " (older ones overwritten)" : "", torn );
+
+  return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * The layout of a flight recording (see recorder.h). This header is
+ * all a reader needs: it only depends on libc.
+ *
+ * The file is a header followed by a ring of fixed-width records.
+ * Record n (counting from 0 since the file was made, modulo 2^32)
+ * lives in slot n % records, and is complete when its sequence is
+ * n + 1. A writer zeroes the sequence first and sets it last, so a
+ * record cut off by a crash reads as empty rather than as rubbish.
+ * (So does the one record in 2^32 whose n + 1 is 0.) The counters are
+ * 32 bits because that is the widest atomic the Pi's ARMv6 has; the
+ * ring is a power of two, so they wrap cleanly. Everything is native
+ * endian: decode on a machine of the same byte order.
+ */
+#ifndef RECORDER_FILE_H
+#define RECORDER_FILE_H
+
+#include <stdint.h>
+
+#define RECORDER_MAGIC 0x4d504652 // "MPFR"
+#define RECORDER_VERSION 2
+//! Records kept (a power of two). At 32 bytes each, 2 MB.
+#define RECORDER_RECORDS 65536
+
+/*!
+ * What happened. The meaning of a record's detail and value depends
+ * on it.
+ */
+enum RECORDER_EVENT {
+  //! mpddisplay started. Value: its pid.
+  RECORDER_STARTED = 1,
+  //! ...and stopped cleanly.
+  RECORDER_STOPPED,
+  //! A new state was shown. Detail: the play status (enum
+  //! MPD_PLAY_STATUS) in the low byte, the MPD_CHANGED bits above it.
+  //! Value: seconds into the song.
+  RECORDER_STATE,
+  //! The connection to a server was lost.
+  RECORDER_DISCONNECTED,
+  //! We tried to connect again. Detail: 1 if it worked. Value: how long
+  //! it took (us).
+  RECORDER_RECONNECT,
+  //! A touch gesture. Detail: enum INPUT_GESTURE_TYPE. Value: where it
+  //! started and where it is now, in 16 bit steps of 1/10000 of the
+  //! screen: start x, start y, x, y from the top down.
+  RECORDER_GESTURE,
+  //! A button was pressed. Detail: its GPIO line.
+  RECORDER_BUTTON,
+  //! A cover wasn't in the cache. Value: how long it took to load and
+  //! scale (us).
+  RECORDER_COVER_MISS,
+  //! A frame was drawn. Detail: 1 if only the damage was redrawn.
+  //! Value: how long it took, swap included (us).
+  RECORDER_FRAME
+};
+
+struct RECORDER_RECORD {
+  //! The record's number + 1, or 0 if it is being (or was never)
+  //! written.
+  uint32_t sequence;
+  //! An enum RECORDER_EVENT.
+  uint16_t event;
+  //! Which MPD server (0 for the first, or if it doesn't apply).
+  uint16_t server;
+  //! CLOCK_REALTIME, in microseconds.
+  int64_t time;
+  int64_t value;
+  uint32_t detail;
+  uint32_t reserved;
+};
+
+struct RECORDER_FILE {
+  uint32_t magic;
+  uint32_t version;
+  //! RECORDER_RECORDS and sizeof( struct RECORDER_RECORD ) when the
+  //! file was made.
+  uint32_t records;
+  uint32_t record_size;
+  //! Set once the ring has come all the way round.
+  uint32_t full;
+  //! Records started, modulo 2^32 (the next goes in slot
+  //! head % records).
+  uint32_t head __attribute__(( aligned( 64 ) ));
+  struct RECORDER_RECORD record[] __attribute__(( aligned( 64 ) ));
+};
+
+//! The size of a recording file.
+#define RECORDER_FILE_SIZE					\
+  ( sizeof( struct RECORDER_FILE ) +				\
+    RECORDER_RECORDS * sizeof( struct RECORDER_RECORD ) )
+#endif
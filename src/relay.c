@@ -0,0 +1,599 @@
+/*
+ * The relay socket is SOCK_SEQPACKET, so each message arrives whole
+ * and a cover's descriptor arrives with the message it belongs to.
+ * The daemon never waits for a renderer: one which can't keep up is
+ * dropped, and gets the latest state and cover when it comes back.
+ */
+#define _GNU_SOURCE // memfd_create
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "glib.h"
+#include "glib-unix.h"
+
+#include "metrics.h"
+#include "relay.h"
+
+// Most renderers at once.
+#define RELAY_RENDERERS_MAX 16
+// Longest string sent (longer ones are cut short).
+#define RELAY_TEXT_MAX 4096
+
+enum RELAY_TYPE {
+  RELAY_STATE = 1,
+  RELAY_COVER,
+  RELAY_COMMAND
+};
+
+/*!
+ * Every message starts with this. The strings follow without their
+ * NULs: artist, album and title for a state, artist and album for a
+ * cover, none for a command.
+ */
+struct RELAY_MESSAGE {
+  uint32_t type;
+  //! MPD_CHANGED bits (state).
+  int32_t changed;
+  //! An MPD_PLAY_STATUS (state) or a RELAY_COMMAND (command).
+  int32_t status;
+  //! The command's argument.
+  int32_t value;
+  int64_t elapsed;
+  int64_t total;
+  //! When the state was polled or the cover asked for (monotonic, us).
+  int64_t stamp;
+  uint32_t lengths[3];
+};
+
+#define RELAY_MESSAGE_MAX ( sizeof( struct RELAY_MESSAGE ) + 3 * RELAY_TEXT_MAX )
+
+static struct METRIC renderers_metric =
+  METRIC_GAUGE_INIT( "mpddisplay_relay_renderers",
+		     "Renderers attached to this daemon.", NULL, NULL );
+static struct METRIC covers_metric =
+  METRIC_COUNTER_INIT( "mpddisplay_relay_covers_total",
+		       "Covers shared with renderers.", NULL, NULL );
+
+struct RELAY_RENDERER {
+  struct RELAY_PRIVATE* relay;
+  int fd;
+  guint source;
+};
+
+struct RELAY_PRIVATE {
+  int status;
+  struct LOG_HANDLE logger;
+  // The listening socket (daemon) or the connection (renderer).
+  int fd;
+  // Daemon only.
+  GString* path;
+  guint source;
+  struct MPD_HANDLE mpd;
+  struct RELAY_RENDERER* renderers[RELAY_RENDERERS_MAX];
+  // The last state and cover, for renderers which attach later. The
+  // state's changed bits are all set.
+  GByteArray* state;
+  GByteArray* cover;
+  int cover_fd;
+  // Renderer only: the last cover received.
+  void* cover_map;
+  size_t cover_size;
+};
+
+static struct RELAY_PRIVATE* relay_new ( struct LOG_HANDLE logger )
+{
+  struct RELAY_PRIVATE* d = malloc( sizeof( struct RELAY_PRIVATE ) );
+  memset( d, 0, sizeof( struct RELAY_PRIVATE ) );
+  d->status = -1;
+  d->logger = logger;
+  d->fd = -1;
+  d->state = g_byte_array_new();
+  d->cover = g_byte_array_new();
+  d->cover_fd = -1;
+  return d;
+}
+
+static int relay_address ( struct sockaddr_un* address, const char* path,
+			   struct LOG_HANDLE logger )
+{
+  memset( address, 0, sizeof *address );
+  address->sun_family = AF_UNIX;
+  if ( strlen( path ) >= sizeof address->sun_path ) {
+    log_message_warn( logger, "Relay socket path too long: \"%s\"", path );
+    return -1;
+  }
+  strcpy( address->sun_path, path );
+  return 0;
+}
+
+/*!
+ * Build a message in out.
+ */
+static void encode ( GByteArray* out, const struct RELAY_MESSAGE* header,
+		     const char* const* strings, int count )
+{
+  struct RELAY_MESSAGE message = *header;
+  int s;
+  for ( s = 0; s < 3; s++ )
+    message.lengths[s] = s < count ?
+      MIN( strlen( strings[s] ), RELAY_TEXT_MAX ) : 0;
+
+  g_byte_array_set_size( out, 0 );
+  g_byte_array_append( out, (const guint8*)&message, sizeof message );
+  for ( s = 0; s < count; s++ )
+    g_byte_array_append( out, (const guint8*)strings[s], message.lengths[s] );
+}
+
+/*!
+ * Send one message, with a descriptor if fd isn't -1. Never waits.
+ * \return 0 if it went, -1 otherwise.
+ */
+static int send_message ( int socket, const GByteArray* message, int fd )
+{
+  struct iovec iov = { message->data, message->len };
+  struct msghdr header;
+  memset( &header, 0, sizeof header );
+  header.msg_iov = &iov;
+  header.msg_iovlen = 1;
+
+  union {
+    struct cmsghdr align;
+    char buffer[CMSG_SPACE( sizeof( int ) )];
+  } control;
+  if ( fd >= 0 ) {
+    header.msg_control = control.buffer;
+    header.msg_controllen = sizeof control.buffer;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR( &header );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN( sizeof( int ) );
+    memcpy( CMSG_DATA( cmsg ), &fd, sizeof fd );
+  }
+
+  ssize_t n_bytes = sendmsg( socket, &header, MSG_NOSIGNAL | MSG_DONTWAIT );
+  return n_bytes == (ssize_t)message->len ? 0 : -1;
+}
+
+static void renderer_free ( struct RELAY_RENDERER* renderer )
+{
+  struct RELAY_PRIVATE* d = renderer->relay;
+  int r;
+  for ( r = 0; r < RELAY_RENDERERS_MAX; r++ ) {
+    if ( d->renderers[r] == renderer )
+      d->renderers[r] = NULL;
+  }
+  if ( renderer->source != 0 )
+    g_source_remove( renderer->source );
+  close( renderer->fd );
+  free( renderer );
+  metric_add( &renderers_metric, -1 );
+}
+
+/*!
+ * Send a message to every renderer, dropping any which can't take it.
+ */
+static void broadcast ( struct RELAY_PRIVATE* d, const GByteArray* message,
+			int fd )
+{
+  int r;
+  for ( r = 0; r < RELAY_RENDERERS_MAX; r++ ) {
+    struct RELAY_RENDERER* renderer = d->renderers[r];
+    if ( renderer == NULL || send_message( renderer->fd, message, fd ) == 0 )
+      continue;
+    log_message_warn( d->logger, "Renderer %d isn't keeping up; dropped it",
+		      renderer->fd );
+    renderer_free( renderer );
+  }
+}
+
+static gboolean renderer_callback ( gint fd, GIOCondition condition,
+				    gpointer data )
+{
+  struct RELAY_RENDERER* renderer = data;
+  struct RELAY_PRIVATE* d = renderer->relay;
+
+  struct RELAY_MESSAGE message;
+  ssize_t n_bytes = 0;
+  if ( condition & G_IO_IN )
+    n_bytes = recv( fd, &message, sizeof message, MSG_DONTWAIT );
+
+  if ( n_bytes <= 0 ) {
+    if ( n_bytes < 0 && ( errno == EAGAIN || errno == EINTR ) )
+      return TRUE;
+    log_message_info( d->logger, "Renderer %d detached", fd );
+    // Returning FALSE removes the source.
+    renderer->source = 0;
+    renderer_free( renderer );
+    return FALSE;
+  }
+
+  if ( n_bytes != sizeof message || message.type != RELAY_COMMAND )
+    return TRUE;
+
+  switch ( message.status ) {
+  case RELAY_COMMAND_PLAY_PAUSE:    mpd_play_pause( d->mpd ); break;
+  case RELAY_COMMAND_NEXT:          mpd_next( d->mpd ); break;
+  case RELAY_COMMAND_PREVIOUS:      mpd_previous( d->mpd ); break;
+  case RELAY_COMMAND_SEEK:          mpd_seek( d->mpd, message.value ); break;
+  case RELAY_COMMAND_SET_VOLUME:    mpd_set_volume( d->mpd, message.value ); break;
+  case RELAY_COMMAND_CHANGE_VOLUME: mpd_change_volume( d->mpd, message.value ); break;
+  default:
+    break;
+  }
+
+  return TRUE;
+}
+
+static gboolean accept_callback ( gint fd, GIOCondition condition,
+				  gpointer data )
+{
+  (void)condition;
+
+  struct RELAY_PRIVATE* d = data;
+
+  int renderer_fd = accept( fd, NULL, NULL );
+  if ( renderer_fd < 0 )
+    return TRUE;
+  fcntl( renderer_fd, F_SETFL, fcntl( renderer_fd, F_GETFL ) | O_NONBLOCK );
+  fcntl( renderer_fd, F_SETFD, FD_CLOEXEC );
+
+  int r;
+  for ( r = 0; r < RELAY_RENDERERS_MAX; r++ ) {
+    if ( d->renderers[r] == NULL )
+      break;
+  }
+  if ( r == RELAY_RENDERERS_MAX ) {
+    log_message_warn( d->logger, "Too many renderers" );
+    close( renderer_fd );
+    return TRUE;
+  }
+
+  // Bring it up to date.
+  if ( ( d->state->len > 0 &&
+	 send_message( renderer_fd, d->state, -1 ) < 0 ) ||
+       ( d->cover->len > 0 &&
+	 send_message( renderer_fd, d->cover, d->cover_fd ) < 0 ) ) {
+    close( renderer_fd );
+    return TRUE;
+  }
+
+  struct RELAY_RENDERER* renderer = malloc( sizeof( struct RELAY_RENDERER ) );
+  renderer->relay = d;
+  renderer->fd = renderer_fd;
+  renderer->source = g_unix_fd_add( renderer_fd, G_IO_IN | G_IO_HUP | G_IO_ERR,
+				    renderer_callback, renderer );
+  d->renderers[r] = renderer;
+  metric_add( &renderers_metric, 1 );
+
+  log_message_info( d->logger, "Renderer %d attached", renderer_fd );
+
+  return TRUE;
+}
+
+struct RELAY_HANDLE relay_serve ( const char* path, struct MPD_HANDLE mpd,
+				  struct LOG_HANDLE logger )
+{
+  struct RELAY_HANDLE handle;
+  handle.d = relay_new( logger );
+  handle.d->mpd = mpd;
+  handle.d->path = g_string_new( path );
+
+  metrics_register( &renderers_metric );
+  metrics_register( &covers_metric );
+
+  struct sockaddr_un address;
+  if ( relay_address( &address, path, logger ) < 0 )
+    return handle;
+
+  handle.d->fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			 0 );
+  if ( handle.d->fd < 0 ) {
+    log_message_warn( logger, "Could not create relay socket: %s",
+		      strerror( errno ) );
+    return handle;
+  }
+
+  // Left over from last time, presumably.
+  (void)unlink( path );
+
+  // Anyone who can connect can play, skip and seek, so only the owner
+  // and the group may: set before listen, so nobody gets in first.
+  if ( bind( handle.d->fd, (struct sockaddr*)&address, sizeof address ) < 0 ||
+       chmod( path, 0660 ) < 0 ||
+       listen( handle.d->fd, 8 ) < 0 ) {
+    log_message_warn( logger, "Could not listen on relay socket \"%s\": %s",
+		      path, strerror( errno ) );
+    close( handle.d->fd );
+    handle.d->fd = -1;
+    return handle;
+  }
+
+  handle.d->source = g_unix_fd_add( handle.d->fd, G_IO_IN, accept_callback,
+				    handle.d );
+  handle.d->status = 0;
+
+  log_message_info( logger, "Serving renderers on \"%s\"", path );
+
+  return handle;
+}
+
+struct RELAY_HANDLE relay_attach ( const char* path,
+				   struct LOG_HANDLE logger )
+{
+  struct RELAY_HANDLE handle;
+  handle.d = relay_new( logger );
+
+  struct sockaddr_un address;
+  if ( relay_address( &address, path, logger ) < 0 )
+    return handle;
+
+  handle.d->fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+  if ( handle.d->fd < 0 ) {
+    log_message_warn( logger, "Could not create relay socket: %s",
+		      strerror( errno ) );
+    return handle;
+  }
+
+  if ( connect( handle.d->fd, (struct sockaddr*)&address,
+		sizeof address ) < 0 ) {
+    log_message_warn( logger, "Could not attach to \"%s\": %s", path,
+		      strerror( errno ) );
+    close( handle.d->fd );
+    handle.d->fd = -1;
+    return handle;
+  }
+
+  handle.d->status = 0;
+
+  log_message_info( logger, "Attached to \"%s\"", path );
+
+  return handle;
+}
+
+int relay_status ( struct RELAY_HANDLE handle )
+{
+  if ( handle.d == NULL )
+    return -1;
+  return handle.d->status;
+}
+
+int relay_renderers ( struct RELAY_HANDLE handle )
+{
+  int count = 0;
+  int r;
+  for ( r = 0; handle.d != NULL && r < RELAY_RENDERERS_MAX; r++ ) {
+    if ( handle.d->renderers[r] != NULL )
+      count++;
+  }
+  return count;
+}
+
+void relay_send_state ( struct RELAY_HANDLE handle,
+			const struct MPD_STATE* state )
+{
+  if ( handle.d == NULL || handle.d->status < 0 )
+    return;
+
+  struct RELAY_MESSAGE message;
+  memset( &message, 0, sizeof message );
+  message.type = RELAY_STATE;
+  message.changed = state->changed;
+  message.status = state->play_status;
+  message.elapsed = state->times.elapsed;
+  message.total = state->times.total;
+  message.stamp = state->polled;
+  const char* strings[3] = { state->artist, state->album, state->title };
+
+  encode( handle.d->state, &message, strings, 3 );
+  broadcast( handle.d, handle.d->state, -1 );
+
+  // A renderer attaching later needs everything.
+  ((struct RELAY_MESSAGE*)handle.d->state->data)->changed = MPD_CHANGED_ANY;
+}
+
+void relay_send_cover ( struct RELAY_HANDLE handle,
+			const struct COVER_RESULT* cover )
+{
+  if ( handle.d == NULL || handle.d->status < 0 )
+    return;
+
+  struct IMAGE_RAW_HEADER raw;
+  memcpy( raw.magic, IMAGE_RAW_MAGIC, sizeof raw.magic );
+  raw.width = image_rgba_width( cover->image );
+  raw.height = image_rgba_height( cover->image );
+  const unsigned char* pixels = image_rgba_image( cover->image );
+  size_t pixels_size = (size_t)raw.width * raw.height * 4;
+  if ( pixels == NULL || pixels_size == 0 )
+    return;
+
+  // The decoded cover goes into a block of memory of its own, sealed
+  // so renderers can map it without worrying that it'll change.
+  int fd = memfd_create( "mpddisplay-cover", MFD_CLOEXEC | MFD_ALLOW_SEALING );
+  if ( fd < 0 ) {
+    log_message_warn( handle.d->logger, "Could not make cover memory: %s",
+		      strerror( errno ) );
+    return;
+  }
+  if ( write( fd, &raw, sizeof raw ) != sizeof raw ||
+       write( fd, pixels, pixels_size ) != (ssize_t)pixels_size ||
+       fcntl( fd, F_ADD_SEALS,
+	      F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL ) < 0 ) {
+    log_message_warn( handle.d->logger, "Could not fill cover memory: %s",
+		      strerror( errno ) );
+    close( fd );
+    return;
+  }
+
+  if ( handle.d->cover_fd >= 0 )
+    close( handle.d->cover_fd );
+  handle.d->cover_fd = fd;
+
+  struct RELAY_MESSAGE message;
+  memset( &message, 0, sizeof message );
+  message.type = RELAY_COVER;
+  message.stamp = cover->requested;
+  const char* strings[2] = { cover->artist, cover->album };
+
+  encode( handle.d->cover, &message, strings, 2 );
+  broadcast( handle.d, handle.d->cover, fd );
+  metric_add( &covers_metric, 1 );
+}
+
+int relay_fd ( struct RELAY_HANDLE handle )
+{
+  if ( handle.d == NULL )
+    return -1;
+  return handle.d->fd;
+}
+
+/*!
+ * Take a string out of a message.
+ */
+static char* decode_string ( const char** p, uint32_t length )
+{
+  char* string = g_strndup( *p, length );
+  *p += length;
+  return string;
+}
+
+int relay_receive ( struct RELAY_HANDLE handle, struct MPD_STATE** state,
+		    struct COVER_RESULT** cover )
+{
+  *state = NULL;
+  *cover = NULL;
+  if ( handle.d == NULL || handle.d->fd < 0 )
+    return -1;
+
+  char buffer[RELAY_MESSAGE_MAX];
+  struct iovec iov = { buffer, sizeof buffer };
+  union {
+    struct cmsghdr align;
+    char buffer[CMSG_SPACE( sizeof( int ) )];
+  } control;
+  struct msghdr header;
+  memset( &header, 0, sizeof header );
+  header.msg_iov = &iov;
+  header.msg_iovlen = 1;
+  header.msg_control = control.buffer;
+  header.msg_controllen = sizeof control.buffer;
+
+  ssize_t n_bytes = recvmsg( handle.d->fd, &header,
+			     MSG_DONTWAIT | MSG_CMSG_CLOEXEC );
+  if ( n_bytes < 0 && ( errno == EAGAIN || errno == EINTR ) )
+    return 0;
+  if ( n_bytes <= 0 )
+    return -1;
+
+  int fd = -1;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR( &header );
+  if ( cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+       cmsg->cmsg_type == SCM_RIGHTS )
+    memcpy( &fd, CMSG_DATA( cmsg ), sizeof fd );
+
+  struct RELAY_MESSAGE message;
+  if ( (size_t)n_bytes < sizeof message ) {
+    if ( fd >= 0 )
+      close( fd );
+    return 1;
+  }
+  memcpy( &message, buffer, sizeof message );
+  size_t strings_size = (size_t)message.lengths[0] + message.lengths[1] +
+    message.lengths[2];
+  if ( sizeof message + strings_size != (size_t)n_bytes ) {
+    if ( fd >= 0 )
+      close( fd );
+    return 1;
+  }
+  const char* p = buffer + sizeof message;
+
+  if ( message.type == RELAY_STATE ) {
+    struct MPD_STATE* new_state = g_new( struct MPD_STATE, 1 );
+    new_state->changed = message.changed;
+    new_state->play_status = message.status;
+    new_state->artist = decode_string( &p, message.lengths[0] );
+    new_state->album = decode_string( &p, message.lengths[1] );
+    new_state->title = decode_string( &p, message.lengths[2] );
+    new_state->times.elapsed = message.elapsed;
+    new_state->times.total = message.total;
+    new_state->polled = message.stamp;
+    new_state->server = 0;
+    *state = new_state;
+  }
+  else if ( message.type == RELAY_COVER && fd >= 0 ) {
+    struct stat st;
+    void* map = MAP_FAILED;
+    if ( fstat( fd, &st ) == 0 && st.st_size > 0 )
+      map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    if ( map != MAP_FAILED ) {
+      // The last one has been taken care of by now.
+      if ( handle.d->cover_map != NULL )
+	munmap( handle.d->cover_map, handle.d->cover_size );
+      handle.d->cover_map = map;
+      handle.d->cover_size = st.st_size;
+
+      struct COVER_RESULT* new_cover = g_new( struct COVER_RESULT, 1 );
+      new_cover->artist = decode_string( &p, message.lengths[0] );
+      new_cover->album = decode_string( &p, message.lengths[1] );
+      new_cover->image = image_rgba_raw( map, st.st_size );
+      new_cover->requested = message.stamp;
+      new_cover->server = 0;
+      *cover = new_cover;
+    }
+  }
+
+  if ( fd >= 0 )
+    close( fd );
+
+  return 1;
+}
+
+void relay_command ( struct RELAY_HANDLE handle, enum RELAY_COMMAND command,
+		     int value )
+{
+  if ( handle.d == NULL || handle.d->fd < 0 )
+    return;
+
+  struct RELAY_MESSAGE message;
+  memset( &message, 0, sizeof message );
+  message.type = RELAY_COMMAND;
+  message.status = command;
+  message.value = value;
+
+  if ( send( handle.d->fd, &message, sizeof message,
+	     MSG_NOSIGNAL | MSG_DONTWAIT ) != sizeof message )
+    log_message_warn( handle.d->logger, "Could not send command to the daemon" );
+}
+
+void relay_free ( struct RELAY_HANDLE handle )
+{
+  if ( handle.d != NULL ) {
+    int r;
+    for ( r = 0; r < RELAY_RENDERERS_MAX; r++ ) {
+      if ( handle.d->renderers[r] != NULL )
+	renderer_free( handle.d->renderers[r] );
+    }
+    if ( handle.d->source != 0 )
+      g_source_remove( handle.d->source );
+    if ( handle.d->fd >= 0 ) {
+      close( handle.d->fd );
+      if ( handle.d->path != NULL )
+	(void)unlink( handle.d->path->str );
+    }
+    if ( handle.d->path != NULL )
+      g_string_free( handle.d->path, TRUE );
+    if ( handle.d->cover_fd >= 0 )
+      close( handle.d->cover_fd );
+    if ( handle.d->cover_map != NULL )
+      munmap( handle.d->cover_map, handle.d->cover_size );
+    g_byte_array_free( handle.d->state, TRUE );
+    g_byte_array_free( handle.d->cover, TRUE );
+    free( handle.d );
+  }
+}
@@ -0,0 +1,113 @@
+/*
+ * Share one MPD connection and one cover pipeline between several
+ * screens. A daemon (mpddisplay --serve) polls MPD and decodes the
+ * covers; renderers (mpddisplay --attach) get every new state and
+ * cover from it over a Unix socket. A cover travels as the descriptor
+ * of a sealed block of memory holding the decoded pixels, so however
+ * many renderers there are, each album is decoded once and never
+ * copied through the socket. Renderers' control requests (buttons,
+ * touch) go back the other way.
+ */
+#ifndef RELAY_H
+#define RELAY_H
+
+#include "mpd_intf.h"
+#include "cover_image.h"
+#include "log_intf.h"
+
+struct RELAY_PRIVATE;
+
+struct RELAY_HANDLE {
+  struct RELAY_PRIVATE* d;
+};
+
+/*!
+ * What a renderer can ask the daemon to do.
+ */
+enum RELAY_COMMAND {
+  RELAY_COMMAND_PLAY_PAUSE = 1,
+  RELAY_COMMAND_NEXT,
+  RELAY_COMMAND_PREVIOUS,
+  //! Value: seconds from the start of the song.
+  RELAY_COMMAND_SEEK,
+  //! Value: percent.
+  RELAY_COMMAND_SET_VOLUME,
+  //! Value: percent to add.
+  RELAY_COMMAND_CHANGE_VOLUME
+};
+
+/*!
+ * Start serving renderers. They are accepted from the main loop.
+ * \param[in] path the socket (replaced if it exists). Only its owner
+ * and group may connect.
+ * \param[in] mpd where renderers' commands go.
+ * \param[in,out] logger the handle to the logger service.
+ * \return a handle to the relay. Check it with relay_status.
+ */
+struct RELAY_HANDLE relay_serve ( const char* path, struct MPD_HANDLE mpd,
+				  struct LOG_HANDLE logger );
+/*!
+ * Attach to a daemon as a renderer.
+ * \param[in] path the daemon's socket.
+ * \param[in,out] logger the handle to the logger service.
+ * \return a handle to the relay. Check it with relay_status.
+ */
+struct RELAY_HANDLE relay_attach ( const char* path,
+				   struct LOG_HANDLE logger );
+/*!
+ * \param[in] handle the relay.
+ * \return 0 if everything is ok, -1 otherwise.
+ */
+int relay_status ( struct RELAY_HANDLE handle );
+/*!
+ * \param[in] handle the daemon's relay.
+ * \return the number of renderers attached.
+ */
+int relay_renderers ( struct RELAY_HANDLE handle );
+/*!
+ * Send a new state to every renderer (and to later ones when they
+ * attach).
+ * \param[in] handle the daemon's relay.
+ * \param[in] state the state.
+ */
+void relay_send_state ( struct RELAY_HANDLE handle,
+			const struct MPD_STATE* state );
+/*!
+ * Send a cover to every renderer (and to later ones when they attach).
+ * \param[in] handle the daemon's relay.
+ * \param[in] cover the cover.
+ */
+void relay_send_cover ( struct RELAY_HANDLE handle,
+			const struct COVER_RESULT* cover );
+/*!
+ * \param[in] handle a renderer's relay.
+ * \return a descriptor which is readable when there is something to
+ * receive (or the daemon has gone).
+ */
+int relay_fd ( struct RELAY_HANDLE handle );
+/*!
+ * Take the next message from the daemon. At most one of state and
+ * cover is set; free them with mpd_state_free and cover_result_free.
+ * A cover's pixels are only good until the next call.
+ * \param[in] handle a renderer's relay.
+ * \param[out] state a new state, or NULL.
+ * \param[out] cover a new cover, or NULL.
+ * \return 1 if there was a message, 0 if there wasn't, -1 if the daemon
+ * has gone.
+ */
+int relay_receive ( struct RELAY_HANDLE handle, struct MPD_STATE** state,
+		    struct COVER_RESULT** cover );
+/*!
+ * Ask the daemon to do something.
+ * \param[in] handle a renderer's relay.
+ * \param[in] command what to do.
+ * \param[in] value its argument (if it has one).
+ */
+void relay_command ( struct RELAY_HANDLE handle, enum RELAY_COMMAND command,
+		     int value );
+/*!
+ * Close the relay (on the daemon, detaching every renderer).
+ * \param[in] handle the relay.
+ */
+void relay_free ( struct RELAY_HANDLE handle );
+#endif
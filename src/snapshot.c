@@ -0,0 +1,267 @@
+/*
+ * The snapshot is a fixed size file mapped shared, so saving is just
+ * storing into memory; the kernel writes it back in its own time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "glib.h"
+
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "MPDSNAPS"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_FIELDS 3
+// What has been saved in a new file: a bit for each text field, then
+// these. It isn't marked valid until all of them have been.
+#define SNAPSHOT_SAVED_TIMES ( 1 << SNAPSHOT_FIELDS )
+#define SNAPSHOT_SAVED_STATUS ( SNAPSHOT_SAVED_TIMES << 1 )
+#define SNAPSHOT_SAVED_COVER ( SNAPSHOT_SAVED_STATUS << 1 )
+#define SNAPSHOT_SAVED_ALL ( ( SNAPSHOT_SAVED_COVER << 1 ) - 1 )
+
+/*!
+ * The start of the file. The cover follows immediately, as a raw
+ * image (see IMAGE_RAW_HEADER) of the size given when the file was
+ * made.
+ */
+struct SNAPSHOT_FILE {
+  char magic[8];
+  uint32_t version;
+  //! Zero while an update is in progress (or was, when we died).
+  uint32_t valid;
+  uint32_t cover_width;
+  uint32_t cover_height;
+  //! Is there a cover after the header?
+  uint32_t has_cover;
+  int32_t play_status;
+  int64_t elapsed;
+  int64_t total;
+  char text[SNAPSHOT_FIELDS][SNAPSHOT_TEXT_MAX];
+};
+
+struct SNAPSHOT_PRIVATE {
+  int status;
+  struct SNAPSHOT_FILE* file;
+  size_t size;
+  //! Was the file valid when we opened it?
+  int valid;
+  //! SNAPSHOT_SAVED_* bits.
+  int saved;
+};
+
+static size_t snapshot_size ( int cover_width, int cover_height )
+{
+  return sizeof( struct SNAPSHOT_FILE ) + sizeof( struct IMAGE_RAW_HEADER ) +
+    (size_t)cover_width * cover_height * 4;
+}
+
+// Bracket each change so a crash half way through is noticed.
+static void change_begin ( struct SNAPSHOT_PRIVATE* d )
+{
+  d->file->valid = 0;
+  __atomic_thread_fence( __ATOMIC_RELEASE );
+}
+
+static void change_end ( struct SNAPSHOT_PRIVATE* d, int saved )
+{
+  d->saved |= saved;
+  // A new file stays invalid until it holds a whole state, cover and
+  // all: a crash before then would otherwise bring back half of one.
+  if ( d->saved != SNAPSHOT_SAVED_ALL )
+    return;
+  __atomic_thread_fence( __ATOMIC_RELEASE );
+  d->file->valid = 1;
+  // Just a nudge; we don't wait for it.
+  (void)msync( d->file, d->size, MS_ASYNC );
+}
+
+struct SNAPSHOT_HANDLE snapshot_open ( const char* path, int cover_width,
+				       int cover_height )
+{
+  struct SNAPSHOT_HANDLE handle;
+  handle.d = malloc( sizeof( struct SNAPSHOT_PRIVATE ) );
+  handle.d->status = -1;
+  handle.d->file = NULL;
+  handle.d->size = snapshot_size( cover_width, cover_height );
+  handle.d->valid = 0;
+  handle.d->saved = 0;
+
+  int fd = open( path, O_RDWR | O_CREAT, 0644 );
+  if ( fd < 0 ) {
+    printf( "Warning: Could not open snapshot %s\n", path );
+    return handle;
+  }
+
+  struct stat st;
+  int fresh = fstat( fd, &st ) < 0 || (size_t)st.st_size != handle.d->size;
+  if ( fresh && ftruncate( fd, handle.d->size ) < 0 ) {
+    printf( "Warning: Could not size snapshot %s\n", path );
+    close( fd );
+    return handle;
+  }
+
+  void* map = mmap( NULL, handle.d->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0 );
+  close( fd );
+  if ( map == MAP_FAILED ) {
+    printf( "Warning: Could not map snapshot %s\n", path );
+    return handle;
+  }
+  handle.d->file = map;
+  handle.d->status = 0;
+
+  struct SNAPSHOT_FILE* file = handle.d->file;
+  if ( ! fresh &&
+       memcmp( file->magic, SNAPSHOT_MAGIC, sizeof file->magic ) == 0 &&
+       file->version == SNAPSHOT_VERSION &&
+       file->cover_width == (uint32_t)cover_width &&
+       file->cover_height == (uint32_t)cover_height &&
+       file->valid ) {
+    // Don't trust the strings any further than we have to.
+    int f;
+    for ( f = 0; f < SNAPSHOT_FIELDS; f++ )
+      file->text[f][SNAPSHOT_TEXT_MAX-1] = '\0';
+    handle.d->valid = 1;
+    handle.d->saved = SNAPSHOT_SAVED_ALL;
+    return handle;
+  }
+
+  // Start over.
+  memset( file, 0, sizeof *file );
+  memcpy( file->magic, SNAPSHOT_MAGIC, sizeof file->magic );
+  file->version = SNAPSHOT_VERSION;
+  file->cover_width = cover_width;
+  file->cover_height = cover_height;
+
+  struct IMAGE_RAW_HEADER cover;
+  memcpy( cover.magic, IMAGE_RAW_MAGIC, sizeof cover.magic );
+  cover.width = cover_width;
+  cover.height = cover_height;
+  memcpy( file + 1, &cover, sizeof cover );
+
+  return handle;
+}
+
+int snapshot_status ( struct SNAPSHOT_HANDLE handle )
+{
+  if ( handle.d == NULL )
+    return -1;
+  return handle.d->status;
+}
+
+int snapshot_valid ( struct SNAPSHOT_HANDLE handle )
+{
+  return handle.d != NULL && handle.d->valid;
+}
+
+const char* snapshot_text ( struct SNAPSHOT_HANDLE handle, int field )
+{
+  if ( handle.d == NULL || handle.d->file == NULL ||
+       field < 0 || field >= SNAPSHOT_FIELDS )
+    return "";
+  return handle.d->file->text[field];
+}
+
+void snapshot_times ( struct SNAPSHOT_HANDLE handle, long* elapsed,
+		      long* total )
+{
+  *elapsed = 0;
+  *total = 0;
+  if ( handle.d == NULL || handle.d->file == NULL )
+    return;
+  *elapsed = handle.d->file->elapsed;
+  *total = handle.d->file->total;
+}
+
+int snapshot_play_status ( struct SNAPSHOT_HANDLE handle )
+{
+  if ( handle.d == NULL || handle.d->file == NULL )
+    return 0;
+  return handle.d->file->play_status;
+}
+
+struct IMAGE_HANDLE snapshot_cover ( struct SNAPSHOT_HANDLE handle )
+{
+  if ( handle.d == NULL || handle.d->file == NULL ||
+       ! handle.d->file->has_cover )
+    return image_rgba_raw( NULL, 0 );
+  return image_rgba_raw( (const unsigned char*)( handle.d->file + 1 ),
+			 handle.d->size - sizeof( struct SNAPSHOT_FILE ) );
+}
+
+void snapshot_set_text ( struct SNAPSHOT_HANDLE handle, int field,
+			 const char* text )
+{
+  if ( handle.d == NULL || handle.d->file == NULL ||
+       field < 0 || field >= SNAPSHOT_FIELDS )
+    return;
+  change_begin( handle.d );
+  g_strlcpy( handle.d->file->text[field], text, SNAPSHOT_TEXT_MAX );
+  change_end( handle.d, 1 << field );
+}
+
+void snapshot_set_times ( struct SNAPSHOT_HANDLE handle, long elapsed,
+			  long total )
+{
+  if ( handle.d == NULL || handle.d->file == NULL )
+    return;
+  // Every second; not worth a msync.
+  handle.d->file->elapsed = elapsed;
+  handle.d->file->total = total;
+  if ( ! ( handle.d->saved & SNAPSHOT_SAVED_TIMES ) ) {
+    change_begin( handle.d );
+    change_end( handle.d, SNAPSHOT_SAVED_TIMES );
+  }
+}
+
+void snapshot_set_play_status ( struct SNAPSHOT_HANDLE handle, int status )
+{
+  if ( handle.d == NULL || handle.d->file == NULL )
+    return;
+  change_begin( handle.d );
+  handle.d->file->play_status = status;
+  change_end( handle.d, SNAPSHOT_SAVED_STATUS );
+}
+
+void snapshot_set_cover ( struct SNAPSHOT_HANDLE handle,
+			  struct IMAGE_HANDLE cover )
+{
+  if ( handle.d == NULL || handle.d->file == NULL )
+    return;
+  struct SNAPSHOT_FILE* file = handle.d->file;
+  unsigned char* pixels = image_rgba_image( cover );
+
+  change_begin( handle.d );
+  file->has_cover = pixels != NULL &&
+    image_rgba_width( cover ) == (int)file->cover_width &&
+    image_rgba_height( cover ) == (int)file->cover_height;
+  if ( file->has_cover ) {
+    unsigned char* saved = (unsigned char*)( file + 1 ) +
+      sizeof( struct IMAGE_RAW_HEADER );
+    memcpy( saved, pixels, (size_t)file->cover_width * file->cover_height * 4 );
+  }
+  change_end( handle.d, SNAPSHOT_SAVED_COVER );
+}
+
+int snapshot_sync ( struct SNAPSHOT_HANDLE handle )
+{
+  if ( handle.d == NULL || handle.d->file == NULL )
+    return -1;
+  return msync( handle.d->file, handle.d->size, MS_SYNC ) < 0 ? -1 : 0;
+}
+
+void snapshot_close ( struct SNAPSHOT_HANDLE handle )
+{
+  if ( handle.d != NULL ) {
+    if ( handle.d->file != NULL )
+      munmap( handle.d->file, handle.d->size );
+    free( handle.d );
+    handle.d = NULL;
+  }
+}
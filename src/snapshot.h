@@ -0,0 +1,104 @@
+/*
+ * Keep what's on the screen in a small memory mapped file, so that
+ * after a restart we can put it back up straight away rather than
+ * waiting for MPD and the cover database.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "image_intf.h"
+
+struct SNAPSHOT_PRIVATE;
+
+struct SNAPSHOT_HANDLE {
+  struct SNAPSHOT_PRIVATE* d;
+};
+
+//! Longest saved metadata string (in bytes, including the NUL).
+#define SNAPSHOT_TEXT_MAX 512
+
+/*!
+ * Open (or create) the snapshot file. A file made for a different
+ * cover size, or a damaged one, is started over. A new file isn't
+ * valid until every field and the cover have been saved.
+ * \param[in] path the snapshot file.
+ * \param[in] cover_width the width of the saved cover in pixels.
+ * \param[in] cover_height the height of the saved cover in pixels.
+ * \return a handle to the snapshot. Check it with snapshot_status.
+ */
+struct SNAPSHOT_HANDLE snapshot_open ( const char* path, int cover_width,
+				       int cover_height );
+/*!
+ * \param[in] handle the snapshot.
+ * \return 0 if everything is ok, -1 otherwise.
+ */
+int snapshot_status ( struct SNAPSHOT_HANDLE handle );
+/*!
+ * \param[in] handle the snapshot.
+ * \return non-zero if the file holds a complete state from before.
+ */
+int snapshot_valid ( struct SNAPSHOT_HANDLE handle );
+/*!
+ * \param[in] handle the snapshot.
+ * \param[in] field 0, 1 or 2 for the artist, album and title.
+ * \return the saved string (never NULL).
+ */
+const char* snapshot_text ( struct SNAPSHOT_HANDLE handle, int field );
+/*!
+ * \param[in] handle the snapshot.
+ * \param[out] elapsed the saved elapsed time in seconds.
+ * \param[out] total the saved track length in seconds.
+ */
+void snapshot_times ( struct SNAPSHOT_HANDLE handle, long* elapsed,
+		      long* total );
+/*!
+ * \param[in] handle the snapshot.
+ * \return the saved play status (an MPD_PLAY_STATUS).
+ */
+int snapshot_play_status ( struct SNAPSHOT_HANDLE handle );
+/*!
+ * \param[in] handle the snapshot.
+ * \return the saved cover, pointing straight into the file (free the
+ * handle as usual). Its size is 0 x 0 if there isn't one.
+ */
+struct IMAGE_HANDLE snapshot_cover ( struct SNAPSHOT_HANDLE handle );
+/*!
+ * Save one metadata string (truncated if need be).
+ * \param[in] handle the snapshot.
+ * \param[in] field 0, 1 or 2 for the artist, album and title.
+ * \param[in] text the string.
+ */
+void snapshot_set_text ( struct SNAPSHOT_HANDLE handle, int field,
+			 const char* text );
+/*!
+ * \param[in] handle the snapshot.
+ * \param[in] elapsed elapsed time in seconds.
+ * \param[in] total track length in seconds.
+ */
+void snapshot_set_times ( struct SNAPSHOT_HANDLE handle, long elapsed,
+			  long total );
+/*!
+ * \param[in] handle the snapshot.
+ * \param[in] status the play status (an MPD_PLAY_STATUS).
+ */
+void snapshot_set_play_status ( struct SNAPSHOT_HANDLE handle, int status );
+/*!
+ * Save the cover. It has to be the size given to snapshot_open;
+ * anything else just clears the saved cover.
+ * \param[in] handle the snapshot.
+ * \param[in] cover the cover image.
+ */
+void snapshot_set_cover ( struct SNAPSHOT_HANDLE handle,
+			  struct IMAGE_HANDLE cover );
+/*!
+ * Write the file back to the disk now, waiting for it.
+ * \param[in] handle the snapshot.
+ * \return 0 if everything is ok, -1 otherwise.
+ */
+int snapshot_sync ( struct SNAPSHOT_HANDLE handle );
+/*!
+ * Unmap the file (the kernel writes back whatever is left).
+ * \param[in] handle the snapshot.
+ */
+void snapshot_close ( struct SNAPSHOT_HANDLE handle );
+#endif
@@ -0,0 +1,132 @@
+/*
+ * The usual ring: the producer owns the tail and the consumer the
+ * head, and each publishes its index with a release store. The
+ * eventfd is only for waking the consumer, and only written when the
+ * consumer has found the queue empty and gone to wait: a write is a
+ * system call, which would otherwise come with every push.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "spsc_queue.h"
+
+// Keep the two ends apart so they don't fight over a cache line.
+#define CACHE_LINE 64
+
+struct SPSC_QUEUE_PRIVATE {
+  //! Next slot to pop (written by the consumer).
+  unsigned int head __attribute__(( aligned( CACHE_LINE ) ));
+  //! Set by the consumer when it finds the queue empty; the producer
+  //! clears it and writes the eventfd.
+  int waiting;
+  //! Next slot to push (written by the producer).
+  unsigned int tail __attribute__(( aligned( CACHE_LINE ) ));
+  unsigned int mask __attribute__(( aligned( CACHE_LINE ) ));
+  int fd;
+  void** slots;
+};
+
+struct SPSC_QUEUE_HANDLE spsc_queue_create ( unsigned int capacity )
+{
+  struct SPSC_QUEUE_HANDLE handle;
+  handle.d = NULL;
+
+  unsigned int size = 1;
+  while ( size < capacity )
+    size <<= 1;
+
+  struct SPSC_QUEUE_PRIVATE* d;
+  if ( posix_memalign( (void**)&d, CACHE_LINE, sizeof *d ) != 0 )
+    return handle;
+
+  d->head = 0;
+  d->waiting = 1;
+  d->tail = 0;
+  d->mask = size - 1;
+  d->slots = calloc( size, sizeof( void* ) );
+  d->fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  if ( d->slots == NULL || d->fd < 0 ) {
+    if ( d->fd >= 0 )
+      close( d->fd );
+    free( d->slots );
+    free( d );
+    return handle;
+  }
+
+  handle.d = d;
+  return handle;
+}
+
+int spsc_queue_status ( struct SPSC_QUEUE_HANDLE handle )
+{
+  if ( handle.d == NULL || handle.d->slots == NULL || handle.d->fd < 0 )
+    return -1;
+  return 0;
+}
+
+int spsc_queue_push ( struct SPSC_QUEUE_HANDLE handle, void* item )
+{
+  struct SPSC_QUEUE_PRIVATE* d = handle.d;
+  unsigned int tail = d->tail;
+  unsigned int head = __atomic_load_n( &d->head, __ATOMIC_ACQUIRE );
+
+  if ( tail - head > d->mask )
+    return -1;
+
+  d->slots[tail & d->mask] = item;
+  __atomic_store_n( &d->tail, tail + 1, __ATOMIC_RELEASE );
+
+  // Either the consumer sees the new tail or we see it waiting (the
+  // fences pair with the ones in spsc_queue_pop).
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+  if ( __atomic_load_n( &d->waiting, __ATOMIC_RELAXED ) &&
+       __atomic_exchange_n( &d->waiting, 0, __ATOMIC_RELAXED ) ) {
+    uint64_t one = 1;
+    (void)write( d->fd, &one, sizeof one );
+  }
+
+  return 0;
+}
+
+void* spsc_queue_pop ( struct SPSC_QUEUE_HANDLE handle )
+{
+  struct SPSC_QUEUE_PRIVATE* d = handle.d;
+  unsigned int head = d->head;
+  unsigned int tail = __atomic_load_n( &d->tail, __ATOMIC_ACQUIRE );
+
+  if ( head == tail ) {
+    // Clear the wake up, say we're waiting and look again: anything
+    // pushed in between has to be found now or wake us.
+    uint64_t count;
+    (void)read( d->fd, &count, sizeof count );
+    __atomic_store_n( &d->waiting, 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    tail = __atomic_load_n( &d->tail, __ATOMIC_ACQUIRE );
+    if ( head == tail )
+      return NULL;
+  }
+
+  void* item = d->slots[head & d->mask];
+  __atomic_store_n( &d->head, head + 1, __ATOMIC_RELEASE );
+
+  return item;
+}
+
+int spsc_queue_fd ( struct SPSC_QUEUE_HANDLE handle )
+{
+  if ( handle.d == NULL )
+    return -1;
+  return handle.d->fd;
+}
+
+void spsc_queue_free ( struct SPSC_QUEUE_HANDLE handle )
+{
+  if ( handle.d != NULL ) {
+    if ( handle.d->fd >= 0 )
+      close( handle.d->fd );
+    free( handle.d->slots );
+    free( handle.d );
+  }
+}
@@ -0,0 +1,53 @@
+/*
+ * A bounded, lock-free queue of pointers for handing work from one
+ * thread to exactly one other. Pushing and popping never block; the
+ * consumer can wait for items by polling a file descriptor (in a
+ * GLib main loop, say).
+ */
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+struct SPSC_QUEUE_PRIVATE;
+
+struct SPSC_QUEUE_HANDLE {
+  struct SPSC_QUEUE_PRIVATE* d;
+};
+
+/*!
+ * \param[in] capacity the most items held at once (rounded up to a
+ * power of two).
+ * \return a handle to the queue. Check it with spsc_queue_status.
+ */
+struct SPSC_QUEUE_HANDLE spsc_queue_create ( unsigned int capacity );
+/*!
+ * \param[in] handle the queue.
+ * \return 0 if everything is ok, -1 otherwise.
+ */
+int spsc_queue_status ( struct SPSC_QUEUE_HANDLE handle );
+/*!
+ * Add an item. Only one thread may push.
+ * \param[in] handle the queue.
+ * \param[in] item the item (not NULL).
+ * \return 0 if it was queued, -1 if the queue is full.
+ */
+int spsc_queue_push ( struct SPSC_QUEUE_HANDLE handle, void* item );
+/*!
+ * Take the oldest item. Only one thread may pop.
+ * \param[in] handle the queue.
+ * \return the item, or NULL if the queue is empty.
+ */
+void* spsc_queue_pop ( struct SPSC_QUEUE_HANDLE handle );
+/*!
+ * \param[in] handle the queue.
+ * \return a descriptor which is readable while there may be items
+ * waiting. Only spsc_queue_pop clears it, when it finds the queue
+ * empty, so the consumer may take a few items at a time and will be
+ * woken again for the rest.
+ */
+int spsc_queue_fd ( struct SPSC_QUEUE_HANDLE handle );
+/*!
+ * Free the queue. Items left in it are not freed.
+ * \param[in] handle the queue.
+ */
+void spsc_queue_free ( struct SPSC_QUEUE_HANDLE handle );
+#endif
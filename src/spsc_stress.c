@@ -0,0 +1,112 @@
+/*
+ * Stress the SPSC queue: one thread pushes the numbers 1 to N as fast
+ * as it can while another pops them, waiting on the descriptor the way
+ * the main loop does, and checks that each arrives once and in order.
+ * The queue is kept small so that it is full (and wraps) all the time.
+ * Every so often the consumer dawdles, to catch a wake up lost while
+ * the producer was waiting for room.
+ *
+ * usage: spsc_stress [items [capacity]]
+ *
+ * Exits non-zero (saying why) if anything goes wrong.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spsc_queue.h"
+
+struct STRESS {
+  struct SPSC_QUEUE_HANDLE queue;
+  uintptr_t items;
+  //! Pushes which found the queue full.
+  unsigned long full;
+};
+
+static void* producer ( void* data )
+{
+  struct STRESS* stress = data;
+  uintptr_t n;
+  for ( n = 1; n <= stress->items; n++ ) {
+    while ( spsc_queue_push( stress->queue, (void*)n ) < 0 ) {
+      stress->full++;
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+int main ( int argc, char* argv[] )
+{
+  struct STRESS stress;
+  stress.items = argc > 1 ? strtoul( argv[1], NULL, 0 ) : 1000000;
+  unsigned int capacity = argc > 2 ? strtoul( argv[2], NULL, 0 ) : 16;
+  stress.full = 0;
+  if ( argc > 3 || stress.items == 0 || capacity == 0 ) {
+    fprintf( stderr, "usage: %s [items [capacity]]\n", argv[0] );
+    return 1;
+  }
+
+  stress.queue = spsc_queue_create( capacity );
+  if ( spsc_queue_status( stress.queue ) < 0 ) {
+    fprintf( stderr, "Could not make a queue\n" );
+    return 1;
+  }
+
+  struct timespec start, end;
+  clock_gettime( CLOCK_MONOTONIC, &start );
+
+  pthread_t thread;
+  if ( pthread_create( &thread, NULL, producer, &stress ) != 0 ) {
+    fprintf( stderr, "Could not start the producer\n" );
+    return 1;
+  }
+
+  uintptr_t expected = 1;
+  unsigned long waits = 0;
+  while ( expected <= stress.items ) {
+    // A second with nothing to show for it is a lost wake up.
+    struct pollfd wait = { spsc_queue_fd( stress.queue ), POLLIN, 0 };
+    if ( poll( &wait, 1, 1000 ) != 1 ) {
+      fprintf( stderr, "Stuck waiting for %lu\n", (unsigned long)expected );
+      return 1;
+    }
+    waits++;
+
+    void* item;
+    while ( ( item = spsc_queue_pop( stress.queue ) ) != NULL ) {
+      if ( (uintptr_t)item != expected ) {
+	fprintf( stderr, "Got %lu, expected %lu\n", (unsigned long)item,
+		 (unsigned long)expected );
+	return 1;
+      }
+      expected++;
+    }
+
+    if ( waits % 1024 == 0 )
+      usleep( 100 );
+  }
+
+  pthread_join( thread, NULL );
+  clock_gettime( CLOCK_MONOTONIC, &end );
+
+  if ( spsc_queue_pop( stress.queue ) != NULL ) {
+    fprintf( stderr, "Something extra in the queue\n" );
+    return 1;
+  }
+  spsc_queue_free( stress.queue );
+
+  double seconds = ( end.tv_sec - start.tv_sec ) +
+    ( end.tv_nsec - start.tv_nsec ) / 1e9;
+  printf( "%lu items through a queue of %u in %.2f s (%.0f ns each); "
+	  "%lu wake ups, %lu pushes found it full\n",
+	  (unsigned long)stress.items, capacity, seconds,
+	  seconds * 1e9 / stress.items, waits, stress.full );
+
+  return 0;
+}
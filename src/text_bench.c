@@ -0,0 +1,130 @@
+/*
+ * Benchmark: how long does a text widget take to draw with its glyphs
+ * as OpenVG paths and as bitmaps from the atlas? Draws the same text
+ * into an off-screen surface over and over in each mode, waiting for
+ * the GPU each time, and prints the mean per draw.
+ *
+ * usage: text_bench [markup [iterations]]
+ *
+ * Needs the VideoCore (run it on the Pi, mpddisplay needn't be
+ * stopped).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bcm_host.h"
+#include "EGL/egl.h"
+#include "VG/openvg.h"
+#include "glib.h"
+
+#include "text_widget.h"
+
+#define BENCH_WIDTH 800
+#define BENCH_HEIGHT 480
+// Roughly the 7" screen's resolution.
+#define BENCH_DPMM 5.f
+
+static const char* DEFAULT_MARKUP =
+  "<span font=\"Droid Sans 20px\">The quick brown fox jumps over the "
+  "lazy dog. Pack my box with five dozen liquor jugs. "
+  "0123456789</span>";
+
+/*!
+ * Draw the widget iterations times, after a few to warm up.
+ * \return the mean time per draw (us).
+ */
+static double time_draws ( struct TEXT_WIDGET_HANDLE widget, int iterations )
+{
+  static const VGfloat black[] = { 0.f, 0.f, 0.f, 1.f };
+  vgSetfv( VG_CLEAR_COLOR, 4, black );
+
+  int i;
+  for ( i = 0; i < 10; i++ ) {
+    vgClear( 0, 0, BENCH_WIDTH, BENCH_HEIGHT );
+    text_widget_draw_text( widget );
+  }
+  vgFinish();
+
+  gint64 start = g_get_monotonic_time();
+  for ( i = 0; i < iterations; i++ ) {
+    vgClear( 0, 0, BENCH_WIDTH, BENCH_HEIGHT );
+    text_widget_draw_text( widget );
+    vgFinish();
+  }
+  return (double)( g_get_monotonic_time() - start ) / iterations;
+}
+
+int main ( int argc, char* argv[] )
+{
+  const char* markup = argc > 1 ? argv[1] : DEFAULT_MARKUP;
+  int iterations = argc > 2 ? atoi( argv[2] ) : 1000;
+  if ( argc > 3 || iterations <= 0 ) {
+    fprintf( stderr, "usage: %s [markup [iterations]]\n", argv[0] );
+    return 1;
+  }
+
+  bcm_host_init();
+
+  EGLDisplay display = eglGetDisplay( EGL_DEFAULT_DISPLAY );
+  if ( display == EGL_NO_DISPLAY ||
+       eglInitialize( display, NULL, NULL ) == EGL_FALSE ||
+       eglBindAPI( EGL_OPENVG_API ) == EGL_FALSE ) {
+    fprintf( stderr, "Could not set up EGL for OpenVG\n" );
+    return 1;
+  }
+
+  static const EGLint config_attrs[] = {
+    EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENVG_BIT,
+    EGL_NONE
+  };
+  static const EGLint surface_attrs[] = {
+    EGL_WIDTH, BENCH_WIDTH, EGL_HEIGHT, BENCH_HEIGHT, EGL_NONE
+  };
+  EGLConfig config;
+  EGLint n_configs = 0;
+  if ( eglChooseConfig( display, config_attrs, &config, 1, &n_configs ) ==
+       EGL_FALSE || n_configs == 0 ) {
+    fprintf( stderr, "No EGL config for an OpenVG pbuffer\n" );
+    return 1;
+  }
+  EGLSurface surface = eglCreatePbufferSurface( display, config,
+						surface_attrs );
+  EGLContext context = eglCreateContext( display, config, EGL_NO_CONTEXT,
+					 NULL );
+  if ( surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT ||
+       eglMakeCurrent( display, surface, surface, context ) == EGL_FALSE ) {
+    fprintf( stderr, "Could not make an OpenVG pbuffer current\n" );
+    return 1;
+  }
+
+  struct TEXT_WIDGET_HANDLE widget =
+    text_widget_init( 10.f, 10.f, ( BENCH_WIDTH - 100 ) / BENCH_DPMM,
+		      ( BENCH_HEIGHT - 100 ) / BENCH_DPMM,
+		      BENCH_DPMM, BENCH_DPMM );
+  float white[4] = { 1.f, 1.f, 1.f, 1.f };
+  text_widget_set_foreground( widget, white );
+  text_widget_set_text( widget, markup, -1 );
+
+  // Paths first: atlas mode falls back to them for what doesn't fit.
+  text_widget_set_render_mode( widget, TEXT_WIDGET_RENDER_PATHS );
+  double paths = time_draws( widget, iterations );
+  text_widget_set_render_mode( widget, TEXT_WIDGET_RENDER_ATLAS );
+  double atlas = time_draws( widget, iterations );
+
+  printf( "paths: %.1f us per draw\n", paths );
+  printf( "atlas: %.1f us per draw (%d%% of the atlas used)\n", atlas,
+	  text_widget_atlas_usage() );
+
+  if ( vgGetError() != VG_NO_ERROR )
+    fprintf( stderr, "Warning: OpenVG reported an error\n" );
+
+  text_widget_free_handle( widget );
+  eglMakeCurrent( display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT );
+  eglDestroySurface( display, surface );
+  eglDestroyContext( display, context );
+  eglTerminate( display );
+
+  return 0;
+}
@@ -2,11 +2,18 @@
  * A text widget which provides some layout services and font
  * selection.
  */
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "pango/pangoft2.h"
+#include "EGL/egl.h"
 #include "VG/openvg.h"
 
+#include "glyph_atlas.h"
+#include "glyph_cache.h"
+#include "metrics.h"
+#include "trace.h"
 #include "text_widget.h"
 
 static float float_from_26_6( FT_Pos x )
@@ -25,13 +32,83 @@ struct VG_DATA {
   uint8_t cmap[144]; // Probably should have an expandable structure. But
 		     // we know we don't have any glyphs > 144*8 = 1152.
 		     // Your collection may vary.
+  uint64_t key;      // Glyph cache key for this face and size.
+  GHashTable* bitmaps; // Glyph (+1) -> ATLAS_GLYPH, in atlas mode.
 };
 
+/*!
+ * A glyph's bitmap in the atlas.
+ */
+struct ATLAS_GLYPH {
+  //! VG_INVALID_HANDLE for blanks.
+  VGImage image;
+  //! The glyph couldn't be rendered or didn't fit: don't try again
+  //! until the atlas is emptied.
+  int missing;
+  //! The atlas generation it was made in.
+  unsigned int generation;
+  //! Offset of the bitmap's top left corner from the pen (pixels, up
+  //! is positive).
+  int left;
+  int top;
+  int rows;
+};
+
+static void atlas_glyph_free ( gpointer data )
+{
+  struct ATLAS_GLYPH* atlas_glyph = data;
+  if ( atlas_glyph->image != VG_INVALID_HANDLE )
+    vgDestroyImage( atlas_glyph->image );
+  free( atlas_glyph );
+}
+
+#define CMAP_GLYPHS_MAX ( 8 * sizeof ((struct VG_DATA*)0)->cmap )
+
+// Glyph outlines saved from previous runs (shared by all widgets, just
+// like the VG_DATA).
+static struct GLYPH_CACHE_HANDLE glyph_cache = { NULL };
+
+// Rendered glyph bitmaps, likewise shared. Created the first time a
+// widget uses atlas mode.
+static struct GLYPH_ATLAS_HANDLE glyph_atlas = { NULL };
+#define GLYPH_ATLAS_WIDTH 1024
+#define GLYPH_ATLAS_HEIGHT 512
+// May a full atlas be emptied to make room? Only while laying out new
+// text, and only once per layout, so two widgets can't take turns
+// emptying it on every frame.
+static int glyph_atlas_resettable = 0;
+
+// All widgets at the same resolution share a font map (and so its
+// font cache). The warm up thread, if there is one, makes it.
+static PangoFontMap* shared_font_map = NULL;
+static float shared_dpmm_x = 0.f;
+static float shared_dpmm_y = 0.f;
+static GThread* warm_up_thread = NULL;
+
+struct WARM_UP {
+  char** fonts;
+  float dpmm_x;
+  float dpmm_y;
+};
+
+// Glyphs handed to OpenVG.
+static struct METRIC upload_metrics[] = {
+  METRIC_COUNTER_INIT( "mpddisplay_glyph_uploads_total",
+		       "Glyphs loaded into OpenVG.", "kind", "path" ),
+  METRIC_COUNTER_INIT( "mpddisplay_glyph_uploads_total",
+		       "Glyphs loaded into OpenVG.", "kind", "bitmap" ),
+};
+static struct METRIC atlas_reset_metric =
+  METRIC_COUNTER_INIT( "mpddisplay_glyph_atlas_resets_total",
+		       "Times the glyph atlas was full and emptied.", NULL, NULL );
+
 struct VG_DATA* vg_data_new ( void )
 {
   struct VG_DATA* vg_data = malloc( sizeof( struct VG_DATA ) );
   vg_data->font = vgCreateFont( 256 );
   memset( vg_data->cmap, 0, sizeof vg_data->cmap );
+  vg_data->key = 0;
+  vg_data->bitmaps = NULL;
   return vg_data;
 }
 
@@ -43,11 +120,435 @@ void vg_data_free ( void* vg_data_ptr )
   struct VG_DATA* data = (struct VG_DATA*)size->generic.data;
   if ( data != NULL ) {
     vgDestroyFont( data->font );
+    if ( data->bitmaps != NULL )
+      g_hash_table_destroy( data->bitmaps );
     free( data );
   }
 }
 
-static void add_char ( VGFont font, FT_Face face, FT_ULong c );
+static void add_char ( struct VG_DATA* vg_data, FT_Face face, FT_ULong c );
+
+static void set_glyph_path ( VGFont font, const struct GLYPH_OUTLINE* outline )
+{
+  VGPath path;
+  path = vgCreatePath( VG_PATH_FORMAT_STANDARD, VG_PATH_DATATYPE_F,
+		       1.f, 0.f, 0, 0, VG_PATH_CAPABILITY_ALL );
+  // It could be a blank. If any character doesn't have a glyph, though,
+  // nothing is drawn by vgDrawGlyphs.
+  if ( outline->segments_count > 0 ) {
+    vgAppendPathData( path, outline->segments_count, outline->segments,
+		      outline->coords );
+  }
+
+  VGfloat origin[] = { 0.f, 0.f };
+
+  vgSetGlyphToPath( font, outline->glyph, path, VG_TRUE, origin,
+		    outline->escapement );
+  metric_add( &upload_metrics[0], 1 );
+
+  vgDestroyPath( path );
+}
+
+/*!
+ * Load a glyph from a previous run straight into the VGFont.
+ */
+static void prepopulate_glyph ( const struct GLYPH_OUTLINE* outline,
+				void* data )
+{
+  struct VG_DATA* vg_data = data;
+  if ( outline->glyph >= CMAP_GLYPHS_MAX )
+    return;
+  set_glyph_path( vg_data->font, outline );
+  vg_data->cmap[outline->glyph / 8] |= 1 << ( outline->glyph & 0x7 );
+}
+
+/*!
+ * Make sure the glyphs of the run are in the VGFont attached to the
+ * face, creating the VGFont if necessary. When it is created, the
+ * VGFont is filled with whatever the glyph cache has for this face.
+ * The face must be locked.
+ * \return the VG data attached to the face's current size.
+ */
+static struct VG_DATA* load_glyphs ( PangoFont* font, FT_Face face,
+				     PangoGlyphString* glyphs )
+{
+  struct VG_DATA* vg_data = face->size->generic.data;
+  if ( vg_data == NULL ) {
+    vg_data = vg_data_new();
+    face->size->generic.data = vg_data;
+    face->size->generic.finalizer = vg_data_free;
+
+    FcChar8* file = NULL;
+    int index = 0;
+    FcPattern* pattern = ((PangoFcFont*)font)->font_pattern;
+    if ( FcPatternGetString( pattern, FC_FILE, 0, &file ) == FcResultMatch ) {
+      (void)FcPatternGetInteger( pattern, FC_INDEX, 0, &index );
+      vg_data->key = glyph_cache_face_key( glyph_cache, (const char*)file,
+					   index,
+					   face->size->metrics.x_scale,
+					   face->size->metrics.y_scale );
+      glyph_cache_foreach( glyph_cache, vg_data->key, prepopulate_glyph,
+			   vg_data );
+    }
+  }
+  int g;
+  for ( g = 0; g < glyphs->num_glyphs; g++ ) {
+    PangoGlyph glyph = glyphs->glyphs[g].glyph;
+    if ( glyph >= CMAP_GLYPHS_MAX ) {
+      // Not tracked (see above); better to redo it than scribble.
+      add_char( vg_data, face, glyph );
+      continue;
+    }
+    int byte = glyph / 8;
+    int bit  = 1 << ( glyph & 0x7 );
+    if ( ! ( vg_data->cmap[byte] & bit  ) ) {
+      vg_data->cmap[byte] |= bit;
+      add_char( vg_data, face, glyph );
+    }
+  }
+  return vg_data;
+}
+
+/*!
+ * Render the glyph into the atlas. The face must be locked.
+ * \return 0 if everything is ok, -1 if the glyph couldn't be rendered
+ * or the atlas is full.
+ */
+static int atlas_render ( struct ATLAS_GLYPH* atlas_glyph, FT_Face face,
+			  PangoGlyph glyph )
+{
+  // Hinted, anti-aliased coverage.
+  if ( FT_Load_Glyph( face, glyph, FT_LOAD_RENDER ) != 0 )
+    return -1;
+
+  FT_Bitmap* bitmap = &face->glyph->bitmap;
+  VGImage image = VG_INVALID_HANDLE;
+  if ( bitmap->width > 0 && bitmap->rows > 0 ) {
+    if ( bitmap->pixel_mode != FT_PIXEL_MODE_GRAY )
+      return -1;
+    if ( glyph_atlas_add( glyph_atlas, bitmap->width, bitmap->rows,
+			  bitmap->pitch, bitmap->buffer, &image ) != 0 ) {
+      if ( ! glyph_atlas_resettable )
+	return -1;
+      // Full: start again (compile_layout notices and lays out again,
+      // since the runs before this one are now stale).
+      glyph_atlas_resettable = 0;
+      glyph_atlas_reset( glyph_atlas );
+      metric_add( &atlas_reset_metric, 1 );
+      atlas_glyph->generation = glyph_atlas_generation( glyph_atlas );
+      if ( glyph_atlas_add( glyph_atlas, bitmap->width, bitmap->rows,
+			    bitmap->pitch, bitmap->buffer, &image ) != 0 )
+	return -1;
+    }
+    metric_add( &upload_metrics[1], 1 );
+  }
+
+  atlas_glyph->image   = image;
+  atlas_glyph->missing = 0;
+  atlas_glyph->left    = face->glyph->bitmap_left;
+  atlas_glyph->top     = face->glyph->bitmap_top;
+  atlas_glyph->rows    = bitmap->rows;
+
+  return 0;
+}
+
+/*!
+ * Find the glyph's bitmap, rendering it into the atlas if it isn't
+ * there yet. The face must be locked.
+ * \return the bitmap or NULL if the glyph couldn't be rendered or the
+ * atlas is full. Either way, that is remembered until the atlas is
+ * next emptied.
+ */
+static const struct ATLAS_GLYPH* atlas_lookup ( struct VG_DATA* vg_data,
+						FT_Face face, PangoGlyph glyph )
+{
+  if ( vg_data->bitmaps == NULL )
+    vg_data->bitmaps = g_hash_table_new_full( g_direct_hash, g_direct_equal,
+					      NULL, atlas_glyph_free );
+
+  unsigned int generation = glyph_atlas_generation( glyph_atlas );
+  gpointer key = GUINT_TO_POINTER( glyph + 1 );
+  struct ATLAS_GLYPH* atlas_glyph = g_hash_table_lookup( vg_data->bitmaps,
+							 key );
+  if ( atlas_glyph != NULL ) {
+    if ( atlas_glyph->generation == generation )
+      return atlas_glyph->missing ? NULL : atlas_glyph;
+    // From before the atlas was emptied: its pixels are gone.
+    g_hash_table_remove( vg_data->bitmaps, key );
+  }
+
+  atlas_glyph = malloc( sizeof( struct ATLAS_GLYPH ) );
+  atlas_glyph->image = VG_INVALID_HANDLE;
+  atlas_glyph->missing = 1;
+  atlas_glyph->generation = generation;
+  atlas_glyph->left = 0;
+  atlas_glyph->top  = 0;
+  atlas_glyph->rows = 0;
+  g_hash_table_insert( vg_data->bitmaps, key, atlas_glyph );
+
+  if ( glyph & PANGO_GLYPH_UNKNOWN_FLAG )
+    return NULL;
+
+  gint64 span = trace_begin();
+  int status = atlas_render( atlas_glyph, face, glyph );
+  trace_end( "glyph bitmap", span );
+
+  return status == 0 ? atlas_glyph : NULL;
+}
+
+/*!
+ * One glyph bitmap placed in the widget.
+ */
+struct BLIT {
+  VGImage image;
+  //! Bottom left corner (pixels).
+  VGfloat x;
+  VGfloat y;
+};
+
+/*!
+ * Place the bitmaps of a run. Positions are snapped to whole pixels
+ * (the bitmaps are hinted for that).
+ * \param[in] vg_data the face's data.
+ * \param[in] face the locked face.
+ * \param[in] glyphs the shaped glyphs.
+ * \param[in] x pen position at the start of the run (pixels).
+ * \param[in] y baseline (pixels, up from the bottom).
+ * \param[inout] blits the bitmaps are appended here.
+ * \return 0 if everything is ok, -1 if any glyph is missing (and then
+ * nothing is appended).
+ */
+static int atlas_run ( struct VG_DATA* vg_data, FT_Face face,
+		       PangoGlyphString* glyphs, float x, float y,
+		       GArray* blits )
+{
+  guint start = blits->len;
+  int pen = 0;
+  int g;
+  for ( g = 0; g < glyphs->num_glyphs; g++ ) {
+    const PangoGlyphInfo* info = &glyphs->glyphs[g];
+    if ( info->glyph != PANGO_GLYPH_EMPTY ) {
+      const struct ATLAS_GLYPH* atlas_glyph =
+	atlas_lookup( vg_data, face, info->glyph );
+      if ( atlas_glyph == NULL ) {
+	g_array_set_size( blits, start );
+	return -1;
+      }
+      if ( atlas_glyph->image != VG_INVALID_HANDLE ) {
+	float pen_x = x + (float)( pen + info->geometry.x_offset ) / PANGO_SCALE;
+	float pen_y = y - (float)info->geometry.y_offset / PANGO_SCALE;
+	struct BLIT blit;
+	blit.image = atlas_glyph->image;
+	blit.x = roundf( pen_x ) + atlas_glyph->left;
+	blit.y = roundf( pen_y ) + atlas_glyph->top - atlas_glyph->rows;
+	g_array_append_val( blits, blit );
+      }
+    }
+    pen += info->geometry.width;
+  }
+  return 0;
+}
+
+// Sprite mode only knows about ASCII.
+#define SPRITE_CHARACTERS 128
+// Longest string we'll draw in sprite mode. "hhh:mm / hhh:mm" fits.
+#define SPRITE_TEXT_MAX 32
+
+/*!
+ * For text like the elapsed time, which only ever uses a handful of
+ * characters, we shape the glyphs once and then do the layout
+ * ourselves. The result can be drawn with a single vgDrawGlyphs.
+ */
+struct SPRITES {
+  //! The Pango font the glyphs came from (we hold a reference).
+  PangoFont* font;
+  //! The OpenVG font attached to it.
+  VGFont vg_font;
+  //! Is the character in the set?
+  uint8_t present[SPRITE_CHARACTERS];
+  //! Glyph index of each character.
+  VGuint glyph[SPRITE_CHARACTERS];
+  //! The advance Pango gave each character (pixels).
+  float width[SPRITE_CHARACTERS];
+  //! The advance we use (the same for all digits).
+  float advance[SPRITE_CHARACTERS];
+  //! Distance from the top of the box to the baseline (pixels).
+  float baseline;
+  //! The current text.
+  char text[SPRITE_TEXT_MAX];
+  int length;
+  //! The current text as glyphs ready for vgDrawGlyphs.
+  VGuint glyphs[SPRITE_TEXT_MAX];
+  VGfloat adjustments[SPRITE_TEXT_MAX];
+  int count;
+  //! Left edge of the text after alignment (pixels).
+  float x;
+};
+
+static void sprites_free ( struct SPRITES* sprites )
+{
+  if ( sprites != NULL ) {
+    g_object_unref( sprites->font );
+    free( sprites );
+  }
+}
+
+/*!
+ * One run of glyphs, all in the same font and color, ready for
+ * vgDrawGlyphs.
+ */
+struct TEXT_RUN {
+  //! Where the run starts (pixels, relative to the bottom left).
+  VGfloat origin[2];
+  //! VG_INVALID_HANDLE means use the widget's foreground.
+  VGPaint paint;
+  VGFont font;
+  VGint glyphs_count;
+  //! Index of the run's first glyph in the list's glyph array.
+  VGint glyphs_offset;
+  //! If >= 0, the run is part of this marquee line and is drawn by
+  //! way of its image.
+  VGint marquee;
+  //! In atlas mode, the run's bitmaps in the list's blit array. A
+  //! count of -1 means draw the glyphs as paths.
+  VGint blits_count;
+  VGint blits_offset;
+};
+
+/*!
+ * The layout compiled down to what OpenVG needs to draw it. The runs,
+ * the glyph indexes and the bitmap placements all live in the one
+ * allocation.
+ */
+struct DISPLAY_LIST {
+  int runs_count;
+  //! The atlas generation the blits come from (if there are any).
+  int blits_count;
+  unsigned int atlas_generation;
+  struct TEXT_RUN* runs;
+  struct BLIT* blits;
+  VGuint* glyphs;
+};
+
+// How many different markup colors we keep paints for. Colors in
+// markup are used sparingly, so this is plenty.
+#define PAINT_CACHE_SIZE 16
+
+/*!
+ * Paints for markup colors, shared by all the text widgets. Entries
+ * which are no longer referenced keep their paint until the slot is
+ * needed for another color, so relaying out the same markup doesn't
+ * create any new driver objects.
+ */
+static struct PAINT_CACHE_ENTRY {
+  uint32_t rgba;
+  VGPaint paint;
+  int references;
+} paint_cache[PAINT_CACHE_SIZE];
+
+/*!
+ * Get a paint of the given color.
+ * \param[in] rgba the color packed as 0xRRGGBBAA.
+ * \return the paint or VG_INVALID_HANDLE if the cache is full of
+ * colors in use (in which case the text gets the default foreground).
+ */
+static VGPaint paint_cache_acquire ( uint32_t rgba )
+{
+  struct PAINT_CACHE_ENTRY* unused = NULL;
+  int i;
+  for ( i = 0; i < PAINT_CACHE_SIZE; i++ ) {
+    struct PAINT_CACHE_ENTRY* entry = &paint_cache[i];
+    if ( entry->paint != VG_INVALID_HANDLE && entry->rgba == rgba ) {
+      entry->references++;
+      return entry->paint;
+    }
+    // Prefer an empty slot over evicting a color.
+    if ( entry->references == 0 &&
+	 ( unused == NULL || entry->paint == VG_INVALID_HANDLE ) )
+      unused = entry;
+  }
+
+  if ( unused == NULL )
+    return VG_INVALID_HANDLE;
+
+  if ( unused->paint == VG_INVALID_HANDLE )
+    unused->paint = vgCreatePaint();
+
+  VGfloat color[] = { (float)( ( rgba >> 24 ) & 0xff ) / 255.f,
+		      (float)( ( rgba >> 16 ) & 0xff ) / 255.f,
+		      (float)( ( rgba >>  8 ) & 0xff ) / 255.f,
+		      (float)( rgba & 0xff ) / 255.f };
+  vgSetParameterfv( unused->paint, VG_PAINT_COLOR, 4, color );
+  unused->rgba = rgba;
+  unused->references = 1;
+
+  return unused->paint;
+}
+
+static void paint_cache_release ( VGPaint paint )
+{
+  int i;
+  for ( i = 0; i < PAINT_CACHE_SIZE; i++ ) {
+    if ( paint_cache[i].paint == paint && paint_cache[i].references > 0 ) {
+      paint_cache[i].references--;
+      return;
+    }
+  }
+}
+
+static void display_list_free ( struct DISPLAY_LIST* list )
+{
+  if ( list != NULL ) {
+    int r;
+    for ( r = 0; r < list->runs_count; r++ ) {
+      if ( list->runs[r].paint != VG_INVALID_HANDLE )
+	paint_cache_release( list->runs[r].paint );
+    }
+    free( list );
+  }
+}
+
+// How many lines of a widget can scroll.
+#define MARQUEE_LINES_MAX 4
+// The VideoCore won't make images wider than this...
+#define MARQUEE_IMAGE_MAX 2048
+// ...so a long line is cut into tiles. Longer than this many and the
+// line is drawn directly.
+#define MARQUEE_TILES_MAX 8
+// Scroll speed in pixels per second.
+static const float MARQUEE_SPEED = 40.f;
+// How long a line sits still before it starts to scroll (us).
+static const gint64 MARQUEE_PAUSE = 2 * G_USEC_PER_SEC;
+
+/*!
+ * A line too long for the box. It is rendered once into images (tiles,
+ * each MARQUEE_IMAGE_MAX wide but the last) which are then slid along
+ * underneath a scissor rectangle.
+ */
+struct MARQUEE {
+  VGImage tiles[MARQUEE_TILES_MAX];
+  //! 0 if the line is drawn directly.
+  int tiles_count;
+  //! Width of the text itself (the image has room for a gap, too).
+  float width;
+  //! Bottom of the line relative to the bottom of the box (pixels).
+  float y;
+  //! Height of the line (pixels).
+  float height;
+};
+
+// Auto-fit picks from at most this many sizes.
+#define FIT_SIZES_MAX 8
+// and remembers the choice for this many strings.
+#define FIT_MEMO_SIZE 32
+
+/*!
+ * The size chosen for a particular markup string.
+ */
+struct FIT_MEMO {
+  guint hash;
+  int index;
+};
 
 struct TEXT_WIDGET_PRIVATE {
   float x_mm;
@@ -57,11 +558,139 @@ struct TEXT_WIDGET_PRIVATE {
   PangoFontMap* font_map;
   PangoContext* context;
   PangoLayout* layout;
+  // Height of the box in pixels.
+  int height;
   VGPaint foreground;
+  // The markup most recently laid out and its hash. If we are handed
+  // the same string again, there is no need to bother Pango.
+  GString* markup;
+  guint markup_hash;
+  // If not NULL, the widget is in sprite mode.
+  struct SPRITES* sprites;
+  // The current layout, ready to draw.
+  struct DISPLAY_LIST* display_list;
+  // Width of the box in Pango units and pixels.
+  int width_units;
+  int width;
+  // Alignment (we do it ourselves in marquee mode).
+  enum TEXT_WIDGET_ALIGNMENT alignment;
+  // Should long lines scroll rather than wrap?
+  int marquee_mode;
+  struct MARQUEE marquees[MARQUEE_LINES_MAX];
+  int marquees_count;
+  // When the marquees were (re)started.
+  gint64 marquee_start;
+  enum TEXT_WIDGET_RENDER_MODE render_mode;
+  // Auto-fit: the base font, the candidate sizes (largest first,
+  // Pango units) and what we picked last time.
+  PangoFontDescription* fit_font;
+  int fit_sizes[FIT_SIZES_MAX];
+  int fit_sizes_count;
+  int fit_index;
+  struct FIT_MEMO fit_memo[FIT_MEMO_SIZE];
+  int fit_memo_count;
+  int fit_memo_next;
 };
 
+/*!
+ * FNV-1a over the markup bytes. Cheap enough to run on every tick,
+ * which is the point.
+ */
+static guint markup_hash ( const char* text, int length )
+{
+  guint hash = 2166136261u;
+  int i;
+  for ( i = 0; i < length; i++ ) {
+    hash ^= (unsigned char)text[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
 static VGfloat DEFAULT_FOREGROUND[] = { 1.f, 1.f, 1.f, 1.f };
 
+static PangoFontMap* font_map_new ( float dpmm_x, float dpmm_y )
+{
+  PangoFontMap* font_map = pango_ft2_font_map_new();
+  // Note: FreeType works in DPI.
+  pango_ft2_font_map_set_resolution( (PangoFT2FontMap*)font_map,
+				     dpmm_x * 25.4, dpmm_y * 25.4 );
+  return font_map;
+}
+
+/*!
+ * Runs in its own thread. Nothing else touches the font map (or
+ * fontconfig) until it's joined.
+ */
+static gpointer warm_up ( gpointer data )
+{
+  struct WARM_UP* job = data;
+  trace_thread_name( "fonts" );
+  gint64 span = trace_begin();
+
+  PangoFontMap* font_map = font_map_new( job->dpmm_x, job->dpmm_y );
+  PangoContext* context = pango_font_map_create_context( font_map );
+  char** font;
+  for ( font = job->fonts; *font != NULL; font++ ) {
+    PangoFontDescription* description =
+      pango_font_description_from_string( *font );
+    // Loading the font is what reads the fontconfig cache and opens
+    // the file. The font map keeps it.
+    PangoFont* loaded = pango_font_map_load_font( font_map, context,
+						  description );
+    if ( loaded != NULL )
+      g_object_unref( loaded );
+    pango_font_description_free( description );
+  }
+  g_object_unref( context );
+
+  g_strfreev( job->fonts );
+  free( job );
+
+  trace_end( "font warm up", span );
+  return font_map;
+}
+
+/*!
+ * \return a reference to a font map at this resolution.
+ */
+static PangoFontMap* font_map_get ( float dpmm_x, float dpmm_y )
+{
+  if ( warm_up_thread != NULL ) {
+    gint64 span = trace_begin();
+    shared_font_map = g_thread_join( warm_up_thread );
+    warm_up_thread = NULL;
+    trace_end( "wait for fonts", span );
+  }
+
+  if ( shared_font_map == NULL ) {
+    shared_font_map = font_map_new( dpmm_x, dpmm_y );
+    shared_dpmm_x = dpmm_x;
+    shared_dpmm_y = dpmm_y;
+  }
+
+  if ( dpmm_x == shared_dpmm_x && dpmm_y == shared_dpmm_y )
+    return g_object_ref( shared_font_map );
+
+  return font_map_new( dpmm_x, dpmm_y );
+}
+
+void text_widget_warm_up ( const char* const* fonts, float dpmm_x,
+			   float dpmm_y )
+{
+  if ( warm_up_thread != NULL || shared_font_map != NULL )
+    return;
+
+  struct WARM_UP* warm_up_data = malloc( sizeof( struct WARM_UP ) );
+  warm_up_data->fonts = g_strdupv( (gchar**)fonts );
+  warm_up_data->dpmm_x = dpmm_x;
+  warm_up_data->dpmm_y = dpmm_y;
+  shared_dpmm_x = dpmm_x;
+  shared_dpmm_y = dpmm_y;
+
+  warm_up_thread = g_thread_new( "fonts", warm_up, warm_up_data );
+}
+
 struct TEXT_WIDGET_HANDLE text_widget_init ( float x_mm, float y_mm,
 					     float width_mm,
 					     float height_mm,
@@ -74,11 +703,11 @@ struct TEXT_WIDGET_HANDLE text_widget_init ( float x_mm, float y_mm,
   handle.d->y_mm = y_mm;
   handle.d->dpmm_x = dpmm_x;
   handle.d->dpmm_y = dpmm_y;
-  handle.d->font_map = pango_ft2_font_map_new();
+  handle.d->font_map = font_map_get( dpmm_x, dpmm_y );
 
-  // Note: FreeType works in DPI.
-  pango_ft2_font_map_set_resolution( (PangoFT2FontMap*)handle.d->font_map,
-				     dpmm_x * 25.4, dpmm_y * 25.4 );
+  metrics_register( &upload_metrics[0] );
+  metrics_register( &upload_metrics[1] );
+  metrics_register( &atlas_reset_metric );
 
   handle.d->context  = pango_font_map_create_context( handle.d->font_map );
   handle.d->layout   = pango_layout_new( handle.d->context );
@@ -89,10 +718,28 @@ struct TEXT_WIDGET_HANDLE text_widget_init ( float x_mm, float y_mm,
   int height = pango_units_from_double( dpmm_y * height_mm );
   pango_layout_set_width( handle.d->layout, width );
   pango_layout_set_height( handle.d->layout, height );
+  handle.d->height = PANGO_PIXELS( height );
+  handle.d->width_units = width;
+  handle.d->width = PANGO_PIXELS( width );
 
   handle.d->foreground = vgCreatePaint();
   vgSetParameterfv( handle.d->foreground, VG_PAINT_COLOR, 4, DEFAULT_FOREGROUND );
 
+  handle.d->markup = g_string_sized_new( 256 );
+  handle.d->markup_hash = markup_hash( "", 0 );
+  handle.d->sprites = NULL;
+  handle.d->display_list = NULL;
+  handle.d->alignment = TEXT_WIDGET_ALIGN_LEFT;
+  handle.d->marquee_mode = 0;
+  handle.d->marquees_count = 0;
+  handle.d->marquee_start = 0;
+  handle.d->render_mode = TEXT_WIDGET_RENDER_PATHS;
+  handle.d->fit_font = NULL;
+  handle.d->fit_sizes_count = 0;
+  handle.d->fit_index = 0;
+  handle.d->fit_memo_count = 0;
+  handle.d->fit_memo_next = 0;
+
   return handle;
 }
 
@@ -101,6 +748,7 @@ void text_widget_set_alignment ( struct TEXT_WIDGET_HANDLE handle,
 {
   if ( handle.d == NULL || handle.d->layout == NULL )
     return;
+  handle.d->alignment = alignment;
   switch ( alignment ) {
   case TEXT_WIDGET_ALIGN_LEFT:
     pango_layout_set_alignment( handle.d->layout, PANGO_ALIGN_LEFT ); break;
@@ -120,50 +768,655 @@ void text_widget_set_foreground ( struct TEXT_WIDGET_HANDLE handle,
   vgSetParameterfv( handle.d->foreground, VG_PAINT_COLOR, 4, color );
 }
 
-void text_widget_set_text ( struct TEXT_WIDGET_HANDLE handle,
-			    const char* text, int length )
+/*!
+ * Space between the end of a scrolling line and its next repetition.
+ */
+static float marquee_gap ( const struct TEXT_WIDGET_PRIVATE* d )
 {
-  if ( handle.d == NULL || handle.d->layout == NULL )
+  return d->width / 3.f;
+}
+
+static void marquees_free ( struct TEXT_WIDGET_PRIVATE* d )
+{
+  int m;
+  for ( m = 0; m < d->marquees_count; m++ ) {
+    int t;
+    for ( t = 0; t < d->marquees[m].tiles_count; t++ )
+      vgDestroyImage( d->marquees[m].tiles[t] );
+  }
+  d->marquees_count = 0;
+}
+
+/*!
+ * We've moved on to a new line of the layout. In marquee mode, decide
+ * if it fits; if so, align it ourselves (Pango has no width to align
+ * to), otherwise set up a marquee for it.
+ * \param[inout] d the widget.
+ * \param[in] li iterator positioned on the line's first run.
+ * \param[out] marquee index of the line's marquee or -1 if it fits.
+ * \param[out] shift horizontal adjustment for the line's runs.
+ */
+static void start_line ( struct TEXT_WIDGET_PRIVATE* d, PangoLayoutIter* li,
+			 int* marquee, float* shift )
+{
+  *marquee = -1;
+  *shift = 0.f;
+  if ( ! d->marquee_mode )
     return;
 
-  pango_layout_set_markup( handle.d->layout, text, length );
+  PangoRectangle line_rect;
+  pango_layout_iter_get_line_extents( li, NULL, &line_rect );
+  int line_x = PANGO_PIXELS( line_rect.x );
+  int line_width = PANGO_PIXELS( line_rect.width );
+
+  if ( line_width <= d->width || d->marquees_count == MARQUEE_LINES_MAX ) {
+    switch ( d->alignment ) {
+    case TEXT_WIDGET_ALIGN_LEFT:
+      *shift = -line_x; break;
+    case TEXT_WIDGET_ALIGN_CENTER:
+      *shift = ( d->width - line_width ) / 2.f - line_x; break;
+    case TEXT_WIDGET_ALIGN_RIGHT:
+      *shift = d->width - line_width - line_x; break;
+    }
+    return;
+  }
 
-  // The idea here is to make sure that the VGFont contains
-  // all the glyphs at the proper size so that when we want
-  // to draw, we can can just call vgDrawGlyphs (well, maybe
-  // not since PangoGlyphInfo is not an array of glyph
-  // indexes; aww).
-  PangoLayoutIter* li = pango_layout_get_iter( handle.d->layout );
+  struct MARQUEE* m = &d->marquees[d->marquees_count];
+  m->tiles_count = 0;
+  m->width  = line_width;
+  m->y      = d->height - PANGO_PIXELS( line_rect.y + line_rect.height );
+  m->height = PANGO_PIXELS( line_rect.height );
+  *marquee = d->marquees_count++;
+  *shift = -line_x;
+}
+
+/*!
+ * Draw the runs belonging to one marquee line (or -1 for the ones
+ * which aren't scrolling). The glyph matrix must already be set.
+ */
+static void draw_runs ( struct TEXT_WIDGET_PRIVATE* d, int marquee,
+			float dx, float dy )
+{
+  struct DISPLAY_LIST* list = d->display_list;
+  VGPaint current = VG_INVALID_HANDLE;
+  // Bitmaps go through the image matrix, so start it off the same as
+  // the glyph matrix.
+  VGfloat glyph_matrix[9];
+  int stencil = FALSE;
+  int r;
+  for ( r = 0; r < list->runs_count; r++ ) {
+    const struct TEXT_RUN* run = &list->runs[r];
+    if ( run->marquee != marquee )
+      continue;
+    VGPaint paint = run->paint != VG_INVALID_HANDLE ?
+      run->paint : d->foreground;
+    if ( paint != current ) {
+      vgSetPaint( paint, VG_FILL_PATH );
+      current = paint;
+    }
+    if ( run->blits_count >= 0 ) {
+      if ( ! stencil ) {
+	vgSeti( VG_MATRIX_MODE, VG_MATRIX_GLYPH_USER_TO_SURFACE );
+	vgGetMatrix( glyph_matrix );
+	vgSeti( VG_MATRIX_MODE, VG_MATRIX_IMAGE_USER_TO_SURFACE );
+	// The bitmap is just coverage; the color comes from the paint.
+	vgSeti( VG_IMAGE_MODE, VG_DRAW_IMAGE_STENCIL );
+	stencil = TRUE;
+      }
+      int b;
+      for ( b = 0; b < run->blits_count; b++ ) {
+	const struct BLIT* blit = &list->blits[run->blits_offset + b];
+	vgLoadMatrix( glyph_matrix );
+	vgTranslate( blit->x + dx, blit->y + dy );
+	vgDrawImage( blit->image );
+      }
+      continue;
+    }
+    VGfloat origin[2] = { run->origin[0] + dx, run->origin[1] + dy };
+    vgSetfv( VG_GLYPH_ORIGIN, 2, origin );
+    vgDrawGlyphs( run->font, run->glyphs_count,
+		  list->glyphs + run->glyphs_offset, NULL, NULL,
+		  VG_FILL_PATH, VG_TRUE );
+  }
+  if ( stencil )
+    vgSeti( VG_IMAGE_MODE, VG_DRAW_IMAGE_NORMAL );
+}
+
+// Scissor rectangles of the caller's we'll put back after drawing the
+// marquees (OpenVG guarantees at least 32).
+#define MARQUEE_SAVED_RECTS_MAX 32
+
+/*!
+ * Draw one tile of a marquee line by pointing the OpenVG context at
+ * the image for a moment.
+ * \return the tile, or VG_INVALID_HANDLE if that didn't work out.
+ */
+static VGImage render_tile ( struct TEXT_WIDGET_PRIVATE* d, int m,
+			     int left, int width, int height,
+			     EGLDisplay display, EGLConfig config,
+			     EGLContext context )
+{
+  static const VGfloat transparent[] = { 0.f, 0.f, 0.f, 0.f };
+
+  VGImage image = vgCreateImage( VG_sRGBA_8888, width, height,
+				 VG_IMAGE_QUALITY_BETTER );
+  if ( image == VG_INVALID_HANDLE )
+    return VG_INVALID_HANDLE;
+
+  EGLSurface surface =
+    eglCreatePbufferFromClientBuffer( display, EGL_OPENVG_IMAGE,
+				      (EGLClientBuffer)(uintptr_t)image,
+				      config, NULL );
+  if ( surface == EGL_NO_SURFACE ) {
+    vgDestroyImage( image );
+    return VG_INVALID_HANDLE;
+  }
+
+  EGLSurface draw = eglGetCurrentSurface( EGL_DRAW );
+  EGLSurface read = eglGetCurrentSurface( EGL_READ );
+  eglMakeCurrent( display, surface, surface, context );
+
+  vgSetfv( VG_CLEAR_COLOR, 4, transparent );
+  vgClear( 0, 0, width, height );
+  vgSeti( VG_MATRIX_MODE, VG_MATRIX_GLYPH_USER_TO_SURFACE );
+  vgLoadIdentity();
+  draw_runs( d, m, -left, 0.f );
+
+  eglMakeCurrent( display, draw, read, context );
+  eglDestroySurface( display, surface );
+
+  return image;
+}
+
+/*!
+ * Draw each marquee line into its own tiles. If that doesn't work out
+ * (or the line is very long), the line is drawn directly (and doesn't
+ * save any GPU time).
+ */
+static void render_marquees ( struct TEXT_WIDGET_PRIVATE* d )
+{
+  EGLDisplay display = eglGetCurrentDisplay();
+  EGLContext context = eglGetCurrentContext();
+  if ( display == EGL_NO_DISPLAY || context == EGL_NO_CONTEXT )
+    return;
+
+  // The image surface has to use the same config as the context.
+  EGLint config_id = 0;
+  EGLint n_configs = 0;
+  EGLConfig config;
+  eglQueryContext( display, context, EGL_CONFIG_ID, &config_id );
+  EGLint config_attrs[] = { EGL_CONFIG_ID, config_id, EGL_NONE };
+  if ( eglChooseConfig( display, config_attrs, &config, 1, &n_configs ) ==
+       EGL_FALSE || n_configs == 0 )
+    return;
+
+  VGfloat saved_clear[4];
+  vgGetfv( VG_CLEAR_COLOR, 4, saved_clear );
+
+  int m;
+  for ( m = 0; m < d->marquees_count; m++ ) {
+    struct MARQUEE* marquee = &d->marquees[m];
+    int width  = ceilf( marquee->width + marquee_gap( d ) );
+    int height = ceilf( marquee->height );
+    int tiles = ( width + MARQUEE_IMAGE_MAX - 1 ) / MARQUEE_IMAGE_MAX;
+    if ( tiles > MARQUEE_TILES_MAX )
+      continue;
+
+    int t;
+    for ( t = 0; t < tiles; t++ ) {
+      int left = t * MARQUEE_IMAGE_MAX;
+      VGImage tile = render_tile( d, m, left,
+				  MIN( width - left, MARQUEE_IMAGE_MAX ),
+				  height, display, config, context );
+      if ( tile == VG_INVALID_HANDLE )
+	break;
+      marquee->tiles[t] = tile;
+    }
+    if ( t < tiles ) {
+      // All or nothing.
+      while ( t-- > 0 )
+	vgDestroyImage( marquee->tiles[t] );
+      continue;
+    }
+    marquee->tiles_count = tiles;
+  }
+
+  vgSetfv( VG_CLEAR_COLOR, 4, saved_clear );
+}
+
+/*!
+ * Walk the layout and turn it into a display list. This is also where
+ * we make sure that the VGFont contains all the glyphs at the proper
+ * size, so the drawing doesn't have to look at Pango or FreeType at
+ * all.
+ * \param[inout] d the widget.
+ */
+static void compile_layout_once ( struct TEXT_WIDGET_PRIVATE* d )
+{
+  // Accumulate here, then copy into one block of the right size.
+  static GArray* runs = NULL;
+  static GArray* glyphs = NULL;
+  static GArray* blits = NULL;
+  if ( runs == NULL ) {
+    runs = g_array_new( FALSE, FALSE, sizeof( struct TEXT_RUN ) );
+    glyphs = g_array_new( FALSE, FALSE, sizeof( VGuint ) );
+    blits = g_array_new( FALSE, FALSE, sizeof( struct BLIT ) );
+  }
+  g_array_set_size( runs, 0 );
+  g_array_set_size( glyphs, 0 );
+  g_array_set_size( blits, 0 );
+
+  int atlas = d->render_mode == TEXT_WIDGET_RENDER_ATLAS;
+  if ( atlas && glyph_atlas.d == NULL ) {
+    glyph_atlas = glyph_atlas_init( GLYPH_ATLAS_WIDTH, GLYPH_ATLAS_HEIGHT );
+    // Without it, everything falls back to paths.
+  }
+
+  marquees_free( d );
+
+  // Which line we're on and what happens to its runs.
+  PangoLayoutLine* line = NULL;
+  int line_marquee = -1;
+  float line_shift = 0.f;
+
+  PangoLayoutIter* li = pango_layout_get_iter( d->layout );
   do {
     PangoLayoutRun* run = pango_layout_iter_get_run( li );
     if ( run == NULL )
       continue;
+    if ( pango_layout_iter_get_line_readonly( li ) != line ) {
+      line = pango_layout_iter_get_line_readonly( li );
+      start_line( d, li, &line_marquee, &line_shift );
+    }
     PangoFont* font = run->item->analysis.font;
     // Well, you can see how C is not the most ideal language for
     // abstraction. Have to read the documentation to discover
     // that this font is a PangoFcFont.
     FT_Face face = pango_fc_font_lock_face( (PangoFcFont*)font );
-    if ( face != NULL ) {
-      struct VG_DATA* vg_data = face->size->generic.data;
-      if ( vg_data == NULL ) {
-	vg_data = vg_data_new();
-	face->size->generic.data = vg_data;
-	face->size->generic.finalizer = vg_data_free;
-      }
-      int g;
-      for ( g = 0; g < run->glyphs->num_glyphs; g++ ) {
-	int byte = run->glyphs->glyphs[g].glyph / 8;
-	int bit  = 1 << ( run->glyphs->glyphs[g].glyph & 0x7 );
-	if ( ! ( vg_data->cmap[byte] & bit  ) ) {
-	  vg_data->cmap[byte] |= bit;
-	  add_char( vg_data->font, face, run->glyphs->glyphs[g].glyph );
+    if ( face == NULL )
+      continue;
+    struct VG_DATA* vg_data = load_glyphs( font, face, run->glyphs );
+
+    PangoRectangle logical_rect;
+    int baseline_pixel = PANGO_PIXELS( pango_layout_iter_get_baseline( li ) );
+    pango_layout_iter_get_run_extents( li, NULL, &logical_rect );
+
+    struct TEXT_RUN text_run;
+    // Note: inverted Y coordinate
+    text_run.origin[0]     = PANGO_PIXELS( logical_rect.x ) + line_shift;
+    text_run.origin[1]     = d->height - baseline_pixel;
+    text_run.marquee       = line_marquee;
+    if ( line_marquee >= 0 ) {
+      // Relative to the bottom left of the marquee's image.
+      text_run.origin[1] -= d->marquees[line_marquee].y;
+    }
+    text_run.paint         = VG_INVALID_HANDLE; // Resolved below.
+    text_run.font          = vg_data->font;
+    text_run.glyphs_count  = run->glyphs->num_glyphs;
+    text_run.glyphs_offset = glyphs->len;
+    text_run.blits_count   = -1;
+    text_run.blits_offset  = blits->len;
+    if ( atlas && glyph_atlas.d != NULL &&
+	 atlas_run( vg_data, face, run->glyphs, text_run.origin[0],
+		    text_run.origin[1], blits ) == 0 )
+      text_run.blits_count = blits->len - text_run.blits_offset;
+
+    pango_fc_font_unlock_face( (PangoFcFont*)font );
+
+    // About the only extra attributes we can manage are the foreground
+    // color and alpha. But, it might be nice to render a background
+    // color to see just how badly the text is fitted into the widget
+    // box. Everything else is ignored.
+    gboolean colored = FALSE;
+    uint32_t rgba = 0xffffffff;
+    GSList* attr_item = run->item->analysis.extra_attrs;
+    while ( attr_item ) {
+      PangoAttribute* attr = attr_item->data;
+      switch ( attr->klass->type ) {
+      case PANGO_ATTR_FOREGROUND:
+	{
+	  PangoColor color = ((PangoAttrColor*)attr)->color;
+	  rgba = ( rgba & 0xff ) |
+	    (uint32_t)( color.red   >> 8 ) << 24 |
+	    (uint32_t)( color.green >> 8 ) << 16 |
+	    (uint32_t)( color.blue  >> 8 ) << 8;
+	  colored = TRUE;
 	}
+	break;
+      case PANGO_ATTR_FOREGROUND_ALPHA:
+	rgba = ( rgba & 0xffffff00 ) | ( ((PangoAttrInt*)attr)->value >> 8 );
+	colored = TRUE;
+	break;
+      default:
+	break;
       }
-      pango_fc_font_unlock_face( (PangoFcFont*)font );
+      attr_item = attr_item->next;
+    }
+    if ( colored )
+      text_run.paint = paint_cache_acquire( rgba );
+
+    int g;
+    for ( g = 0; g < run->glyphs->num_glyphs; g++ ) {
+      VGuint glyph = run->glyphs->glyphs[g].glyph;
+      g_array_append_val( glyphs, glyph );
+    }
+    g_array_append_val( runs, text_run );
+  } while ( pango_layout_iter_next_run( li ) );
+
+  pango_layout_iter_free( li );
+
+  display_list_free( d->display_list );
+
+  size_t runs_bytes = runs->len * sizeof( struct TEXT_RUN );
+  size_t blits_bytes = blits->len * sizeof( struct BLIT );
+  struct DISPLAY_LIST* list = malloc( sizeof( struct DISPLAY_LIST ) +
+				      runs_bytes + blits_bytes +
+				      glyphs->len * sizeof( VGuint ) );
+  list->runs_count = runs->len;
+  list->blits_count = blits->len;
+  list->atlas_generation = glyph_atlas_generation( glyph_atlas );
+  list->runs   = (struct TEXT_RUN*)( list + 1 );
+  list->blits  = (struct BLIT*)( (char*)list->runs + runs_bytes );
+  list->glyphs = (VGuint*)( (char*)list->blits + blits_bytes );
+  memcpy( list->runs, runs->data, runs_bytes );
+  memcpy( list->blits, blits->data, blits_bytes );
+  memcpy( list->glyphs, glyphs->data, glyphs->len * sizeof( VGuint ) );
+
+  d->display_list = list;
+
+  if ( d->marquees_count > 0 ) {
+    render_marquees( d );
+    d->marquee_start = g_get_monotonic_time();
+  }
+}
+
+/*!
+ * Compile the layout. If the atlas had to be emptied part way through,
+ * the runs before that point are stale, so go round again (this time
+ * without emptying it).
+ */
+static void compile_layout ( struct TEXT_WIDGET_PRIVATE* d )
+{
+  unsigned int generation = glyph_atlas_generation( glyph_atlas );
+  glyph_atlas_resettable = 1;
+  compile_layout_once( d );
+  glyph_atlas_resettable = 0;
+  if ( glyph_atlas_generation( glyph_atlas ) != generation )
+    compile_layout_once( d );
+}
+
+static void fit_set_size ( struct TEXT_WIDGET_PRIVATE* d, int index )
+{
+  pango_font_description_set_absolute_size( d->fit_font,
+					    d->fit_sizes[index] );
+  pango_layout_set_font_description( d->layout, d->fit_font );
+}
+
+/*!
+ * Does the layout fit in the box at this size? This only measures, so
+ * Pango looks at the font metrics but no OpenVG glyphs are made.
+ */
+static int fit_try ( struct TEXT_WIDGET_PRIVATE* d, int index )
+{
+  PangoRectangle logical_rect;
+  fit_set_size( d, index );
+  pango_layout_get_pixel_extents( d->layout, NULL, &logical_rect );
+  return logical_rect.height <= d->height && logical_rect.width <= d->width;
+}
+
+/*!
+ * Pick the largest size for the current markup which fits. The answer
+ * is remembered per string; otherwise it is a binary search which
+ * starts with the size we used last (usually right for the next song,
+ * too, so that's one or two layouts). If nothing fits, we use the
+ * smallest (and, in marquee mode, let it scroll).
+ */
+static void fit_layout ( struct TEXT_WIDGET_PRIVATE* d )
+{
+  int m;
+  for ( m = 0; m < d->fit_memo_count; m++ ) {
+    if ( d->fit_memo[m].hash == d->markup_hash ) {
+      d->fit_index = d->fit_memo[m].index;
+      fit_set_size( d, d->fit_index );
+      return;
+    }
+  }
+
+  int low = 0;
+  int high = d->fit_sizes_count - 1;
+  int best = high;
+  int last = -1;
+  int probe = d->fit_index;
+  while ( low <= high ) {
+    if ( probe < low || probe > high )
+      probe = ( low + high ) / 2;
+    last = probe;
+    if ( fit_try( d, probe ) ) {
+      best = probe;
+      high = probe - 1;
+    }
+    else {
+      low = probe + 1;
+    }
+    probe = -1;
+  }
+  if ( last != best )
+    fit_set_size( d, best );
+
+  d->fit_index = best;
+
+  d->fit_memo[d->fit_memo_next].hash = d->markup_hash;
+  d->fit_memo[d->fit_memo_next].index = best;
+  d->fit_memo_next = ( d->fit_memo_next + 1 ) % FIT_MEMO_SIZE;
+  if ( d->fit_memo_count < FIT_MEMO_SIZE )
+    d->fit_memo_count++;
+}
+
+int text_widget_set_auto_fit ( struct TEXT_WIDGET_HANDLE handle,
+			       const char* font, const float* sizes_px,
+			       int sizes_count )
+{
+  if ( handle.d == NULL || handle.d->layout == NULL )
+    return -1;
+
+  if ( handle.d->fit_font != NULL ) {
+    pango_font_description_free( handle.d->fit_font );
+    handle.d->fit_font = NULL;
+  }
+  handle.d->fit_sizes_count = 0;
+  handle.d->fit_index = 0;
+  handle.d->fit_memo_count = 0;
+  handle.d->fit_memo_next = 0;
+
+  if ( font == NULL || sizes_count <= 0 )
+    return 0;
+
+  // Just the largest ones.
+  if ( sizes_count > FIT_SIZES_MAX )
+    sizes_count = FIT_SIZES_MAX;
+
+  handle.d->fit_font = pango_font_description_from_string( font );
+  int s;
+  for ( s = 0; s < sizes_count; s++ )
+    handle.d->fit_sizes[s] = pango_units_from_double( sizes_px[s] );
+  handle.d->fit_sizes_count = sizes_count;
+
+  if ( handle.d->markup->len > 0 ) {
+    fit_layout( handle.d );
+    compile_layout( handle.d );
+  }
+
+  return 0;
+}
+
+void text_widget_set_text ( struct TEXT_WIDGET_HANDLE handle,
+			    const char* text, int length )
+{
+  if ( handle.d == NULL || handle.d->layout == NULL )
+    return;
+
+  if ( length < 0 )
+    length = strlen( text );
+
+  // Most ticks hand us exactly what we already have. Check the hash
+  // first and only compare the bytes if it matches.
+  guint hash = markup_hash( text, length );
+  if ( hash == handle.d->markup_hash &&
+       (gsize)length == handle.d->markup->len &&
+       memcmp( text, handle.d->markup->str, length ) == 0 )
+    return;
+
+  handle.d->markup_hash = hash;
+  g_string_truncate( handle.d->markup, 0 );
+  g_string_append_len( handle.d->markup, text, length );
+
+  gint64 span = trace_begin();
+  pango_layout_set_markup( handle.d->layout, text, length );
+
+  if ( handle.d->fit_sizes_count > 0 )
+    fit_layout( handle.d );
+  trace_end( "pango layout", span );
+
+  span = trace_begin();
+  compile_layout( handle.d );
+  trace_end( "compile layout", span );
+}
+
+int text_widget_set_sprites ( struct TEXT_WIDGET_HANDLE handle,
+			      const char* font, const char* characters )
+{
+  if ( handle.d == NULL || handle.d->layout == NULL )
+    return -1;
+
+  struct SPRITES* sprites = calloc( 1, sizeof( struct SPRITES ) );
+
+  // Shape the whole character set once. We only need the glyph
+  // indexes and advances out of this.
+  PangoFontDescription* description = pango_font_description_from_string( font );
+  PangoLayout* layout = pango_layout_new( handle.d->context );
+  pango_layout_set_font_description( layout, description );
+  pango_layout_set_text( layout, characters, -1 );
+  pango_font_description_free( description );
+
+  sprites->baseline = PANGO_PIXELS( pango_layout_get_baseline( layout ) );
+
+  // Everything has to come out of one font or vgDrawGlyphs won't do.
+  // If Pango falls back to another font for any of the characters,
+  // the set is no good and the widget stays with Pango.
+  int complete = 1;
+  PangoLayoutIter* li = pango_layout_get_iter( layout );
+  do {
+    PangoLayoutRun* run = pango_layout_iter_get_run( li );
+    if ( run == NULL )
+      continue;
+    PangoFont* pg_font = run->item->analysis.font;
+    if ( sprites->font != NULL && sprites->font != pg_font ) {
+      complete = 0;
+      break;
+    }
+    FT_Face face = pango_fc_font_lock_face( (PangoFcFont*)pg_font );
+    if ( face == NULL ) {
+      complete = 0;
+      break;
+    }
+    struct VG_DATA* vg_data = load_glyphs( pg_font, face, run->glyphs );
+    pango_fc_font_unlock_face( (PangoFcFont*)pg_font );
+
+    if ( sprites->font == NULL ) {
+      // Holding the Pango font keeps the FT_Size, and so the VGFont,
+      // alive.
+      sprites->font = g_object_ref( pg_font );
+      sprites->vg_font = vg_data->font;
+    }
+    int g;
+    for ( g = 0; g < run->glyphs->num_glyphs; g++ ) {
+      unsigned char c =
+	characters[ run->item->offset + run->glyphs->log_clusters[g] ];
+      if ( c >= SPRITE_CHARACTERS )
+	continue;
+      sprites->present[c] = 1;
+      sprites->glyph[c]   = run->glyphs->glyphs[g].glyph;
+      sprites->width[c]   =
+	(float)run->glyphs->glyphs[g].geometry.width / PANGO_SCALE;
     }
   } while ( pango_layout_iter_next_run( li ) );
 
   pango_layout_iter_free( li );
+  g_object_unref( layout );
+
+  if ( sprites->font == NULL ) {
+    free( sprites );
+    return -1;
+  }
+  if ( ! complete ) {
+    sprites_free( sprites );
+    return -1;
+  }
+
+  // Tabular figures: every digit gets the advance of the widest one so
+  // the string doesn't shuffle sideways as the time ticks over.
+  float digit_width = 0.f;
+  int c;
+  for ( c = '0'; c <= '9'; c++ ) {
+    if ( sprites->present[c] && sprites->width[c] > digit_width )
+      digit_width = sprites->width[c];
+  }
+  for ( c = 0; c < SPRITE_CHARACTERS; c++ ) {
+    sprites->advance[c] = sprites->width[c];
+    if ( c >= '0' && c <= '9' )
+      sprites->advance[c] = digit_width;
+  }
+
+  sprites_free( handle.d->sprites );
+  handle.d->sprites = sprites;
+
+  return 0;
+}
+
+void text_widget_set_sprite_text ( struct TEXT_WIDGET_HANDLE handle,
+				   const char* text, int length )
+{
+  if ( handle.d == NULL || handle.d->sprites == NULL )
+    return;
+
+  struct SPRITES* sprites = handle.d->sprites;
+
+  if ( length < 0 )
+    length = strlen( text );
+  if ( length > SPRITE_TEXT_MAX )
+    length = SPRITE_TEXT_MAX;
+
+  if ( length == sprites->length && memcmp( text, sprites->text, length ) == 0 )
+    return;
+
+  memcpy( sprites->text, text, length );
+  sprites->length = length;
+
+  // Characters outside of the set are silently dropped.
+  float total = 0.f;
+  int count = 0;
+  int i;
+  for ( i = 0; i < length; i++ ) {
+    unsigned char c = text[i];
+    if ( c >= SPRITE_CHARACTERS || ! sprites->present[c] )
+      continue;
+    sprites->glyphs[count] = sprites->glyph[c];
+    // vgDrawGlyphs adds this to the glyph's own escapement.
+    sprites->adjustments[count] = sprites->advance[c] - sprites->width[c];
+    total += sprites->advance[c];
+    count++;
+  }
+  sprites->count = count;
+
+  float width = PANGO_PIXELS( pango_layout_get_width( handle.d->layout ) );
+  switch ( pango_layout_get_alignment( handle.d->layout ) ) {
+  case PANGO_ALIGN_LEFT:
+    sprites->x = 0.f; break;
+  case PANGO_ALIGN_CENTER:
+    sprites->x = ( width - total ) / 2.f; break;
+  case PANGO_ALIGN_RIGHT:
+    sprites->x = width - total; break;
+  }
 }
 
 void text_widget_draw_text ( struct TEXT_WIDGET_HANDLE handle )
@@ -171,6 +1424,23 @@ void text_widget_draw_text ( struct TEXT_WIDGET_HANDLE handle )
   if ( handle.d == NULL || handle.d->layout == NULL )
     return;
 
+  // Another widget emptied the atlas since we were laid out. Lay out
+  // again (without emptying it in turn; what doesn't fit is drawn as
+  // paths), carrying on scrolling from where we were. Scrolling lines
+  // are rendered into their images as part of that, which mustn't be
+  // clipped to the display's damage.
+  if ( handle.d->display_list != NULL &&
+       handle.d->display_list->blits_count > 0 &&
+       handle.d->display_list->atlas_generation !=
+       glyph_atlas_generation( glyph_atlas ) ) {
+    VGint saved_scissoring = vgGeti( VG_SCISSORING );
+    vgSeti( VG_SCISSORING, VG_FALSE );
+    gint64 marquee_start = handle.d->marquee_start;
+    compile_layout_once( handle.d );
+    handle.d->marquee_start = marquee_start;
+    vgSeti( VG_SCISSORING, saved_scissoring );
+  }
+
   vgSetPaint( handle.d->foreground, VG_FILL_PATH );
 
   vgSeti( VG_MATRIX_MODE, VG_MATRIX_GLYPH_USER_TO_SURFACE );
@@ -186,73 +1456,163 @@ void text_widget_draw_text ( struct TEXT_WIDGET_HANDLE handle )
   // Back to dots.
   vgScale( 1.f/handle.d->dpmm_x, 1.f/handle.d->dpmm_y );
 
-  int height = PANGO_PIXELS( pango_layout_get_height( handle.d->layout ) );
-
-  PangoLayoutIter* li = pango_layout_get_iter( handle.d->layout );
-  do {
-    PangoLayoutRun* run = pango_layout_iter_get_run( li );
-    if ( run == NULL )
-      continue;
+  if ( handle.d->sprites != NULL ) {
+    struct SPRITES* sprites = handle.d->sprites;
+    if ( sprites->count > 0 ) {
+      // Note: inverted Y coordinate
+      VGfloat point[2] = { sprites->x, handle.d->height - sprites->baseline };
+      vgSetfv( VG_GLYPH_ORIGIN, 2, point );
+      vgDrawGlyphs( sprites->vg_font, sprites->count, sprites->glyphs,
+		    sprites->adjustments, NULL, VG_FILL_PATH, VG_TRUE );
+    }
+    return;
+  }
 
-    PangoRectangle logical_rect;
-    int baseline_pango = pango_layout_iter_get_baseline( li );
-    int baseline_pixel = PANGO_PIXELS( baseline_pango );
-    pango_layout_iter_get_run_extents( li, NULL, &logical_rect );
-    int x_pixel = PANGO_PIXELS( logical_rect.x );
+  if ( handle.d->display_list == NULL )
+    return;
 
-    PangoFont* pg_font = run->item->analysis.font;
+  draw_runs( handle.d, -1, 0.f, 0.f );
 
-    FT_Face face = pango_fc_font_lock_face( (PangoFcFont*)pg_font );
+  if ( handle.d->marquees_count == 0 )
+    return;
 
-    if ( face != NULL ) {
-
-      struct VG_DATA* vg_data = face->size->generic.data;
-      if ( vg_data != NULL ) {
-	// About the only extra attribute we can manage is the foreground
-	// color. But, it might be nice to render a background color
-	// to see just how badly the text is fitted into the widget
-	// box.
-	GSList* attr_item = run->item->analysis.extra_attrs;
-	while ( attr_item ) {
-	  PangoAttribute* attr = attr_item->data;
-	  switch ( attr->klass->type ) {
-	  case PANGO_ATTR_FOREGROUND:
-	    {
-	      PangoColor color = ((PangoAttrColor*)attr)->color;
-	      VGfloat new_color[] = { (float)color.red / 65535.f,
-				      (float)color.green / 65535.f,
-				      (float)color.blue / 65535.f, 1.f };
-	      VGPaint new_paint = vgCreatePaint();
-	      vgSetParameterfv( new_paint, VG_PAINT_COLOR, 4, new_color );
-	      vgSetPaint( new_paint, VG_FILL_PATH );
-	      vgDestroyPaint( new_paint );
-	    }
-	    break;
-	  default:
-	    printf( "\tHmm. Unknown attribute: %d\n", attr->klass->type );
-	  }
-	  attr_item = attr_item->next;
-	}
+  // Now the scrolling lines.
+  float offset = 0.f;
+  gint64 elapsed = g_get_monotonic_time() - handle.d->marquee_start -
+    MARQUEE_PAUSE;
+  if ( elapsed > 0 )
+    offset = MARQUEE_SPEED * elapsed / G_USEC_PER_SEC;
 
-	// Note: inverted Y coordinate
-	VGfloat point[2] = { x_pixel, height - baseline_pixel };
-	vgSetfv( VG_GLYPH_ORIGIN, 2, point );
-	VGFont vg_font = vg_data->font;
-	int g;
-	for ( g = 0; g < run->glyphs->num_glyphs; g++ ) {
-	  vgDrawGlyph( vg_font, run->glyphs->glyphs[g].glyph, VG_FILL_PATH,
-		       VG_TRUE );
-	}
+  float box_x = handle.d->x_mm * handle.d->dpmm_x;
+  float box_y = handle.d->y_mm * handle.d->dpmm_y;
 
-	if ( vgGetPaint( VG_FILL_PATH ) != handle.d->foreground ) {
-	  vgSetPaint( handle.d->foreground, VG_FILL_PATH );
+  vgSeti( VG_MATRIX_MODE, VG_MATRIX_IMAGE_USER_TO_SURFACE );
+  vgLoadIdentity();
+  vgScale( handle.d->dpmm_x, handle.d->dpmm_y );
+  vgTranslate( handle.d->x_mm, handle.d->y_mm );
+  vgScale( 1.f/handle.d->dpmm_x, 1.f/handle.d->dpmm_y );
+  VGfloat box_matrix[9];
+  vgGetMatrix( box_matrix );
+
+  // The display may already be clipping to what it is redrawing. Each
+  // marquee line lies inside our box, so it is safe to replace that
+  // for a moment, but it has to be put back.
+  VGint saved_scissoring = vgGeti( VG_SCISSORING );
+  VGint saved_rects[4 * MARQUEE_SAVED_RECTS_MAX];
+  VGint saved_rects_count = vgGetVectorSize( VG_SCISSOR_RECTS );
+  if ( saved_rects_count > 4 * MARQUEE_SAVED_RECTS_MAX )
+    saved_rects_count = 4 * MARQUEE_SAVED_RECTS_MAX;
+  if ( saved_rects_count > 0 )
+    vgGetiv( VG_SCISSOR_RECTS, saved_rects_count, saved_rects );
+
+  vgSeti( VG_IMAGE_MODE, VG_DRAW_IMAGE_NORMAL );
+  vgSeti( VG_SCISSORING, VG_TRUE );
+
+  int m;
+  for ( m = 0; m < handle.d->marquees_count; m++ ) {
+    const struct MARQUEE* marquee = &handle.d->marquees[m];
+    float period = marquee->width + marquee_gap( handle.d );
+    float x = -fmodf( offset, period );
+
+    VGint scissor[4] = { floorf( box_x ), floorf( box_y + marquee->y ),
+			 handle.d->width, ceilf( marquee->height ) };
+    vgSetiv( VG_SCISSOR_RECTS, 4, scissor );
+
+    // Two copies cover the wrap around; only the tiles in the box
+    // are drawn.
+    if ( marquee->tiles_count > 0 ) {
+      vgSeti( VG_MATRIX_MODE, VG_MATRIX_IMAGE_USER_TO_SURFACE );
+      int copy, t;
+      for ( copy = 0; copy < 2; copy++ ) {
+	for ( t = 0; t < marquee->tiles_count; t++ ) {
+	  float left = x + copy * period + t * MARQUEE_IMAGE_MAX;
+	  if ( left >= handle.d->width || left + MARQUEE_IMAGE_MAX <= 0 )
+	    continue;
+	  vgLoadMatrix( box_matrix );
+	  vgTranslate( left, marquee->y );
+	  vgDrawImage( marquee->tiles[t] );
 	}
       }
-      pango_fc_font_unlock_face( (PangoFcFont*)pg_font );
     }
-  } while ( pango_layout_iter_next_run( li ) );
-  // Iterators are not free.
-  pango_layout_iter_free( li);
+    else {
+      draw_runs( handle.d, m, x, marquee->y );
+      draw_runs( handle.d, m, x + period, marquee->y );
+    }
+  }
+
+  vgSetiv( VG_SCISSOR_RECTS, saved_rects_count, saved_rects );
+  vgSeti( VG_SCISSORING, saved_scissoring );
+}
+
+void text_widget_set_render_mode ( struct TEXT_WIDGET_HANDLE handle,
+				   enum TEXT_WIDGET_RENDER_MODE mode )
+{
+  if ( handle.d == NULL || handle.d->render_mode == mode )
+    return;
+
+  handle.d->render_mode = mode;
+
+  if ( handle.d->markup->len > 0 )
+    compile_layout( handle.d );
+}
+
+int text_widget_set_marquee ( struct TEXT_WIDGET_HANDLE handle, int enabled )
+{
+  if ( handle.d == NULL || handle.d->layout == NULL )
+    return -1;
+
+  handle.d->marquee_mode = enabled;
+  // Without a width, Pango won't wrap.
+  pango_layout_set_width( handle.d->layout,
+			  enabled ? -1 : handle.d->width_units );
+
+  // What fits has changed.
+  handle.d->fit_memo_count = 0;
+
+  if ( handle.d->markup->len > 0 ) {
+    if ( handle.d->fit_sizes_count > 0 )
+      fit_layout( handle.d );
+    compile_layout( handle.d );
+  }
+
+  return 0;
+}
+
+int text_widget_animating ( struct TEXT_WIDGET_HANDLE handle )
+{
+  if ( handle.d == NULL )
+    return 0;
+  return handle.d->marquees_count > 0;
+}
+
+int text_widget_marquee_rects ( struct TEXT_WIDGET_HANDLE handle,
+				int rects[][4], int max )
+{
+  if ( handle.d == NULL )
+    return 0;
+
+  float box_x = handle.d->x_mm * handle.d->dpmm_x;
+  float box_y = handle.d->y_mm * handle.d->dpmm_y;
+  int m;
+  for ( m = 0; m < handle.d->marquees_count && m < max; m++ ) {
+    const struct MARQUEE* marquee = &handle.d->marquees[m];
+    // The same as the scissor in text_widget_draw.
+    rects[m][0] = floorf( box_x );
+    rects[m][1] = floorf( box_y + marquee->y );
+    rects[m][2] = handle.d->width;
+    rects[m][3] = ceilf( marquee->height );
+  }
+  return m;
+}
+
+void text_widget_set_glyph_cache ( struct GLYPH_CACHE_HANDLE cache )
+{
+  glyph_cache = cache;
+}
+
+int text_widget_atlas_usage ( void )
+{
+  return glyph_atlas_usage( glyph_atlas );
 }
 
 void text_widget_free_handle ( struct TEXT_WIDGET_HANDLE handle )
@@ -262,6 +1622,12 @@ void text_widget_free_handle ( struct TEXT_WIDGET_HANDLE handle )
     g_object_unref( handle.d->context );
     g_object_unref( handle.d->font_map );
     vgDestroyPaint( handle.d->foreground );
+    g_string_free( handle.d->markup, TRUE );
+    sprites_free( handle.d->sprites );
+    display_list_free( handle.d->display_list );
+    marquees_free( handle.d );
+    if ( handle.d->fit_font != NULL )
+      pango_font_description_free( handle.d->fit_font );
     free( handle.d );
     handle.d = NULL;
   }
@@ -395,32 +1761,43 @@ static void convert_outline ( const FT_Vector *points,
    /* assert(coords_count <= COORDS_COUNT_MAX); */
 }
 
-static void add_char ( VGFont font, FT_Face face, FT_ULong c )
+static void add_char ( struct VG_DATA* vg_data, FT_Face face, FT_ULong c )
 {
   // Pango already provides us with the font index, not the glyph UNICODE
   // point.
 
+  gint64 span = trace_begin();
+  const struct GLYPH_OUTLINE* cached =
+    glyph_cache_lookup( glyph_cache, vg_data->key, c );
+
+  if ( cached != NULL ) {
+    set_glyph_path( vg_data->font, cached );
+    trace_end( "glyph path (cached)", span );
+    return;
+  }
+
   FT_Load_Glyph( face, c, FT_LOAD_DEFAULT );
 
   FT_Outline *outline = &face->glyph->outline;
 
-  VGPath path;
-  path = vgCreatePath( VG_PATH_FORMAT_STANDARD, VG_PATH_DATATYPE_F,
-		       1.f, 0.f, 0, 0, VG_PATH_CAPABILITY_ALL );
-  // It could be a blank. If any character doesn't have a glyph, though,
-  // nothing is drawn by vgDrawGlyphs.
+  segments_count = 0;
+  coords_count = 0;
   if ( outline->n_contours > 0 ) {
     convert_outline( outline->points, outline->tags, outline->contours,
 		     outline->n_contours, outline->n_points );
-    vgAppendPathData( path, segments_count, segments, coords );
   }
 
-  VGfloat origin[] = { 0.f, 0.f };
-  VGfloat escapement[] = { float_from_26_6(face->glyph->advance.x),
-			   float_from_26_6(face->glyph->advance.y) };
+  struct GLYPH_OUTLINE converted;
+  converted.glyph = c;
+  converted.segments_count = segments_count;
+  converted.segments = segments;
+  converted.coords_count = coords_count;
+  converted.coords = coords;
+  converted.escapement[0] = float_from_26_6(face->glyph->advance.x);
+  converted.escapement[1] = float_from_26_6(face->glyph->advance.y);
 
-  vgSetGlyphToPath( font, c, path, VG_TRUE, origin, escapement );
+  set_glyph_path( vg_data->font, &converted );
 
-  vgDestroyPath( path );
+  glyph_cache_store( glyph_cache, vg_data->key, &converted );
+  trace_end( "glyph path", span );
 }
-
@@ -6,6 +6,7 @@
 #define TEXT_WIDGET_H
 
 struct TEXT_WIDGET_PRIVATE;
+struct GLYPH_CACHE_HANDLE;
 
 struct TEXT_WIDGET_HANDLE {
   struct TEXT_WIDGET_PRIVATE* d;
@@ -17,6 +18,14 @@ enum TEXT_WIDGET_ALIGNMENT {
   TEXT_WIDGET_ALIGN_RIGHT
 };
 
+enum TEXT_WIDGET_RENDER_MODE {
+  //! Glyphs are OpenVG paths, filled every frame (the default).
+  TEXT_WIDGET_RENDER_PATHS,
+  //! Glyphs are hinted FreeType bitmaps in a shared atlas image. Much
+  //! cheaper to draw at small sizes.
+  TEXT_WIDGET_RENDER_ATLAS
+};
+
 /*!
  * Create a text widget.  What attributes are important? Really the
  * width and height in mm and and pixels. Do we want to have a default
@@ -54,13 +63,97 @@ void text_widget_set_foreground( struct TEXT_WIDGET_HANDLE handle,
 
 /*!
  * Layout this text. Could have Pango markup to make it attractive.
+ * If the markup is the same as last time, nothing is done.
  * \param[inout] handle the text widget.
  * \param[in] text the new string to display.
- * \param[in] length the number of bytes in text.
+ * \param[in] length the number of bytes in text (or -1 if text
+ * is nul terminated).
  */
 void text_widget_set_text ( struct TEXT_WIDGET_HANDLE handle,
 			    const char* text, int length );
 
+/*!
+ * Put the widget into sprite mode. The glyphs for the given
+ * characters are shaped once and thereafter text is laid out without
+ * Pango. Digits all get the advance of the widest digit so that
+ * numbers don't wobble as they change. Meant for the time display.
+ * \param[inout] handle the text widget.
+ * \param[in] font a Pango font description, e.g. "Droid Sans 24px".
+ * \param[in] characters every (ASCII) character which will be
+ * displayed.
+ * \return 0 if everything is ok, -1 if the glyphs could not be loaded
+ * or would not all come from the one font (the widget is left as it
+ * was).
+ */
+int text_widget_set_sprites ( struct TEXT_WIDGET_HANDLE handle,
+			      const char* font, const char* characters );
+
+/*!
+ * Display this plain text in sprite mode. Characters not given to
+ * text_widget_set_sprites() are skipped.
+ * \param[inout] handle the text widget.
+ * \param[in] text the new string to display (not markup).
+ * \param[in] length the number of bytes in text (or -1 if text
+ * is nul terminated).
+ */
+void text_widget_set_sprite_text ( struct TEXT_WIDGET_HANDLE handle,
+				   const char* text, int length );
+
+/*!
+ * Size the text to fit the box. The markup should not set a font size
+ * itself; instead the widget tries each of the given sizes and uses the
+ * largest one where the text fits. The choice is remembered for each
+ * string, so seeing it again costs no extra layouts.
+ * \param[inout] handle the text widget.
+ * \param[in] font the font description (e.g. "Droid Sans") without a
+ * size. NULL turns auto-fit off.
+ * \param[in] sizes_px candidate sizes in pixels, largest first.
+ * \param[in] sizes_count number of sizes (at most 8 are used).
+ * \return 0 if everything is ok, -1 otherwise.
+ */
+int text_widget_set_auto_fit ( struct TEXT_WIDGET_HANDLE handle,
+			       const char* font, const float* sizes_px,
+			       int sizes_count );
+
+/*!
+ * Choose how the glyphs are drawn. If the atlas fills up, runs which
+ * don't fit in it are drawn as paths anyway.
+ * \param[inout] handle the text widget.
+ * \param[in] mode the rendering mode.
+ */
+void text_widget_set_render_mode ( struct TEXT_WIDGET_HANDLE handle,
+				   enum TEXT_WIDGET_RENDER_MODE mode );
+
+/*!
+ * Let lines which are too long for the box scroll sideways (like a
+ * theater marquee) instead of wrapping. A scrolling line is rendered
+ * once into images, so animating it is cheap. (Very long lines, more
+ * than 16384 pixels, are drawn glyph by glyph instead.)
+ * \param[inout] handle the text widget.
+ * \param[in] enabled non-zero to scroll, zero to wrap.
+ * \return 0 if everything is ok, -1 otherwise.
+ */
+int text_widget_set_marquee ( struct TEXT_WIDGET_HANDLE handle, int enabled );
+
+/*!
+ * \param[in] handle the text widget.
+ * \return non-zero if the widget has lines scrolling and should be
+ * redrawn at the frame rate.
+ */
+int text_widget_animating ( struct TEXT_WIDGET_HANDLE handle );
+
+/*!
+ * Where the scrolling lines are: only these need redrawing on each
+ * frame.
+ * \param[in] handle the text widget.
+ * \param[out] rects the lines' rectangles on the screen (x, y, width,
+ * height in pixels).
+ * \param[in] max room in rects.
+ * \return the number of rectangles.
+ */
+int text_widget_marquee_rects ( struct TEXT_WIDGET_HANDLE handle,
+				int rects[][4], int max );
+
 /*!
  * Draw the text. The OpenVG context should be all set up to
  * draw the text in the right place, namely the text transform
@@ -69,6 +162,33 @@ void text_widget_set_text ( struct TEXT_WIDGET_HANDLE handle,
  */
 void text_widget_draw_text ( struct TEXT_WIDGET_HANDLE handle );
 			   
+/*!
+ * Start loading fonts in the background: setting up fontconfig and
+ * opening the font files take a while, and can happen while the
+ * caller does something else. The first text_widget_init waits for
+ * it. All widgets at this resolution then share the font map.
+ * \param[in] fonts NULL terminated list of Pango font descriptions
+ * to load (copied).
+ * \param[in] dpmm_x dots per mm in the x direction.
+ * \param[in] dpmm_y dots per mm in the y direction.
+ */
+void text_widget_warm_up ( const char* const* fonts, float dpmm_x,
+			   float dpmm_y );
+
+/*!
+ * Use this cache for glyph outlines. This applies to all text widgets
+ * (they share the fonts) and should be done before any text is set.
+ * The caller still owns the cache.
+ * \param[in] cache the glyph cache.
+ */
+void text_widget_set_glyph_cache ( struct GLYPH_CACHE_HANDLE cache );
+
+/*!
+ * \return how much of the shared glyph atlas is in use (percent), or
+ * -1 if no widget has used atlas mode yet.
+ */
+int text_widget_atlas_usage ( void );
+
 /*!
  * Release any memory held by the handle.
  */
@@ -0,0 +1,190 @@
+/*
+ * Per-thread span rings and the Chrome trace-event writer.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+int trace_enabled = 0;
+
+struct TRACE_EVENT {
+  const char* name;
+  gint64 start;
+  gint64 duration;
+};
+
+struct TRACE_RING {
+  int tid;
+  const char* name;
+  //! Total spans ever recorded (modulo 2^32: ARMv6 has no 64 bit
+  //! atomics); the ring holds the last TRACE_RING_SIZE of them.
+  guint32 recorded;
+  //! Has the ring filled up? (recorded alone can't say once it wraps.)
+  int full;
+  struct TRACE_EVENT events[TRACE_RING_SIZE];
+  struct TRACE_RING* next;
+};
+
+// Each thread's ring, created when it records its first span.
+static __thread struct TRACE_RING* thread_ring = NULL;
+
+// All the rings (they are never freed, since a dump may be looking at
+// one after its thread is gone).
+static GMutex rings_lock;
+static struct TRACE_RING* rings = NULL;
+static int rings_count = 0;
+
+static struct TRACE_RING* ring_get ( void )
+{
+  if ( thread_ring != NULL )
+    return thread_ring;
+
+  struct TRACE_RING* ring = calloc( 1, sizeof( struct TRACE_RING ) );
+  if ( ring == NULL )
+    return NULL;
+
+  g_mutex_lock( &rings_lock );
+  ring->tid = ++rings_count;
+  ring->next = rings;
+  rings = ring;
+  g_mutex_unlock( &rings_lock );
+
+  thread_ring = ring;
+  return ring;
+}
+
+void trace_enable ( int enabled )
+{
+  __atomic_store_n( &trace_enabled, enabled != 0, __ATOMIC_RELAXED );
+}
+
+void trace_thread_name ( const char* name )
+{
+  struct TRACE_RING* ring = ring_get();
+  if ( ring != NULL )
+    ring->name = name;
+}
+
+void trace_record ( const char* name, gint64 start, gint64 end )
+{
+  struct TRACE_RING* ring = ring_get();
+  if ( ring == NULL )
+    return;
+
+  guint32 recorded = ring->recorded;
+  struct TRACE_EVENT* event = &ring->events[recorded % TRACE_RING_SIZE];
+  event->name = name;
+  event->start = start;
+  event->duration = end - start;
+  if ( recorded + 1 == TRACE_RING_SIZE )
+    __atomic_store_n( &ring->full, 1, __ATOMIC_RELAXED );
+  // Publish the span only after it's filled in.
+  __atomic_store_n( &ring->recorded, recorded + 1, __ATOMIC_RELEASE );
+}
+
+/*!
+ * Copy out a ring's spans, oldest first. The owning thread carries on
+ * recording meanwhile, so any span it may have written over while we
+ * copied is left out.
+ * \param[in] ring the ring.
+ * \param[out] events room for TRACE_RING_SIZE spans.
+ * 
+eturn how many spans were copied.
+ */
+static int ring_copy ( const struct TRACE_RING* ring,
+		       struct TRACE_EVENT* events )
+{
+  guint32 recorded = __atomic_load_n( &ring->recorded, __ATOMIC_ACQUIRE );
+  guint32 count = __atomic_load_n( &ring->full, __ATOMIC_RELAXED ) ?
+    TRACE_RING_SIZE : recorded;
+  // The counter may have wrapped, but the ring is a power of two.
+  guint32 first = recorded - count;
+  guint32 n;
+  for ( n = 0; n < count; n++ )
+    events[n] = ring->events[( first + n ) % TRACE_RING_SIZE];
+
+  // The span being recorded now goes in the slot of the one
+  // TRACE_RING_SIZE before it. Anything that old or older is suspect.
+  __atomic_thread_fence( __ATOMIC_ACQUIRE );
+  guint32 now = __atomic_load_n( &ring->recorded, __ATOMIC_RELAXED );
+  guint32 skip = 0;
+  while ( skip < count && now - ( first + skip ) >= TRACE_RING_SIZE )
+    skip++;
+  memmove( events, events + skip, ( count - skip ) * sizeof *events );
+  return count - skip;
+}
+
+int trace_dump ( const char* path )
+{
+  struct TRACE_EVENT* events =
+    malloc( TRACE_RING_SIZE * sizeof( struct TRACE_EVENT ) );
+  if ( events == NULL )
+    return -1;
+
+  GString* json = g_string_new( "{\"traceEvents\":[\n" );
+  int pid = getpid();
+  const char* separator = "";
+
+  g_mutex_lock( &rings_lock );
+  struct TRACE_RING* ring;
+  for ( ring = rings; ring != NULL; ring = ring->next ) {
+    if ( ring->name != NULL ) {
+      g_string_append_printf( json, "%s{\"name\":\"thread_name\",\"ph\":\"M\","
+			      "\"pid\":%d,\"tid\":%d,"
+			      "\"args\":{\"name\":\"%s\"}}",
+			      separator, pid, ring->tid, ring->name );
+      separator = ",\n";
+    }
+
+    int count = ring_copy( ring, events );
+    int e;
+    for ( e = 0; e < count; e++ ) {
+      const struct TRACE_EVENT* event = &events[e];
+      g_string_append_printf( json, "%s{\"name\":\"%s\",\"cat\":\"mpddisplay\","
+			      "\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT ","
+			      "\"dur\":%" G_GINT64_FORMAT ","
+			      "\"pid\":%d,\"tid\":%d}",
+			      separator, event->name, event->start,
+			      event->duration, pid, ring->tid );
+      separator = ",\n";
+    }
+  }
+  g_mutex_unlock( &rings_lock );
+  free( events );
+
+  g_string_append( json, "\n],\"displayTimeUnit\":\"ms\"}\n" );
+
+  gboolean written = g_file_set_contents( path, json->str, json->len, NULL );
+  g_string_free( json, TRUE );
+
+  return written ? 0 : -1;
+}
+
+void trace_report ( GString* out, gint64 since )
+{
+  struct TRACE_EVENT* events =
+    malloc( TRACE_RING_SIZE * sizeof( struct TRACE_EVENT ) );
+  if ( events == NULL )
+    return;
+
+  g_mutex_lock( &rings_lock );
+  struct TRACE_RING* ring;
+  for ( ring = rings; ring != NULL; ring = ring->next ) {
+    int count = ring_copy( ring, events );
+    int e;
+    for ( e = 0; e < count; e++ ) {
+      const struct TRACE_EVENT* event = &events[e];
+      if ( event->start < since )
+	continue;
+      g_string_append_printf( out, "%-10s %-20s +%7.1f ms %7.1f ms\n",
+			      ring->name != NULL ? ring->name : "?",
+			      event->name,
+			      ( event->start - since ) / 1000.,
+			      event->duration / 1000. );
+    }
+  }
+  g_mutex_unlock( &rings_lock );
+  free( events );
+}
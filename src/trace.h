@@ -0,0 +1,76 @@
+/*
+ * Timed spans for working out where the time goes, say, on a track
+ * change. Each thread records into its own ring buffer of the most
+ * recent spans; the whole lot can be written out in the Chrome
+ * trace-event format (load it in chrome://tracing or Perfetto).
+ *
+ * While tracing is off, a span costs a load and a branch at each end.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "glib.h"
+
+//! Spans kept per thread.
+#define TRACE_RING_SIZE 4096
+
+//! Don't touch; use trace_enable.
+extern int trace_enabled;
+
+/*!
+ * Turn recording on or off. Spans already recorded are kept.
+ * \param[in] enabled non-zero to record.
+ */
+void trace_enable ( int enabled );
+
+/*!
+ * Name the calling thread in the output.
+ * \param[in] name a string which lives forever (a literal, say).
+ */
+void trace_thread_name ( const char* name );
+
+/*!
+ * Store a finished span. Use trace_begin/trace_end instead.
+ */
+void trace_record ( const char* name, gint64 start, gint64 end );
+
+/*!
+ * Write everything recorded so far as Chrome trace-event JSON. Spans
+ * which other threads write over while this copies them are left
+ * out.
+ * \param[in] path the file to write (replaced atomically).
+ * \return 0 if everything is ok, -1 otherwise.
+ */
+int trace_dump ( const char* path );
+
+/*!
+ * Describe the spans recorded since a given time, one per line, in a
+ * form fit for people: thread, span, start (relative to since) and
+ * duration, in milliseconds.
+ * \param[inout] out the text is appended here.
+ * \param[in] since monotonic time (us) to measure from.
+ */
+void trace_report ( GString* out, gint64 since );
+
+/*!
+ * Start a span.
+ * \return the start time, or 0 if tracing is off.
+ */
+static inline gint64 trace_begin ( void )
+{
+  return __atomic_load_n( &trace_enabled, __ATOMIC_RELAXED ) ?
+    g_get_monotonic_time() : 0;
+}
+
+/*!
+ * Finish a span.
+ * \param[in] name what was going on. Must be a string literal (only
+ * the pointer is kept).
+ * \param[in] start what trace_begin returned.
+ */
+static inline void trace_end ( const char* name, gint64 start )
+{
+  if ( start != 0 )
+    trace_record( name, start, g_get_monotonic_time() );
+}
+#endif